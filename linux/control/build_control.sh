@@ -1,4 +1,4 @@
 #
 # Build the KUtrace control library and program
 #
-cc -O2 kutrace_control.cc kutrace_lib.cc -o kutrace_control
\ No newline at end of file
+cc -O2 -pthread kutrace_control.cc kutrace_lib.cc -o kutrace_control
\ No newline at end of file
@@ -4,10 +4,13 @@
 // 2017.11.16 dsites Updated to include instructions per cycle IPC flag
 // 2018.05.08 dsites Updated by switching to using kutrace_lib
 // 2019.02.19 dsites Updated ...
+// Added gostream, draining the trace to disk while tracing
+// Added filter and pids, to record less
+// Added compress, for smaller trace files
 //
 // This program reads commands from stdin
 //
-// Compile with gcc -O2 kutrace_control.cc kutrace_lib.cc -o kutrace_control
+// Compile with gcc -O2 -pthread kutrace_control.cc kutrace_lib.cc -o kutrace_control
 
 /*
  * Copyright (C) 2019 Richard L. Sites
@@ -39,6 +42,7 @@ Rationalize the use of side-effect-free DoTest
 /* Outgoing arg to DoReset  */
 #define DO_IPC 1
 #define DO_WRAP 2
+#define DO_STREAM 8
 
 ////typedef long unsigned int u64;
 ////typedef long signed int   s64;
@@ -123,9 +127,49 @@ static int64 stop_usec = 0;
 void Usage() {
   fprintf(stderr, "usage: kutrace_control, with sysin lines\n");
   fprintf(stderr, "  init, on, off, flush, reset, stat, dump, quit\n");
+  fprintf(stderr, "  go, goipc, gowrap, gostream, goipcstream, stop\n");
+  fprintf(stderr, "  filter [all|syscall trap irq sched pc user other], pids [p1 p2 ...]\n");
+  fprintf(stderr, "  compress [off]\n");
   exit(0);
 }
 
+// Event class names for the filter command
+static const char* const kClassName[7] = {
+  "syscall", "trap", "irq", "sched", "pc", "user", "other"
+};
+
+// filter with no names or "all" records everything again
+// Return false if a name is not recognized
+bool SetFilter(char* names) {
+  u64 mask = 0;
+  for (char* tok = strtok(names, " ,"); tok != NULL; tok = strtok(NULL, " ,")) {
+    if (strcmp(tok, "all") == 0) {mask = KUTRACE_CLASS_ALL; continue;}
+    int i = 0;
+    while ((i < 7) && (strcmp(tok, kClassName[i]) != 0)) {++i;}
+    if (i == 7) {
+      fprintf(stdout, "Not recognized class '%s'\n", tok);
+      return false;
+    }
+    mask |= (1llu << i);
+  }
+  if (mask == 0) {mask = KUTRACE_CLASS_ALL;}
+  return kutrace::DoFilter(mask);
+}
+
+// pids with no numbers records all pids again
+bool SetPids(char* nums) {
+  static u64 pids[KUTRACE_MAX_PIDS];
+  int n = 0;
+  for (char* tok = strtok(nums, " ,"); tok != NULL; tok = strtok(NULL, " ,")) {
+    if (n == KUTRACE_MAX_PIDS) {
+      fprintf(stdout, "At most %d pids\n", KUTRACE_MAX_PIDS);
+      return false;
+    }
+    pids[n++] = strtoull(tok, NULL, 10);
+  }
+  return kutrace::DoPids(pids, n);
+}
+
 // Sleep for n milliseconds
 void msleep(int msec) {
   struct timespec ts;
@@ -157,6 +201,13 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 //  reset	Set up for a new tracing run
 //  stat	Show some sort of tracing status
 //  dump	Dump the trace buffer to constructed filename
+//  gostream	Like go, but write full blocks to the trace file as it runs,
+//		so the trace can be much longer than the kernel buffer
+//  filter c...	With tracing off, record only these event classes:
+//		syscall trap irq sched pc user other, or all
+//  pids p...	With tracing off, record syscalls, traps, PC samples, and
+//		user events only for these pids; none means all pids
+//  compress	Write compressed trace files from now on; compress off stops
 //  quit	Exit this program
 //
 // Command-line argument -force ignores any other running tracing and turns it off
@@ -215,14 +266,28 @@ fprintf(stderr, "Entering kutrace_control\n");
       control_flags |= DO_WRAP; kutrace::DoReset(control_flags); kutrace::DoInit(argv[0]); kutrace::DoOn();
     } else if ((strcmp(buffer, "goipcwrap") == 0) || (strcmp(buffer, "gowrapipc") == 0)) {
       control_flags |= (DO_IPC | DO_WRAP); kutrace::DoReset(control_flags); kutrace::DoInit(argv[0]); kutrace::DoOn();
+    } else if ((strcmp(buffer, "gostream") == 0) || (strcmp(buffer, "goipcstream") == 0)) {
+      control_flags = DO_STREAM;
+      if (strcmp(buffer, "goipcstream") == 0) {control_flags |= DO_IPC;}
+      kutrace::DoReset(control_flags); kutrace::DoInit(argv[0]);
+      if (kutrace::DoStreamStart(fname)) {kutrace::DoOn();} else {control_flags = 0;}
     } else if (strcmp(buffer, "stop") == 0) {
       /* After DoOff wait 20 msec for any pending tracing to finish */
-      kutrace::DoOff(); msleep(20); kutrace::DoFlush(); kutrace::DoDump(fname); control_flags = 0; kutrace::DoQuit();
+      kutrace::DoOff(); msleep(20); kutrace::DoFlush();
+      if ((control_flags & DO_STREAM) != 0) {kutrace::DoStreamStop();} else {kutrace::DoDump(fname);}
+      control_flags = 0; kutrace::DoQuit();
     } else if (strcmp(buffer, "quit") == 0) {kutrace::DoQuit();}
     else if (strcmp(buffer, "exit") == 0) {kutrace::DoQuit();}
+    else if ((strncmp(buffer, "filter", 6) == 0) &&
+             ((buffer[6] == ' ') || (buffer[6] == '\0'))) {SetFilter(&buffer[6]);}
+    else if (strcmp(buffer, "compress") == 0) {kutrace::DoCompress(true);}
+    else if (strcmp(buffer, "compress off") == 0) {kutrace::DoCompress(false);}
+    else if ((strncmp(buffer, "pids", 4) == 0) &&
+             ((buffer[4] == ' ') || (buffer[4] == '\0'))) {SetPids(&buffer[4]);}
     else {
       fprintf(stdout, "Not recognized '%s'\n", buffer);
-      fprintf(stdout, "  go goipc stop init on off flush reset stat dump quit\n");
+      fprintf(stdout, "  go goipc gostream stop init on off flush reset stat dump quit\n");
+      fprintf(stdout, "  filter [classes] pids [pids] compress [off]\n");
     }
 
     fprintf(stdout, "control> ");
@@ -2,13 +2,17 @@
 // Copyright 2023 Richard L. Sites
 //
 
+#include <fcntl.h>	// open
+#include <pthread.h>	// streaming drain thread
 #include <stdio.h>
 #include <stdlib.h>     // exit, system
 #include <string.h>
 #include <time.h>	// nanosleep
 #include <unistd.h>     // getpid gethostname syscall
+#include <sys/mman.h>	// mmap
 #include <sys/time.h>   // gettimeofday
 #include <sys/types.h>	
+#include <sys/uio.h>	// writev
 
 #if defined(__x86_64__)
 #include <x86intrin.h>		// _rdtsc
@@ -17,6 +21,7 @@
 #include "basetypes.h"
 #include "kutrace_control_names.h"	// PidNames, TrapNames, IrqNames, Syscall64Names
 #include "kutrace_lib.h"
+#include "../../postproc/trace_compress.h"	// Compressed trace files, shared with postproc
 
 // All the real stuff is inside this anonymous namespace
 namespace {
@@ -24,6 +29,7 @@ namespace {
 /* Outgoing arg to DoReset  */
 #define DO_IPC 1
 #define DO_WRAP 2
+#define DO_STREAM 8
 
 /* For the flags byte in traceblock[1] */
 #define IPC_Flag     CLU(0x80)
@@ -39,6 +45,44 @@ static const u64 kMinModuleVersionNumber = 3;
 // Module/code must be at least this version number for us to use fast 4KB dump
 static const u64 kMin4KBModuleVersionNumber = 4;
 
+// Module/code must be at least this version number for us to dump from /dev/kutrace
+static const u64 kMinMapModuleVersionNumber = 5;
+static const char* const kTraceDevice = "/dev/kutrace";
+
+// Module/code must be at least this version number for us to stream
+static const u64 kMinStreamModuleVersionNumber = 6;
+
+// Streaming: how often to drain full blocks, and most blocks per drain pass
+static const int kStreamDrainMsec = 10;
+static const int kMaxDrainBlocks = 4096;
+
+// Streaming: how often to have quiet CPUs hand over the block they are
+// filling. Module/code must be at least this version number for that
+static const int kStreamHandoffMsec = 1000;
+static const u64 kMinHandoffModuleVersionNumber = 11;
+
+// Module/code must be at least this version number for us to use INSERTBATCH
+static const u64 kMinBatchModuleVersionNumber = 7;
+
+// Module/code must be at least this version number for us to use event rings
+static const u64 kMinRingModuleVersionNumber = 8;
+
+// Module/code must be at least this version number for us to show statistics
+static const u64 kMinStatsModuleVersionNumber = 9;
+
+// Module/code must be at least this version number for us to filter events
+static const u64 kMinFilterModuleVersionNumber = 10;
+
+// Batching: most words per INSERTBATCH call, same as the module, and the
+// oldest pending entry, in ku_get_cycles counts, before we send the batch.
+// The module moves up entries older than twice this, and counts them
+static const int kMaxBatchWords = 64;
+static const u64 kBatchFlushAge = 0x8000;
+
+// Module/code must be at least this version number for us to send the full
+// time of each batch, and to read the count of entries moved up
+static const u64 kMinBatchBaseModuleVersionNumber = 12;
+
 // This defines the format of the resulting trace file
 static const u64 kTracefileVersionNumber = 3;
 
@@ -54,6 +98,13 @@ static const int kTraceBufSize = 8192;
 // Number of u64 values per IPC block, one u8 per u64 in trace buf
 static const int kIpcBufSize = kTraceBufSize >> 3;
 
+// Leading u64 values of a trace block that DoDump fills in: [1] always,
+// [2..5] in the very first block
+static const int kDumpHeaderSize = 6;
+
+// Write compressed trace files, see trace_compress.h. Set by DoCompress
+bool compress_trace = false;
+
 // For wraparound fixup on Raspberry Pi-4B Arm-v7
 static const int mhz_32bit_cycles = 54;
 
@@ -718,6 +769,45 @@ void DoReset(u64 control_flags) {
   stop_cycles = 0;
 }
 
+// Record only the event classes in class_mask, KUTRACE_CLASS_*
+// Module must be loaded. Tracing must be off. The filter stays across resets
+bool DoFilter(u64 class_mask) {
+  if (DoControl(KUTRACE_CMD_VERSION, 0) < kMinFilterModuleVersionNumber) {
+    fprintf(stderr, "KUtrace module has no event filter\n");
+    return false;
+  }
+  u64 retval = DoControl(KUTRACE_CMD_SETCLASSES, class_mask);
+  if (retval == ~0llu) {
+    fprintf(stderr, "Turn tracing off before changing the filter\n");
+    return false;
+  }
+  return true;
+}
+
+// Record syscalls, traps, PC samples, and user entries only for these n pids
+// n == 0 records all pids again
+// Module must be loaded. Tracing must be off. The list stays across resets
+bool DoPids(const u64* pids, int n) {
+  if (DoControl(KUTRACE_CMD_VERSION, 0) < kMinFilterModuleVersionNumber) {
+    fprintf(stderr, "KUtrace module has no pid filter\n");
+    return false;
+  }
+  if ((n < 0) || (KUTRACE_MAX_PIDS < n)) {
+    fprintf(stderr, "At most %d pids\n", KUTRACE_MAX_PIDS);
+    return false;
+  }
+  // Module wants the count first
+  u64 temp[1 + KUTRACE_MAX_PIDS];
+  temp[0] = n;
+  for (int i = 0; i < n; ++i) {temp[1 + i] = pids[i];}
+  u64 retval = DoControl(KUTRACE_CMD_SETPIDS, (u64)&temp[0]);
+  if (retval == ~0llu) {
+    fprintf(stderr, "Turn tracing off before changing the pid list\n");
+    return false;
+  }
+  return true;
+}
+
 // Show some sort of tracing status
 // Module must be loaded. Tracing may well be on
 // If IPC,only 7/8 of the blocks are counted: 
@@ -728,6 +818,27 @@ void DoStat(u64 control_flags) {
   if ((control_flags & DO_IPC) != 0) {blocksize = (blocksize * 8) / 7;}
   fprintf(stderr, "Stat: %lld trace blocks used (%3.1fMB)\n", 
           retval, (retval * blocksize) / (1024 * 1024));
+
+  // Per-CPU counters summed by the module, since the last reset
+  if (DoControl(KUTRACE_CMD_VERSION, 0) < kMinStatsModuleVersionNumber) {return;}
+  u64 stats[KUTRACE_STAT_WORDS];
+  memset(stats, 0, sizeof(stats));
+  u64 words = DoControl(KUTRACE_CMD_GETSTATS, (u64)&stats[0]);
+  if ((words < 9) || (KUTRACE_STAT_WORDS < words)) {return;}
+  double words_per_block = stats[5] ? (double)stats[1] / stats[5] : 0.0;
+  fprintf(stderr, "  %lld entries, %lld words (%3.0f per block started)\n",
+          stats[0], stats[1], words_per_block);
+  fprintf(stderr, "  %lld returns folded into their calls, %lld TSDELTA words\n",
+          stats[3], stats[2]);
+  fprintf(stderr, "  %lld blocks started, %lld claims abandoned at a block end\n",
+          stats[5], stats[4]);
+  fprintf(stderr, "  %lld entries dropped", stats[6]);
+  if (stats[7] != 0) {fprintf(stderr, ", buffer FULL, tracing stopped");}
+  fprintf(stderr, "\n");
+  if (stats[9] != 0) {
+    fprintf(stderr, "  %lld batched user entries sent too late, moved up in time\n",
+            stats[9]);
+  }
 }
 
 #if 0
@@ -790,6 +901,135 @@ void DumpTimePair(const char* label, int64 cycles, int64 usec) {
 #endif
 
 
+// Fill in the very first trace block's header for the trace file: version,
+// wrap flag, and the start/stop timepairs. Also fixes up stop_cycles for a
+// 32-bit cycle counter
+void FillFirstBlock(u64* traceblock, bool did_wrap_around) {
+  // Fill in the tracefile version 
+  traceblock[1] |= ((kTracefileVersionNumber & VERSION_MASK) << 56);
+  if (!did_wrap_around) {
+    // The kernel exports the wrap flag in the first block before 
+    // it is known whether the trace actually wrapped.
+    // It did not, so turn off that bit
+    traceblock[1] &= ~(WRAP_Flag << 56);
+  }
+  
+  // For Arm-32, the "cycle" counter is only 32 bits at 54 MHz, so wraps about every 79 seconds.
+  // This can leave stop_cycles small by a few multiples of 4G. We do a temporary fix here
+  // for exactly 54 MHz. Later, we could find or take as input a different approximate
+  // frequency. We could also do something similar for a 40-bit counter.
+  bool has_32bit_cycles = ((start_cycles | stop_cycles) & 0xffffffff00000000llu) == 0;
+  if (has_32bit_cycles) {
+//VERYTEMP
+//fprintf(stderr, "DoDump detected 32-bit cycle counter. Should be RPi4.\n");
+    uint64 elapsed_usec = (uint64)(stop_usec - start_usec);
+    uint64 elapsed_cycles = (uint64)(stop_cycles - start_cycles);
+    uint64 expected_cycles = elapsed_usec * mhz_32bit_cycles;
+    // Pick off the expected high bits
+    uint64 approx_hi = (start_cycles + expected_cycles) & 0xffffffff00000000llu;
+    // Put them in
+    stop_cycles |= (int64)approx_hi;
+    // Cross-check and change by 1 if right at a boundary
+    // and off by more than 12.5% from expected MHz
+    elapsed_cycles = (uint64)(stop_cycles - start_cycles);
+    uint64 ratio = elapsed_cycles / elapsed_usec;
+    if (ratio > (mhz_32bit_cycles + (mhz_32bit_cycles >> 3))) {stop_cycles -= 0x0000000100000000llu;}
+    if (ratio < (mhz_32bit_cycles - (mhz_32bit_cycles >> 3))) {stop_cycles += 0x0000000100000000llu;}
+    elapsed_cycles = (uint64)(stop_cycles - start_cycles);
+  }
+
+  // Fill in the start/stop timepairs we are using, so
+  // downstream programs can also SetParams
+  traceblock[2] = start_cycles;
+  traceblock[3] = start_usec;
+  traceblock[4] = stop_cycles;
+  traceblock[5] = stop_usec;
+  
+  ////DumpTimePair("start", start_cycles, start_usec);
+  ////DumpTimePair("stop ", stop_cycles, stop_usec);
+}
+
+// Map the whole kernel trace buffer read-only. Returns NULL if the module
+// has no /dev/kutrace or we may not open it
+const u64* MapTraceBuffer(u64* mapsize) {
+  *mapsize = 0;
+  if (DoControl(KUTRACE_CMD_VERSION, 0) < kMinMapModuleVersionNumber) {return NULL;}
+  int fd = open(kTraceDevice, O_RDONLY);
+  if (fd < 0) {return NULL;}
+  u64 size = DoControl(KUTRACE_CMD_GETMAPSIZE, 0);
+  void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);	// The mapping stays valid
+  if (map == MAP_FAILED) {return NULL;}
+  *mapsize = size;
+  return (const u64*)map;
+}
+
+// Write one trace block from the mapping, with our filled-in header words in
+// place of its first kDumpHeaderSize, then its IPC block if any.
+// One syscall per block, no copies through user space
+bool WriteMappedBlock(FILE* f, const u64* header, const u64* mapblock, 
+                      const u64* mapipc) {
+  struct iovec iov[3];
+  iov[0].iov_base = (void*)header;
+  iov[0].iov_len = kDumpHeaderSize * sizeof(u64);
+  iov[1].iov_base = (void*)&mapblock[kDumpHeaderSize];
+  iov[1].iov_len = (kTraceBufSize - kDumpHeaderSize) * sizeof(u64);
+  iov[2].iov_base = (void*)mapipc;
+  iov[2].iov_len = kIpcBufSize * sizeof(u64);
+  int iovcnt = (mapipc != NULL) ? 3 : 2;
+  ssize_t want = iov[0].iov_len + iov[1].iov_len;
+  if (mapipc != NULL) {want += iov[2].iov_len;}
+  return writev(fileno(f), iov, iovcnt) == want;
+}
+
+// Write one trace block and its IPC block, if any, as one compressed chunk.
+// The first kDumpHeaderSize words come from header, the rest from block
+bool WriteCompressedBlock(FILE* f, const u64* header, const u64* block,
+                          const u64* ipc) {
+  static u64 chunk[kTraceBufSize + kIpcBufSize];
+  memcpy(chunk, header, kDumpHeaderSize * sizeof(u64));
+  memcpy(&chunk[kDumpHeaderSize], &block[kDumpHeaderSize],
+         (kTraceBufSize - kDumpHeaderSize) * sizeof(u64));
+  int len = kTraceBufSize * sizeof(u64);
+  if (ipc != NULL) {
+    memcpy(&chunk[kTraceBufSize], ipc, kIpcBufSize * sizeof(u64));
+    len += kIpcBufSize * sizeof(u64);
+  }
+  return WriteCompressedChunk(f, (const uint8*)chunk, len);
+}
+
+// Rewrite plain trace file fname as a compressed one, block by block
+// Returns false, leaving the plain file, if that fails
+bool CompressTraceFile(const char* fname) {
+  char tempname[256 + 8];
+  snprintf(tempname, sizeof(tempname), "%s.tmp", fname);
+  FILE* in = fopen(fname, "rb");
+  FILE* out = fopen(tempname, "wb");
+  bool ok = (in != NULL) && (out != NULL) && StartCompressedTrace(out, 0);
+  u64 traceblock[kTraceBufSize];
+  u64 ipcblock[kIpcBufSize];
+  u64 plain_bytes = 0;
+  while (ok && (fread(traceblock, 1, sizeof(traceblock), in) == sizeof(traceblock))) {
+    uint8 flags = traceblock[1] >> 56;
+    const u64* ipc = NULL;
+    if ((flags & IPC_Flag) != 0) {
+      ok = (fread(ipcblock, 1, sizeof(ipcblock), in) == sizeof(ipcblock));
+      ipc = ipcblock;
+    }
+    ok = ok && WriteCompressedBlock(out, traceblock, traceblock, ipc);
+    plain_bytes += sizeof(traceblock) + ((ipc != NULL) ? sizeof(ipcblock) : 0);
+  }
+  ok = ok && FinishCompressedTrace(out, plain_bytes);
+  if (in != NULL) {fclose(in);}
+  if (out != NULL) {ok &= (fclose(out) == 0);}
+  if (ok) {ok = (rename(tempname, fname) == 0);}
+  if (!ok) {
+    fprintf(stderr, "%s not compressed\n", fname);
+    unlink(tempname);
+  }
+  return ok;
+}
+
 // Dump the trace buffer to filename
 // Module must be loaded. Tracing must be off
 void DoDump(const char* fname) {
@@ -807,6 +1047,8 @@ void DoDump(const char* fname) {
     fprintf(stderr, "%s did not open\n", fname);
     return;
   }
+  u64 plain_bytes = 0;	// For a compressed file
+  if (compress_trace) {StartCompressedTrace(f, 0);}
 
   u64 traceblock[kTraceBufSize];
   u64 ipcblock[kIpcBufSize];
@@ -826,6 +1068,16 @@ void DoDump(const char* fname) {
   bool use_4kb = (kIpcBufSize >= k4KBSize);
   use_4kb &= (DoControl(KUTRACE_CMD_VERSION, 0) >= kMin4KBModuleVersionNumber);
 
+  // Better yet, if module exports the trace buffer via mmap, write straight 
+  // from that. Trace blocks count down from the top of the mapping, IPC 
+  // blocks down from 1/8 of the way up, just as the module stores them
+  u64 mapsize = 0;
+  const u64* map = MapTraceBuffer(&mapsize);
+  if (map != NULL) {
+    u64 mapblocks = (mapsize >> 3) / kTraceBufSize;
+    if (blockcount > mapblocks) {blockcount = mapblocks;}
+  }
+
   // Live dump:
   // To trace kutrace_control itself dumping, live dump does:
   //   set the stop time pair, stop_cycles and stop_usec
@@ -842,7 +1094,12 @@ void DoDump(const char* fname) {
     u64 k2 = i * kIpcBufSize;  	// IPC Word number to fetch next
 
     // Extract 64KB trace block
-    if (use_4kb) {
+    const u64* mapblock = NULL;
+    if (map != NULL) {
+      // Just the header words; the rest is written from the mapping below
+      mapblock = &map[(mapsize >> 3) - (i + 1) * kTraceBufSize];
+      memcpy(traceblock, mapblock, kDumpHeaderSize * sizeof(u64));
+    } else if (use_4kb) {
       for (int j = 0; j < kTraceBufSize; j += k4KBSize) {
         DoControl(KUTRACE_CMD_SET4KB, k);
         DoControl(KUTRACE_CMD_GET4KB, (u64)(&traceblock[j]));
@@ -862,60 +1119,31 @@ void DoDump(const char* fname) {
 
     bool very_first_block = (i == 0);
     if (very_first_block) {
-      // Fill in the tracefile version 
-      traceblock[1] |= ((kTracefileVersionNumber & VERSION_MASK) << 56);
-      if (!did_wrap_around) {
-        // The kernel exports the wrap flag in the first block before 
-        // it is known whether the trace actually wrapped.
-        // It did not, so turn off that bit
-        traceblock[1] &= ~(WRAP_Flag << 56);
-      }
-      
-      // For Arm-32, the "cycle" counter is only 32 bits at 54 MHz, so wraps about every 79 seconds.
-      // This can leave stop_cycles small by a few multiples of 4G. We do a temporary fix here
-      // for exactly 54 MHz. Later, we could find or take as input a different approximate
-      // frequency. We could also do something similar for a 40-bit counter.
-      bool has_32bit_cycles = ((start_cycles | stop_cycles) & 0xffffffff00000000llu) == 0;
-      if (has_32bit_cycles) {
-//VERYTEMP
-//fprintf(stderr, "DoDump detected 32-bit cycle counter. Should be RPi4.\n");
-        uint64 elapsed_usec = (uint64)(stop_usec - start_usec);
-        uint64 elapsed_cycles = (uint64)(stop_cycles - start_cycles);
-        uint64 expected_cycles = elapsed_usec * mhz_32bit_cycles;
-        // Pick off the expected high bits
-        uint64 approx_hi = (start_cycles + expected_cycles) & 0xffffffff00000000llu;
-        // Put them in
-        stop_cycles |= (int64)approx_hi;
-        // Cross-check and change by 1 if right at a boundary
-        // and off by more than 12.5% from expected MHz
-        elapsed_cycles = (uint64)(stop_cycles - start_cycles);
-        uint64 ratio = elapsed_cycles / elapsed_usec;
-        if (ratio > (mhz_32bit_cycles + (mhz_32bit_cycles >> 3))) {stop_cycles -= 0x0000000100000000llu;}
-        if (ratio < (mhz_32bit_cycles - (mhz_32bit_cycles >> 3))) {stop_cycles += 0x0000000100000000llu;}
-        elapsed_cycles = (uint64)(stop_cycles - start_cycles);
-      }
-
-      uint64 block_0_cycle = traceblock[0] & CLU(0x00ffffffffffffff);
-
+      FillFirstBlock(traceblock, did_wrap_around);
       // Get ready to reconstruct gettimeofday values for each traceblock
       SetParams(start_cycles, start_usec, stop_cycles, stop_usec, &params);
-
-      // Fill in the start/stop timepairs we are using, so
-      // downstream programs can also SetParams
-      traceblock[2] = start_cycles;
-      traceblock[3] = start_usec;
-      traceblock[4] = stop_cycles;
-      traceblock[5] = stop_usec;
-      
-      ////DumpTimePair("start", start_cycles, start_usec);
-      ////DumpTimePair("stop ", stop_cycles, stop_usec);
     }	// End of very first block
 
     // Reconstruct the gettimeofday value for this block
     int64 block_cycles = traceblock[0] & CLU(0x00ffffffffffffff);
     int64 block_usec = CyclesToUsec(block_cycles, params);
     traceblock[1] |= (block_usec &  CLU(0x00ffffffffffffff));
-    fwrite(traceblock, 1, sizeof(traceblock), f);
+
+    plain_bytes += sizeof(traceblock) + (this_block_has_ipc ? sizeof(ipcblock) : 0);
+    if (map != NULL) {
+      const u64* mapipc = NULL;
+      if (this_block_has_ipc) {
+        mapipc = &map[(mapsize >> 6) - (i + 1) * kIpcBufSize];
+      }
+      bool ok = compress_trace ?
+        WriteCompressedBlock(f, traceblock, mapblock, mapipc) :
+        WriteMappedBlock(f, traceblock, mapblock, mapipc);
+      if (!ok) {
+        fprintf(stderr, "%s write failed\n", fname);
+        break;
+      }
+      continue;
+    }
 
     ////fprintf(stderr, "[%d] ", i); DumpTimePair("block", block_cycles, block_usec);
 
@@ -933,13 +1161,254 @@ void DoDump(const char* fname) {
           ipcblock[j] = DoControl(KUTRACE_CMD_GETIPCWORD, k2++);
         }
       }
+    }
 
-      fwrite(ipcblock, 1, sizeof(ipcblock), f);
+    if (compress_trace) {
+      WriteCompressedBlock(f, traceblock, traceblock, this_block_has_ipc ? ipcblock : NULL);
+    } else {
+      fwrite(traceblock, 1, sizeof(traceblock), f);
+      if (this_block_has_ipc) {fwrite(ipcblock, 1, sizeof(ipcblock), f);}
     }
   }
+  if (compress_trace) {FinishCompressedTrace(f, plain_bytes);}
+  long filebytes = ftell(f);
   fclose(f);
+  if (map != NULL) {munmap((void*)map, mapsize);}
 
   fprintf(stdout, "  %s written (%3.1fMB)\n", fname, blockcount / 16.0);
+  if (compress_trace) {
+    fprintf(stdout, "  compressed to %3.1fMB\n", filebytes / (1024.0 * 1024.0));
+  }
+
+  // Go ahead and set up for another trace
+  DoControl(KUTRACE_CMD_RESET, 0);
+}
+
+
+// Streaming: a thread writes full trace blocks to the trace file every 
+// kStreamDrainMsec while tracing stays on, and hands them back to the module
+// for reuse. Each CPU's blocks go out oldest first. Every kStreamHandoffMsec
+// it also has each CPU hand over the block it is filling, so a quiet CPU's
+// entries do not wait for the end.
+// The very first block, kernel block 0, must lead the file, as in a DoDump 
+// file, but it fills at the pace of its CPU. The start/stop timepairs and 
+// per-block gettimeofday values are known only at the end; DoStreamStop 
+// moves block 0 to the front and fills them in.
+
+typedef struct {
+  u64 timestamp;
+  u64 blocknum;
+} FullBlock;
+
+pthread_t stream_thread;
+volatile bool stream_running = false;
+FILE* stream_file = NULL;
+char stream_fname[256];
+const u64* stream_map = NULL;	// Or NULL to use 4KB transfers
+u64 stream_mapsize = 0;
+u64 stream_blocks = 0;		// Written so far
+long stream_offset = 0;		// Bytes written so far
+long stream_block0_offset = -1;	// Where kernel block 0 went, or -1
+
+// Copy kernel trace block blocknum, or its IPC block, into buf 4KB at a time
+void GetStreamBlock(u64 blocknum, u64* buf, int words, u64 getcmd) {
+  u64 k = blocknum * words;
+  for (int j = 0; j < words; j += k4KBSize) {
+    DoControl(KUTRACE_CMD_SET4KB, k);
+    DoControl(getcmd, (u64)(&buf[j]));
+    k += k4KBSize;
+  }
+}
+
+// Return the cycle counter at the front of kernel trace block blocknum
+u64 StreamBlockTime(u64 blocknum) {
+  if (stream_map != NULL) {
+    return stream_map[(stream_mapsize >> 3) - (blocknum + 1) * kTraceBufSize] & 
+           CLU(0x00ffffffffffffff);
+  }
+  u64 first4kb[k4KBSize];
+  GetStreamBlock(blocknum, first4kb, k4KBSize, KUTRACE_CMD_GET4KB);
+  return first4kb[0] & CLU(0x00ffffffffffffff);
+}
+
+int CompareFullBlock(const void* a, const void* b) {
+  u64 ta = ((const FullBlock*)a)->timestamp;
+  u64 tb = ((const FullBlock*)b)->timestamp;
+  return (ta < tb) ? -1 : (ta > tb) ? 1 : 0;
+}
+
+// Write every full kernel trace block to the stream file, oldest first, and 
+// free each one. Return number of blocks written
+int DrainStream() {
+  static FullBlock full[kMaxDrainBlocks];
+  static u64 traceblock[kTraceBufSize];
+  static u64 ipcblock[kIpcBufSize];
+
+  int n = 0;
+  u64 blocknum = DoControl(KUTRACE_CMD_GETFULL, 0);
+  while ((blocknum != ~CLU(0)) && (n < kMaxDrainBlocks)) {
+    full[n].timestamp = StreamBlockTime(blocknum);
+    full[n].blocknum = blocknum;
+    ++n;
+    blocknum = DoControl(KUTRACE_CMD_GETFULL, blocknum + 1);
+  }
+  qsort(full, n, sizeof(FullBlock), CompareFullBlock);
+
+  for (int i = 0; i < n; ++i) {
+    blocknum = full[i].blocknum;
+    const u64* block = traceblock;
+    const u64* ipc = ipcblock;
+    if (stream_map != NULL) {
+      block = &stream_map[(stream_mapsize >> 3) - (blocknum + 1) * kTraceBufSize];
+      ipc = &stream_map[(stream_mapsize >> 6) - (blocknum + 1) * kIpcBufSize];
+    } else {
+      GetStreamBlock(blocknum, traceblock, kTraceBufSize, KUTRACE_CMD_GET4KB);
+    }
+    // Block 0 is used first, so the first time it is full it is the real one
+    if ((blocknum == 0) && (stream_block0_offset < 0)) {
+      stream_block0_offset = stream_offset;
+    }
+    fwrite(block, 1, kTraceBufSize * sizeof(u64), stream_file);
+    stream_offset += kTraceBufSize * sizeof(u64);
+    uint8 flags = block[1] >> 56;
+    if ((flags & IPC_Flag) != 0) {
+      if (stream_map == NULL) {
+        GetStreamBlock(blocknum, ipcblock, kIpcBufSize, KUTRACE_CMD_GETIPC4KB);
+      }
+      fwrite(ipc, 1, kIpcBufSize * sizeof(u64), stream_file);
+      stream_offset += kIpcBufSize * sizeof(u64);
+    }
+    DoControl(KUTRACE_CMD_FREEBLOCK, blocknum);
+    ++stream_blocks;
+  }
+  return n;
+}
+
+void* StreamThread(void* arg) {
+  bool handoff = (DoControl(KUTRACE_CMD_VERSION, 0) >= kMinHandoffModuleVersionNumber);
+  int handoff_msec = 0;
+  while (stream_running) {
+    DrainStream();
+    msleep(kStreamDrainMsec);
+    handoff_msec += kStreamDrainMsec;
+    if (handoff && (handoff_msec >= kStreamHandoffMsec)) {
+      DoControl(KUTRACE_CMD_HANDOFF, 1);
+      handoff_msec = 0;
+    }
+  }
+  return NULL;
+}
+
+// Move the len bytes of kernel block 0 at offset to the front of the file,
+// sliding everything before it up. Return false on a read/write error
+bool MoveBlock0ToFront(FILE* f, long offset, long len) {
+  static u64 buf[kTraceBufSize + kIpcBufSize];
+  static u64 block0[kTraceBufSize + kIpcBufSize];
+  fseek(f, offset, SEEK_SET);
+  if (fread(block0, 1, len, f) != (size_t)len) {return false;}
+  // Top down, so nothing is overwritten before it is moved
+  long end = offset;
+  while (end > 0) {
+    long chunk = (end < (long)sizeof(buf)) ? end : (long)sizeof(buf);
+    fseek(f, end - chunk, SEEK_SET);
+    if (fread(buf, 1, chunk, f) != (size_t)chunk) {return false;}
+    fseek(f, end - chunk + len, SEEK_SET);
+    fwrite(buf, 1, chunk, f);
+    end -= chunk;
+  }
+  fseek(f, 0, SEEK_SET);
+  fwrite(block0, 1, len, f);
+  return true;
+}
+
+// Put kernel block 0 first, then fill in the streamed file's block headers, 
+// as DoDump does on the fly
+void FixupStreamFile(const char* fname) {
+  FILE* f = fopen(fname, "r+b");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not reopen\n", fname);
+    return;
+  }
+  if (stream_block0_offset > 0) {
+    u64 header[kDumpHeaderSize];
+    fseek(f, stream_block0_offset, SEEK_SET);
+    if (fread(header, sizeof(u64), kDumpHeaderSize, f) == kDumpHeaderSize) {
+      uint8 flags = header[1] >> 56;
+      long len = kTraceBufSize * sizeof(u64);
+      if ((flags & IPC_Flag) != 0) {len += kIpcBufSize * sizeof(u64);}
+      if (!MoveBlock0ToFront(f, stream_block0_offset, len)) {
+        fprintf(stderr, "%s: could not move block 0 to the front\n", fname);
+      }
+    }
+  }
+  CyclesToUsecParams params;
+  u64 header[kDumpHeaderSize];
+  long offset = 0;
+  for (u64 i = 0; i < stream_blocks; ++i) {
+    fseek(f, offset, SEEK_SET);
+    if (fread(header, sizeof(u64), kDumpHeaderSize, f) != kDumpHeaderSize) {break;}
+    uint8 flags = header[1] >> 56;
+    if (i == 0) {
+      FillFirstBlock(header, false);
+      SetParams(start_cycles, start_usec, stop_cycles, stop_usec, &params);
+    }
+    int64 block_cycles = header[0] & CLU(0x00ffffffffffffff);
+    int64 block_usec = CyclesToUsec(block_cycles, params);
+    header[1] |= (block_usec &  CLU(0x00ffffffffffffff));
+    fseek(f, offset, SEEK_SET);
+    fwrite(header, sizeof(u64), kDumpHeaderSize, f);
+    offset += kTraceBufSize * sizeof(u64);
+    if ((flags & IPC_Flag) != 0) {offset += kIpcBufSize * sizeof(u64);}
+  }
+  fclose(f);
+}
+
+// Start draining the trace to fname. Tracing should be reset with DO_STREAM.
+// Return false if the module cannot stream
+bool DoStreamStart(const char* fname) {
+  if (DoControl(KUTRACE_CMD_VERSION, 0) < kMinStreamModuleVersionNumber) {
+    fprintf(stderr, "KUtrace module/code cannot stream. Need at least version %lld\n",
+            kMinStreamModuleVersionNumber);
+    return false;
+  }
+  stream_file = fopen(fname, "wb");
+  if (stream_file == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    return false;
+  }
+  strncpy(stream_fname, fname, sizeof(stream_fname) - 1);
+  stream_map = MapTraceBuffer(&stream_mapsize);
+  stream_blocks = 0;
+  stream_offset = 0;
+  stream_block0_offset = -1;
+  stream_running = true;
+  if (pthread_create(&stream_thread, NULL, StreamThread, NULL) != 0) {
+    fprintf(stderr, "Streaming thread did not start\n");
+    stream_running = false;
+    return false;
+  }
+  return true;
+}
+
+// Finish the streamed trace file. Tracing must be off and flushed, which
+// hands every remaining block to us
+void DoStreamStop() {
+  if (!stream_running) {return;}
+  stream_running = false;
+  pthread_join(stream_thread, NULL);
+  while (DrainStream() > 0) {}
+  fclose(stream_file);
+  stream_file = NULL;
+  if (stream_map != NULL) {munmap((void*)stream_map, stream_mapsize);}
+  stream_map = NULL;
+
+  FixupStreamFile(stream_fname);
+  fprintf(stdout, "  %s written (%3.1fMB)\n", stream_fname, stream_blocks / 16.0);
+  // The drain thread writes plain blocks, with headers fixed up in place
+  // at the end, so compress the finished file
+  if (compress_trace && CompressTraceFile(stream_fname)) {
+    fprintf(stdout, "  compressed\n");
+  }
 
   // Go ahead and set up for another trace
   DoControl(KUTRACE_CMD_RESET, 0);
@@ -947,6 +1416,11 @@ void DoDump(const char* fname) {
 
 
 
+// Write compressed trace files from now on, or not
+void DoCompress(bool on) {
+  compress_trace = on;
+}
+
 // Exit this program
 // Tracing must be off
 void DoQuit() {
@@ -954,6 +1428,146 @@ void DoQuit() {
   exit(0);
 }
 
+// Per-thread batch of entries not yet sent to the module
+// batch_buf[0] is the word count, then whole 1..8 word entries
+static __thread bool batching = false;
+static __thread u64 batch_buf[1 + kMaxBatchWords];
+static __thread u64 batch_first_cycles = 0;
+static int batch_module_ok = -1;	// -1 not yet asked, else 0/1, 2 with time base
+
+// Length in words of the entry starting with word, as the module sees it.
+// Only events 0x010..0x1FF carry a length
+u64 EntryLen(u64 word) {
+  u64 n = (word >> 32) & 0xFFF;
+  if ((n < 0x010) || (0x1FF < n)) {return 1;}
+  return (n >> 4) & 0x0F;
+}
+
+// Send the pending batch, one call if the module has INSERTBATCH. The full
+// time of its first entry goes along, so the module places every entry
+// exactly however late we send it, or counts it if it cannot
+void BatchSubmit() {
+  u64 count = batch_buf[0];
+  if (count == 0) {return;}
+  if (batch_module_ok < 0) {
+    u64 version = DoControl(KUTRACE_CMD_VERSION, 0);
+    batch_module_ok = (version >= kMinBatchBaseModuleVersionNumber) ? 2 :
+                      (version >= kMinBatchModuleVersionNumber) ? 1 : 0;
+  }
+  if (batch_module_ok) {
+    //              time base                                        count
+    if (batch_module_ok == 2) {
+      batch_buf[0] = ((batch_first_cycles & CLU(0x00ffffffffffffff)) << 8) | count;
+    }
+    DoControl(KUTRACE_CMD_INSERTBATCH, (u64)&batch_buf[0]);
+  } else {
+    // Older module: one call per entry, timestamped when sent
+    for (u64 i = 1; i <= count; ) {
+      u64 len = EntryLen(batch_buf[i]);
+      if (len == 1) {
+        DoControl(KUTRACE_CMD_INSERT1, batch_buf[i]);
+      } else {
+        u64 temp[8];		// Always 8 words for INSERTN
+        memset(temp, 0, sizeof(temp));
+        memcpy(temp, &batch_buf[i], len * sizeof(u64));
+        DoControl(KUTRACE_CMD_INSERTN, (u64)&temp[0]);
+      }
+      i += len;
+    }
+  }
+  batch_buf[0] = 0;
+}
+
+// Add one 1..8 word entry to the batch, with the current time
+void BatchAdd(u64* entry, u64 len) {
+  u64 now = ku_get_cycles();
+  if ((batch_buf[0] + len > kMaxBatchWords) ||
+      ((batch_buf[0] != 0) && (now - batch_first_cycles > kBatchFlushAge))) {
+    BatchSubmit();
+  }
+  if (batch_buf[0] == 0) {batch_first_cycles = now;}
+  //                                T
+  entry[0] = (entry[0] & CLU(0x00000FFFFFFFFFFF)) | ((now & CLU(0xFFFFF)) << 44);
+  memcpy(&batch_buf[1 + batch_buf[0]], entry, len * sizeof(u64));
+  batch_buf[0] += len;
+}
+
+void DoBatch(bool on) {
+  if (!on) {BatchSubmit();}
+  batching = on;
+}
+
+// Per-thread event ring shared with the module, NULL if none.
+// ring_header[0] is our head, [1] the module's tail, in words, [2] the full
+// time of the oldest pending entry
+static __thread u64* ring_header = NULL;
+static __thread u64 ring_first_cycles = 0;
+
+// Add one 1..8 word entry to our ring, with the current time. The module
+// drains the ring when we are switched out; we drain it ourselves if it
+// is full or its oldest entry is getting old, as for a batch
+void RingAdd(u64* entry, u64 len) {
+  u64* data = ring_header + (KUTRACE_RING_HEADER_BYTES / sizeof(u64));
+  u64 now = ku_get_cycles();
+  u64 head = ring_header[0];
+  u64 tail = __atomic_load_n(&ring_header[1], __ATOMIC_ACQUIRE);
+  if ((head != tail) &&
+      ((head - tail + len > KUTRACE_RING_DATA_WORDS) ||
+       (now - ring_first_cycles > kBatchFlushAge))) {
+    DoControl(KUTRACE_CMD_DRAINRING, 0);
+    tail = head;
+  }
+  if (head == tail) {
+    ring_first_cycles = now;
+    ring_header[2] = now & CLU(0x00ffffffffffffff);	// Ordered by the head store
+  }
+  //                                T
+  entry[0] = (entry[0] & CLU(0x00000FFFFFFFFFFF)) | ((now & CLU(0xFFFFF)) << 44);
+  for (u64 k = 0; k < len; ++k) {
+    data[(head + k) & (KUTRACE_RING_DATA_WORDS - 1)] = entry[k];
+  }
+  // Entry words before head
+  __atomic_store_n(&ring_header[0], head + len, __ATOMIC_RELEASE);
+}
+
+// Get a ring from the module and map it. Returns false if we cannot
+bool RingStart() {
+  if (ring_header != NULL) {return true;}
+  if (DoControl(KUTRACE_CMD_VERSION, 0) < kMinRingModuleVersionNumber) {return false;}
+  u64 r = DoControl(KUTRACE_CMD_REGRING, 1);
+  if (r >= KUTRACE_MAX_RINGS) {return false;}
+  int fd = open(kTraceDevice, O_RDWR);
+  void* map = MAP_FAILED;
+  if (fd >= 0) {
+    off_t offset = DoControl(KUTRACE_CMD_GETMAPSIZE, 0) + r * KUTRACE_RING_BYTES;
+    map = mmap(NULL, KUTRACE_RING_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    close(fd);	// The mapping stays valid
+  }
+  if (map == MAP_FAILED) {
+    DoControl(KUTRACE_CMD_REGRING, 0);
+    return false;
+  }
+  ring_header = (u64*)map;
+  return true;
+}
+
+// Drain and give back our ring
+void RingStop() {
+  if (ring_header == NULL) {return;}
+  DoControl(KUTRACE_CMD_REGRING, 0);
+  munmap(ring_header, KUTRACE_RING_BYTES);
+  ring_header = NULL;
+}
+
+void DoRing(bool on) {
+  if (on) {
+    if (!RingStart()) {DoBatch(true);}
+  } else {
+    RingStop();
+    DoBatch(false);
+  }
+}
+
 // Add a name of type n, value number, to the trace
 void addname(uint64 eventnum, uint64 number, const char* name) {
   u64 temp[8];		// Buffer for name entry
@@ -966,6 +1580,8 @@ void addname(uint64 eventnum, uint64 number, const char* name) {
   temp[0] = (CLU(0) << 44) | (n_with_length << 32) | (number);
   memset((char*)&temp[1], 0, 7 * sizeof(u64));
   memcpy((char*)&temp[1], name, bytelen);
+  if (ring_header != NULL) {RingAdd(temp, wordlen); return;}
+  if (batching) {BatchAdd(temp, wordlen); return;}
   kutrace::DoControl(KUTRACE_CMD_INSERTN, (u64)&temp[0]);
 }
 
@@ -973,6 +1589,8 @@ void addname(uint64 eventnum, uint64 number, const char* name) {
 void DoMark(u64 n, u64 arg) {
   //         T             N                       ARG
   u64 temp = (CLU(0) << 44) | (n << 32) | (arg &  CLU(0x00000000FFFFFFFF));
+  if (ring_header != NULL) {RingAdd(&temp, 1); return;}
+  if (batching) {BatchAdd(&temp, 1); return;}
   DoControl(KUTRACE_CMD_INSERT1, temp);
 }
 
@@ -980,6 +1598,10 @@ void DoMark(u64 n, u64 arg) {
 u64 DoEvent(u64 eventnum, u64 arg) {
   //         T             N                       ARG
   u64 temp = ((eventnum & CLU(0xFFF)) << 32) | (arg & CLU(0x00000000FFFFFFFF));
+  if (EntryLen(temp) == 1) {
+    if (ring_header != NULL) {RingAdd(&temp, 1); return 1;}
+    if (batching) {BatchAdd(&temp, 1); return 1;}
+  }
   return DoControl(KUTRACE_CMD_INSERT1, temp);
 }
 
@@ -1069,6 +1691,9 @@ void kutrace::mark_d(uint64 n) {::DoMark(KUTRACE_MARKD, n);}
 u64 kutrace::addevent(uint64 eventnum, uint64 arg) {return ::DoEvent(eventnum, arg);}
 
 void kutrace::addname(uint64 eventnum, uint64 number, const char* name) {::addname(eventnum, number, name);}
+void kutrace::batch(bool on) {::DoBatch(on);}
+void kutrace::flush_batch() {::BatchSubmit();}
+void kutrace::ring(bool on) {::DoRing(on);}
 
 void kutrace::msleep(int msec) {::msleep(msec);}
 int64 kutrace::readtime() {return ::ku_get_cycles();}
@@ -1081,13 +1706,18 @@ u64 kutrace::DoControl(u64 command, u64 arg) {
   return ::DoControl(command, arg);
 }
 void kutrace::DoDump(const char* fname) {::DoDump(fname);}
+bool kutrace::DoStreamStart(const char* fname) {return ::DoStreamStart(fname);}
+void kutrace::DoStreamStop() {::DoStreamStop();}
 u64  kutrace::DoEvent(u64 eventnum, u64 arg) {return ::DoEvent(eventnum, arg);}
+void kutrace::DoCompress(bool on) {::DoCompress(on);}
+bool kutrace::DoFilter(u64 class_mask) {return ::DoFilter(class_mask);}
 void kutrace::DoFlush() {::DoFlush();}
 void kutrace::DoInit(const char* process_name) {::DoInit(process_name);}
 void kutrace::DoMark(u64 n, u64 arg) {::DoMark(n, arg);}
 bool kutrace::DoTest() {return ::DoTest();}
 bool kutrace::DoOff() {return ::DoOff();}
 bool kutrace::DoOn() {return ::DoOn();}
+bool kutrace::DoPids(const u64* pids, int n) {return ::DoPids(pids, n);}
 void kutrace::DoQuit() {::DoQuit();}
 void kutrace::DoReset(u64 doing_ipc){::DoReset(doing_ipc);}
 void kutrace::DoStat(u64 control_flags) {::DoStat(control_flags);}
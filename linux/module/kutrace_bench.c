@@ -0,0 +1,412 @@
+/*
+ * kutrace_bench.c
+ *
+ * Userspace microbenchmark for the kutrace_mod.c fast path, linked with the
+ * module source built as libkutrace_mod_user.a. One thread per simulated CPU
+ * does syscall-like call/return pairs through trace_1, the same entry point
+ * the kernel patches use, so each pair goes through get_claim_with_tsdelta,
+ * get_claim, insert_1, insert_1_retopt and do_ipcllc_calc.
+ *
+ * With -irq usec, SIGALRM every usec simulates interrupts. The handler
+ * inserts -burst n (default 1) IRQ/IRQRET pairs on whatever CPU it lands on,
+ * nested inside whatever insert was in progress, or held until the module
+ * re-enables interrupts. Large bursts make the interrupt switch blocks under
+ * the interrupted claim. Afterward every call, return, IRQ and IRQRET must be found in
+ * the trace exactly once, in order, in a block of the right CPU, with the
+ * return values intact.
+ *
+ * With -rollover n, every n-th call starts a new trace block, so the
+ * block switch path is a measurable share of the time.
+ *
+ * With -classes mask, only the KUTRACE_CLASS_* event classes in mask are
+ * recorded, and with -evenpids only the even CPUs' threads have their
+ * syscalls recorded. The check then expects no calls or no IRQs where those
+ * are filtered out, so the cost of a filtered-out call can be timed too.
+ *
+ * Reports nsec per trace_1 call (thread CPU time), trace words per call,
+ * and block switches.
+ *
+ * Compile with  make user  or
+ *   gcc -O2 -pthread kutrace_bench.c libkutrace_mod_user.a -o kutrace_bench
+ *
+ * Usage: kutrace_bench [-cpus n] [-events n] [-mb n] [-batch n]
+ *                     [-irq usec] [-burst n] [-rollover n]
+ *                     [-classes mask] [-evenpids] [-ipc] [-v]
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>	/* uintptr_t */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>	/* setitimer, gettimeofday */
+#include <time.h>	/* clock_gettime */
+
+#include "kutrace_mod_user.h"
+
+/* Simulated syscall and interrupt numbers */
+#define BENCH_SYSCALL 39	/* getpid */
+#define BENCH_VECTOR 236	/* local timer */
+
+typedef struct {
+	int cpu;
+	u64 events;		/* Call/return pairs to do */
+	u64 irqs;		/* Simulated interrupts taken */
+	u64 deferred;		/* ... of which were held until irqs were enabled */
+	double cpu_nsec;	/* Thread CPU time for the loop */
+} ThreadArg;
+
+typedef struct {
+	u64 calls;		/* Syscall entries found */
+	u64 returns;		/* ... their returns, optimized or not */
+	u64 optimized;		/* Returns folded into the call entry */
+	u64 irqs;
+	u64 irqrets;
+	u64 words;		/* All entries, in u64 words */
+	bool call_open;		/* Call seen, return not yet */
+	bool irq_open;
+} CpuCheck;
+
+static pthread_barrier_t start_barrier;
+static int irq_burst = 1;
+static u64 rollover = 0;	/* Calls per forced block switch, 0 for none */
+static __thread u64 irq_seq;
+
+/* Runs on the interrupted thread's CPU with simulated interrupts off */
+static void bench_irq(void)
+{
+	int i;
+	for (i = 0; i < irq_burst; ++i) {
+		++irq_seq;
+		ku_user_trace_1(KUTRACE_IRQ + BENCH_VECTOR, irq_seq & 0xffff);
+		ku_user_trace_1(KUTRACE_IRQRET + BENCH_VECTOR, 0);
+	}
+}
+
+static void on_alarm(int sig)
+{
+	ku_user_interrupt();
+}
+
+static double thread_cpu_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000.0 + ts.tv_nsec;
+}
+
+static void *bench_thread(void *v)
+{
+	ThreadArg *ta = (ThreadArg *)v;
+	char comm[16];
+	sigset_t alarm_set;
+	double start;
+	u64 seq;
+
+	snprintf(comm, sizeof(comm), "bench%d", ta->cpu);
+	ku_user_set_cpu(ta->cpu, 1000 + ta->cpu, comm);
+	sigemptyset(&alarm_set);
+	sigaddset(&alarm_set, SIGALRM);
+	pthread_barrier_wait(&start_barrier);
+
+	pthread_sigmask(SIG_UNBLOCK, &alarm_set, NULL);
+	start = thread_cpu_nsec();
+	for (seq = 1; seq <= ta->events; ++seq) {
+		if ((rollover != 0) && (seq % rollover == 0))
+			ku_user_end_block();
+		/* Syscall arg0 is 16 bits; small retval allows return optimization */
+		ku_user_trace_1(KUTRACE_SYSCALL64 + BENCH_SYSCALL, seq & 0xffff);
+		ku_user_trace_1(KUTRACE_SYSRET64 + BENCH_SYSCALL, seq & 0x7f);
+	}
+	ta->cpu_nsec = thread_cpu_nsec() - start;
+	pthread_sigmask(SIG_BLOCK, &alarm_set, NULL);
+
+	ta->irqs = irq_seq;
+	ta->deferred = ku_user_deferred_interrupts();
+	return NULL;
+}
+
+/* Walk one flushed block. Return number of errors */
+static int check_block(u64 blocknum, int ncpus, CpuCheck *check)
+{
+	const u64 *block = ku_user_trace_block(blocknum);
+	int first = (blocknum == 0) ? 8 : 2;
+	u64 cpu = block[0] >> KU_USER_CPU_SHIFT;
+	CpuCheck *cc;
+	int errors = 0;
+	int i;
+
+	if (cpu >= (u64)ncpus) {
+		fprintf(stderr, "block %llu: bad cpu %llu\n", blocknum, cpu);
+		return 1;
+	}
+	cc = &check[cpu];
+
+	for (i = first + 4; i < KU_USER_BLOCKSIZEU64; ) {
+		u64 word = block[i];
+		u64 event = (word >> KU_USER_EVENT_SHIFT) & 0xfff;
+		u64 delta = (word >> KU_USER_DELTA_SHIFT) & 0xff;
+		u64 retval = (word >> KU_USER_RETVAL_SHIFT) & 0xff;
+		u64 arg0 = word & 0xffff;
+		u64 len = ku_user_entry_len(word);
+
+		if (i + len > KU_USER_BLOCKSIZEU64) {
+			fprintf(stderr, "block %llu[%d]: entry crosses block end\n",
+				blocknum, i);
+			return errors + 1;
+		}
+		if (word == 0) {
+			++i;
+			continue;
+		}
+		cc->words += len;
+		if (event == KUTRACE_TSDELTA) {
+			i += len;
+			continue;
+		}
+
+		if (event == KUTRACE_SYSCALL64 + BENCH_SYSCALL) {
+			u64 seq = cc->calls + 1;
+			if (cc->call_open || (arg0 != (seq & 0xffff))) {
+				fprintf(stderr, "block %llu[%d]: cpu %llu call %llu, expected %llu\n",
+					blocknum, i, cpu, arg0, seq & 0xffff);
+				++errors;
+			}
+			++cc->calls;
+			cc->call_open = true;
+			if (delta != 0) {
+				/* Return folded in */
+				if (retval != (seq & 0x7f)) {
+					fprintf(stderr, "block %llu[%d]: cpu %llu retval %llu, expected %llu\n",
+						blocknum, i, cpu, retval, seq & 0x7f);
+					++errors;
+				}
+				++cc->returns;
+				++cc->optimized;
+				cc->call_open = false;
+			}
+		} else if (event == KUTRACE_SYSRET64 + BENCH_SYSCALL) {
+			if (!cc->call_open || ((word & 0xff) != (cc->calls & 0x7f))) {
+				fprintf(stderr, "block %llu[%d]: cpu %llu unmatched return\n",
+					blocknum, i, cpu);
+				++errors;
+			}
+			++cc->returns;
+			cc->call_open = false;
+		} else if (event == KUTRACE_IRQ + BENCH_VECTOR) {
+			u64 seq = cc->irqs + 1;
+			if (cc->irq_open || (arg0 != (seq & 0xffff))) {
+				fprintf(stderr, "block %llu[%d]: cpu %llu irq %llu, expected %llu\n",
+					blocknum, i, cpu, arg0, seq & 0xffff);
+				++errors;
+			}
+			++cc->irqs;
+			cc->irq_open = (delta == 0);
+			if (delta != 0)
+				++cc->irqrets;
+		} else if (event == KUTRACE_IRQRET + BENCH_VECTOR) {
+			if (!cc->irq_open) {
+				fprintf(stderr, "block %llu[%d]: cpu %llu unmatched irqret\n",
+					blocknum, i, cpu);
+				++errors;
+			}
+			++cc->irqrets;
+			cc->irq_open = false;
+		} else {
+			fprintf(stderr, "block %llu[%d]: cpu %llu unexpected %016llx\n",
+				blocknum, i, cpu, word);
+			++errors;
+		}
+		i += len;
+	}
+	return errors;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: kutrace_bench [-cpus n] [-events n] [-mb n] [-batch n] "
+		"[-irq usec] [-burst n] [-rollover n] [-classes mask] [-evenpids] "
+		"[-ipc] [-v]\n");
+	exit(0);
+}
+
+int main(int argc, const char **argv)
+{
+	int ncpus = 4;
+	u64 events = 1000000;
+	long tracemb = 0;
+	long batchblocks = 4;
+	long irq_usec = 0;
+	u64 classes = KUTRACE_CLASS_ALL;
+	bool evenpids = false;
+	u64 pidlist[1 + KU_USER_MAX_CPUS];
+	bool ipc = false;
+	bool verbose = false;
+	ThreadArg ta[KU_USER_MAX_CPUS];
+	pthread_t thread[KU_USER_MAX_CPUS];
+	CpuCheck check[KU_USER_MAX_CPUS];
+	struct timeval tv_start, tv_end;
+	struct itimerval timer;
+	struct sigaction sa;
+	sigset_t alarm_set;
+	KuUserInfo info;
+	u64 count, blocks, b;
+	u64 words = 0, returns = 0, optimized = 0;
+	u64 irqs = 0, deferred = 0;
+	double cpu_nsec = 0.0, usec, calls;
+	int errors = 0;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if ((strcmp(argv[i], "-cpus") == 0) && (i + 1 < argc)) {
+			ncpus = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "-events") == 0) && (i + 1 < argc)) {
+			events = atoll(argv[++i]);
+		} else if ((strcmp(argv[i], "-mb") == 0) && (i + 1 < argc)) {
+			tracemb = atol(argv[++i]);
+		} else if ((strcmp(argv[i], "-batch") == 0) && (i + 1 < argc)) {
+			batchblocks = atol(argv[++i]);
+		} else if ((strcmp(argv[i], "-irq") == 0) && (i + 1 < argc)) {
+			irq_usec = atol(argv[++i]);
+		} else if ((strcmp(argv[i], "-burst") == 0) && (i + 1 < argc)) {
+			irq_burst = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "-rollover") == 0) && (i + 1 < argc)) {
+			rollover = atoll(argv[++i]);
+		} else if ((strcmp(argv[i], "-classes") == 0) && (i + 1 < argc)) {
+			classes = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-evenpids") == 0) {
+			evenpids = true;
+		} else if (strcmp(argv[i], "-ipc") == 0) {
+			ipc = true;
+		} else if (strcmp(argv[i], "-v") == 0) {
+			verbose = true;
+		} else {
+			usage();
+		}
+	}
+	if ((ncpus < 1) || (KU_USER_MAX_CPUS < ncpus) || (events < 1) ||
+		(tracemb < 0) || (irq_usec < 0) || (irq_burst < 1))
+		usage();
+	if (tracemb == 0) {
+		/* Room for two words per pair, plus IPC bytes and slack */
+		tracemb = 8 + ((ncpus * events * 2 * 8 * 5 / 4) >> 20);
+		/* Plus a 64KB block per forced switch, and IPC bytes */
+		if (rollover != 0)
+			tracemb += ((ncpus * (events / rollover + 2 * batchblocks)) * 5 / 4) >> 4;
+	}
+
+	if (ku_user_init(ncpus, tracemb, batchblocks, verbose, bench_irq) != 0) {
+		fprintf(stderr, "kutrace_bench: init failed\n");
+		exit(0);
+	}
+	ku_user_control(KUTRACE_CMD_SETCLASSES, classes);
+	pidlist[0] = 0;
+	if (evenpids) {
+		/* Same pids as bench_thread gives each CPU */
+		for (i = 0; i < ncpus; i += 2)
+			pidlist[1 + pidlist[0]++] = 1000 + i;
+	}
+	ku_user_control(KUTRACE_CMD_SETPIDS, (u64)(uintptr_t)pidlist);
+	ku_user_control(KUTRACE_CMD_RESET, ipc ? DO_IPC : 0);
+	ku_user_control(KUTRACE_CMD_ON, 0);
+
+	/* Only the CPU threads take the simulated interrupts */
+	sigemptyset(&alarm_set);
+	sigaddset(&alarm_set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &alarm_set, NULL);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_alarm;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+
+	pthread_barrier_init(&start_barrier, NULL, ncpus + 1);
+	for (i = 0; i < ncpus; ++i) {
+		ta[i].cpu = i;
+		ta[i].events = events;
+		pthread_create(&thread[i], NULL, bench_thread, &ta[i]);
+	}
+	if (irq_usec > 0) {
+		timer.it_interval.tv_sec = irq_usec / 1000000;
+		timer.it_interval.tv_usec = irq_usec % 1000000;
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_REAL, &timer, NULL);
+	}
+	gettimeofday(&tv_start, NULL);
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < ncpus; ++i)
+		pthread_join(thread[i], NULL);
+	gettimeofday(&tv_end, NULL);
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	ku_user_control(KUTRACE_CMD_OFF, 0);
+	ku_user_control(KUTRACE_CMD_FLUSH, 0);
+	count = ku_user_control(KUTRACE_CMD_GETCOUNT, 0);
+	ku_user_get_info(&info);
+	blocks = count / KU_USER_BLOCKSIZEU64;
+
+	if (!ku_user_trace_guards_ok()) {
+		fprintf(stderr, "store outside the trace buffer\n");
+		++errors;
+	}
+	memset(check, 0, sizeof(check));
+	for (b = 0; b < blocks; ++b)
+		errors += check_block(b, ncpus, check);
+
+	for (i = 0; i < ncpus; ++i) {
+		cpu_nsec += ta[i].cpu_nsec;
+		irqs += ta[i].irqs;
+		deferred += ta[i].deferred;
+		words += check[i].words;
+		returns += check[i].returns;
+		optimized += check[i].optimized;
+	}
+	if (info.cursor >= info.blocks) {
+		fprintf(stderr, "kutrace_bench: trace buffer filled; use a larger -mb to check counts\n");
+	} else {
+		for (i = 0; i < ncpus; ++i) {
+			/* Filtered-out classes and pids leave nothing */
+			u64 want_calls = events;
+			u64 want_irqs = ta[i].irqs;
+			if (((classes & KUTRACE_CLASS_SYSCALL) == 0) ||
+				(evenpids && (i & 1)))
+				want_calls = 0;
+			if ((classes & KUTRACE_CLASS_IRQ) == 0)
+				want_irqs = 0;
+			if ((check[i].calls != want_calls) ||
+				(check[i].returns != want_calls) ||
+				(check[i].irqs != want_irqs) ||
+				(check[i].irqrets != want_irqs)) {
+				fprintf(stderr, "cpu %d: found %llu calls, %llu returns, "
+					"%llu irqs, %llu irqrets; expected %llu, %llu\n",
+					i, check[i].calls, check[i].returns,
+					check[i].irqs, check[i].irqrets, want_calls, want_irqs);
+				++errors;
+			}
+		}
+	}
+
+	usec = (tv_end.tv_sec - tv_start.tv_sec) * 1000000.0 +
+		(tv_end.tv_usec - tv_start.tv_usec);
+	calls = 2.0 * ncpus * events;
+	fprintf(stdout, "%d CPUs x %llu call/return pairs, %s, batch %llu\n",
+		ncpus, events, ipc ? "IPC" : "no IPC", info.batch);
+	fprintf(stdout, "  %7.1f nsec per trace_1 call (thread CPU time), %.0f usec elapsed\n",
+		cpu_nsec / calls, usec);
+	fprintf(stdout, "  %7.3f trace words per call, %.1f%% of returns optimized\n",
+		words / calls, (100.0 * optimized) / (returns ? returns : 1));
+	fprintf(stdout, "  %7llu block switches, %.0f per CPU-second, one per %.0f calls\n",
+		blocks, blocks / (cpu_nsec / 1000000000.0), calls / (blocks ? blocks : 1));
+	if (irq_usec > 0)
+		fprintf(stdout, "  %7llu simulated interrupts, %llu held until interrupts enabled\n",
+			irqs, deferred);
+	ku_user_exit();
+
+	if (errors != 0) {
+		fprintf(stderr, "kutrace_bench FAIL: %d errors\n", errors);
+		return 1;
+	}
+	fprintf(stdout, "  OK\n");
+	return 0;
+}
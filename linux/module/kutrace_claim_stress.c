@@ -0,0 +1,576 @@
+/*
+ * kutrace_claim_stress.c
+ *
+ * Userspace stress test for the trace block claim path in kutrace_mod.c.
+ * Links with the module source built as libkutrace_mod_user.a and runs one
+ * thread per simulated CPU, each inserting 1- to 8-word entries as fast as it can through
+ * kutrace_control, so many CPUs switch blocks at once. Then it flushes and
+ * walks the trace buffer checking that
+ *   nothing was stored outside the trace buffer,
+ *   every block has a valid header for one of the CPUs,
+ *   every entry is in a block owned by the CPU that inserted it, and
+ *   (without wraparound) every entry inserted is found exactly once, in order
+ *
+ * With -stream, the module recycles blocks, and a consumer thread plays
+ * kutrace_control: every -drain usec it copies out the full blocks, oldest
+ * first, and frees them. At the end it has each CPU hand over the block it
+ * is filling, as for a quiet CPU, and moves the very first block to the
+ * front. The checks run over the copies. Entries dropped because the
+ * consumer fell behind are counted, not inserted, so all the others must
+ * still be found.
+ *
+ * With -insertbatch n, each thread sends its entries n words at a time
+ * through INSERTBATCH, each stamped with the time it was made, and the
+ * batch with the full time of its first entry.
+ *
+ * With -ring, each thread registers a user event ring and stores its
+ * entries there, as kutrace_lib does, draining it itself when full. Every
+ * -switch n entries it plays a context switch away, which drains the ring
+ * in the module. If the trace fills, each CPU must have a prefix of its
+ * entries. At the end, even CPUs give their rings back and odd ones exit
+ * without doing so; every ring must come back.
+ *
+ * Last, the module's statistics must agree: one entry counted per entry
+ * inserted, and in streaming one drop per entry turned away.
+ *
+ * Compile with  make user  or
+ *   gcc -O2 -pthread kutrace_claim_stress.c libkutrace_mod_user.a -o kutrace_claim_stress
+ *
+ * Usage: kutrace_claim_stress [-cpus n] [-events n] [-mb n] [-batch n] [-wrap]
+ *                             [-stream] [-drain usec] [-insertbatch n]
+ *                             [-ring] [-switch n] [-v]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>	/* gettimeofday */
+#include <unistd.h>	/* usleep */
+
+#include "kutrace_mod_user.h"
+
+/* Test entries use event 0x800 + cpu with arg = sequence number, or a */
+/* length-coded event 0x0L0 with [1..L-1] = cpu << 32 | sequence */
+#define TEST_EVENT 0x800
+
+typedef struct {
+	int cpu;
+	u64 events;		/* Entries to try */
+	u64 inserted;		/* Entries kutrace_control accepted */
+	u64 dropped;		/* Streaming: entries it turned away */
+} ThreadArg;
+
+static pthread_barrier_t start_barrier;
+
+/* With wraparound a lapped CPU may still finish its old block after */
+/* another CPU reuses it, as with the single global block pointer. */
+/* Such blocks are counted, not reported as errors */
+static bool report = true;
+
+static bool stream = false;
+
+/* Words per INSERTBATCH call, or 0 to insert one entry per call */
+static u64 insertbatch = 0;
+
+/* User event rings, and entries between simulated context switches */
+static bool ring = false;
+static u64 switch_every = 50;
+
+/* Streaming: copies of the drained blocks, in drain order */
+static u64 *drained;
+static u64 drained_count;
+static u64 drained_max;
+static long drain_usec = 100;
+static volatile bool consumer_stop;
+static u64 drained_block0 = ~0ULL;	/* Where buffer block 0 went */
+static int drain_errors;
+
+typedef struct {
+	u64 timestamp;
+	u64 slot;
+} FullBlock;
+
+/* Build test entry seq for cpu in entry[0..len-1] */
+static void make_entry(int cpu, u64 seq, u64 len, u64 *entry)
+{
+	u64 i;
+	if (len == 1) {
+		entry[0] = ((u64)(TEST_EVENT + cpu) << KU_USER_EVENT_SHIFT) |
+			(uint32_t)seq;
+		return;
+	}
+	entry[0] = ((len << KU_USER_LENGTH_SHIFT) << KU_USER_EVENT_SHIFT) |
+		(uint32_t)seq;
+	for (i = 1; i < len; ++i)
+		entry[i] = ((u64)cpu << 32) | (uint32_t)seq;
+}
+
+/* Send one batch, with the full time of its first entry. Return false if */
+/* full and not streaming */
+static bool send_batch(ThreadArg *ta, u64 *batch, u64 base, u64 entries)
+{
+	u64 words = batch[0];
+	u64 n;
+	u64 i, k;
+
+	batch[0] = (base << 8) | words;
+	n = ku_user_control(KUTRACE_CMD_INSERTBATCH, (u64)(uintptr_t)batch);
+
+	/* Whole entries in the first n words went in */
+	for (i = 1, k = 0; i < 1 + n; i += ku_user_entry_len(batch[i]))
+		++k;
+	ta->inserted += k;
+	batch[0] = 0;
+	if (n == words)
+		return true;
+	ta->dropped += entries - k;
+	return stream;
+}
+
+/* Store entry in user event ring r the way kutrace_lib does */
+static void ring_add(u64 r, u64 *entry, u64 len)
+{
+	u64 *header = ku_user_ring(r);
+	u64 *data = header + KUTRACE_RING_HEADER_BYTES / sizeof(u64);
+	u64 head = header[0];
+	u64 now = ku_user_timecount();
+	u64 k;
+
+	if (head - __atomic_load_n(&header[1], __ATOMIC_ACQUIRE) + len >
+		KUTRACE_RING_DATA_WORDS)
+		ku_user_control(KUTRACE_CMD_DRAINRING, 0);
+	if (head == __atomic_load_n(&header[1], __ATOMIC_ACQUIRE))
+		header[2] = now;	/* Time base of an empty ring */
+	entry[0] |= (now & 0xfffff) << KU_USER_TIMESTAMP_SHIFT;
+	for (k = 0; k < len; ++k)
+		data[(head + k) & (KUTRACE_RING_DATA_WORDS - 1)] = entry[k];
+	__atomic_store_n(&header[0], head + len, __ATOMIC_RELEASE);
+}
+
+static void *stress_thread(void *v)
+{
+	ThreadArg *ta = (ThreadArg *)v;
+	char comm[16];
+	u64 batch[1 + 64];
+	u64 base = 0;
+	u64 entries = 0;
+	u64 r = 0;
+	u64 seq;
+
+	snprintf(comm, sizeof(comm), "stress%d", ta->cpu);
+	ku_user_set_cpu(ta->cpu, 1000 + ta->cpu, comm);
+	pthread_barrier_wait(&start_barrier);
+
+	if (ring) {
+		r = ku_user_control(KUTRACE_CMD_REGRING, 1);
+		if (r == ~0ULL) {
+			fprintf(stderr, "cpu %d: no ring\n", ta->cpu);
+			return NULL;
+		}
+	}
+
+	batch[0] = 0;
+	for (seq = 1; seq <= ta->events; ++seq) {
+		u64 len = 1 + (seq % 11) % 8;	/* Mostly 1-word, some up to 8 */
+		u64 temp[8];
+		u64 n;
+		make_entry(ta->cpu, seq, len, temp);
+		if (ring) {
+			/* Counted as made; the checks allow for a full trace */
+			ring_add(r, temp, len);
+			++ta->inserted;
+			if (seq % switch_every == 0)
+				ku_user_trace_1(KUTRACE_USERPID, 1000 + ta->cpu);
+			continue;
+		}
+		if (insertbatch != 0) {
+			u64 now;
+			if (batch[0] + len > insertbatch) {
+				if (!send_batch(ta, batch, base, entries))
+					return NULL;	/* Full */
+				entries = 0;
+			}
+			now = ku_user_timecount();
+			if (batch[0] == 0)
+				base = now;
+			temp[0] |= (now & 0xfffff) << KU_USER_TIMESTAMP_SHIFT;
+			memcpy(&batch[1 + batch[0]], temp, len * sizeof(u64));
+			batch[0] += len;
+			++entries;
+			continue;
+		}
+		if (len == 1)
+			n = ku_user_control(KUTRACE_CMD_INSERT1, temp[0]);
+		else
+			n = ku_user_control(KUTRACE_CMD_INSERTN, (u64)(uintptr_t)temp);
+		if (n == 0) {
+			if (!stream)
+				break;	/* Full */
+			++ta->dropped;	/* Consumer behind */
+			continue;
+		}
+		++ta->inserted;
+	}
+	if (batch[0] != 0)
+		send_batch(ta, batch, base, entries);
+	if (ring && ((ta->cpu & 1) == 0))
+		ku_user_control(KUTRACE_CMD_REGRING, 0);	/* Drain, give back */
+	else if (ring)
+		ku_user_exit_thread();	/* Drained at its last switch */
+	return NULL;
+}
+
+static int compare_full(const void *a, const void *b)
+{
+	u64 ta = ((const FullBlock *)a)->timestamp;
+	u64 tb = ((const FullBlock *)b)->timestamp;
+	return (ta < tb) ? -1 : (ta > tb) ? 1 : 0;
+}
+
+/* One consumer pass, as kutrace_control would do it: write out every full */
+/* block oldest first, so each CPU's blocks stay in order, then free them */
+static void drain_pass(void)
+{
+	static FullBlock full[4096];
+	u64 slot;
+	int n = 0;
+	int i;
+
+	for (slot = ku_user_control(KUTRACE_CMD_GETFULL, 0);
+		(slot != ~0ULL) && (n < 4096);
+		slot = ku_user_control(KUTRACE_CMD_GETFULL, slot + 1)) {
+		full[n].timestamp = ku_user_trace_block(slot)[0] & 0x00ffffffffffffffULL;
+		full[n].slot = slot;
+		++n;
+	}
+	qsort(full, n, sizeof(FullBlock), compare_full);
+
+	for (i = 0; i < n; ++i) {
+		if (drained_count == drained_max) {
+			drained_max = (drained_max == 0) ? 256 : drained_max * 2;
+			drained = (u64 *)realloc(drained,
+				drained_max * KU_USER_BLOCKSIZEU64 * sizeof(u64));
+		}
+		memcpy(&drained[drained_count * KU_USER_BLOCKSIZEU64],
+			ku_user_trace_block(full[i].slot),
+			KU_USER_BLOCKSIZEU64 * sizeof(u64));
+		if ((full[i].slot == 0) && (drained_block0 == ~0ULL))
+			drained_block0 = drained_count;
+		++drained_count;
+		if (ku_user_control(KUTRACE_CMD_FREEBLOCK, full[i].slot) != 0) {
+			fprintf(stderr, "block %llu: free failed\n", full[i].slot);
+			++drain_errors;
+		}
+	}
+}
+
+/* Move the copy of buffer block 0 to the front, as kutrace_control does */
+/* to the streamed file. It is its CPU's first block, so each CPU's blocks */
+/* stay in order */
+static void block0_to_front(void)
+{
+	u64 *block0;
+	if ((drained_block0 == ~0ULL) || (drained_block0 == 0))
+		return;
+	block0 = (u64 *)malloc(KU_USER_BLOCKSIZEU64 * sizeof(u64));
+	memcpy(block0, &drained[drained_block0 * KU_USER_BLOCKSIZEU64],
+		KU_USER_BLOCKSIZEU64 * sizeof(u64));
+	memmove(&drained[KU_USER_BLOCKSIZEU64], drained,
+		drained_block0 * KU_USER_BLOCKSIZEU64 * sizeof(u64));
+	memcpy(drained, block0, KU_USER_BLOCKSIZEU64 * sizeof(u64));
+	free(block0);
+}
+
+static void *consumer_thread(void *v)
+{
+	while (!consumer_stop) {
+		drain_pass();
+		usleep(drain_usec);
+	}
+	return NULL;
+}
+
+/* Walk one flushed or drained block. Return number of errors */
+static int check_block(const u64 *block, u64 blocknum, int ncpus, bool wrapped,
+	u64 *found, u64 *prior_seq)
+{
+	int first = (blocknum == 0) ? 8 : 2;
+	u64 cpu = block[0] >> KU_USER_CPU_SHIFT;
+	int errors = 0;
+	int i;
+
+	if (cpu >= (u64)ncpus) {
+		if (report) fprintf(stderr, "block %llu: bad cpu %llu\n", blocknum, cpu);
+		return 1;
+	}
+	if ((block[first] & 0xffffffff) != 1000 + cpu) {
+		if (report) fprintf(stderr, "block %llu: cpu %llu has pid %llu\n",
+			blocknum, cpu, block[first] & 0xffffffff);
+		++errors;
+	}
+
+	for (i = first + 4; i < KU_USER_BLOCKSIZEU64; ) {
+		u64 word = block[i];
+		u64 event = (word >> KU_USER_EVENT_SHIFT) & 0xfff;
+		u64 len = ku_user_entry_len(word);
+		u64 seq = word & 0xffffffff;
+		u64 owner = cpu;
+		u64 k;
+
+		if (word == 0) {
+			++i;
+			continue;
+		}
+		if (i + len > KU_USER_BLOCKSIZEU64) {
+			if (report) fprintf(stderr, "block %llu[%d]: entry crosses block end\n",
+				blocknum, i);
+			return errors + 1;
+		}
+		if ((event == KUTRACE_TSDELTA) || (event == KUTRACE_USERPID)) {
+			++i;
+			continue;
+		}
+		if ((TEST_EVENT <= event) && (event < TEST_EVENT + (u64)ncpus)) {
+			owner = event - TEST_EVENT;
+		} else if (len > 1) {
+			owner = block[i + 1] >> 32;
+			for (k = 1; k < len; ++k) {
+				if (block[i + k] != ((owner << 32) | seq)) {
+					if (report) fprintf(stderr, "block %llu[%d]: torn entry\n",
+						blocknum, i);
+					++errors;
+					break;
+				}
+			}
+		} else {
+			if (report) fprintf(stderr, "block %llu[%d]: unexpected %016llx\n",
+				blocknum, i, word);
+			++errors;
+		}
+		if (owner != cpu) {
+			if (report) fprintf(stderr, "block %llu[%d]: cpu %llu entry in cpu %llu block\n",
+				blocknum, i, owner, cpu);
+			++errors;
+		}
+		if ((owner < (u64)ncpus) && !wrapped) {
+			if (seq <= prior_seq[owner]) {
+				if (report) fprintf(stderr, "block %llu[%d]: cpu %llu seq %llu after %llu\n",
+					blocknum, i, owner, seq, prior_seq[owner]);
+				++errors;
+			}
+			prior_seq[owner] = seq;
+			++found[owner];
+		}
+		i += len;
+	}
+	return errors;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: kutrace_claim_stress [-cpus n] [-events n] [-mb n] [-batch n] [-wrap] "
+		"[-stream] [-drain usec] [-insertbatch n] [-ring] [-switch n] [-v]\n");
+	exit(0);
+}
+
+int main(int argc, const char **argv)
+{
+	int ncpus = 16;
+	u64 events = 2000000;
+	bool wrap = false;
+	ThreadArg ta[KU_USER_MAX_CPUS];
+	pthread_t thread[KU_USER_MAX_CPUS];
+	pthread_t consumer;
+	u64 found[KU_USER_MAX_CPUS];
+	u64 prior_seq[KU_USER_MAX_CPUS];
+	struct timeval tv_start, tv_end;
+	KuUserInfo info;
+	u64 stats[KUTRACE_STAT_WORDS];
+	long tracemb = 64;
+	long batchblocks = 4;
+	bool verbose = false;
+	u64 count, blocks, b, total = 0, dropped = 0;
+	double usec;
+	int errors = 0;
+	int lapped = 0;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if ((strcmp(argv[i], "-cpus") == 0) && (i + 1 < argc)) {
+			ncpus = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "-events") == 0) && (i + 1 < argc)) {
+			events = atoll(argv[++i]);
+		} else if ((strcmp(argv[i], "-mb") == 0) && (i + 1 < argc)) {
+			tracemb = atol(argv[++i]);
+		} else if ((strcmp(argv[i], "-batch") == 0) && (i + 1 < argc)) {
+			batchblocks = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-wrap") == 0) {
+			wrap = true;
+		} else if (strcmp(argv[i], "-stream") == 0) {
+			stream = true;
+		} else if ((strcmp(argv[i], "-drain") == 0) && (i + 1 < argc)) {
+			drain_usec = atol(argv[++i]);
+		} else if ((strcmp(argv[i], "-insertbatch") == 0) && (i + 1 < argc)) {
+			insertbatch = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "-ring") == 0) {
+			ring = true;
+		} else if ((strcmp(argv[i], "-switch") == 0) && (i + 1 < argc)) {
+			switch_every = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			verbose = true;
+		} else {
+			usage();
+		}
+	}
+	if ((ncpus < 1) || (KU_USER_MAX_CPUS < ncpus) || (tracemb < 1) ||
+		((insertbatch != 0) && ((insertbatch < 8) || (64 < insertbatch))) ||
+		(switch_every < 1))
+		usage();
+
+	if (ku_user_init(ncpus, tracemb, batchblocks, verbose, NULL) != 0) {
+		fprintf(stderr, "kutrace_claim_stress: init failed\n");
+		exit(0);
+	}
+	if (ring) {
+		/* Plain mode only, one ring per simulated CPU */
+		stream = false;
+		wrap = false;
+		insertbatch = 0;
+		if (ncpus > KUTRACE_MAX_RINGS)
+			usage();
+	}
+	if (stream)
+		wrap = false;
+	ku_user_control(KUTRACE_CMD_RESET, stream ? DO_STREAM : wrap ? DO_WRAP : 0);
+	ku_user_control(KUTRACE_CMD_ON, 0);
+	if (stream)
+		pthread_create(&consumer, NULL, consumer_thread, NULL);
+
+	pthread_barrier_init(&start_barrier, NULL, ncpus + 1);
+	for (i = 0; i < ncpus; ++i) {
+		ta[i].cpu = i;
+		ta[i].events = events;
+		ta[i].inserted = 0;
+		ta[i].dropped = 0;
+		pthread_create(&thread[i], NULL, stress_thread, &ta[i]);
+	}
+	gettimeofday(&tv_start, NULL);
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < ncpus; ++i)
+		pthread_join(thread[i], NULL);
+	gettimeofday(&tv_end, NULL);
+
+	/* The CPU threads are done, so each CPU can hand over the block it */
+	/* is filling with tracing still on */
+	if (stream)
+		ku_user_control(KUTRACE_CMD_HANDOFF, 1);
+	ku_user_control(KUTRACE_CMD_OFF, 0);
+	ku_user_control(KUTRACE_CMD_FLUSH, 0);
+	if (stream) {
+		/* Final pass picks up the blocks the flush handed over */
+		consumer_stop = true;
+		pthread_join(consumer, NULL);
+		drain_pass();
+		if (ku_user_control(KUTRACE_CMD_GETFULL, 0) != ~0ULL) {
+			fprintf(stderr, "full blocks left after the last drain\n");
+			++errors;
+		}
+		errors += drain_errors;
+		block0_to_front();
+	}
+	count = ku_user_control(KUTRACE_CMD_GETCOUNT, 0);
+	ku_user_get_info(&info);
+	if (ku_user_control(KUTRACE_CMD_GETSTATS, (u64)(uintptr_t)stats) !=
+		KUTRACE_STAT_WORDS) {
+		fprintf(stderr, "GETSTATS failed\n");
+		memset(stats, 0, sizeof(stats));
+		++errors;
+	}
+	if (info.wrapped)
+		count = ~count;
+	blocks = stream ? drained_count : count / KU_USER_BLOCKSIZEU64;
+
+	if (!ku_user_trace_guards_ok()) {
+		fprintf(stderr, "store outside the trace buffer\n");
+		++errors;
+	}
+	for (i = 0; i < ncpus; ++i) {
+		found[i] = 0;
+		prior_seq[i] = 0;
+		total += ta[i].inserted;
+		dropped += ta[i].dropped;
+	}
+	report = !wrap;
+	for (b = 0; b < blocks; ++b) {
+		const u64 *block = stream ? &drained[b * KU_USER_BLOCKSIZEU64] :
+			ku_user_trace_block(b);
+		int block_errors = check_block(block, b, ncpus, wrap, found, prior_seq);
+		if (wrap && (block_errors != 0))
+			++lapped;
+		else
+			errors += block_errors;
+	}
+	if (ring) {
+		u64 r;
+		for (r = 0; r < KUTRACE_MAX_RINGS; ++r) {
+			if (ku_user_ring_owner(r) != 0) {
+				fprintf(stderr, "ring %llu still owned by pid %llu\n",
+					r, ku_user_ring_owner(r));
+				++errors;
+			}
+		}
+	}
+	/* Ring mode also counts its context switch entries, and its */
+	/* entries made are not all inserted */
+	if (!ring && (stats[0] != total)) {
+		fprintf(stderr, "stats: %llu entries, inserted %llu\n", stats[0], total);
+		++errors;
+	}
+	if (stream && (stats[6] != dropped)) {
+		fprintf(stderr, "stats: %llu drops, dropped %llu\n", stats[6], dropped);
+		++errors;
+	}
+	if (!wrap) {
+		for (i = 0; i < ncpus; ++i) {
+			/* Ring entries past a full trace are lost, but only */
+			/* from the end */
+			bool full = ring && (info.cursor >= info.blocks);
+			if (full && (found[i] == prior_seq[i]))
+				continue;
+			if (found[i] != ta[i].inserted) {
+				fprintf(stderr, "cpu %d: inserted %llu entries, found %llu\n",
+					i, ta[i].inserted, found[i]);
+				++errors;
+			}
+		}
+	}
+
+	usec = (tv_end.tv_sec - tv_start.tv_sec) * 1000000.0 +
+		(tv_end.tv_usec - tv_start.tv_usec);
+	fprintf(stdout, "%d CPUs, batch %llu, %llu %s %llu blocks%s, "
+		"cursor %llu\n", ncpus, info.batch, blocks,
+		stream ? "streamed through" : "of", info.blocks,
+		info.wrapped ? " (wrapped)" : "", info.cursor);
+	fprintf(stdout, "  %llu entries in %.0f usec, %.1f nsec/entry\n",
+		total, usec, (usec * 1000.0) / (total ? total : 1));
+	if (stream)
+		fprintf(stdout, "  %llu entries dropped, %llu overruns\n",
+			dropped, info.overruns);
+	fprintf(stdout, "  stats: %llu words, %llu tsdelta, %llu abandoned, "
+		"%llu switches, %llu drops, %llu full stops, %llu clamped\n",
+		stats[1], stats[2], stats[4], stats[5], stats[6], stats[7],
+		stats[9]);
+	if (lapped != 0)
+		fprintf(stdout, "  %d blocks also written by a lapped CPU\n", lapped);
+	ku_user_exit();
+	free(drained);
+
+	if (errors != 0) {
+		fprintf(stderr, "kutrace_claim_stress FAIL: %d errors\n", errors);
+		return 1;
+	}
+	fprintf(stdout, "  OK\n");
+	return 0;
+}
@@ -47,30 +47,67 @@
  * dsites 2023.06.22 Trace LLC misses instead of IPC per timespan
  * dsites 2023.06.25 Extend LLC range by 4x
  * dsites 2024.05.29 Combine to do either/both IPC and LLC
+ * Per-CPU batches of trace blocks from an atomic cursor,
+ *   no global lock. Userspace build for the test harness, -DKUTRACE_USERSPACE
+ * Read-only mmap of the trace buffer through /dev/kutrace
+ * Streaming mode: a consumer drains full blocks while
+ *   tracing stays on, and the module recycles them
+ * INSERTBATCH: many user entries, user timestamps, one call
+ * Per-thread user event rings, mapped through /dev/kutrace
+ *   and drained at context switch
+ * Per-CPU statistics counters, KUTRACE_CMD_GETSTATS
+ * Block header flags and block tails set up at reset,
+ *   counter setup on every CPU at trace on, next pooled block prefetched
+ * Event-class mask and PID include-list filters
+ * Streaming hands over a block at the switch outside
+ *   interrupts; KUTRACE_CMD_HANDOFF for quiet CPUs
+ * Full time base for batch and ring timestamps; entries
+ *   moved in time and entries dropped after a full claim are counted
+ * Rings keep their owners across reset; an exiting or
+ *   vanished thread's ring is given back
+ * Statistics counted with this_cpu_inc/this_cpu_add
+ * Unused pooled blocks given back at flush, not dumped empty
  *
  */
 
+#ifdef KUTRACE_USERSPACE
+/* Userspace stand-ins for everything below; see kutrace_user_shim.h */
+#include "kutrace_user_shim.h"
+#else
+
 #include <linux/kutrace.h>
 
 #include <linux/capability.h>
 #include <linux/compiler.h>	/* for unlikely() */
 #include <linux/cpufreq.h>
 #include <linux/delay.h>
+#include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/percpu.h>
+#include <linux/pid.h>		/* find_pid_ns, pid_task */
+#include <linux/pid_namespace.h>	/* init_pid_ns */
+#include <linux/prefetch.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
+#include <linux/smp.h>		/* on_each_cpu */
 #include <linux/spinlock.h>
 #include <linux/stat.h>
 #include <linux/string.h>
 #include <linux/types.h>	/* u64, among others */
 #include <linux/uaccess.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>	/* work_on_cpu */
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
+#endif	/* KUTRACE_USERSPACE */
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Richard L Sites");
 
@@ -87,6 +124,77 @@ MODULE_AUTHOR("Richard L Sites");
 #define KUTRACE_CMD_GETIPC4KB 14
 #endif
 
+// Added 2024.10.21
+#ifndef KUTRACE_CMD_GETMAPSIZE
+#define KUTRACE_CMD_GETMAPSIZE 15
+#endif
+
+// Added 2024.10.22
+#ifndef KUTRACE_CMD_GETFULL
+#define KUTRACE_CMD_GETFULL 16
+#endif
+
+#ifndef KUTRACE_CMD_FREEBLOCK
+#define KUTRACE_CMD_FREEBLOCK 17
+#endif
+
+// Added 2024.10.23
+#ifndef KUTRACE_CMD_INSERTBATCH
+#define KUTRACE_CMD_INSERTBATCH 18
+#endif
+
+// Added 2024.10.24
+#ifndef KUTRACE_CMD_REGRING
+#define KUTRACE_CMD_REGRING 19
+#endif
+
+#ifndef KUTRACE_CMD_DRAINRING
+#define KUTRACE_CMD_DRAINRING 20
+#endif
+
+// Added 2024.10.25
+#ifndef KUTRACE_CMD_GETSTATS
+#define KUTRACE_CMD_GETSTATS 21
+#endif
+
+// Added 2024.10.27
+#ifndef KUTRACE_CMD_SETCLASSES
+#define KUTRACE_CMD_SETCLASSES 22
+#endif
+
+#ifndef KUTRACE_CMD_SETPIDS
+#define KUTRACE_CMD_SETPIDS 23
+#endif
+
+// Added 2024.11.03
+#ifndef KUTRACE_CMD_HANDOFF
+#define KUTRACE_CMD_HANDOFF 24
+#endif
+
+/* Event classes for KUTRACE_CMD_SETCLASSES */
+#ifndef KUTRACE_CLASS_ALL
+#define KUTRACE_CLASS_SYSCALL 0x01	/* Syscalls and returns */
+#define KUTRACE_CLASS_TRAP    0x02	/* Traps and returns */
+#define KUTRACE_CLASS_IRQ     0x04	/* Interrupts and returns */
+#define KUTRACE_CLASS_SCHED   0x08	/* Runnable, IPI, mwait, frequency */
+#define KUTRACE_CLASS_PCSAMP  0x10	/* PC samples */
+#define KUTRACE_CLASS_USER    0x20	/* Entries inserted from user code */
+#define KUTRACE_CLASS_OTHER   0x40	/* RPC, lock, packet, wait */
+#define KUTRACE_CLASS_ALL     0x7F
+#endif
+
+/* User event rings. Each is a header page then a power-of-two data area */
+#ifndef KUTRACE_RING_BYTES
+#define KUTRACE_MAX_RINGS 64
+#define KUTRACE_RING_HEADER_BYTES 4096
+#define KUTRACE_RING_DATA_WORDS 2048
+#define KUTRACE_RING_BYTES (KUTRACE_RING_HEADER_BYTES + KUTRACE_RING_DATA_WORDS * 8)
+#endif
+
+#ifndef KUTRACE_USERPID
+#define KUTRACE_USERPID         0x200  /* Context switch: new PID */
+#endif
+
 #ifndef KUTRACE_TSDELTA
 #define KUTRACE_TSDELTA         0x21D  /* Delta to advance timestamp */
 #endif
@@ -217,6 +325,7 @@ typedef long long unsigned int uint64;
 #define ATOMIC_READ atomic64_read
 #define ATOMIC_SET atomic64_set
 #define ATOMIC_ADD_RETURN atomic64_add_return
+#define ATOMIC_CMPXCHG atomic64_cmpxchg
 
 #elif Isx86_64
 /* This is for 64-bit X86 */
@@ -230,6 +339,7 @@ typedef long unsigned int uint64;
 #define ATOMIC_READ atomic64_read
 #define ATOMIC_SET atomic64_set
 #define ATOMIC_ADD_RETURN atomic64_add_return
+#define ATOMIC_CMPXCHG atomic64_cmpxchg
 
 #else
 #error Need type defines for your architecture
@@ -257,6 +367,7 @@ static int __init kutrace_mod_init(void);
 #define DO_IPC 1
 #define DO_WRAP 2
 #define DO_LLC 4
+#define DO_STREAM 8
 
 /*Outgoing flags byte in each traceblock[1] */
 #define IPC_Flag CLU(0x80)
@@ -269,7 +380,16 @@ static int __init kutrace_mod_init(void);
 
 /* Version number of this kernel tracing code */
 /* 2023.02.13 Incremented to 4 for fast 4KB trace buffer extraction */
-static const u64 kModuleVersionNumber = 4;
+/* 2024.10.21 Incremented to 5 for mmap of the trace buffer, /dev/kutrace */
+/* 2024.10.22 Incremented to 6 for streaming, DO_STREAM */
+/* 2024.10.23 Incremented to 7 for KUTRACE_CMD_INSERTBATCH */
+/* 2024.10.24 Incremented to 8 for user event rings */
+/* 2024.10.25 Incremented to 9 for KUTRACE_CMD_GETSTATS */
+/* 2024.10.27 Incremented to 10 for event-class and PID filters */
+/* 2024.11.03 Incremented to 11 for KUTRACE_CMD_HANDOFF */
+/* 2024.11.04 Incremented to 12 for time bases on batches and rings, */
+/*   and the clamped count */
+static const u64 kModuleVersionNumber = 12;
 
 
 /* A few global variables */
@@ -287,6 +407,12 @@ static bool do_ipc_only;	/* do_ipc and !do_llc */
 /* Wraparound tracing vs. stop when buffer is full */
 static bool do_wrap;	/* Initially false */
 
+/* Streaming: recycle blocks once a consumer has drained them */
+static bool do_stream;	/* Initially false */
+
+/* Second word of every trace block: the flags byte, set at reset */
+static u64 block_header_flags;
+
 /* Current offset to use for fast 4KB trace buffer extraction get4kb and getipc4kb */
 /* Set by KUTRACE_CMD_SET4KB call */
 static u64 get4kb_subscr;	/* Initially zero */
@@ -295,6 +421,9 @@ static u64 get4kb_subscr;	/* Initially zero */
 static long int tracemb = 2;
 static long int check = 1;	/* require PTRACE permission by default */
 
+/* Module parameter: how many trace blocks each CPU takes at once */
+static long int batchblocks = 4;
+
 /* Module parameters: packet filtering. Initially match just dclab RPC markers */
 static long int pktmask  = 0x0000000f;
 static long int pktmatch = 0xd1c517e5;
@@ -307,6 +436,8 @@ module_param(pktmask, long, S_IRUSR);
 MODULE_PARM_DESC(pktmask, "Bit-per-byte of which bytes to use in hash");
 module_param(pktmatch, long, S_IRUSR);
 MODULE_PARM_DESC(pktmatch, "Matching hash value");
+module_param(batchblocks, long, S_IRUSR);
+MODULE_PARM_DESC(batchblocks, "Trace blocks each CPU takes at once (4)");
 
 
 /* These four are exported by our patched kernel. 
@@ -394,6 +525,17 @@ DECLARE_PER_CPU(struct kutrace_traceblock, kutrace_traceblock_per_cpu);
 /* with backward time. */
 static const u64 kLateStoreThresh = 0x00000000000e0000LLU;
 
+/* INSERTBATCH: most words per batch, and the oldest a user timestamp may */
+/* be. Older ones are moved up to this, inside rawtoevent's late-store range, */
+/* and counted */
+#define KUTRACE_MAX_BATCH 64
+static const u64 kMaxBatchAge = 0x0000000000010000LLU;
+
+/* INSERTBATCH word 0: count of words in the low byte, and above it the */
+/* full time counter the batch's 20-bit timestamps are relative to, or 0 */
+#define BATCH_COUNT_MASK CLU(0xff)
+#define BATCH_BASE_SHIFT 8
+
 /*
  * Trace memory is consumed backward, high to low
  * This allows valid test for full block even if an interrupt routine
@@ -407,13 +549,16 @@ static const u64 kLateStoreThresh = 0x00000000000e0000LLU;
 char *tracebase;	/* Initially NULL address of kernel trace memory */
 u64 *traceblock_high;		/* just off high end of trace memory */
 u64 *traceblock_limit;		/* at low end of trace memory */
-u64 *traceblock_next;		/* starts at high, moves down to limit */
+u64 traceblock_count;		/* number of blocks from limit to high */
+atomic64_t traceblock_cursor;	/* next block number to hand out, 0.. */
 bool did_wrap_around;
 
 /*
- * Trace memory layout without IPC/LLC tracing.
+ * Trace memory layout without IPC/LLC tracing. Block number N is the Nth
+ * block down from traceblock_high, so block 0 is at the top. Blocks up to
+ * traceblock_cursor have been handed out.
  *  tracebase
- *  traceblock_limit          traceblock_next                traceblock_high
+ *  traceblock_limit          traceblock_cursor              traceblock_high
  *  |                               |                                |
  *  v                               v                                v
  *  +-------+-------+------+--------+-------+-------+-------+-------+
@@ -424,7 +569,7 @@ bool did_wrap_around;
  *
  * Trace memory layout with IPC/LLCtracing. IPC/LLC bytes go into lower 1/8.
  *  tracebase
- *  |    traceblock_limit     traceblock_next                traceblock_high
+ *  |    traceblock_limit     traceblock_cursor              traceblock_high
  *  |       |                       |                                |
  *  v       v                       v                                v
  *  +-------+-------+------+--------+-------+-------+-------+-------+
@@ -432,9 +577,88 @@ bool did_wrap_around;
  *  +-------+-------+------+--------+-------+-------+-------+-------+
  *       <==                        <==== allocated blocks grow down
  *       IPC/LLC bytes
+ *
+ * Each CPU takes a batch of block numbers at once with one atomic add to
+ * traceblock_cursor, then uses them one at a time from its kutrace_blockpool.
+ * Nothing on the block-switch path takes a lock shared between CPUs.
+ * With wraparound, block numbers past the end reuse blocks 1..count-1;
+ * block 0 keeps the start of the trace.
+ *
+ * Streaming, block numbers cycle through all blocks 0..count-1, and
+ * traceblock_state says which blocks are free to take:
+ *   FREE --CPU takes it--> OWNED --CPU leaves it--> FULL
+ *   FULL --consumer has written it out, KUTRACE_CMD_FREEBLOCK--> FREE
+ * A CPU hands over the block it leaves as soon as it takes the next one,
+ * unless it switched inside an interrupt. That interrupt may have come
+ * between a claim in the old block and its store, so the old block waits
+ * for the next switch or for KUTRACE_CMD_HANDOFF. HANDOFF also closes the
+ * block a quiet CPU is filling, so its entries reach the consumer.
+ * A number whose block is not FREE is skipped; if a CPU finds none, the
+ * entry is dropped and counted in stream_overruns. Tracing stays on.
  */
 
-DEFINE_RAW_SPINLOCK(kutrace_lock);
+/* Per-CPU batch of block numbers taken from traceblock_cursor, not yet used */
+struct kutrace_blockpool {
+	u64 next;	/* Next block number to use */
+	u64 end;	/* Just past the last block number in the batch */
+	u64 curr_slot;	/* Streaming: block being filled, or NO_BLOCK */
+	u64 prev_slot;	/* Streaming: block left inside an interrupt, not */
+			/*   yet handed over */
+};
+
+#define BLOCK_FREE 0
+#define BLOCK_OWNED 1
+#define BLOCK_FULL 2
+
+/* Streaming: state of each block, traceblock_count of them */
+static atomic64_t *traceblock_state;
+
+/* Streaming: entries dropped because no block was free */
+static atomic64_t stream_overruns;
+
+/* Streaming: block numbers a CPU tries before it gives up on an entry */
+static const int kStreamTries = 8;
+
+static DEFINE_PER_CPU(struct kutrace_blockpool, kutrace_blockpool_per_cpu);
+
+/*
+ * Per-CPU statistics, cleared at reset and summed by KUTRACE_CMD_GETSTATS.
+ * kutrace_traceblock is shared with the kernel patches, so these live in
+ * a per-CPU struct of their own. Counts go in with this_cpu_inc and
+ * this_cpu_add, one instruction on x86, so an interrupt that traces cannot
+ * lose one.
+ */
+struct kutrace_stats {
+	u64 entries;	/* Entries given space */
+	u64 words;	/* ... their words, not counting TSDELTA */
+	u64 tsdelta;	/* TSDELTA words added in front of an entry */
+	u64 retopt;	/* Returns folded into their call entry */
+	u64 abandoned;	/* Claims left at a block end after an interrupt */
+			/*   switched blocks under them */
+	u64 switches;	/* New blocks started */
+	u64 drops;	/* Entries with no space: full buffer or stream overrun */
+	u64 fullstops;	/* Times a full buffer turned tracing off */
+	u64 clamped;	/* User-timestamped entries too old or in the */
+			/*   future, moved to the nearest time allowed */
+};
+
+/* Words returned by KUTRACE_CMD_GETSTATS: the sums above except clamped, */
+/* blocks used, then clamped */
+#define KUTRACE_STAT_WORDS 10
+
+static DEFINE_PER_CPU(struct kutrace_stats, kutrace_stats_per_cpu);
+
+/* One of this CPU's statistics, for this_cpu_inc and this_cpu_add. The */
+/* userspace shim has its own */
+#ifndef kutrace_stat
+#define kutrace_stat(field) kutrace_stats_per_cpu.field
+#endif
+
+/* Blocks per batch, batchblocks cut down at reset to fit the buffer */
+static u64 blockpool_batch;
+
+/* Returned by take_block when the buffer is full and not wrapping */
+#define NO_BLOCK (~CLU(0))
 
 /* Trace block size in bytes = 64KB */
 #define KUTRACEBLOCKSHIFT (16)
@@ -520,6 +744,9 @@ inline u64 get_granular_llc(u64 delta_llc) {
 }
 
 
+#ifndef KUTRACE_USERSPACE
+/* In the userspace build, kutrace_user_shim.h supplies ku_setup_* and ku_get_* */
+
 /* Machine-specific register Access utilities */
 /*----------------------------------------------------------------------------*/
 #if Isx86_64
@@ -747,6 +974,8 @@ inline u64 ku_get_cpu_freq(void) {
 #endif
 }
 
+#endif	/* KUTRACE_USERSPACE */
+
 /* Return true for large time advance that should be treated as small backward time */
 inline bool LateStoreOrLarge(u64 delta_cycles) {
   return delta_cycles > kLateStoreThresh;
@@ -766,6 +995,16 @@ inline bool is_bad_len_plus(int len)
 	return (len < 1) | (len > 9);
 }
 
+/* Set up the time, IPC, LLC, and frequency counters on this CPU */
+/* Called on each CPU by on_each_cpu */
+static void setup_counters(void *unused)
+{
+	ku_setup_timecount();
+	ku_setup_inst_retired();
+	ku_setup_llc_miss();
+	ku_setup_cpu_freq();
+}
+
 /* Turn off tracing. (We cannot wait here) */
 /* Return tracing bit */
 static u64 do_trace_off(void)
@@ -779,10 +1018,325 @@ static u64 do_trace_off(void)
 /* Return tracing bit */
 static u64 do_trace_on(void)
 {
+	/* Set up the counters on every CPU now, not in the first trace */
+	/* block each CPU starts, with interrupts off */
+	on_each_cpu(setup_counters, NULL, 1);
 	kutrace_tracing = true;
 	return kutrace_tracing;
 }
 
+/* Return which block in the buffer holds block number blocknum */
+/* With wraparound, numbers past the end cycle through blocks 1..count-1; */
+/* streaming, through all of them */
+static inline u64 block_slot(u64 blocknum)
+{
+	if (blocknum < traceblock_count)
+		return blocknum;
+	if (do_stream)
+		return blocknum % traceblock_count;
+	return 1 + (blocknum - 1) % (traceblock_count - 1);
+}
+
+/* Return address of trace block number blocknum */
+static inline u64 *block_address(u64 blocknum)
+{
+	return traceblock_high -
+		((block_slot(blocknum) + 1) << KUTRACEBLOCKSHIFTU64);
+}
+
+/* With wraparound, true if some CPU has since been handed the same block */
+/* as blocknum under a later number */
+static inline bool block_reused(u64 blocknum, u64 cursor)
+{
+	return do_wrap && (blocknum != 0) &&
+		(blocknum + traceblock_count - 1 < cursor);
+}
+
+/* Return the next block number for this CPU, refilling its pool with a */
+/* batch from traceblock_cursor when empty. */
+/* Return NO_BLOCK if the trace buffer is full and we are not wrapping */
+/* We are called with interrupts disabled, no lock held */
+static u64 take_block(struct kutrace_blockpool *pool)
+{
+	u64 blocknum;
+	u64 batch_end;
+
+	/* Use a pooled block unless other CPUs have lapped it */
+	if (pool->next < pool->end) {
+		blocknum = pool->next++;
+		if (!block_reused(blocknum,
+			(u64)ATOMIC_READ(&traceblock_cursor)))
+			goto got_block;
+	}
+
+	/* add_return returns the updated cursor; we want the prior */
+	batch_end = (u64)ATOMIC_ADD_RETURN(blockpool_batch, &traceblock_cursor);
+	blocknum = batch_end - blockpool_batch;
+	pool->next = blocknum + 1;
+	pool->end = batch_end;
+
+	/* Whoever takes the first number that wraps to block 1 clears the */
+	/* pid filter, so names get re-inserted into the wrapped trace */
+	if (do_wrap && (batch_end > traceblock_count)) {
+		u64 n;
+		for (n = blocknum; n < batch_end; ++n) {
+			if ((n >= traceblock_count) &&
+				((n - 1) % (traceblock_count - 1) == 0)) {
+				did_wrap_around = true;
+				memset(kutrace_pid_filter, 0, 1024 * sizeof(u64));
+			}
+		}
+	}
+
+got_block:
+	if ((blocknum >= traceblock_count) && !do_wrap) {
+		/* All full */
+		pool->next = pool->end;
+		return NO_BLOCK;
+	}
+	return blocknum;
+}
+
+/* Streaming version of take_block. Return the next block number for this */
+/* CPU whose block is FREE, marking it OWNED, or NO_BLOCK if the consumer */
+/* has not yet freed any of the next few */
+/* We are called with interrupts disabled, no lock held */
+static u64 take_stream_block(struct kutrace_blockpool *pool)
+{
+	int tries;
+
+	for (tries = 0; tries < kStreamTries; ++tries) {
+		u64 blocknum;
+		if (pool->next >= pool->end) {
+			u64 batch_end = (u64)ATOMIC_ADD_RETURN(blockpool_batch,
+				&traceblock_cursor);
+			pool->next = batch_end - blockpool_batch;
+			pool->end = batch_end;
+		}
+		blocknum = pool->next++;
+		if (ATOMIC_CMPXCHG(&traceblock_state[block_slot(blocknum)],
+			BLOCK_FREE, BLOCK_OWNED) == BLOCK_FREE)
+			return blocknum;
+	}
+	ATOMIC_ADD_RETURN(1, &stream_overruns);
+	return NO_BLOCK;
+}
+
+/* Streaming: give block slot to the consumer */
+static inline void hand_over_block(u64 slot)
+{
+	smp_wmb();	/* Block contents before its state */
+	ATOMIC_SET(&traceblock_state[slot], BLOCK_FULL);
+}
+
+/* Streaming: this CPU is moving to block slot. Hand over the block left */
+/* inside an interrupt before, if any, and the block it is leaving now */
+/* unless nested says this switch is inside an interrupt too */
+static void stream_switch_block(struct kutrace_blockpool *pool, u64 slot,
+	bool nested)
+{
+	if (pool->prev_slot != NO_BLOCK)
+		hand_over_block(pool->prev_slot);
+	pool->prev_slot = NO_BLOCK;
+	if (pool->curr_slot != NO_BLOCK) {
+		if (nested)
+			pool->prev_slot = pool->curr_slot;
+		else
+			hand_over_block(pool->curr_slot);
+	}
+	pool->curr_slot = slot;
+}
+
+/* Streaming: hand over both blocks this CPU still holds and drop the rest */
+/* of its batch; unused numbers own nothing. Tracing must be off */
+static void flush_stream_blocks(struct kutrace_blockpool *pool)
+{
+	stream_switch_block(pool, NO_BLOCK, false);
+	pool->next = pool->end;
+}
+
+/* Streaming: KUTRACE_CMD_HANDOFF work, run on each CPU by a kernel thread */
+/* bound to it. Entries are claimed and stored with preempt off, so none */
+/* on this CPU is between its claim and its store now. Hand over the block */
+/* left inside an interrupt, and if close is non-NULL also zero the rest */
+/* of the block being filled and hand it over; the next entry starts a */
+/* new block. Return number of blocks handed over */
+static long handoff_cpu_blocks(void *close)
+{
+	struct kutrace_traceblock *tb;
+	struct kutrace_blockpool *pool;
+	unsigned long flags;
+	long n = 0;
+
+	preempt_disable();
+	local_irq_save(flags);
+	tb = &per_cpu(kutrace_traceblock_per_cpu, smp_processor_id());
+	pool = &per_cpu(kutrace_blockpool_per_cpu, smp_processor_id());
+	if (pool->prev_slot != NO_BLOCK) {
+		hand_over_block(pool->prev_slot);
+		pool->prev_slot = NO_BLOCK;
+		++n;
+	}
+	if ((close != NULL) && (pool->curr_slot != NO_BLOCK)) {
+		u64 *p;
+		for (p = (u64 *)ATOMIC_READ(&tb->next); p < tb->limit; ++p)
+			*p = 0;
+		ATOMIC_SET(&tb->next, (uintptr_t)tb->limit);
+		hand_over_block(pool->curr_slot);
+		pool->curr_slot = NO_BLOCK;
+		++n;
+	}
+	local_irq_restore(flags);
+	preempt_enable();
+	return n;
+}
+
+/* Streaming: hand over what each CPU still holds, see handoff_cpu_blocks. */
+/* arg nonzero also closes the blocks being filled. This sleeps. */
+/* Return number of blocks handed over */
+static u64 do_handoff(u64 arg)
+{
+	u64 n = 0;
+	int cpu;
+
+	if (!do_stream || !kutrace_tracing)
+		return 0;
+	for_each_online_cpu(cpu)
+		n += work_on_cpu(cpu, handoff_cpu_blocks, (void *)(uintptr_t)arg);
+	return n;
+}
+
+/* Streaming: return the first block at or after arg that is ready for the */
+/* consumer, or ~0 if none. The consumer reads it, then frees it */
+static u64 get_full_block(u64 arg)
+{
+	u64 slot;
+
+	if (!do_stream)
+		return ~CLU(0);
+	for (slot = arg; slot < traceblock_count; ++slot) {
+		if (ATOMIC_READ(&traceblock_state[slot]) == BLOCK_FULL) {
+			smp_rmb();	/* State before block contents */
+			return slot;
+		}
+	}
+	return ~CLU(0);
+}
+
+/* Streaming: the consumer is done with block arg. Return 0, or ~0 if it */
+/* was not a FULL block */
+static u64 free_block(u64 arg)
+{
+	if (!do_stream || (arg >= traceblock_count))
+		return ~CLU(0);
+	smp_mb();	/* Consumer's reads before anyone reuses it */
+	if (ATOMIC_CMPXCHG(&traceblock_state[arg], BLOCK_FULL, BLOCK_FREE) !=
+		BLOCK_FULL)
+		return ~CLU(0);
+	return 0;
+}
+
+/* Return address of the IPC bytes for the trace block at block */
+static inline u8 *ipc_block_of(u64 *block)
+{
+	/* NOTE: pointer arithmetic divides by 8, giving the IPC bytes */
+	return (u8 *)(tracebase) + (block - (u64 *)(tracebase));
+}
+
+/* After wraparound, turn the blocks a CPU took but never used into valid */
+/* empty blocks, with the same header as its current block. They are part */
+/* of the dump. Tracing must be off */
+/* Return number of words zeroed */
+static u64 flush_blockpool(struct kutrace_blockpool *pool, u64 *limit_item)
+{
+	u64 *curr_block = limit_item - KUTRACEBLOCKSIZEU64;
+	u64 *curr_pid = &curr_block[2];
+	u64 cursor = (u64)ATOMIC_READ(&traceblock_cursor);
+	u64 zeroed = 0;
+
+	/* The very first block has six more words before the PID */
+	if (curr_block == block_address(0))
+		curr_pid = &curr_block[8];
+
+	for ( ; pool->next < pool->end; ++pool->next) {
+		u64 *block;
+		/* Numbers past the end are wrapped blocks that still hold */
+		/* a valid block from the prior lap. Leave those alone. */
+		if (pool->next >= traceblock_count)
+			break;
+		if (block_reused(pool->next, cursor))
+			continue;
+		block = block_address(pool->next);
+		memset(block, 0, KUTRACEBLOCKSIZE);
+		block[0] = curr_block[0];
+		block[1] = curr_block[1];
+		block[2] = curr_pid[0] & CLU(0x00000000ffffffff);	/* no freq */
+		memcpy(&block[4], &curr_pid[2], MAX_PIDNAME_LENGTH);
+		if (do_ipc | do_llc)
+			memset(ipc_block_of(block), 0, KUIPCBLOCKSIZEU8);
+		zeroed += KUTRACEBLOCKSIZEU64 - 6;
+	}
+	pool->next = pool->end;
+	return zeroed;
+}
+
+/* Return number of trace blocks handed out, at most all of them */
+/* The cursor overshoots the count when we are full */
+static u64 blocks_used(void)
+{
+	u64 cursor = (u64)ATOMIC_READ(&traceblock_cursor);
+
+	if (did_wrap_around || (cursor > traceblock_count))
+		return traceblock_count;
+	return cursor;
+}
+
+/* True if block number blocknum is still unused in some CPU's pool */
+static bool in_some_pool(u64 blocknum)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		const struct kutrace_blockpool *pool =
+			&per_cpu(kutrace_blockpool_per_cpu, cpu);
+		if ((pool->next <= blocknum) && (blocknum < pool->end))
+			return true;
+	}
+	return false;
+}
+
+/* Without wraparound, give back the blocks the CPUs took into their pools */
+/* but never used. The used blocks after each one move down, keeping their */
+/* order, and the cursor moves back to just past the last of them, so */
+/* GETCOUNT and the dump cover only used blocks. Tracing must be off */
+/* Return number of blocks given back */
+static u64 compact_blocks(void)
+{
+	u64 used = blocks_used();
+	u64 from;
+	u64 to = 0;
+	int cpu;
+
+	for (from = 0; from < used; ++from) {
+		if (in_some_pool(from))
+			continue;
+		if (to != from) {
+			memcpy(block_address(to), block_address(from),
+				KUTRACEBLOCKSIZE);
+			if (do_ipc | do_llc)
+				memcpy(ipc_block_of(block_address(to)),
+					ipc_block_of(block_address(from)),
+					KUIPCBLOCKSIZEU8);
+		}
+		++to;
+	}
+	for_each_online_cpu(cpu)
+		per_cpu(kutrace_blockpool_per_cpu, cpu).next =
+			per_cpu(kutrace_blockpool_per_cpu, cpu).end;
+	ATOMIC_SET(&traceblock_cursor, to);
+	return used - to;
+}
+
 /* Flush all partially-filled trace blocks, filling them up */
 /* Tracing must be off */
 /* Return number of words zeroed */
@@ -811,39 +1365,73 @@ static u64 do_flush(void)
 		}
 
 		ATOMIC_SET(&tb->next, (uintptr_t)limit_item);
+
+		if (do_stream)
+			flush_stream_blocks(
+				&per_cpu(kutrace_blockpool_per_cpu, cpu));
+		else if (did_wrap_around)
+			zeroed += flush_blockpool(
+				&per_cpu(kutrace_blockpool_per_cpu, cpu), limit_item);
 	}
+	if (!do_stream && !did_wrap_around)
+		compact_blocks();
 	return zeroed;
 }
 
 
 /* Return number of filled trace blocks */
-/* Next can overshoot limit when we are full */
 /* Tracing will usually be on */
-/* NOTE: difference of two u64* values is 1/8 of what you might be thinking */
 static u64 do_stat(void)
 {
-	if (did_wrap_around || (traceblock_next < traceblock_limit))
-		return (u64)(traceblock_high -
-				traceblock_limit) >> KUTRACEBLOCKSHIFTU64;
-	else
-		return (u64)(traceblock_high -
-				traceblock_next) >> KUTRACEBLOCKSHIFTU64;
+	return blocks_used();
+}
+
+/* Copy the per-CPU statistics, summed, then blocks used, to user space */
+/* arg is actually a u64* pointer to KUTRACE_STAT_WORDS words */
+/* Tracing may be on; counts still moving on other CPUs may be a little off */
+/* Return number of words copied, or ~0 */
+static u64 get_stats(u64 arg)
+{
+	const uintptr_t tempword = arg;	/* 32- or 64-bit pointer */
+	void __user *to_user_ptr = (void __user *)tempword;
+	u64 sum[KUTRACE_STAT_WORDS];
+	int cpu;
+
+	memset(sum, 0, sizeof(sum));
+	for_each_online_cpu(cpu) {
+		const struct kutrace_stats *st = &per_cpu(kutrace_stats_per_cpu, cpu);
+		sum[0] += st->entries;
+		sum[1] += st->words;
+		sum[2] += st->tsdelta;
+		sum[3] += st->retopt;
+		sum[4] += st->abandoned;
+		sum[5] += st->switches;
+		sum[6] += st->drops;
+		sum[7] += st->fullstops;
+		sum[9] += st->clamped;
+	}
+	sum[8] = blocks_used();
+	if (copy_to_user(to_user_ptr, sum, sizeof(sum)) != 0)
+		return ~CLU(0);
+	return KUTRACE_STAT_WORDS;
 }
 
 /* Return number of filled trace words */
 /* Tracing must be off and flush must have been called */
-/* NOTE: difference of two u64* values is 1/8 of what you might be thinking */
 static u64 get_count(void)
 {
-	u64 retval;
-
 	kutrace_tracing = false;
-	if (did_wrap_around || (traceblock_next < traceblock_limit))
-		retval = (u64)(traceblock_high - traceblock_limit);
-	else
-		retval = (u64)(traceblock_high - traceblock_next);
+	return blocks_used() << KUTRACEBLOCKSHIFTU64;
+}
 
-	return retval;
+/* Return number of trace words the 4KB commands may read. Streaming, that */
+/* is the whole buffer, with tracing left on; the consumer reads only */
+/* blocks that get_full_block returned */
+static u64 get_readable_count(void)
+{
+	if (do_stream)
+		return traceblock_count << KUTRACEBLOCKSHIFTU64;
+	return get_count();
 }
 
 /* Read and return one u64 word of trace data, working down from top.
@@ -851,7 +1439,7 @@ static u64 get_count(void)
  * by a user program that is writing all this to disk, thus is constrained
  * by disk I/O speed. So we don't care that this is somewhat inefficient
  *
- *  traceblock_limit          traceblock_next                traceblock_high
+ *  traceblock_limit          traceblock_cursor              traceblock_high
  *  |                               |                                |
  *  v                               v                                v
  *  +-------+-------+------+--------+-------+-------+-------+-------+
@@ -885,7 +1473,7 @@ static u64 get_word(u64 subscr)
  *
  * Trace memory layout with IPC tracing. IPC bytes go into lower 1/8.
  *  tracebase
- *  |    traceblock_limit     traceblock_next                traceblock_high
+ *  |    traceblock_limit     traceblock_cursor              traceblock_high
  *  |       |                       |                                |
  *  v       v                       v                                v
  *  +-------+-------+------+--------+-------+-------+-------+-------+
@@ -949,7 +1537,7 @@ static u64 get_4kb(u64 arg)
 	void __user *to_user_ptr;
 	const void *from_kernel_ptr;
 
-	if (get4kb_subscr >= get_count())
+	if (get4kb_subscr >= get_readable_count())
 		return 4096;
 
 	blocknum = get4kb_subscr >> KUTRACEBLOCKSHIFTU64;
@@ -974,7 +1562,7 @@ static u64 get_ipc_4kb(u64 arg)
 	const void *from_kernel_ptr;
 
 	/* IPC word count is 1/8 of main trace count */
-	if (get4kb_subscr >= (get_count() >> 3))
+	if (get4kb_subscr >= (get_readable_count() >> 3))
 		return 4096;
 
 	blocknum = get4kb_subscr >> KUIPCBLOCKSHIFTU8;
@@ -986,14 +1574,90 @@ static u64 get_ipc_4kb(u64 arg)
 	return copy_to_user(to_user_ptr, from_kernel_ptr, 4096);
 }
 
+/*
+ * Zero-copy trace buffer extraction: /dev/kutrace maps all tracemb MB at
+ * tracebase read-only into the caller. KUTRACE_CMD_GETMAPSIZE returns the
+ * length to map. Trace block N is then at offset
+ *   (tracemb << 20) - (N + 1) * 64KB
+ * and, with IPC/LLC, its 8KB of IPC bytes at offset
+ *   (tracemb << 17) - (N + 1) * 8KB
+ * exactly as get_4kb and get_ipc_4kb find them. The same rules apply:
+ * tracing must be off and flush must have been called before reading.
+ *
+ * This removes the 16 SET4KB/GET4KB syscall pairs per 64KB block. The caller
+ * writes straight from the mapping to its file.
+ *
+ * Past get_map_size(), the user event rings may be mapped writable, one
+ * KUTRACE_RING_BYTES ring at a time. See register_ring
+ */
+static u64 get_map_size(void)
+{
+	return (u64)tracemb << 20;
+}
+
+#ifndef KUTRACE_USERSPACE
+static int kutrace_dev_open(struct inode *inode, struct file *file)
+{
+	/* Same permission rule as kutrace_control */
+	if (check && !has_capability(current, CAP_SYS_PTRACE))
+		return -EPERM;
+	if (tracebase == NULL)
+		return -ENODEV;
+	return 0;
+}
+
+static int kutrace_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	u64 len = vma->vm_end - vma->vm_start;
+	u64 offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	/* A user event ring, writable */
+	if (offset >= get_map_size()) {
+		offset -= get_map_size();
+		if ((ringbase == NULL) || (len != KUTRACE_RING_BYTES) ||
+			(offset % KUTRACE_RING_BYTES != 0) ||
+			(offset + len > KUTRACE_MAX_RINGS * KUTRACE_RING_BYTES))
+			return -EINVAL;
+		return remap_vmalloc_range(vma, ringbase, offset >> PAGE_SHIFT);
+	}
+
+	/* Read-only, and it may not be mprotect'ed writable later */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	if (offset + len > get_map_size())
+		return -EINVAL;
+	/* tracebase came from vmalloc_user, as remap_vmalloc_range requires */
+	return remap_vmalloc_range(vma, tracebase, vma->vm_pgoff);
+}
+
+static const struct file_operations kutrace_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = kutrace_dev_open,
+	.mmap = kutrace_dev_mmap,
+};
+
+static struct miscdevice kutrace_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "kutrace",
+	.fops = &kutrace_dev_fops,
+	.mode = S_IRUSR | S_IWUSR,	/* Write only for the rings */
+};
+static bool kutrace_dev_registered;
+#endif	/* KUTRACE_USERSPACE */
+
 
 
 /* We are called with preempt disabled */
 /* We are called with interrupts disabled */
-/* We are called holding the lock that guards traceblock_next */
+/* No lock is held; init_me belongs to this CPU alone */
 /* Cannot do printf or anything else here that could block */
 static u64 *initialize_trace_block(u64 *init_me, bool very_first_block,
-	struct kutrace_traceblock *tb)
+	bool tail_is_zero, struct kutrace_traceblock *tb)
 {
 	u64 *myclaim = NULL;
 	u64 cpu = smp_processor_id();
@@ -1010,16 +1674,8 @@ static u64 *initialize_trace_block(u64 *init_me, bool very_first_block,
 	/* Second word is going to be corresponding gettimeofday(), */
 	/* filled in via postprocessing */
 	/* We put some flags in the top byte, though. 0x80 = do_ipc bit, etc. */
-	/* NOTE: This could all be pre-calculated in do_reset() */
-	init_me[1] = 0;
-	if (do_ipc)
-		init_me[1] |= (IPC_Flag << FLAGS_SHIFT);
-	if (do_llc)
-		init_me[1] |= (LLC_Flag << FLAGS_SHIFT);
-	if (do_wrap)
-		init_me[1] |= (WRAP_Flag << FLAGS_SHIFT);
-	/* We don't know if we actually wrapped until the end. */
-	/* See KUTRACE_CMD_GETCOUNT */
+	/* Pre-calculated in do_reset() */
+	init_me[1] = block_header_flags;
 
 	/* For very first trace block, also insert six NOPs at [2..7]. */
 	/* The dump to disk code will overwrite the first pair with */
@@ -1047,25 +1703,23 @@ static u64 *initialize_trace_block(u64 *init_me, bool very_first_block,
 
 	/* Next len words are the claimed space for an entry */
 
-	/* Last 8 words of a block set to NOPs (0) */
-	init_me[KUTRACEBLOCKSIZEU64 - 8] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 7] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 6] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 5] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 4] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 3] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 2] = 0;
-	init_me[KUTRACEBLOCKSIZEU64 - 1] = 0;
-
-	/* If this is the very first traceblock for this CPU, set up the MSRs */
-	/* If there are 12 CPU cores (6 physical 2x hyperthreaded) this will happen 12 times */
+	/* Last 8 words of a block set to NOPs (0). do_reset zeroed them */
+	/* for the first use of each block, which saves a cache miss here */
+	if (!tail_is_zero) {
+		init_me[KUTRACEBLOCKSIZEU64 - 8] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 7] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 6] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 5] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 4] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 3] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 2] = 0;
+		init_me[KUTRACEBLOCKSIZEU64 - 1] = 0;
+	}
+
+	/* The MSRs were set up on every CPU by do_trace_on */
 	{
 		bool first_block_per_cpu = (tb->prior_cycles == 0);
 		if (first_block_per_cpu) {
-			ku_setup_timecount();
-			ku_setup_inst_retired();
-			ku_setup_llc_miss();
-			ku_setup_cpu_freq();
 			tb->prior_cycles = 1;	/* mark it as initialized */
 #if IsRPi4_64
 			{
@@ -1087,43 +1741,49 @@ static u64 *initialize_trace_block(u64 *init_me, bool very_first_block,
 
 /* We are called with preempt disabled */
 /* We are called with interrupts disabled */
-/* We are called holding the lock that guards traceblock_next */
-static u64 *really_get_slow_claim(int len, struct kutrace_traceblock *tb)
+/* No lock is held. Only the batch refill touches memory shared with other */
+/* CPUs, one atomic add on traceblock_cursor */
+/* nested is true if we may have interrupted another claim on this CPU */
+static u64 *really_get_slow_claim(int len, struct kutrace_traceblock *tb,
+	bool nested)
 {
 	u64 *myclaim = NULL;
-	bool very_first_block = (traceblock_next == traceblock_high);
-
-	/* Allocate a new traceblock. Allocations grow downward. */
-	traceblock_next -= KUTRACEBLOCKSIZEU64;
-
-	if (traceblock_next < traceblock_limit) {
-		if (do_wrap) {
-			/* Wrap to traceblock[1], not [0] */
-			did_wrap_around = true;
-			traceblock_next = traceblock_high -
-				2 * KUTRACEBLOCKSIZEU64;
-			/* Clear pid filter. */
-			/* It is unfortunate to do this while holding a */
-			/* lock and also holding off interrupts... */
-			memset(kutrace_pid_filter, 0, 1024 * sizeof(u64));
-		} else {
-			/* All full. Stop and get out. */
-			kutrace_tracing = false;
+	u64 *new_block;
+	struct kutrace_blockpool *pool =
+		&per_cpu(kutrace_blockpool_per_cpu, smp_processor_id());
+	u64 blocknum = do_stream ? take_stream_block(pool) : take_block(pool);
+
+	if (blocknum == NO_BLOCK) {
+		/* Streaming: consumer is behind. Drop this entry only */
+		if (do_stream)
 			return myclaim;
-		}
+		/* All full. Stop and get out. */
+		if (kutrace_tracing)
+			this_cpu_inc(kutrace_stat(fullstops));
+		kutrace_tracing = false;
+		return myclaim;
 	}
+	new_block = block_address(blocknum);
+	if (do_stream)
+		stream_switch_block(pool, block_slot(blocknum), nested);
+	this_cpu_inc(kutrace_stat(switches));
 
 	/* Need to do this before setting next/limit if same CPU could get */
 	/* an interrupt and use uninitilized block */
-	/* It is unfortunate to do this while holding a lock and also */
-	/* holding off interrupts... */
-	/* Most of the cost is two cache misses, so maybe 200 nsec */
-	myclaim = initialize_trace_block(traceblock_next, very_first_block, tb);
+	/* Most of the cost is the cache miss on the block's first lines, */
+	/* plus one on its last line once blocks are being reused */
+	myclaim = initialize_trace_block(new_block, blocknum == 0,
+		blocknum < traceblock_count, tb);
+
+	/* Start the first-line miss for this CPU's next block now, a whole */
+	/* block of entries ahead */
+	if (!do_stream && (pool->next < pool->end))
+		prefetchw(block_address(pool->next));
 
 	/* Set up the next traceblock pointers, reserving */
 	/* first N + len words */
 	ATOMIC_SET(&tb->next, (uintptr_t)(myclaim + len));
-	tb->limit = traceblock_next + KUTRACEBLOCKSIZEU64;
+	tb->limit = new_block + KUTRACEBLOCKSIZEU64;
 	return myclaim;
 }
 
@@ -1138,15 +1798,16 @@ static u64 *get_slow_claim(int len, struct kutrace_traceblock *tb)
 	u64 *limit_item;
 	u64 *myclaim = NULL;
 
-	if (unlikely(is_bad_len(len))) {
+	/* 1..9: get_claim may add a TSDELTA word in front of an 8-word entry */
+	if (unlikely(is_bad_len_plus(len))) {
 		kutrace_tracing = false;
 printk(KERN_INFO "is_bad_len 1\n");
 		return NULL;
 	}
 
-	/* This gets the lock that protects traceblock_next and */
-	/* disables interrupts */
-	raw_spin_lock_irqsave(&kutrace_lock, flags);
+	/* Disable interrupts. tb and the block pool are this CPU's alone, */
+	/* so no lock is needed */
+	local_irq_save(flags);
 	/* Nothing else can be touching tb->limit now */
 	limit_item = tb->limit;
 	/* add_return returns the updated pointer; we want the prior */
@@ -1157,12 +1818,15 @@ printk(KERN_INFO "is_bad_len 1\n");
 	if (((myclaim + len) >= limit_item) || (limit_item == NULL)) {
 		/* Normal case: */
 		/* the claim we got still doesn't fit in its block */
-		myclaim = really_get_slow_claim(len, tb);
+		/* Interrupt entry runs with interrupts off, so a claim */
+		/* made with them on is not inside one */
+		myclaim = really_get_slow_claim(len, tb,
+			irqs_disabled_flags(flags) || in_interrupt());
 	}
 	/* Rare: If some interrupt already allocated a new traceblock, */
 	/* fallthru to here */
-	/* Free lock; re-enable interrupts if they were enabled on entry */
-	raw_spin_unlock_irqrestore(&kutrace_lock, flags);
+	/* Re-enable interrupts if they were enabled on entry */
+	local_irq_restore(flags);
 
 	return myclaim;
 }
@@ -1212,6 +1876,7 @@ static u64 *get_claim(int len, struct kutrace_traceblock* tb)
 			/* Claim is in new block -- use it */
 			break;
 		/* Else claim is at end of old block -- abandon it, and try again */
+		this_cpu_inc(kutrace_stat(abandoned));
 	} while (true);
 
 	/* Make sure the entire allocation fits */
@@ -1261,11 +1926,18 @@ inline u64* get_claim_with_tsdelta(u64 now, u64 delta_cycles,
 			           ((u64)KUTRACE_TSDELTA << EVENT_SHIFT) | 
                                    (delta_cycles & ARG_MASK);
 			++claim;		/* Start of space for original entry */
+			this_cpu_inc(kutrace_stat(tsdelta));
 		}
 	} else {
 		/* Common case */
 		claim = get_claim(len, tb);	/* Start of space for original entry */
 	}
+	if (likely(claim != NULL)) {
+		this_cpu_inc(kutrace_stat(entries));
+		this_cpu_add(kutrace_stat(words), len);
+	} else {
+		this_cpu_inc(kutrace_stat(drops));
+	}
 	return claim;
 }
 
@@ -1407,6 +2079,7 @@ static u64 insert_1_retopt(u64 arg1)
 			
 			/* IPC/LLC option. Changes CPU overhead from ~1/4% to ~3/4% */
 			do_ipcllc_calc(prior_entry, delta_t, tb, true);		
+			this_cpu_inc(kutrace_stat(retopt));
 			put_cpu_var(kutrace_traceblock_per_cpu);	/* release preempt */
 			return 0;
 		}
@@ -1534,6 +2207,451 @@ static u64 insert_n_user(u64 word)
 }
 
 
+/*
+ * Filters, to keep the trace to what matters and so lengthen the window a
+ * fixed tracemb holds. kutrace_class_mask has one bit per event class to
+ * record. If kutrace_pid_including, syscalls, traps, PC samples, and user
+ * entries are also recorded only while a task in the pid include-list is
+ * current; the list is a bit per pid & 0xffff. Interrupts, scheduling,
+ * and other events are not per-task, so only the class mask applies.
+ *
+ * Names, context switches, and the scheduler's pseudo-syscall around each
+ * switch always go in, so eventtospan3 still sees every task change.
+ * Because a task's syscalls are kept or dropped as a whole, calls and
+ * returns stay matched. The filters may only change with tracing off, and
+ * they stay in place across reset.
+ */
+#define KUTRACE_SCHED_SYSCALL 0xDFF	/* SYSCALL64 + kutrace_map_nr(1023) */
+#define KUTRACE_SCHED_SYSRET  0xFFF	/* SYSRET64 + kutrace_map_nr(1023) */
+#define KUTRACE_CLASS_BY_PID (KUTRACE_CLASS_SYSCALL | KUTRACE_CLASS_TRAP | \
+	KUTRACE_CLASS_PCSAMP | KUTRACE_CLASS_USER)
+
+static bool kutrace_filtering;	/* Either filter is on */
+static u64 kutrace_class_mask = KUTRACE_CLASS_ALL;
+static bool kutrace_pid_including;
+static u64 kutrace_pid_include[1024];
+
+/* Class of a 12-bit event number, or 0 for always recorded */
+static inline u64 event_class(u64 event)
+{
+	switch (event >> 8) {
+	case 0x0: case 0x1:
+		return 0;	/* Names */
+	case 0x2:
+		if (event == KUTRACE_USERPID)
+			return 0;
+		if ((event >= 0x206 && event <= 0x209) ||
+			(event >= 0x21C && event <= 0x21F))
+			return KUTRACE_CLASS_SCHED;
+		if (event >= 0x280)
+			return KUTRACE_CLASS_PCSAMP;
+		return KUTRACE_CLASS_OTHER;
+	case 0x3:
+		return KUTRACE_CLASS_OTHER;
+	case 0x4: case 0x6:
+		return KUTRACE_CLASS_TRAP;
+	case 0x5: case 0x7:
+		return KUTRACE_CLASS_IRQ;
+	default:
+		if ((event == KUTRACE_SCHED_SYSCALL) ||
+			(event == KUTRACE_SCHED_SYSRET))
+			return 0;
+		return KUTRACE_CLASS_SYSCALL;
+	}
+}
+
+/* Return true if an entry of class cls is to be recorded now */
+static inline bool keep_class(u64 cls)
+{
+	u64 pid;
+
+	if (cls == 0)
+		return true;
+	if ((kutrace_class_mask & cls) == 0)
+		return false;
+	if (!kutrace_pid_including || ((cls & KUTRACE_CLASS_BY_PID) == 0))
+		return true;
+	pid = (u64)current->pid & 0xffff;
+	return (kutrace_pid_include[pid >> 6] & (CLU(1) << (pid & 63))) != 0;
+}
+
+/* Return true if the kernel event is to be recorded. Caller checks */
+/* kutrace_filtering first */
+static inline bool keep_event(u64 event)
+{
+	return keep_class(event_class(event & UNSHIFTED_EVENT_MASK));
+}
+
+/* Same for an entry from user code; its names still always go in */
+static inline bool keep_user_entry(u64 word)
+{
+	u64 event = (word >> EVENT_SHIFT) & UNSHIFTED_EVENT_MASK;
+	return keep_class((event < 0x200) ? 0 : KUTRACE_CLASS_USER);
+}
+
+/* Same for an INSERTN entry; arg is actually a u64* pointer to its */
+/* user space words */
+static bool keep_user_first_word(u64 arg)
+{
+	const uintptr_t tempword = arg;	/* 32- or 64-bit pointer */
+	u64 word;
+
+	if (raw_copy_from_user(&word, (const u64 *)tempword, sizeof(u64)) > 0)
+		return true;	/* insert_n_user will fail the same way */
+	return keep_user_entry(word);
+}
+
+/* Set the event classes to record. Tracing must be off */
+/* Return the prior mask, or ~0 if tracing is on */
+static u64 set_classes(u64 mask)
+{
+	u64 prior = kutrace_class_mask;
+
+	if (kutrace_tracing)
+		return ~CLU(0);
+	kutrace_class_mask = mask & KUTRACE_CLASS_ALL;
+	kutrace_filtering = (kutrace_class_mask != KUTRACE_CLASS_ALL) ||
+		kutrace_pid_including;
+	return prior;
+}
+
+/* Set the pid include-list. Tracing must be off */
+/* arg is actually a u64* pointer to user space array: a count of */
+/* 0..1024 pids, then the pids. A count of 0 records all pids again */
+/* Return the count, or ~0 if tracing is on or the array is bad */
+static u64 set_pids(u64 arg)
+{
+	const uintptr_t tempword = arg;	/* 32- or 64-bit pointer */
+	const u64 *userptr = (const u64 *)tempword;
+	u64 count;
+	u64 i;
+
+	if (kutrace_tracing)
+		return ~CLU(0);
+	if (raw_copy_from_user(&count, userptr, sizeof(u64)) > 0)
+		return ~CLU(0);
+	if (count > 1024)
+		return ~CLU(0);
+	memset(kutrace_pid_include, 0, sizeof(kutrace_pid_include));
+	for (i = 0; i < count; ++i) {
+		u64 pid;
+		if (raw_copy_from_user(&pid, &userptr[1 + i], sizeof(u64)) > 0)
+			return ~CLU(0);
+		pid &= 0xffff;
+		kutrace_pid_include[pid >> 6] |= CLU(1) << (pid & 63);
+	}
+	kutrace_pid_including = (count != 0);
+	kutrace_filtering = (kutrace_class_mask != KUTRACE_CLASS_ALL) ||
+		kutrace_pid_including;
+	return count;
+}
+
+
+/* Return the full time counter for an entry captured in user space, from */
+/* the 20-bit timestamp in its first word, the full time base of its batch */
+/* or ring, and now. The entry is at most one 20-bit period after base. */
+/* With no base (0, older libraries) it is taken to be within half a period */
+/* of now. An entry more than kMaxBatchAge old, or in the future, cannot */
+/* go in as is; it is moved to the nearest allowed time and counted */
+static inline u64 batch_timestamp(u64 word, u64 base, u64 now)
+{
+	u64 ts;
+
+	if (base == 0)
+		base = now - (UNSHIFTED_TIMESTAMP_MASK >> 1);
+	ts = base + (((word >> TIMESTAMP_SHIFT) - base) & UNSHIFTED_TIMESTAMP_MASK);
+	if (unlikely((ts > now) || (now - ts > kMaxBatchAge))) {
+		this_cpu_inc(kutrace_stat(clamped));
+		ts = (ts > now) ? now : now - kMaxBatchAge;
+	}
+	return ts;
+}
+
+/* Count the whole entries in words[0..count) as dropped. Caller holds */
+/* off preempt */
+static void count_dropped(const u64 *words, u64 count)
+{
+	u64 i = 0;
+	u64 len;
+
+	while ((i < count) && ((len = entry_len(words[i])) != 0)) {
+		this_cpu_inc(kutrace_stat(drops));
+		i += len;
+	}
+}
+
+/* Insert one 1..8 word entry built in user space, with its own 20-bit */
+/* timestamp, for current CPU. Caller holds off preempt */
+/* Return false if there was no room */
+static bool insert_timed(u64 *entry, u64 len, u64 base, u64 now,
+	struct kutrace_traceblock *tb)
+{
+	u64 ts = batch_timestamp(entry[0], base, now);
+	u64 delta_cycles = ts - tb->prior_cycles;
+	u64 *claim;
+
+	claim = get_claim_with_tsdelta(ts, delta_cycles, len, tb);
+	/* This update must be after the first getclaim per CPU */
+	tb->prior_cycles = ts;
+	if (claim == NULL)
+		return false;
+	entry[0] = (entry[0] & ~TIMESTAMP_MASK) | (ts << TIMESTAMP_SHIFT);
+	memcpy(claim, entry, len * sizeof(u64));
+	return true;
+}
+
+/* Insert a batch of trace entries built in user space, for current CPU */
+/* word is actually a const u64* pointer to user space array: */
+/* a count of 1..KUTRACE_MAX_BATCH words and the time base, see */
+/* BATCH_BASE_SHIFT, then that many words of whole 1..8 word entries in */
+/* time order, each with its own 20-bit timestamp */
+/* Entries go in one at a time, so interrupt entries may land in between; */
+/* earlier timestamps than the CPU's last entry are late stores, as usual */
+/* If one finds no room, it and the rest are dropped and counted */
+/* Tracing may be otherwise off */
+/* Return number of words inserted */
+static u64 insert_batch_user(u64 word)
+{
+	const uintptr_t tempword = word;	/* 32- or 64-bit pointer */
+	const u64 *userptr = (const u64 *)tempword;
+	u64 count;
+	u64 base;
+	u64 i;
+	u64 inserted = 0;
+	struct kutrace_traceblock* tb;
+	u64 now;
+	u64 temp[KUTRACE_MAX_BATCH];
+
+	/* This call may sleep or otherwise context switch */
+	if (raw_copy_from_user(&count, userptr, sizeof(u64)) > 0)
+		return 0;
+	base = count >> BATCH_BASE_SHIFT;
+	count &= BATCH_COUNT_MASK;
+	if ((count < 1) || (count > KUTRACE_MAX_BATCH))
+		return 0;
+	if (raw_copy_from_user(temp, &userptr[1], count * sizeof(u64)) > 0)
+		return 0;
+
+	now = ku_get_timecount();
+	tb = &get_cpu_var(kutrace_traceblock_per_cpu);	/* hold off preempt */
+	for (i = 0; i < count; ) {
+		u64 len = entry_len(temp[i]);
+
+		/* Bad length or torn last entry: drop the rest */
+		if ((len == 0) || (i + len > count))
+			break;
+		if (unlikely(kutrace_filtering) && !keep_user_entry(temp[i])) {
+			i += len;
+			continue;
+		}
+		if (!insert_timed(&temp[i], len, base, now, tb)) {
+			count_dropped(&temp[i + len], count - (i + len));
+			break;
+		}
+		inserted += len;
+		i += len;
+	}
+	put_cpu_var(kutrace_traceblock_per_cpu);	/* release preempt */
+	return inserted;
+}
+
+
+/*
+ * User event rings: a thread that registers gets one ring of
+ * KUTRACE_RING_BYTES in ringbase, which it maps writable through
+ * /dev/kutrace at offset get_map_size() + ring * KUTRACE_RING_BYTES.
+ * It then adds trace entries with plain stores, no syscall:
+ *   header[0]  head, words written. Only the thread writes it, with
+ *              release order after the entry words
+ *   header[1]  tail, words taken. Only the module writes it
+ *   header[2]  full time counter the pending entries' 20-bit timestamps
+ *              are relative to, as for INSERTBATCH. The thread sets it
+ *              when it adds to an empty ring
+ *   data[]     whole 1..8 word entries at (position & (DATA_WORDS - 1)),
+ *              each with its own 20-bit timestamp as for INSERTBATCH;
+ *              an entry may wrap around the end
+ * The module drains a ring into the current CPU's trace when its thread
+ * is switched out, just before that CPU's context switch entry, so the
+ * entries land inside the thread's own time on that CPU. The thread
+ * drains it itself with KUTRACE_CMD_DRAINRING when the ring is nearly
+ * full or its oldest entry is getting old. Draining therefore only ever
+ * happens in the owning thread's own context, so one drain at a time.
+ *
+ * Ring r belongs to the pid in ring_owner[r], 0 if free. A pid can only
+ * have ring (pid & (KUTRACE_MAX_RINGS - 1)), so the context switch check
+ * is one compare. Registration fails if another live pid holds that ring;
+ * the caller then uses INSERTBATCH instead. A ring comes back when its
+ * thread gives it back, at the thread's context switch once it is exiting,
+ * or when another pid asks for it and the owner no longer exists.
+ * Reset keeps the owners, whose threads still have the rings mapped, and
+ * only discards what is pending.
+ */
+static u8 *ringbase;
+static atomic64_t ring_owner[KUTRACE_MAX_RINGS];
+static u64 ring_tail[KUTRACE_MAX_RINGS];	/* Module's own copy */
+static bool ring_registered;	/* Any ring ever registered since reset */
+
+static inline u64 *ring_header(u64 r)
+{
+	return (u64 *)(ringbase + r * KUTRACE_RING_BYTES);
+}
+
+static inline u64 *ring_data(u64 r)
+{
+	return (u64 *)(ringbase + r * KUTRACE_RING_BYTES +
+		KUTRACE_RING_HEADER_BYTES);
+}
+
+/* Move ring r's pending entries into the current CPU's trace */
+/* If tracing is off, just discard them; if one finds no room, it and the */
+/* rest are dropped and counted */
+/* Return number of words inserted */
+static u64 drain_ring(u64 r)
+{
+	u64 *header = ring_header(r);
+	const u64 *data = ring_data(r);
+	const u64 mask = KUTRACE_RING_DATA_WORDS - 1;
+	u64 head;
+	u64 tail;
+	u64 base;
+	u64 inserted = 0;
+	struct kutrace_traceblock* tb;
+	u64 now;
+
+	/* Hold off preempt before reading tail: a context switch in here */
+	/* would drain the same ring */
+	tb = &get_cpu_var(kutrace_traceblock_per_cpu);
+	head = READ_ONCE(header[0]);
+	tail = ring_tail[r];
+	smp_rmb();	/* Entry words and base after head */
+	base = READ_ONCE(header[2]) & FULL_TIMESTAMP_MASK;
+	/* The thread can write the header. Garbage there loses its own */
+	/* entries and nothing else */
+	if ((head - tail) > KUTRACE_RING_DATA_WORDS)
+		tail = head;
+
+	now = ku_get_timecount();
+	while (kutrace_tracing && (tail != head)) {
+		u64 temp[8];
+		u64 len = entry_len(data[tail & mask]);
+		u64 k;
+
+		if ((len == 0) || (len > head - tail))
+			break;
+		for (k = 0; k < len; ++k)
+			temp[k] = data[(tail + k) & mask];
+		if (unlikely(kutrace_filtering) && !keep_user_entry(temp[0])) {
+			tail += len;
+			continue;
+		}
+		if (!insert_timed(temp, len, base, now, tb)) {
+			/* This one was counted; count the rest */
+			for (tail += len; tail != head; tail += len) {
+				len = entry_len(data[tail & mask]);
+				if ((len == 0) || (len > head - tail))
+					break;
+				this_cpu_inc(kutrace_stat(drops));
+			}
+			break;
+		}
+		inserted += len;
+		tail += len;
+	}
+
+	/* Whatever is left is dropped */
+	ring_tail[r] = head;
+	smp_wmb();
+	WRITE_ONCE(header[1], head);
+	put_cpu_var(kutrace_traceblock_per_cpu);	/* release preempt */
+	return inserted;
+}
+
+#ifndef KUTRACE_USERSPACE
+/* True if no task has pid any more, so its ring was never given back */
+static bool ku_pid_gone(u64 pid)
+{
+	bool gone;
+
+	rcu_read_lock();
+	gone = (pid_task(find_pid_ns((pid_t)pid, &init_pid_ns),
+		PIDTYPE_PID) == NULL);
+	rcu_read_unlock();
+	return gone;
+}
+#endif
+
+/* Give the calling thread a ring, or with arg 0 drain and give it back */
+/* Return the ring number, 0 for a give-back, or ~0 if none */
+static u64 register_ring(u64 arg)
+{
+	u64 pid = (u64)current->pid;
+	u64 r = pid & (KUTRACE_MAX_RINGS - 1);
+	u64 owner;
+
+	if ((ringbase == NULL) || (pid == 0))
+		return ~CLU(0);
+	if (arg == 0) {
+		if ((u64)ATOMIC_READ(&ring_owner[r]) != pid)
+			return ~CLU(0);
+		drain_ring(r);
+		ATOMIC_SET(&ring_owner[r], 0);
+		return 0;
+	}
+	owner = (u64)ATOMIC_READ(&ring_owner[r]);
+	if (owner == pid)
+		return r;	/* Already ours */
+	if ((owner != 0) && !ku_pid_gone(owner))
+		return ~CLU(0);
+	if ((u64)ATOMIC_CMPXCHG(&ring_owner[r], owner, pid) != owner)
+		return ~CLU(0);
+	/* Start empty, wherever the last owner left off */
+	ring_tail[r] = READ_ONCE(ring_header(r)[1]);
+	WRITE_ONCE(ring_header(r)[0], ring_tail[r]);
+	WRITE_ONCE(ring_header(r)[2], 0);
+	ring_registered = true;
+	return r;
+}
+
+/* Drain the calling thread's ring. If the thread is exiting, this is a */
+/* context switch on its way out; give the ring back */
+/* Return number of words inserted */
+static u64 drain_own_ring(void)
+{
+	u64 pid = (u64)current->pid;
+	u64 r = pid & (KUTRACE_MAX_RINGS - 1);
+	u64 inserted;
+
+	if ((ringbase == NULL) || ((u64)ATOMIC_READ(&ring_owner[r]) != pid))
+		return 0;
+	inserted = drain_ring(r);
+	if (unlikely((current->flags & PF_EXITING) != 0))
+		ATOMIC_SET(&ring_owner[r], 0);
+	return inserted;
+}
+
+/* Discard every ring's pending entries, keeping its owner. The owning */
+/* threads still have their rings mapped and go on using them. */
+/* Tracing must be off */
+static void reset_rings(void)
+{
+	int r;
+
+	ring_registered = false;
+	if (ringbase == NULL)
+		return;
+	for (r = 0; r < KUTRACE_MAX_RINGS; ++r) {
+		u64 *header = ring_header(r);
+		if (ATOMIC_READ(&ring_owner[r]) == 0)
+			continue;
+		ring_registered = true;
+		/* Only the module writes the tail; the thread sees an empty */
+		/* ring and sets a new time base */
+		ring_tail[r] = READ_ONCE(header[0]);
+		WRITE_ONCE(header[1], ring_tail[r]);
+	}
+}
+
+
 /*
  * pid filter is an array of 64K bits, arranged as 1024 u64. It
  * cleared. When tracing context switches in kernel/sched/core.c, the
@@ -1544,13 +2662,14 @@ static u64 insert_n_user(u64 word)
 
 /* Reset tracing state to start a new clean trace */
 /* Tracing must be off. tracebase must be non-NULL */
-/* traceblock_next always points *just above* the next block to use */
-/* When empty, traceblock_next == traceblock_high */
-/* when full, traceblock_next == traceblock_limit */
+/* traceblock_cursor is the number of the next block to use */
+/* When empty, traceblock_cursor == 0 */
+/* when full, traceblock_cursor >= traceblock_count */
 /* Return 0 */
 static u64 do_reset(u64 flags)
 {
 	int cpu;
+	u64 slot;
 /* hack_count = 0; */
 
 	/* printk(KERN_INFO "  kutrace_trace reset(%016llx) called\n", flags); */
@@ -1558,11 +2677,23 @@ static u64 do_reset(u64 flags)
 	kutrace_tracing = false;	/* Should already be off */
 	do_ipc = ((flags & DO_IPC) != 0);
 	do_llc = ((flags & DO_LLC) != 0);
-	do_wrap = ((flags & DO_WRAP) != 0);
+	do_stream = ((flags & DO_STREAM) != 0);
+	/* Streaming never wraps; the consumer keeps the history */
+	do_wrap = ((flags & DO_WRAP) != 0) && !do_stream;
 	do_neither = (!do_ipc) & (!do_llc);
 	do_both = (do_ipc & do_llc);
 	do_ipc_only = (do_ipc & !do_llc);
 
+	/* We don't know if we actually wrapped until the end. */
+	/* See KUTRACE_CMD_GETCOUNT */
+	block_header_flags = 0;
+	if (do_ipc)
+		block_header_flags |= (IPC_Flag << FLAGS_SHIFT);
+	if (do_llc)
+		block_header_flags |= (LLC_Flag << FLAGS_SHIFT);
+	if (do_wrap)
+		block_header_flags |= (WRAP_Flag << FLAGS_SHIFT);
+
 	/* Clear pid filter */
 	memset(kutrace_pid_filter, 0, 1024 * sizeof(u64));
 
@@ -1570,7 +2701,7 @@ static u64 do_reset(u64 flags)
 	traceblock_high = (u64 *)(tracebase + (tracemb << 20));
 	traceblock_limit = (u64 *)(tracebase);
 	/* First trace item inserted will cause first new block */
-	traceblock_next = traceblock_high;	
+	ATOMIC_SET(&traceblock_cursor, 0);
 	did_wrap_around = false;
 
 	if (do_ipc | do_llc) {
@@ -1578,20 +2709,47 @@ static u64 do_reset(u64 flags)
 		/* Strictly speaking, this should be 1/9. We waste a little space. */
 		traceblock_limit = (u64*)(tracebase + (tracemb << (20 - 3)));
 	}
+	traceblock_count = (u64)(traceblock_high - traceblock_limit) >>
+		KUTRACEBLOCKSHIFTU64;
+
+	/* Streaming: every block free. Every block's last 8 words NOPs, so */
+	/* initialize_trace_block need not touch them the first time around */
+	for (slot = 0; slot < traceblock_count; ++slot) {
+		u64 *block = traceblock_high - ((slot + 1) << KUTRACEBLOCKSHIFTU64);
+		ATOMIC_SET(&traceblock_state[slot], BLOCK_FREE);
+		memset(&block[KUTRACEBLOCKSIZEU64 - 8], 0, 8 * sizeof(u64));
+	}
+	ATOMIC_SET(&stream_overruns, 0);
+
+	reset_rings();
 
-	/* Set up spinlock as available */
-	raw_spin_lock_init(&kutrace_lock);
+	/* Blocks sitting in per-CPU pools are unused until flush gives them */
+	/* back. Keep them to at most 1/4 of the buffer */
+	blockpool_batch = (batchblocks < 1) ? 1 : batchblocks;
+	while ((blockpool_batch > 1) &&
+		(blockpool_batch * num_online_cpus() * 4 > traceblock_count))
+		blockpool_batch >>= 1;
 
 	/* Set up per-CPU limits to immediately allocate a block */
 	for_each_online_cpu(cpu) {
 		struct kutrace_traceblock *tb =
 			&per_cpu(kutrace_traceblock_per_cpu, cpu);
+		struct kutrace_blockpool *pool =
+			&per_cpu(kutrace_blockpool_per_cpu, cpu);
+
+		pool->next = 0;
+		pool->end = 0;
+		pool->curr_slot = NO_BLOCK;
+		pool->prev_slot = NO_BLOCK;
 
 		ATOMIC_SET(&tb->next, (uintptr_t)NULL);
 		tb->limit = NULL;
 		tb->prior_cycles = 0;		// Cycle tracking
 		tb->prior_inst_retired = 0;	// IPC tracking
 		tb->prior_llc_misses = 0;	// LLC tracking
+
+		memset(&per_cpu(kutrace_stats_per_cpu, cpu), 0,
+			sizeof(struct kutrace_stats));
 	}
 
 	return 0;
@@ -1606,6 +2764,14 @@ static /*asmlinkage*/ void trace_1(u64 event, u64 arg)
 ////        if (!kutrace_tracing)
 ////		return;
 
+	/* Context switch: the outgoing thread is still current. Its ring */
+	/* entries go in first, inside its own time on this CPU */
+	if (unlikely(ring_registered) && (event == KUTRACE_USERPID))
+		drain_own_ring();
+
+	if (unlikely(kutrace_filtering) && !keep_event(event))
+		return;
+
 	/* Check for possible return optimization */
 	if (((event & UNSHIFTED_EVENT_RETURN_BIT) != 0) &&
 		((event & UNSHIFTED_EVENT_HAS_RETURN_MASK) != 0))
@@ -1630,6 +2796,8 @@ static void trace_2(u64 event, u64 arg1, u64 arg2)
 	u64 freq;
 	if (!kutrace_tracing)
 		return;
+	if (unlikely(kutrace_filtering) && !keep_event(event))
+		return;
 
 /* dsites 2021.04.05 insert CPU frequency */
 	freq = ku_get_cpu_freq();
@@ -1644,6 +2812,8 @@ static void trace_many(u64 event, u64 len, const char *arg)
 
 	if (!kutrace_tracing)
 		return;
+	if (unlikely(kutrace_filtering) && !keep_event(event))
+		return;
 	/* Turn off tracing if bogus length */
 	if (is_bad_len(len)) {
 		kutrace_tracing = false;
@@ -1682,12 +2852,21 @@ static u64 kutrace_control(u64 command, u64 arg)
 		/* If not tracing, insert nothing */
 		if (!kutrace_tracing)
 			return 0;
+		if (unlikely(kutrace_filtering) && !keep_user_entry(arg))
+			return 0;
 		return insert_1(arg);
 	} else if (command == KUTRACE_CMD_INSERTN) {
 		/* If not tracing, insert nothing */
 		if (!kutrace_tracing)
 			return 0;
+		if (unlikely(kutrace_filtering) && !keep_user_first_word(arg))
+			return 0;
 		return insert_n_user(arg);
+	} else if (command == KUTRACE_CMD_INSERTBATCH) {
+		/* If not tracing, insert nothing */
+		if (!kutrace_tracing)
+			return 0;
+		return insert_batch_user(arg);
 	} else if (command == KUTRACE_CMD_GETWORD) {
 		return get_word(arg);
 	} else if (command == KUTRACE_CMD_GETIPCWORD) {
@@ -1726,6 +2905,24 @@ static u64 kutrace_control(u64 command, u64 arg)
 		return get_4kb(arg);
 	} else if (command == KUTRACE_CMD_GETIPC4KB) {
 		return get_ipc_4kb(arg);
+	} else if (command == KUTRACE_CMD_GETMAPSIZE) {
+		return get_map_size();
+	} else if (command == KUTRACE_CMD_GETFULL) {
+		return get_full_block(arg);
+	} else if (command == KUTRACE_CMD_FREEBLOCK) {
+		return free_block(arg);
+	} else if (command == KUTRACE_CMD_REGRING) {
+		return register_ring(arg);
+	} else if (command == KUTRACE_CMD_DRAINRING) {
+		return drain_own_ring();
+	} else if (command == KUTRACE_CMD_GETSTATS) {
+		return get_stats(arg);
+	} else if (command == KUTRACE_CMD_SETCLASSES) {
+		return set_classes(arg);
+	} else if (command == KUTRACE_CMD_SETPIDS) {
+		return set_pids(arg);
+	} else if (command == KUTRACE_CMD_HANDOFF) {
+		return do_handoff(arg);
 	}
 
 	/* Else quietly return -1 */
@@ -1748,7 +2945,8 @@ static int __init kutrace_mod_init(void)
 	if (!kutrace_pid_filter)
 		return -1;
 
-	tracebase =  vmalloc(tracemb << 20);
+	/* vmalloc_user so that /dev/kutrace can map it */
+	tracebase =  vmalloc_user(tracemb << 20);
 	printk(KERN_INFO "  vmalloc kutrace_tracebase(%ld MB) " FUINTPTRX " %s\n",
 		tracemb,
 		(uintptr_t)tracebase,
@@ -1758,6 +2956,21 @@ static int __init kutrace_mod_init(void)
 		return -1;
 	}
 
+	/* One state per 64KB block, for streaming */
+	traceblock_state = (atomic64_t *)vmalloc(
+		((tracemb << 20) >> KUTRACEBLOCKSHIFT) * sizeof(atomic64_t));
+	if (!traceblock_state) {
+		vfree(tracebase);
+		vfree(kutrace_pid_filter);
+		return -1;
+	}
+
+	/* User event rings, also mapped through /dev/kutrace. Without them, */
+	/* KUTRACE_CMD_REGRING fails and users fall back to INSERTBATCH */
+	ringbase = (u8 *)vmalloc_user(KUTRACE_MAX_RINGS * KUTRACE_RING_BYTES);
+	printk(KERN_INFO "  vmalloc kutrace rings " FUINTPTRX " %s\n",
+		(uintptr_t)ringbase, (ringbase == NULL) ? "FAIL" : "OK");
+
 	/* Set up TCP packet filter */
 	/* Filter forms a hash over masked first N=24 bytes of packet payload */
 	/* and looks for zero result. The hash is just u32 XOR along with */
@@ -1811,6 +3024,13 @@ static int __init kutrace_mod_init(void)
 	do_reset(0);
 	printk(KERN_INFO "  kutrace_tracing = %d\n", kutrace_tracing);
 
+#ifndef KUTRACE_USERSPACE
+	/* Without the device node, kutrace_control falls back to 4KB copies */
+	kutrace_dev_registered = (misc_register(&kutrace_dev) == 0);
+	printk(KERN_INFO "  /dev/kutrace %s\n",
+		kutrace_dev_registered ? "OK" : "FAIL");
+#endif
+
 	/* Finally, connect up the routines that can change the state */
 	kutrace_global_ops.kutrace_trace_1 = &trace_1;
 	kutrace_global_ops.kutrace_trace_2 = &trace_2;
@@ -1838,6 +3058,14 @@ static void __exit kutrace_mod_exit(void)
 	kutrace_global_ops.kutrace_trace_control = NULL;
 	printk(KERN_INFO "  kutrace_global_ops = NULL\n");
 
+#ifndef KUTRACE_USERSPACE
+	/* No mapping can be left: each one holds the device file, which */
+	/* holds this module */
+	if (kutrace_dev_registered)
+		misc_deregister(&kutrace_dev);
+	kutrace_dev_registered = false;
+#endif
+
 	/* Clear out all the pointers to trace data */
 	for_each_online_cpu(cpu) {
 		struct kutrace_traceblock* tb = &per_cpu(kutrace_traceblock_per_cpu, cpu);
@@ -1851,12 +3079,16 @@ static void __exit kutrace_mod_exit(void)
 
 	traceblock_high = NULL;
 	traceblock_limit = NULL;
-	traceblock_next = NULL;
+	traceblock_count = 0;
 
 	/* Now that nothing points to it, free memory */
 	if (tracebase) {vfree(tracebase);}
 	if (kutrace_pid_filter) {vfree(kutrace_pid_filter);}
 	kutrace_pid_filter = NULL;
+	if (traceblock_state) {vfree(traceblock_state);}
+	traceblock_state = NULL;
+	if (ringbase) {vfree(ringbase);}
+	ringbase = NULL;
 
 	printk(KERN_INFO "  kutrace_tracebase = NULL\n");
 	printk(KERN_INFO "  kutrace_pid_filter = NULL\n");
@@ -0,0 +1,131 @@
+/*
+ * kutrace_mod_user.c
+ *
+ * kutrace_mod.c compiled as a userspace library. See kutrace_mod_user.h
+ *
+ * Compile with  make user  or
+ *   gcc -O2 -c -DKUTRACE_USERSPACE kutrace_mod_user.c
+ *   ar rcs libkutrace_mod_user.a kutrace_mod_user.o
+ */
+
+#include "kutrace_mod.c"
+
+int ku_user_init(int ncpus, long mb, long batch, bool verbose,
+	void (*irq_handler)(void))
+{
+	int retval;
+
+	ku_user_ncpus = ncpus;
+	tracemb = mb;
+	batchblocks = batch;
+	ku_user_verbose = verbose;
+	ku_user_irq_handler = irq_handler;
+	retval = kutrace_mod_init();
+	ku_user_set_cpu(0, 0, "ku_user_init");
+	return retval;
+}
+
+void ku_user_exit(void)
+{
+	kutrace_mod_exit();
+}
+
+void ku_user_set_cpu(int cpu, int pid, const char *comm)
+{
+	ku_user_cpu = cpu;
+	ku_user_task.pid = pid;
+	ku_user_task.flags = 0;
+	memset(ku_user_task.comm, 0, TASK_COMM_LEN);
+	strncpy(ku_user_task.comm, comm, TASK_COMM_LEN - 1);
+}
+
+u64 ku_user_control(u64 command, u64 arg)
+{
+	return kutrace_control(command, arg);
+}
+
+void ku_user_trace_1(u64 event, u64 arg)
+{
+	trace_1(event, arg);
+}
+
+void ku_user_trace_2(u64 event, u64 arg1, u64 arg2)
+{
+	trace_2(event, arg1, arg2);
+}
+
+void ku_user_trace_many(u64 event, u64 len, const char *arg)
+{
+	trace_many(event, len, arg);
+}
+
+void ku_user_interrupt(void)
+{
+	if (ku_user_irq_handler == NULL)
+		return;
+	if (ku_user_irqs_off) {
+		/* Held until local_irq_restore */
+		ku_user_irq_pending = 1;
+		++ku_user_irq_deferred;
+		return;
+	}
+	ku_user_take_irq();
+}
+
+u64 ku_user_deferred_interrupts(void)
+{
+	return ku_user_irq_deferred;
+}
+
+const u64 *ku_user_trace_block(u64 blocknum)
+{
+	return traceblock_high - ((blocknum + 1) << KUTRACEBLOCKSHIFTU64);
+}
+
+void ku_user_get_info(KuUserInfo *info)
+{
+	info->batch = blockpool_batch;
+	info->blocks = traceblock_count;
+	info->cursor = (u64)ATOMIC_READ(&traceblock_cursor);
+	info->wrapped = did_wrap_around;
+	info->overruns = (u64)ATOMIC_READ(&stream_overruns);
+}
+
+bool ku_user_trace_guards_ok(void)
+{
+	return ku_user_guards_ok(tracebase);
+}
+
+u64 ku_user_entry_len(u64 word)
+{
+	return entry_len(word);
+}
+
+void ku_user_end_block(void)
+{
+	struct kutrace_traceblock *tb =
+		&per_cpu(kutrace_traceblock_per_cpu, ku_user_cpu);
+	if (tb->limit != NULL)
+		ATOMIC_SET(&tb->next, (uintptr_t)tb->limit);
+}
+
+u64 ku_user_timecount(void)
+{
+	return ku_get_timecount();
+}
+
+u64 *ku_user_ring(u64 r)
+{
+	return ring_header(r);
+}
+
+u64 ku_user_ring_owner(u64 r)
+{
+	return (u64)ATOMIC_READ(&ring_owner[r]);
+}
+
+void ku_user_exit_thread(void)
+{
+	ku_user_task.flags |= PF_EXITING;
+	trace_1(KUTRACE_USERPID, 0);
+}
@@ -0,0 +1,145 @@
+/*
+ * kutrace_mod_user.h
+ *
+ * kutrace_mod.c built as a userspace library, libkutrace_mod_user.a, for
+ * test and benchmark programs. kutrace_user_shim.h stands in for the kernel.
+ *
+ * Each calling thread is one simulated CPU. It calls ku_user_set_cpu once
+ * before tracing and keeps that CPU number. A signal handler may call
+ * ku_user_interrupt to simulate an interrupt on the thread's CPU. It runs the
+ * handler given to ku_user_init right away if simulated interrupts are on,
+ * else when the module next turns them back on.
+ *
+ */
+
+#ifndef _KUTRACE_MOD_USER_H
+#define _KUTRACE_MOD_USER_H
+
+#include <stdbool.h>
+
+typedef unsigned long long u64;
+
+/* From the patched include/linux/kutrace.h */
+#define KUTRACE_CMD_OFF 0
+#define KUTRACE_CMD_ON 1
+#define KUTRACE_CMD_FLUSH 2
+#define KUTRACE_CMD_RESET 3
+#define KUTRACE_CMD_STAT 4
+#define KUTRACE_CMD_GETCOUNT 5
+#define KUTRACE_CMD_GETWORD 6
+#define KUTRACE_CMD_INSERT1 7
+#define KUTRACE_CMD_INSERTN 8
+#define KUTRACE_CMD_GETIPCWORD 9
+#define KUTRACE_CMD_TEST 10
+#define KUTRACE_CMD_VERSION 11
+#define KUTRACE_CMD_GETFULL 16
+#define KUTRACE_CMD_FREEBLOCK 17
+#define KUTRACE_CMD_INSERTBATCH 18
+#define KUTRACE_CMD_REGRING 19
+#define KUTRACE_CMD_DRAINRING 20
+#define KUTRACE_CMD_GETSTATS 21
+#define KUTRACE_STAT_WORDS 10
+#define KUTRACE_CMD_SETCLASSES 22
+#define KUTRACE_CMD_SETPIDS 23
+#define KUTRACE_CMD_HANDOFF 24
+
+/* Event classes for KUTRACE_CMD_SETCLASSES */
+#define KUTRACE_CLASS_SYSCALL 0x01
+#define KUTRACE_CLASS_TRAP    0x02
+#define KUTRACE_CLASS_IRQ     0x04
+#define KUTRACE_CLASS_SCHED   0x08
+#define KUTRACE_CLASS_PCSAMP  0x10
+#define KUTRACE_CLASS_USER    0x20
+#define KUTRACE_CLASS_OTHER   0x40
+#define KUTRACE_CLASS_ALL     0x7F
+
+/* User event rings */
+#define KUTRACE_MAX_RINGS 64
+#define KUTRACE_RING_HEADER_BYTES 4096
+#define KUTRACE_RING_DATA_WORDS 2048
+#define KUTRACE_RING_BYTES (KUTRACE_RING_HEADER_BYTES + KUTRACE_RING_DATA_WORDS * 8)
+
+#define KUTRACE_PIDNAME       0x002
+#define KUTRACE_USERPID       0x200
+#define KUTRACE_TSDELTA       0x21D
+#define KUTRACE_IRQ           0x0500
+#define KUTRACE_IRQRET        0x0700
+#define KUTRACE_SYSCALL64     0x0800
+#define KUTRACE_SYSRET64      0x0A00
+
+/* Flags for KUTRACE_CMD_RESET, same as kutrace_control.cc */
+#define DO_IPC 1
+#define DO_WRAP 2
+#define DO_LLC 4
+#define DO_STREAM 8
+
+/* Trace block and entry layout, same as kutrace_mod.c */
+#define KU_USER_BLOCKSIZEU64 8192
+#define KU_USER_CPU_SHIFT 56
+#define KU_USER_TIMESTAMP_SHIFT 44
+#define KU_USER_EVENT_SHIFT 32
+#define KU_USER_DELTA_SHIFT 24
+#define KU_USER_RETVAL_SHIFT 16
+#define KU_USER_LENGTH_SHIFT 4
+
+#define KU_USER_MAX_CPUS 256
+
+typedef struct {
+	u64 batch;		/* Blocks each CPU takes at once */
+	u64 blocks;		/* Blocks in the trace buffer */
+	u64 cursor;		/* Block numbers handed out so far */
+	bool wrapped;
+	u64 overruns;		/* Streaming: entries dropped, no free block */
+} KuUserInfo;
+
+/* Allocate the trace buffer as module init does and reset it */
+/* irq_handler may be NULL. Return 0 on success */
+int ku_user_init(int ncpus, long tracemb, long batchblocks, bool verbose,
+	void (*irq_handler)(void));
+
+/* Free the trace buffer */
+void ku_user_exit(void);
+
+/* Make the calling thread CPU number cpu, running pid/comm */
+void ku_user_set_cpu(int cpu, int pid, const char *comm);
+
+/* The module entry points, as called from kernel patches and syscall */
+u64 ku_user_control(u64 command, u64 arg);
+void ku_user_trace_1(u64 event, u64 arg);
+void ku_user_trace_2(u64 event, u64 arg1, u64 arg2);
+void ku_user_trace_many(u64 event, u64 len, const char *arg);
+
+/* Simulated interrupt on the calling thread's CPU. Async-signal-safe */
+void ku_user_interrupt(void);
+
+/* Number of simulated interrupts held off until interrupts were re-enabled */
+u64 ku_user_deferred_interrupts(void);
+
+/* Trace block blocknum, counting down from the top of the buffer */
+const u64 *ku_user_trace_block(u64 blocknum);
+
+void ku_user_get_info(KuUserInfo *info);
+
+/* Return true if nothing has been stored just outside the trace buffer */
+bool ku_user_trace_guards_ok(void);
+
+/* Length in words of the entry starting with word, as the module sees it */
+u64 ku_user_entry_len(u64 word);
+
+/* Make the calling thread's CPU start a new block at its next entry */
+void ku_user_end_block(void);
+
+/* The module's time counter, for user timestamps in INSERTBATCH entries */
+u64 ku_user_timecount(void);
+
+/* User event ring r, header then data, as /dev/kutrace would map it */
+u64 *ku_user_ring(u64 r);
+
+/* Pid that owns ring r, or 0 if it is free */
+u64 ku_user_ring_owner(u64 r);
+
+/* The calling thread exits without giving back its ring: its last */
+/* context switch away, with the task marked exiting */
+void ku_user_exit_thread(void);
+
+#endif	/* _KUTRACE_MOD_USER_H */
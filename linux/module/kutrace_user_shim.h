@@ -0,0 +1,306 @@
+/*
+ * kutrace_user_shim.h
+ *
+ * Userspace stand-ins for the kernel facilities used by kutrace_mod.c, so
+ * that the module source itself can be compiled into test programs with
+ *   -DKUTRACE_USERSPACE
+ * Each test thread plays one CPU. It sets ku_user_cpu once and never changes
+ * it, which is the userspace version of running with preemption disabled.
+ * local_irq_save/restore only set a per-thread flag. A simulated interrupt
+ * that arrives while that flag is set is held until local_irq_restore.
+ *
+ * Only kutrace_mod.c includes this, so it also defines the globals that the
+ * patched kernel would export to the module.
+ *
+ */
+
+#ifndef _KUTRACE_USER_SHIM_H
+#define _KUTRACE_USER_SHIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>	/* S_IRUSR */
+#include <unistd.h>	/* usleep */
+#if defined(__x86_64__)
+#include <x86intrin.h>	/* __rdtsc */
+#endif
+
+/* Also the command numbers and events from include/linux/kutrace.h */
+#include "kutrace_mod_user.h"
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef long long s64;
+
+typedef struct {
+	s64 counter;
+} atomic64_t;
+
+static inline s64 atomic64_read(const atomic64_t *v)
+{
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_set(atomic64_t *v, s64 i)
+{
+	__atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_add_return(s64 i, atomic64_t *v)
+{
+	return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline s64 atomic64_cmpxchg(atomic64_t *v, s64 old, s64 new_value)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new_value, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;	/* The prior value either way */
+}
+
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+
+#define prefetchw(x) __builtin_prefetch((x), 1)
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+/* Module boilerplate */
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_init(fn)
+#define module_exit(fn)
+#define __init
+#define __exit
+#define __user
+
+/* printk goes to stderr only with ku_user_verbose */
+static bool ku_user_verbose;
+#define KERN_INFO ""
+#define printk(...) \
+	do { if (ku_user_verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/* The rest of the patched include/linux/kutrace.h */
+struct kutrace_ops {
+	void (*kutrace_trace_1)(u64 num, u64 arg);
+	void (*kutrace_trace_2)(u64 num, u64 arg1, u64 arg2);
+	void (*kutrace_trace_many)(u64 num, u64 len, const char *arg);
+	u64 (*kutrace_trace_control)(u64 command, u64 arg);
+};
+
+struct kutrace_nf {
+	u64 hash_init;
+	u64 hash_mask[3];
+};
+
+struct kutrace_traceblock {
+	atomic64_t next;	/* Next u64 in current per-cpu trace block */
+	u64 *limit;		/* Off-the-end u64 in current per-cpu block */
+	u64 prior_cycles;	/* Cycle tracking */
+	u64 prior_inst_retired;	/* IPC tracking */
+	u64 prior_llc_misses;	/* LLC tracking */
+};
+
+/* Exported by the patched kernel, kernel/kutrace/kutrace.c */
+bool kutrace_tracing;
+struct kutrace_ops kutrace_global_ops;
+u64 *kutrace_pid_filter;
+struct kutrace_nf kutrace_net_filter;
+
+/* Per-CPU data is an array indexed by the simulated CPU number */
+static int ku_user_ncpus = 1;
+static __thread int ku_user_cpu;
+
+#define DECLARE_PER_CPU(type, name) type name[KU_USER_MAX_CPUS]
+#define DEFINE_PER_CPU(type, name) type name[KU_USER_MAX_CPUS]
+#define per_cpu(var, cpu) ((var)[cpu])
+#define get_cpu_var(var) ((var)[ku_user_cpu])
+#define put_cpu_var(var) do { } while (0)
+#define smp_processor_id() (ku_user_cpu)
+/* The module's per-CPU statistics, as kutrace_stat(field) names them */
+#define kutrace_stat(field) (kutrace_stats_per_cpu[ku_user_cpu].field)
+#define this_cpu_inc(pcp) (++(pcp))
+#define this_cpu_add(pcp, n) ((pcp) += (n))
+/* The counter setup it runs does nothing here */
+#define on_each_cpu(func, info, wait) ((func)(info))
+#define num_online_cpus() (ku_user_ncpus)
+#define for_each_online_cpu(cpu) \
+	for ((cpu) = 0; (cpu) < ku_user_ncpus; ++(cpu))
+
+/* Simulated interrupt enable and held interrupt, one per thread */
+static __thread volatile int ku_user_irqs_off;
+static __thread volatile int ku_user_irq_pending;
+static __thread u64 ku_user_irq_deferred;
+static void (*ku_user_irq_handler)(void);
+
+/* Run the interrupt handler with interrupts off, as the kernel would */
+static inline void ku_user_take_irq(void)
+{
+	ku_user_irqs_off = 1;
+	__asm__ __volatile__("" ::: "memory");
+	(*ku_user_irq_handler)();
+	__asm__ __volatile__("" ::: "memory");
+	ku_user_irqs_off = 0;
+}
+
+#define irqs_disabled_flags(flags) ((flags) != 0)
+/* Handlers run with interrupts off, so irqs_disabled_flags covers them */
+#define in_interrupt() (0)
+#define preempt_disable() do { } while (0)
+#define preempt_enable() do { } while (0)
+
+/* Runs func as CPU cpu on the calling thread. Right only while that CPU's */
+/* own thread is not tracing */
+static inline long work_on_cpu(int cpu, long (*func)(void *), void *arg)
+{
+	int saved_cpu = ku_user_cpu;
+	long retval;
+	ku_user_cpu = cpu;
+	retval = (*func)(arg);
+	ku_user_cpu = saved_cpu;
+	return retval;
+}
+
+#define local_irq_save(flags) \
+	do { (flags) = ku_user_irqs_off; ku_user_irqs_off = 1; \
+	     __asm__ __volatile__("" ::: "memory"); } while (0)
+#define local_irq_restore(flags) \
+	do { __asm__ __volatile__("" ::: "memory"); \
+	     ku_user_irqs_off = (flags); \
+	     while (!ku_user_irqs_off && ku_user_irq_pending) { \
+	       ku_user_irq_pending = 0; ku_user_take_irq(); } } while (0)
+
+/* The current task, one per thread */
+#define TASK_COMM_LEN 16
+#define PF_EXITING 0x00000004
+struct task_struct {
+	int pid;
+	unsigned int flags;
+	char comm[TASK_COMM_LEN];
+};
+static __thread struct task_struct ku_user_task;
+#define current (&ku_user_task)
+
+/* Simulated threads give their rings back or exit as ku_user_exit_thread */
+static inline bool ku_pid_gone(u64 pid)
+{
+	return false;
+}
+
+#define CAP_SYS_PTRACE 19
+static inline bool has_capability(struct task_struct *t, int cap)
+{
+	return true;
+}
+
+/* Trace memory, with a guard region on each side to catch stray stores */
+#define KU_USER_GUARD 65536
+#define KU_USER_GUARD_BYTE 0xA5
+
+static inline void *vmalloc(unsigned long size)
+{
+	char *p = (char *)malloc(size + 2 * KU_USER_GUARD + sizeof(u64));
+	if (p == NULL)
+		return NULL;
+	*(u64 *)p = size;
+	p += sizeof(u64);
+	memset(p, KU_USER_GUARD_BYTE, KU_USER_GUARD);
+	memset(p + KU_USER_GUARD + size, KU_USER_GUARD_BYTE, KU_USER_GUARD);
+	return p + KU_USER_GUARD;
+}
+
+/* Zeroed, as the kernel's is; it is also mappable there */
+static inline void *vmalloc_user(unsigned long size)
+{
+	void *p = vmalloc(size);
+	if (p != NULL)
+		memset(p, 0, size);
+	return p;
+}
+
+static inline void vfree(const void *addr)
+{
+	free((char *)addr - KU_USER_GUARD - sizeof(u64));
+}
+
+/* Return true if nothing has been stored just outside a vmalloc area */
+static inline bool ku_user_guards_ok(const void *addr)
+{
+	const unsigned char *p = (const unsigned char *)addr;
+	u64 size = *(const u64 *)(p - KU_USER_GUARD - sizeof(u64));
+	u64 i;
+	for (i = 0; i < KU_USER_GUARD; ++i) {
+		if (p[-1 - (s64)i] != KU_USER_GUARD_BYTE)
+			return false;
+		if (p[size + i] != KU_USER_GUARD_BYTE)
+			return false;
+	}
+	return true;
+}
+
+static inline void msleep(unsigned int msecs)
+{
+	usleep(msecs * 1000);
+}
+
+static inline unsigned long copy_to_user(void *to, const void *from,
+	unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long raw_copy_from_user(void *to, const void *from,
+	unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+struct cpufreq_policy {
+	unsigned int cur;
+};
+static inline struct cpufreq_policy *cpufreq_cpu_get_raw(unsigned int cpu)
+{
+	return NULL;
+}
+
+/* Counters. The time counter is real; the rest read as zero */
+static inline void ku_setup_timecount(void) {}
+static inline void ku_setup_inst_retired(void) {}
+static inline void ku_setup_llc_miss(void) {}
+static inline void ku_setup_cpu_freq(void) {}
+
+static inline u64 ku_get_timecount(void)
+{
+#if defined(__x86_64__)
+	/* Same scaling as the module */
+	return __rdtsc() >> 6;
+#elif defined(__aarch64__)
+	u64 timer_value;
+	asm volatile("mrs %x0, cntvct_el0" : "=r"(timer_value));
+	return timer_value;
+#else
+#error Define the time counter for your architecture
+#endif
+}
+
+static inline u64 ku_get_inst_retired(void) {return 0;}
+static inline u64 ku_get_llc_miss(void) {return 0;}
+static inline u64 ku_get_cpu_freq(void) {return 0;}
+
+/* Kernel C inline semantics: plain inline functions get a real definition */
+#define inline inline __attribute__((__gnu_inline__))
+
+#endif	/* _KUTRACE_USER_SHIM_H */
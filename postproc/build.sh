@@ -1,11 +1,12 @@
 g++ -O2 base40.cc -o base40
 g++ -O2 eventtospan3.cc -o eventtospan3
+g++ -O2 flat_hash_map_bench.cc -o flat_hash_map_bench
 g++ -O2 hello_world_trace.c kutrace_lib.cc -o hello_world_trace
-g++ -O2 kuod.cc -o kuod
+g++ -O2 kuod.cc -o kuod -lpthread
 g++ -O2 kutrace_control.cc kutrace_lib.cc -o kutrace_control
 g++ -O2 kutrace_unittest.cc kutrace_lib.cc -o kutrace_unittest
 g++ -O2 makeself.cc -o makeself
-g++ -O2 rawtoevent.cc -Wno-format-overflow  from_base40.cc kutrace_lib.cc -o rawtoevent
+g++ -O2 rawtoevent.cc -Wno-format-overflow  from_base40.cc kutrace_lib.cc -o rawtoevent -lpthread
 g++ -O2 samptoname_k.cc -o samptoname_k
 g++ -O2 samptoname_u.cc -o samptoname_u
 g++ -O2 spantospan.cc -o spantospan
@@ -11,6 +11,8 @@
 //   od -Ax -tx8z -w32 foo.trace
 //
 // dsites 2022.08.17 Initial version
+// Walk memory-mapped trace blocks in place, see trace_mmap.h
+// Read compressed traces too, see trace_compress.h
 //
 
 
@@ -29,6 +31,7 @@
 
 #include "basetypes.h"
 #include "kutrace_lib.h"
+#include "trace_mmap.h"
 
 #define IPC_Flag     0x80
 #define WRAP_Flag    0x40
@@ -536,8 +539,9 @@ bool Note2(Err err, Msg msg, uint64* block, size_t delta_byte, const char* str,
 }
 
 
-// These tests fail immediately
-FILE* CheckStat(const char* fname) {
+// These tests fail immediately. The size checks are on the plain trace, after
+// any decompression in OpenTraceInput
+FILE* CheckStat(const char* fname, TraceInput* in) {
   if (fname == NULL) {Usage();}
   struct stat buff;
   int status = stat(fname, &buff);
@@ -553,13 +557,16 @@ FILE* CheckStat(const char* fname) {
     exit(0);
   }
 
+  OpenTraceInput(f, in);	// Blocks are checked in place in the mapped file
+  uint64 size = (in->base != NULL) ? in->size : buff.st_size;
+
   bool fail_fast = false;
   // Size must be a multiple of 8KB >= 64KB (blocks are 64KB or 72KB)
-  if ((buff.st_size & 0x1FFF) != 0) {
-    fail_fast |= Note(FAIL, TR_NOT_8K, NULL, 0, FormatUint64x(buff.st_size));
+  if ((size & 0x1FFF) != 0) {
+    fail_fast |= Note(FAIL, TR_NOT_8K, NULL, 0, FormatUint64x(size));
   }
-  if (buff.st_size < 64 * 1024) {
-    fail_fast |=Note(FAIL, TR_NOT_64K, NULL, 0, FormatUint64(buff.st_size));
+  if (size < 64 * 1024) {
+    fail_fast |=Note(FAIL, TR_NOT_64K, NULL, 0, FormatUint64(size));
   }
 
   if (fail_fast) {
@@ -1177,23 +1184,29 @@ int main (int argc, const char** argv) {
 
 
   // Exits if any problem with file -- fail_fast
-  FILE* f = CheckStat(fname);
+  TraceInput in;
+  FILE* f = CheckStat(fname, &in);
 
   // Loop reading and testing trace blocks
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint64 ipcblock[kIpcBufSize];		// One byte per trace entry
+  uint64 tracebuf[kTraceBufSize];	// 8 bytes per trace entry, if not mapped
+  uint64 ipcbuf[kIpcBufSize];		// One byte per trace entry, if not mapped
+  uint64* traceblock = tracebuf;
+  uint64* ipcblock = ipcbuf;
+  uint8* p;
 
   offset = 0;
   block_num = 0;
   size_t n;
-  while ((n = fread(traceblock, 1, sizeof(traceblock), f)) != 0) {
+  while ((n = ReadTraceBytes(&in, tracebuf, sizeof(tracebuf), &p)) != 0) {
+    traceblock = reinterpret_cast<uint64*>(p);
     bool subpar_block = false; 
     subpar_block |= CheckTraceBlock(n, traceblock);	// Sets flags at first block
     offset += n;
 
     if (HasIPC(flags)) {
       // Extract 8KB IPC block
-      n = fread(ipcblock, 1, sizeof(ipcblock), f);
+      n = ReadTraceBytes(&in, ipcbuf, sizeof(ipcbuf), &p);
+      ipcblock = reinterpret_cast<uint64*>(p);
       subpar_block |= CheckIpcBlock(n, ipcblock);
       offset += n;
     }
@@ -1253,6 +1266,7 @@ int main (int argc, const char** argv) {
 
   fprintf(stdout, "%s %s\n\n", trace_fail ? "FAIL" : "PASS", fname);
 
+  CloseTraceInput(&in);
   return 0;
 }
 
@@ -0,0 +1,165 @@
+// event_record.h
+//
+// Fixed-width binary event records passed from rawtoevent to eventtospan3,
+// as an alternative to the default Ascii event lines. Each record carries
+// exactly the fields of one text line, so either form can be turned into the other.
+//
+
+#ifndef __EVENT_RECORD_H__
+#define __EVENT_RECORD_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include "basetypes.h"
+
+// What one record holds
+static const uint8 kRecordEvent = 0;	// time dur event cpu  pid rpc  arg retval IPC name
+static const uint8 kRecordName = 1;	// time dur event arg name
+static const uint8 kRecordComment = 2;	// # ... stylized comment text in name
+
+// Longest name carried, including NUL. Longer names are truncated.
+static const int kRecordNameSize = 80;
+
+// 128 bytes per record
+//   +-------------------------------+-------------------------------+
+//   |                     ts (multiples of 10ns)                    |
+//   +-------------------------------+-------------------------------+
+//   |                    duration (multiples of 10ns)               |
+//   +-------------------------------+-------------------------------+
+//   |            cpu                |            event              |
+//   +-------------------------------+-------------------------------+
+//   |            rpc                |             pid               |
+//   +-------------------------------+-------------------------------+
+//   |           retval              |             arg               |
+//   +-------+-------+-------+-------+-------------------------------+
+//   |///////|namelen| kind  |  ipc  |                               |
+//   +-------+-------+-------+-------+                               +
+//   ~                    name, NUL-padded                           ~
+//   +---------------------------------------------------------------+
+//
+typedef struct {
+  int64 ts;		// -1 for the copy of each name sorted to the very front
+  int64 duration;
+  int32 event;
+  int32 cpu;
+  int32 pid;
+  int32 rpc;
+  int32 arg;
+  int32 retval;
+  uint8 ipc;
+  uint8 kind;
+  uint8 namelen;
+  uint8 unused;
+  char name[kRecordNameSize];
+} EventRecord;
+
+
+// Fill in the name field, truncating if need be
+inline void SetRecordName(EventRecord* rec, const char* name) {
+  int len = strlen(name);
+  if (len > (kRecordNameSize - 1)) {len = kRecordNameSize - 1;}
+  memset(rec->name, 0, kRecordNameSize);
+  memcpy(rec->name, name, len);
+  rec->namelen = len;
+}
+
+// Sort key, the same value that sort -n would see at the front of the text line.
+// Comment lines have no leading number, so count as zero.
+inline int64 RecordSortKey(const EventRecord* rec) {
+  return (rec->kind == kRecordComment) ? 0 : rec->ts;
+}
+
+// Produce the exact text line for a record, without the trailing newline
+inline void FormatEventRecord(const EventRecord* rec, char* buffer, int maxsize) {
+  if (rec->kind == kRecordComment) {
+    snprintf(buffer, maxsize, "%s", rec->name);
+  } else if (rec->kind == kRecordName) {
+    snprintf(buffer, maxsize, "%lld %lld %d %d %s",
+             rec->ts, rec->duration, rec->event, rec->arg, rec->name);
+  } else {
+    snprintf(buffer, maxsize, "%lld %lld %d %d  %lld %d  %lld %lld %d %s (%x)",
+             rec->ts, rec->duration, rec->event, rec->cpu,
+             (int64)(uint32)rec->pid, rec->rpc,
+             (int64)(uint32)rec->arg, (int64)(uint32)rec->retval, rec->ipc, rec->name, rec->event);
+  }
+}
+
+// Compare two numbers the way their decimal text compares byte by byte:
+// '-' sorts before any digit, and a shorter digit string that is a prefix of a
+// longer one sorts first, since the space after it is below any digit.
+// Returns <0, 0, >0.
+inline int TextNumberCompare(int64 a, int64 b) {
+  if (a == b) {return 0;}
+  if ((a < 0) != (b < 0)) {return (a < 0) ? -1 : 1;}
+  uint64 ua = (a < 0) ? -(uint64)a : (uint64)a;
+  uint64 ub = (b < 0) ? -(uint64)b : (uint64)b;
+  int adigits = 1;
+  int bdigits = 1;
+  for (uint64 x = ua; x >= 10; x /= 10) {++adigits;}
+  for (uint64 x = ub; x >= 10; x /= 10) {++bdigits;}
+  // Drop the extra low digits of the longer one, then compare as numbers
+  uint64 ta = ua;
+  uint64 tb = ub;
+  for (int i = adigits; i > bdigits; --i) {ta /= 10;}
+  for (int i = bdigits; i > adigits; --i) {tb /= 10;}
+  if (ta != tb) {return (ta < tb) ? -1 : 1;}
+  return (adigits < bdigits) ? -1 : 1;	// Equal prefix; shorter is first
+}
+
+// Same ordering as LC_ALL=C sort -n on the text lines: numeric key first,
+// then ties broken by plain byte comparison of the whole line. The tie break
+// walks the fields in the order FormatEventRecord writes them.
+inline bool RecordLess(const EventRecord& a, const EventRecord& b) {
+  int64 akey = RecordSortKey(&a);
+  int64 bkey = RecordSortKey(&b);
+  if (akey != bkey) {return akey < bkey;}
+  // Comment text starts with #, below the leading '-' or digit of any other line
+  if ((a.kind == kRecordComment) || (b.kind == kRecordComment)) {
+    if (a.kind != b.kind) {return a.kind == kRecordComment;}
+    return strcmp(a.name, b.name) < 0;
+  }
+  int c = TextNumberCompare(a.ts, b.ts);
+  if (c == 0) {c = TextNumberCompare(a.duration, b.duration);}
+  if (c == 0) {c = TextNumberCompare(a.event, b.event);}
+  if (c != 0) {return c < 0;}
+  if (a.kind != b.kind) {
+    // Name line has "arg name" where an event line has "cpu  pid"
+    int64 afourth = (a.kind == kRecordName) ? a.arg : a.cpu;
+    int64 bfourth = (b.kind == kRecordName) ? b.arg : b.cpu;
+    c = TextNumberCompare(afourth, bfourth);
+    if (c != 0) {return c < 0;}
+    // Then the event line's second space is below any name character,
+    // unless the name is empty and the name line simply ends there
+    const EventRecord& namerec = (a.kind == kRecordName) ? a : b;
+    bool name_first = (namerec.name[0] == '\0');
+    return (a.kind == kRecordName) ? name_first : !name_first;
+  }
+  if (a.kind == kRecordName) {
+    c = TextNumberCompare(a.arg, b.arg);
+    if (c != 0) {return c < 0;}
+    return strcmp(a.name, b.name) < 0;
+  }
+  c = TextNumberCompare(a.cpu, b.cpu);
+  if (c == 0) {c = TextNumberCompare((uint32)a.pid, (uint32)b.pid);}
+  if (c == 0) {c = TextNumberCompare(a.rpc, b.rpc);}
+  if (c == 0) {c = TextNumberCompare((uint32)a.arg, (uint32)b.arg);}
+  if (c == 0) {c = TextNumberCompare((uint32)a.retval, (uint32)b.retval);}
+  if (c == 0) {c = TextNumberCompare(a.ipc, b.ipc);}
+  if (c == 0) {c = strcmp(a.name, b.name);}
+  return c < 0;
+}
+
+// Write one record. Return false on error
+inline bool WriteEventRecord(FILE* f, const EventRecord* rec) {
+  return fwrite(rec, sizeof(EventRecord), 1, f) == 1;
+}
+
+// Read next record. Return false if no more.
+inline bool ReadEventRecord(FILE* f, EventRecord* rec) {
+  if (fread(rec, sizeof(EventRecord), 1, f) != 1) {return false;}
+  rec->name[kRecordNameSize - 1] = '\0';	// Be safe with bad input
+  return true;
+}
+
+#endif	// __EVENT_RECORD_H__
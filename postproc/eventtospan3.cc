@@ -68,6 +68,14 @@
 // 2024.07.03 dsites Add MakeIPISpan processing
 // 2024.07.06 dsites Do CPU-related cexit latency tables
 // 2024.09.01 dsites Add wakeup reason for monitor-store
+// Add -bin to read fixed-width binary event records, see event_record.h
+// Carry interned NameId in spans and stacks instead of strings
+// Keep per-PID/lock/hash tables in FlatHashMap instead of std::map
+// Grow per-CPU state for the CPU numbers seen, up to 256
+// Format span and event lines with integer digits, 1MB stdout buffer
+// Hold span lines in a reorder buffer and write them already sorted
+// Add -spans to write a columnar span store, see span_store.h
+// Hold OneSpans, not lines, for reordering; row names at the trace start
 
 // Compile with  g++ -O2 eventtospan3.cc -o eventtospan3
 
@@ -77,8 +85,11 @@
   spantotrim new ipc
 */
 
+#include <algorithm>
 #include <map>
+#include <queue>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit, random
@@ -89,6 +100,10 @@
 #include <sys/types.h>
 
 #include "basetypes.h"
+#include "event_record.h"
+#include "flat_hash_map.h"
+#include "span_format.h"
+#include "span_store.h"
 ////#include "kutrace_control_names.h"
 #include "kutrace_lib.h"
 
@@ -123,7 +138,7 @@
 
 static const char* kIdleName = "-idle-";
 static const char* kIdlelpName = "-idlelp-";
-static const int kMAX_CPUS = 80;
+static const int kMAX_CPUS = 256;	// Raw trace block header CPU number is 8 bits
 static const int kNetworkMbitSec = 1000;	// Default: 1 Gb/s if not in trace
 
 static const uint64 kMIN_CEXIT_DURATION = 10LL;	//  0.100 usec in multiples of 10 nsec
@@ -238,6 +253,77 @@ using std::multimap;
 using std::string;
 
 
+// Interned names. Spans and call stacks carry a 32-bit NameId instead of a string,
+// so copying them around does no heap allocation. The text is looked up only
+// for output and for the occasional name test or rewrite.
+// The fixed names go in first, so their ids are constants.
+typedef uint32 NameId;
+typedef map<string, NameId, std::less<> > NameIndex;	// Finds a const char* without a copy
+
+static const char* kFixedNames[] = {
+  "", "-idle-", "-idlelp-", "-sched-", "-dummy-", "-wakeup-", "-ipi-", "-freq-",
+  "-c-exit-", "runnable", "wfi", "reschedule_ipi", "/BH:hi",
+  "clone", "/clone", "fork", "/fork",
+};
+enum {
+  kNoNameId = 0, kIdleId, kIdlelpId, kSchedId, kDummyId, kWakeupId, kIpiId, kFreqId,
+  kCexitId, kRunnableId, kWfiId, kReschedIpiId, kRetBHhiId,
+  kCloneId, kRetCloneId, kForkId, kRetForkId,
+  kFirstWaitId			// Then the 26 kWAIT_NAMES
+};
+
+std::vector<string> name_table;		// NameId => text
+NameIndex name_index;			// text => NameId
+
+// Return the id for this name, adding it if new
+NameId Intern(const char* name) {
+  NameIndex::const_iterator it = name_index.find(name);
+  if (it != name_index.end()) {return it->second;}
+  NameId id = name_table.size();
+  name_table.push_back(string(name));
+  name_index[name_table.back()] = id;
+  return id;
+}
+
+NameId Intern(const string& name) {return Intern(name.c_str());}
+
+inline const string& NameString(NameId id) {return name_table[id];}
+
+// Names made from another name: the return name of a call and back, and the
+// lock contended/held span names. Each is built once per base name and kind,
+// then found by id, so the per-event paths allocate nothing.
+static const int kRetName = 0;		// "/" + name
+static const int kCallName = 1;		// name without its leading "/"
+static const int kLockTryName = 2;	// "~" + name less its try_ acq_ rel_
+static const int kLockHeldName = 3;	// "=" + name less its try_ acq_ rel_
+static const int kDerivedKinds = 4;
+static const NameId kNotDerived = ~0u;
+std::vector<NameId> derived_names;	// (id * kDerivedKinds + kind) => NameId
+
+NameId DerivedName(NameId id, int kind) {
+  uint64 k = (uint64)id * kDerivedKinds + kind;
+  if (derived_names.size() <= k) {derived_names.resize(name_table.size() * kDerivedKinds, kNotDerived);}
+  if (derived_names[k] != kNotDerived) {return derived_names[k];}
+  string text;
+  switch (kind) {
+  case kRetName: text = "/" + NameString(id); break;
+  case kCallName: text = NameString(id).substr(1); break;
+  case kLockTryName: text = "~" + NameString(id).substr(4); break;
+  default: text = "=" + NameString(id).substr(4); break;
+  }
+  NameId derived = Intern(text);
+  derived_names[k] = derived;	// Intern may have grown name_table, but not derived_names
+  return derived;
+}
+
+// Put in the fixed names, once
+void InitNames() {
+  if (!name_table.empty()) {return;}
+  for (int i = 0; i < sizeof(kFixedNames) / sizeof(kFixedNames[0]); ++i) {Intern(kFixedNames[i]);}
+  for (int i = 0; i < 26; ++i) {Intern(kWAIT_NAMES[i]);}
+}
+
+
 // Per-PID short stack of events to return to.
 // These are saved/restored when a thread, i.e. pid, is context switched out
 // and later starts running again, possibly on another CPU.
@@ -279,7 +365,7 @@ typedef struct {
   int dequeue_num_pending;	// For piecing together RPC waiting in a queue (-1 = inactive)
   int top;		        // Top of our small stack
   int eventnum[5];		// One or more event numbers that are stacked calls
-  string name[5];		// One or more event names that are stacked calls
+  NameId name[5];		// One or more event names that are stacked calls
 } PidState;
 
 
@@ -310,7 +396,7 @@ typedef struct {
   int arg;
   int retval;
   int ipc;
-  string name;
+  NameId name;
 } OneSpan;
 
 
@@ -385,20 +471,23 @@ typedef struct {
 //
 // Globals across all CPUs
 //
-typedef map<int, PidState> PerPidState;	// State of each suspended task, by PID
+// The tables looked up on every context switch, wakeup, lock, and packet event
+// are open-addressing hash tables; none of them is ever walked in key order
+typedef FlatHashMap<int, PidState> PerPidState;	// State of each suspended task, by PID
 typedef map<int, char> WaitReason;	// Per-CPU reason for a wait for its next process after idle
 typedef map<int, string> IntName;	// Name for each PID/lock/method
-typedef map<int, OneSpan> PidWakeup;	// Previous wakeup event, by PID
-typedef map<int, uint64> PidTime;	// Previous per-PID timestamp (span end, kernel-seen packet)
+typedef FlatHashMap<int, OneSpan> PidWakeup;	// Previous wakeup event, by PID
+typedef FlatHashMap<int, uint64> PidTime;	// Previous per-PID timestamp (span end, kernel-seen packet)
 typedef map<int, uint> CpuTarg;		// Previous per-PID lock hash number
-typedef map<int, uint> PidLock;		// Previous per-PID lock hash number
-typedef map<int, uint> PidHash32;	// Previous per-PID pending user packet hash number
-typedef map<int, bool> PidRunning;	// Set of currently-running PIDs
-typedef map<uint64, LockContend> LockPending;	// Previous lock try&fail event, by lockhash&pid
+typedef FlatHashMap<int, uint> PidLock;		// Previous per-PID lock hash number
+typedef FlatHashMap<int, uint> PidHash32;	// Previous per-PID pending user packet hash number
+typedef FlatHashMap<int, bool> PidRunning;	// Set of currently-running PIDs
+typedef FlatHashMap<uint64, LockContend> LockPending;	// Previous lock try&fail event, by lockhash&pid
 						// Multiple threads can be wanting the same lock
-typedef map<uint32, PidCorr> PidToCorr;		// pid to <timestamp, rpcid, len>
-typedef map<uint32, HashCorr> HashToCorr;	// hash32 to <timestamp, pid>
-typedef map<uint32, uint64> RpcQueuetime;	// rpcid to enqueue timestamp
+typedef FlatHashMap<uint32, PidCorr> PidToCorr;		// pid to <timestamp, rpcid, len>
+typedef FlatHashMap<uint32, HashCorr> HashToCorr;	// hash32 to <timestamp, pid>
+typedef FlatHashMap<uint32, uint64> RpcQueuetime;	// rpcid to enqueue timestamp
+typedef FlatHashMap<int, NameId> PidNameIds;	// Interned user thread name, by PID
 
 
 // RPC-to-packet correlation
@@ -536,6 +625,11 @@ static const HashCorr inithashcorr = {0, 0};
 bool verbose = false;
 bool trace = false;
 bool rel0 = false;
+bool binary_in = false;		// Input is EventRecords, not text lines
+FILE* span_out = NULL;		// The json header lines go here; debug output stays on stdout
+std::vector<OneSpan> new_spans;	// Spans finished since the last scan, for the reorder buffer
+FILE* json_out = stdout;	// Sorted json from the reorder buffer goes here
+SpanStoreWriter* span_store = NULL;	// -spans: sorted spans go here instead of json_out
 bool is_rpi = false;		// True for Raspberry Pi
 bool is_low_res_ts = false;	// True for Riscv u74
 
@@ -553,6 +647,7 @@ IntName pidnames;		  // Current name for each PID, by pid#
 				  //   Changes over time if execve and the like
 IntName pidrownames;		  // Collected names for each PID (clone, execve, etc. rename a thread), by pid#
 				  //   Accumulates names in order over time
+PidNameIds pidnameids;		  // Interned NameAppendPid(pidnames[pid], pid), by pid#
 WaitReason pendingWait;		  // Per-CPU reason next process was waiting, for monitor-store
 PidWakeup pendingWakeup;	  // Any pending wakeup event, to make arc from wakeup to running [PID]
 PidWakeup pendingIPI;	 	  // Any pending IPI event, to make arc from sender to target CPU [cpu]
@@ -832,10 +927,10 @@ bool IsOptimizedCall(const OneSpan& event) {  // Must be a call already
 bool IsNewRunnablePidSyscall(const OneSpan& event) {
   if (!IsACallOrReturn(event)) {return false;}
   if (!IsASyscallOrReturn(event)) {return false;}
-  if (event.name == "clone") {return true;}
-  if (event.name == "/clone") {return true;}
-  if (event.name == "fork") {return true;}
-  if (event.name == "/fork") {return true;}
+  if (event.name == kCloneId) {return true;}
+  if (event.name == kRetCloneId) {return true;}
+  if (event.name == kForkId) {return true;}
+  if (event.name == kRetForkId) {return true;}
   return false;
 }
 
@@ -939,6 +1034,15 @@ string NameAppendPid(string name, int pid) {
   return name + "." + IntToString(pid);
 }
 
+// Interned NameAppendPid(pidnames[pid], pid), kept until the PID's name changes
+NameId PidNameId(int pid) {
+  PidNameIds::const_iterator it = pidnameids.find(pid);
+  if (it != pidnameids.end()) {return it->second;}
+  NameId id = Intern(NameAppendPid(pidnames[pid], pid));
+  pidnameids[pid] = id;
+  return id;
+}
+
 // Initially empty stack of -idle- running on this thread
 void InitPidState(PidState* t) {
   t->ambiguous = 0;
@@ -948,12 +1052,11 @@ void InitPidState(PidState* t) {
   t->top = 0;
   for (int i = 0; i < 5; ++i) {
     t->eventnum[i] = event_idle;
-    t->name[i].clear();
-    t->name[i] = string(kIdleName);
+    t->name[i] = kIdleId;
   }
 }
 
-void BrandNewPid(int newpid, const string& newname, PerPidState* perPidState) {
+void BrandNewPid(int newpid, NameId newname, PerPidState* perPidState) {
   PidState temp;
   InitPidState(&temp);
   temp.top = 1;
@@ -961,10 +1064,10 @@ void BrandNewPid(int newpid, const string& newname, PerPidState* perPidState) {
   temp.name[0] = newname;
   // Use current name, not the possibly-bad one from rawtoevent
   if (pidnames.find(newpid) != pidnames.end()) {
-    temp.name[0] = NameAppendPid(pidnames[newpid], newpid);
+    temp.name[0] = PidNameId(newpid);
   }
   temp.eventnum[1] = sched_syscall;
-  temp.name[1] = "-sched-";
+  temp.name[1] = kSchedId;
   (*perPidState)[newpid] = temp;
 }
 
@@ -982,7 +1085,7 @@ void InitSpan(OneSpan* s, int i) {
   // s->arg = 0;	// idle(0) regular; idle(1) low-power after mwait
   // s->retval = 0;
   // s->ipc = 0;
-  s->name = kIdleName;
+  s->name = kIdleId;
 }
 
 // Example:
@@ -997,17 +1100,17 @@ void InitSpan(OneSpan* s, int i) {
 void DumpSpan(FILE* f, const char* label, const OneSpan* span) {
   fprintf(f, "%s <%llu %llu %d  %d %d %d %d %d %d %s>\n",
   label, span->start_ts, span->duration, span->cpu,
-  span->pid, span->rpcid, span->eventnum, span->arg, span->retval, span->ipc, span->name.c_str());
+  span->pid, span->rpcid, span->eventnum, span->arg, span->retval, span->ipc, NameString(span->name).c_str());
 }
 
 void DumpSpanShort(FILE* f,  const OneSpan* span) {
-  fprintf(f, "<%llu %llu ... %s> ", span->start_ts, span->duration, span->name.c_str());
+  fprintf(f, "<%llu %llu ... %s> ", span->start_ts, span->duration, NameString(span->name).c_str());
 }
 
 void DumpStack(FILE* f, const char* label, const PidState* stack) {
   fprintf(f, "%s [%d] %d %d {\n", label, stack->top, stack->ambiguous, stack->rpcid);
   for (int i = 0; i < 5; ++i) {
-    fprintf(f, "  [%d] %05x %s\n",i, stack->eventnum[i], stack->name[i].c_str());
+    fprintf(f, "  [%d] %05x %s\n",i, stack->eventnum[i], NameString(stack->name[i]).c_str());
   }
   fprintf(f, "}\n");
 }
@@ -1015,7 +1118,7 @@ void DumpStack(FILE* f, const char* label, const PidState* stack) {
 void DumpStackShort(FILE* f, const PidState* stack) {
   fprintf(f, "%d{", stack->top);
   for (int i = 0; i <= stack->top; ++i) {
-    fprintf(f, "%s ", stack->name[i].c_str());
+    fprintf(f, "%s ", NameString(stack->name[i]).c_str());
   }
   fprintf(f, "}%s %d ", stack->ambiguous ? "ambig" : "", stack->rpcid);
 }
@@ -1023,7 +1126,8 @@ void DumpStackShort(FILE* f, const PidState* stack) {
 void DumpEvent(FILE* f, const char* label, const OneSpan& event) {
   fprintf(f, "%s [%llu %llu %d  %d %d %d %d %d %d %s]\n",
   label, event.start_ts, event.duration, event.cpu,
-  event.pid, event.rpcid, event.eventnum, event.arg, event.retval, event.ipc, event.name.c_str());
+  event.pid, event.rpcid, event.eventnum, event.arg, event.retval, event.ipc,
+  NameString(event.name).c_str());
 }
 
 
@@ -1163,7 +1267,7 @@ void MakeArcSpan(const OneSpan& event1, const OneSpan& event2, OneSpan* span) {
   span->arg = event2.cpu;
   span->retval = event2.pid;	// Added 2020.08.20
   span->ipc = 0;
-  span->name = "-wakeup-";
+  span->name = kWakeupId;
 }
 
 void MakeIPISpan(const OneSpan& event1, const OneSpan& event2, OneSpan* span) {
@@ -1177,7 +1281,7 @@ void MakeIPISpan(const OneSpan& event1, const OneSpan& event2, OneSpan* span) {
   span->arg = event2.cpu;
   span->retval = 0;
   span->ipc = 0;
-  span->name = "-ipi-";
+  span->name = kIpiId;
 }
 
 // Waiting on reason c from event1 to event2. For PID or RPC, not on any CPU
@@ -1205,12 +1309,12 @@ void MakeWaitSpan(char letter, uint64 start_ts, uint64 end_ts, int pid, int rpci
   span->arg = 0;
   span->retval = 0;
   span->ipc = 0;
-  span->name = kWAIT_NAMES[letter - 'a'];
+  span->name = kFirstWaitId + (letter - 'a');	// kWAIT_NAMES[letter - 'a']
 }
 
 // For PID only; not CPU- or RPC-specific
 void MakeLockSpan(bool dots, uint64 start_ts, uint64 end_ts, int pid,
-                  int lockhash, const string& lockname, OneSpan* span) {
+                  int lockhash, NameId lockname, OneSpan* span) {
   span->start_ts = start_ts;
   span->duration = end_ts - start_ts;
   span->cpu = -1;
@@ -1238,7 +1342,7 @@ void MakeRpcidMidSpan(uint64 start_ts, int cpu, int pid, int rpcid, OneSpan* spa
   span->arg = rpcid;
   span->retval = 0;
   span->ipc = 0;
-  span->name = string(rpc_name);
+  span->name = Intern(rpc_name);
 }
 
 // To insert just after dequeuing an RPC
@@ -1253,7 +1357,7 @@ void MakeQueuedSpan(uint64 start_ts, uint64 end_ts, int queue_num, int rpcid, On
   span->arg = queue_num;
   span->retval = 0;
   span->ipc = 0;
-  span->name = string(queuenames[queue_num]);
+  span->name = Intern(queuenames[queue_num]);
 }
 
 
@@ -1262,7 +1366,7 @@ void MakeQueuedSpan(uint64 start_ts, uint64 end_ts, int queue_num, int rpcid, On
 void CexitBackToIdle(OneSpan* span) {
   if (span->eventnum != event_c_exit) {return;}
   span->eventnum = event_idle;
-  span->name = string(kIdleName);
+  span->name = kIdleId;
 //fprintf(stdout, "CexitBackToIdle at %llu\n", span->start_ts);
 }
 
@@ -1270,10 +1374,10 @@ void CexitBackToIdle(OneSpan* span) {
 void CheckSpan(const char* label, const CPUState* thiscpu) {
   bool fail = false;
   const OneSpan* span = &thiscpu->cur_span;
-  if ((span->name == string(kIdleName)) &&
+  if ((span->name == kIdleId) &&
       (span->eventnum != event_idle)) {fail = true;}
   for (int i = 0; i < 5; ++i) {
-    if ((thiscpu->cpu_stack.name[i] == string(kIdleName)) &&
+    if ((thiscpu->cpu_stack.name[i] == kIdleId) &&
         (thiscpu->cpu_stack.eventnum[i] != event_idle)) {fail = true;}
   }
   if (fail) {
@@ -1288,23 +1392,18 @@ void CheckSpan(const char* label, const CPUState* thiscpu) {
 // Change time from multiples of 10ns to seconds
 // ts           dur       CPU tid  rpc event arg0 ret  name
 // Make time stamp ts 12.8 so fixed width for later text sort
-void WriteSpanJson2(FILE* f, const OneSpan* span) {
+void WriteSpanJson2(const OneSpan* span) {
   if (span->start_ts == 0) {return;}       // Front of trace for each CPU
   if (span->duration > kMAX_PLAUSIBLE_DURATION) {return;}  // More than 8 sec in 10ns increments
 
   // Output
   // time dur cpu pid rpcid event arg retval ipc name
   // Change time from multiples of 10 nsec to seconds and fraction
-  double ts_sec = span->start_ts / 100000000.0;
   double dur_sec = span->duration / 100000000.0;
 //CHECK("f", *span);
-  //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],",
-          ts_sec, dur_sec, span->cpu,
-          span->pid, span->rpcid, span->eventnum,
-          span->arg, span->retval, span->ipc, span->name.c_str());
+  // The line is formatted when the reorder buffer writes it
+  new_spans.push_back(*span);
   ++span_count;
-  fprintf(f, "\n");
 
   // Stastics
   if (IsUserExecNonidlenum(span->eventnum)) {
@@ -1318,21 +1417,14 @@ void WriteSpanJson2(FILE* f, const OneSpan* span) {
   }
 }
 
-void WriteSpanJson(FILE* f, const CPUState* thiscpu) {
-  WriteSpanJson2(f, &thiscpu->cur_span);
+void WriteSpanJson(const CPUState* thiscpu) {
+  WriteSpanJson2(&thiscpu->cur_span);
 }
 
 // Write a point event, so they aren't lost
-// Change time from multiples of 10 nsec to seconds and fraction
-void WriteEventJson(FILE* f, const OneSpan* event) {
-  double ts_sec = event->start_ts / 100000000.0;
-  double dur_sec = event->duration / 100000000.0;
+void WriteEventJson(const OneSpan* event) {
 //CHECK("g", *event);
-  //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n",
-          ts_sec, dur_sec, event->cpu,
-          event->pid, event->rpcid, event->eventnum,
-          event->arg, event->retval, event->ipc, event->name.c_str());
+  new_spans.push_back(*event);
   ++span_count;
 }
 
@@ -1442,7 +1534,7 @@ fprintf(stdout,"AdjustStackForPush FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 0) {break;}
 if (verbose) fprintf(stdout, "-%d  dummy return from %s\n",
-event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
+event.cpu, NameString(thiscpu->cpu_stack.name[thiscpu->cpu_stack.top]).c_str());
     --thiscpu->cpu_stack.top;
   }
 }
@@ -1452,10 +1544,10 @@ void AdjustStackForPop(const OneSpan& event, CPUState* thiscpu) {
   if (thiscpu->cpu_stack.top == 0) {
 fprintf(stdout,"AdjustStackForPop FAIL\n");
     // Trying to return above user mode. Push a dummy syscall
-if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, event.name.c_str());
+if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, NameString(event.name).c_str());
     ++thiscpu->cpu_stack.top;
     thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top] = dummy_syscall;
-    thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = string("-dummy-");
+    thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = kDummyId;
   }
   // If returning from something lower nesting than top of stack,
   // pop the stack for a match.
@@ -1466,7 +1558,7 @@ fprintf(stdout,"AdjustStackForPop FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 1) {break;}
 if (verbose) fprintf(stdout, "-%d  dummy return from %s\n",
-event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
+event.cpu, NameString(thiscpu->cpu_stack.name[thiscpu->cpu_stack.top]).c_str());
     --thiscpu->cpu_stack.top;
   }
 }
@@ -1482,7 +1574,7 @@ string AppendPid(const string& name, uint64 pid) {
 }
 
 string EventNamePlusPid(const OneSpan& event) {
-  return AppendPid(event.name, event.pid);
+  return AppendPid(NameString(event.name), event.pid);
 }
 
 void DumpShort(FILE* f, const CPUState* thiscpu) {
@@ -1581,7 +1673,7 @@ void WaitBeforeWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* per
 
   // The name of the routine doing this wakeup determines what the blocked  
   // thread was waiting for.
-  char letter = FindWaitReason(event.start_ts, stack->name[stack->top]);
+  char letter = FindWaitReason(event.start_ts, NameString(stack->name[stack->top]));
   
   // But if a pending monitor-store for our CPU, the reason is in pendingWait.
   if ((letter == ' ') && (pendingWait.find(event.cpu) != pendingWait.end())) {
@@ -1600,7 +1692,7 @@ void WaitBeforeWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* per
 
     // Don't clutter if the waiting is short (say < 10 usec)
     if (thiscpu->cur_span.duration >= kMIN_WAIT_DURATION) {
-      WriteSpanJson(stdout, thiscpu);	// Standalone wait_cpu span
+      WriteSpanJson(thiscpu);	// Standalone wait_cpu span
     }
     thiscpu->cur_span = temp_span;		// Restore
   }
@@ -1638,7 +1730,7 @@ void DoIPI(const OneSpan& event, CPUState* cpustate, PerPidState* perpidstate) {
   // to run, so no reason for waiting. The code here saves the reason at
   // the monitor-store, for later retreival by the idle thread.
   if (event.eventnum == KUTRACE_MONITORSTORE) {
-    char letter = FindWaitReason(event.start_ts, stack->name[stack->top]);
+    char letter = FindWaitReason(event.start_ts, NameString(stack->name[stack->top]));
     pendingWait[target_cpu] = letter;
 //// VERYTEMP
 //fprintf(stdout, "  %lld Saved pendingWait[%d] '%c'\n", event.start_ts, event.cpu, letter);
@@ -1648,7 +1740,7 @@ void DoIPI(const OneSpan& event, CPUState* cpustate, PerPidState* perpidstate) {
   pendingIPI[target_cpu] = event;
 }
 
-void SwapStacks(int oldpid, int newpid, const string& name, CPUState* thiscpu, PerPidState* perpidstate) {
+void SwapStacks(int oldpid, int newpid, NameId name, CPUState* thiscpu, PerPidState* perpidstate) {
   if (oldpid == newpid) {return;}
 
   // Swap out the old thread's stack, but don't change the idle stack
@@ -1685,7 +1777,7 @@ void FixupAmbiguousSpan(const OneSpan& event,
 
 if (verbose) {
 DumpStackShort(stdout, &thiscpu->cpu_stack);
-fprintf(stdout, " ===ambiguous at %s :\n", event.name.c_str());
+fprintf(stdout, " ===ambiguous at %s :\n", NameString(event.name).c_str());
 }
   if (OnlyInKernelMode(event)) {
     thiscpu->cpu_stack.ambiguous = 0;
@@ -1723,8 +1815,8 @@ void WriteFreqSpan(uint64 start_ts, uint64 end_ts, uint64 cpu, uint64 freq) {
   event.arg = freq;
   event.retval = 0;
   event.ipc = 0;
-  event.name = string("-freq-");
-  WriteEventJson(stdout, &event);
+  event.name = kFreqId;
+  WriteEventJson(&event);
 }
 
 
@@ -1744,7 +1836,7 @@ void ProcessEvent(const OneSpan& event,
   if (verbose) {
     fprintf(stdout, "zz[%d] %llu %llu %03x(%d)=%d %s ",
           event.cpu, event.start_ts, event.duration,
-          event.eventnum, event.arg, event.retval, event.name.c_str());
+          event.eventnum, event.arg, event.retval, NameString(event.name).c_str());
     DumpEvent(stdout, "", event);
     DumpShort(stdout, &cpustate[event.cpu]);
   }
@@ -1771,7 +1863,7 @@ void ProcessEvent(const OneSpan& event,
     if (thiscpu->cpu_stack.rpcid != 0) {
       OneSpan temp_span;
       MakeRpcidMidSpan(event.start_ts, event.cpu, event.pid, thiscpu->cpu_stack.rpcid, &temp_span);
-      WriteSpanJson2(stdout, &temp_span);
+      WriteSpanJson2(&temp_span);
     }
   }
 
@@ -1790,9 +1882,9 @@ void ProcessEvent(const OneSpan& event,
     if (thiscpu->valid_span) {
       // Prior span stops here 					--------^^^^^^^^
       FinishSpan(event, &thiscpu->cur_span);
-      WriteSpanJson(stdout, thiscpu);	// Previous span
+      WriteSpanJson(thiscpu);	// Previous span
     }
-    WriteEventJson(stdout, &event);	// Standalone mark
+    WriteEventJson(&event);	// Standalone mark
 
 // This is looking just like IsAMark
 // Just update the still-open span start
@@ -1825,7 +1917,7 @@ if (verbose) DumpStackShort(stdout, &thiscpu->cpu_stack);
       // Scheduler entered from within a kernel routine
       // stack such as: 2{mystery25.3950 read -sched- }0
       // Record the subscript of the ambiguous stack entry just before -sched-
-if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", event.name.c_str());
+if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", NameString(event.name).c_str());
       thiscpu->cpu_stack.ambiguous = thiscpu->cpu_stack.top - 1;
     }
 
@@ -1842,7 +1934,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Turn context switch event into a user-mode-execution event at top of stack
     thiscpu->cpu_stack.eventnum[0] = PidToEventnum(event.pid);
     ////sthiscpu->cpu_stack.name[0] = EventNamePlusPid(event);
-    thiscpu->cpu_stack.name[0] = NameAppendPid(pidnames[event.pid], event.pid);
+    thiscpu->cpu_stack.name[0] = PidNameId(event.pid);
 
     // And also update the current span if we are at top
     if (thiscpu->cpu_stack.top == 0) {
@@ -1866,7 +1958,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       OneSpan event1 = event;
       event1.start_ts = thiscpu->prior_pc_samp_ts;
       event1.duration = event.start_ts - event1.start_ts;
-      WriteEventJson(stdout, &event1);
+      WriteEventJson(&event1);
     }
     thiscpu->prior_pc_samp_ts = event.start_ts;
     return;
@@ -1921,9 +2013,9 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     if (thiscpu->valid_span) {
       // Prior span stops here 					--------^^^^^^^^
       FinishSpan(event, &thiscpu->cur_span);
-      WriteSpanJson(stdout, thiscpu);	// Previous span
+      WriteSpanJson(thiscpu);	// Previous span
     }
-    WriteEventJson(stdout, &event);	// Standalone mark/mwait/etc.
+    WriteEventJson(&event);	// Standalone mark/mwait/etc.
     // Continue what we were doing, with new start_ts
     thiscpu->cur_span.start_ts = event.start_ts + event.duration;
 
@@ -1931,14 +2023,14 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     if (IsAnMwait(event)) {
       thiscpu->mwait_pending = event.arg;
       thiscpu->cur_span.arg = 1;	// Mark continuing idle as low-power
-      thiscpu->cur_span.name = kIdlelpName;
+      thiscpu->cur_span.name = kIdlelpId;
     }
     // No mwait pending , back to regular idle
     if (IsAnMwaitExit(event)) {
       // We want to insert a c-exit span here
       thiscpu->mwait_pending = -1;
       thiscpu->cur_span.arg = 0;	// Mark continuing idle as regular
-      thiscpu->cur_span.name = kIdlelpName;
+      thiscpu->cur_span.name = kIdlelpId;
     }
 
     return;
@@ -1948,7 +2040,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   
   } else if (IsAPointEvent(event)) {	// Marks do not end up here due to test just above
  
-    WriteEventJson(stdout, &event);	// Standalone point event
+    WriteEventJson(&event);	// Standalone point event
 
 // Things that can happen in the trace
 // 1) CPU A releases lock, spinning CPU B acquires it immediately, produces ACQ trace entry, then A produces REL entry 10-20ns later
@@ -1987,11 +2079,11 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
         // Ignore contention < 250ns
         if  (25 <= (end_ts - start_ts)) {
           bool dots = true;
-          string lockname = "~" + event.name.substr(4);	// Remove try_ acq_ rel_
+          NameId lockname = DerivedName(event.name, kLockTryName);	// Remove try_ acq_ rel_
           OneSpan temp_span;
           MakeLockSpan(dots, start_ts, end_ts, event.pid,
                        lockhash, lockname, &temp_span);
-          WriteSpanJson2(stdout, &temp_span);
+          WriteSpanJson2(&temp_span);
         }
       }
       // Remember that this PID now holds this lock
@@ -2014,11 +2106,11 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
         // Ignore contention < 250ns
         if (25 <= (end_ts - start_ts)) {
           bool dots = false;
-          string lockname = "=" + event.name.substr(4);	// Remove try_ acq_ rel_
+          NameId lockname = DerivedName(event.name, kLockHeldName);	// Remove try_ acq_ rel_
           OneSpan temp_span;
           MakeLockSpan(dots, start_ts, end_ts, event.pid,
                        lockhash, lockname, &temp_span);
-          WriteSpanJson2(stdout, &temp_span);
+          WriteSpanJson2(&temp_span);
         }
       }
       // This PID is no longer interested in the lock
@@ -2055,7 +2147,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Suppress idle spans of length zero or exactly 10ns
     bool suppress = ((thiscpu->cur_span.duration <= 1) && 
                      IsAnIdlenum(thiscpu->cur_span.eventnum));
-    if (!suppress) {WriteSpanJson(stdout, thiscpu);}	// Previous span
+    if (!suppress) {WriteSpanJson(thiscpu);}	// Previous span
   }
 
   // Connect wakeup event to new span if the PID matches
@@ -2064,7 +2156,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Make a wakeup arc
     OneSpan temp_span = thiscpu->cur_span;	// Save
     MakeArcSpan(pendingWakeup[event.pid], event, &thiscpu->cur_span);
-    WriteSpanJson(stdout, thiscpu);	// Standalone arc span
+    WriteSpanJson(thiscpu);	// Standalone arc span
     // Consume the pending wakeup
     pendingWakeup.erase(event.pid);
     thiscpu->cur_span = temp_span;		// Restore
@@ -2078,7 +2170,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     OneSpan temp_span = thiscpu->cur_span;	// Save
     MakeIPISpan(pendingIPI[event.cpu], event, &thiscpu->cur_span);
     ////DumpSpan(stdout, "IPIspan", &thiscpu->cur_span);
-    WriteSpanJson(stdout, thiscpu);	// Standalone arc span
+    WriteSpanJson(thiscpu);	// Standalone arc span
     // Consume the pending IPI
     pendingIPI.erase(event.cpu);
     thiscpu->cur_span = temp_span;		// Restore
@@ -2095,7 +2187,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     priorPidEnd[event.pid] = event.start_ts + event.duration;
     // Don't clutter if the waiting is short (say < 10 usec)
     if (thiscpu->cur_span.duration >= kMIN_WAIT_DURATION) {
-      WriteSpanJson(stdout, thiscpu);	// Standalone wait_cpu span
+      WriteSpanJson(thiscpu);	// Standalone wait_cpu span
     }
     thiscpu->cur_span = temp_span;		// Restore
   }
@@ -2116,7 +2208,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       thiscpu->cur_span.duration = event.duration;
       // Note: Optimized call/ret, prior span ipc in ipc<3:0>, current span in ipc<7:4>
       thiscpu->cur_span.ipc = (event.ipc >> 4) & ipc_mask;
-      WriteSpanJson(stdout, thiscpu);	// Standalone call-return span
+      WriteSpanJson(thiscpu);	// Standalone call-return span
       // Continue what we were doing, with new start_ts
       thiscpu->cur_span = oldspan;
       thiscpu->cur_span.start_ts = event.start_ts + event.duration;
@@ -2149,7 +2241,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   } else {
     // c-exit and other synthesized items
     // Make it a standalone span and go back to what was running
-    WriteEventJson(stdout, &event);
+    WriteEventJson(&event);
     // Continue what we were doing, with new start_ts
     StartSpan(event, &thiscpu->cur_span);  // New start 	--------vvvvvvvv
     thiscpu->valid_span = true;
@@ -2174,8 +2266,8 @@ void InsertEvent(const OneSpan& event,
 int CallToRet(int eventnum) {return eventnum | ret_mask;}
 int RetToCall(int eventnum) {return eventnum & ~ret_mask;}
 
-string CallnameToRetname(string name) {return "/" + name;}	// Add '/'
-string RetnameToCallname(string name) {return name.substr(1);}  // Remove '/'
+NameId CallnameToRetname(NameId name) {return DerivedName(name, kRetName);}	// Add '/'
+NameId RetnameToCallname(NameId name) {return DerivedName(name, kCallName);}  // Remove '/'
 
 // Insert a dummy return at ts from TOS
 void InsertReturnAt(uint64 ts,
@@ -2257,8 +2349,8 @@ bool FixupReturn(uint64 new_start_ts,
   if (thiscpu_stack->eventnum[thiscpu_stack->top] == matching_callnum) {return true;}
 
   // If TOS = reschedule_ipi and this = /BH:hi, let it match
-  if ((thiscpu_stack->name[thiscpu_stack->top] == "reschedule_ipi") &&
-      (event.name == "/BH:hi")) {return true;}
+  if ((thiscpu_stack->name[thiscpu_stack->top] == kReschedIpiId) &&
+      (event.name == kRetBHhiId)) {return true;}
 
   bool callfound = false;
   for (int i = 1; i <= thiscpu_stack->top; ++i) {
@@ -2314,7 +2406,7 @@ bool FixupResched(uint64 ts,
                  PerPidState* perpidstate) {
   CPUState* thiscpu = &cpustate[event.cpu];
   PidState* thiscpu_stack = &thiscpu->cpu_stack;
-  if (thiscpu_stack->name[thiscpu_stack->top] == "reschedule_ipi") {
+  if (thiscpu_stack->name[thiscpu_stack->top] == kReschedIpiId) {
     --thiscpu_stack->top;
   }
   return true;
@@ -2396,13 +2488,13 @@ bool FixupCexit(uint64 new_start_ts,
   newevent.arg = 0;
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = "-c-exit-";
+  newevent.name = kCexitId;
   // Inserting the c-exit shortens the pending low-power idle
   InsertEvent(newevent, cpustate, perpidstate);
 
   // After the c-exit, we are no longer low power
   thiscpu->cur_span.arg = 0;	// Mark continuing idle as normal power
-  thiscpu->cur_span.name = kIdleName;
+  thiscpu->cur_span.name = kIdleId;
 
   return true;
 }
@@ -2428,7 +2520,7 @@ bool FixupRunnable(uint64 new_start_ts,
   newevent.arg = event.retval;	// The target of clone/fork/etc.
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = "runnable";
+  newevent.name = kRunnableId;
   InsertEvent(newevent, cpustate, perpidstate);
   return true;
 }
@@ -2464,7 +2556,7 @@ bool EmitRxTxMsg(const PidCorr& corr, CPUState* cpustate, PerPidState* perpidsta
   newevent.arg = msg_len;
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = string(msg_name);
+  newevent.name = Intern(msg_name);
 //DumpEvent(stderr, "EmitRxTxMsg:", newevent);
   InsertEvent(newevent, cpustate, perpidstate);
   return true;
@@ -2616,7 +2708,7 @@ void PreProcessEvent(const OneSpan& event,
       thiscpu->cpu_stack.dequeue_num_pending = -1;
       // Don't clutter if the queued waiting is short (say < 10 usec)
       if (temp_span.duration >= kMIN_WAIT_DURATION) {
-        WriteSpanJson2(stdout, &temp_span);	// Standalone queued span
+        WriteSpanJson2(&temp_span);	// Standalone queued span
       }
     }
   }
@@ -2751,6 +2843,7 @@ void RecordPidName(int64 temp_ts, int temp_arg,
   // temp_arg might be an event number, pid + 0x10000. If so, covert it to a PID number
   temp_arg = EventnumToPid(temp_arg);
   if (temp_arg == pid_idle) {return;}			// Never update idle name
+  pidnameids.erase(temp_arg);				// Name may be changing
 
   string temp_name_str = string(temp_name);
   // Turn "./kutrace_contro" into "kutrace_control"
@@ -2783,9 +2876,9 @@ void RecordPidName(int64 temp_ts, int temp_arg,
   // Update this name on any pending CPU stack
   for (int cpu = 0; cpu <= max_cpu_seen; ++cpu) {
     if(cpustatep[cpu].cpu_stack.eventnum[0] ==  PidToEventnum(temp_arg)) {
-      cpustatep[cpu].cpu_stack.name[0] = NameAppendPid(temp_name_str, temp_arg);
+      cpustatep[cpu].cpu_stack.name[0] = PidNameId(temp_arg);
 //fprintf(stderr, "%lld cpu[%d] stack updated with %s\n", 
-//temp_ts, cpu, cpustatep[cpu].cpu_stack.name[0].c_str());
+//temp_ts, cpu, NameString(cpustatep[cpu].cpu_stack.name[0]).c_str());
     }
   }
 
@@ -2813,7 +2906,7 @@ void FixPidName(OneSpan* eventp) {
   int pid = EventnumToPid(eventp->eventnum);
   if (pidnames.find(pid) != pidnames.end()) {
 //fprintf(stdout, "    %s => %s\n", eventp->name.c_str(), NameAppendPid(pidnames[pid], pid).c_str());
-    eventp->name = NameAppendPid(pidnames[pid], pid);
+    eventp->name = PidNameId(pid);
     // Also update the stacked name for this pid
     // also update the span name for this pid
     //stack->name[0]
@@ -2824,7 +2917,7 @@ void FixPidName(OneSpan* eventp) {
 // For Raspberry PI, change mwait to wfi
 void FixMwaitName(OneSpan* eventp) {
   if (is_rpi && IsAnMwait(*eventp)) {
-    eventp->name = string("wfi");
+    eventp->name = kWfiId;
   }
 
 }
@@ -2869,11 +2962,388 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // If we encounter a not-allowed transition, we insert pops and pushes as needed
 // to make a correctly-nested set of time spans.
 
+// Span reconstruction state that the reorder buffer also looks at
+static std::vector<CPUState> cpustate;	// Running state for each CPU seen so far
+static uint64 lowest_ts = 0;
+
+//---------------------------------------------------------------------------//
+// Reorder buffer
+//
+// Spans are written as each one finishes, not in start-time order: the open
+// span on each CPU, a pending wakeup arc, a wait_* span back to when a PID
+// last ran, and the like all start before the current event. So each span is
+// held as its OneSpan in a min-heap, ordered the way its json line sorts as
+// text, and the line is only formatted when it is written. Every so often we
+// find the watermark, the earliest start time any span not yet written can
+// still have, and write the held spans that sort below it to json_out. The
+// output is then in the same order as LC_ALL=C sort of the unsorted lines,
+// without the second sort.
+//
+// Nothing is written until the heap holds kMaxHeldLines spans or the input
+// ends. The header lines (no leading '[') and mbit_sec go first, then a left
+// mark at the trace start for each multi-named PID joins the held spans. The
+// display names a PID row from the first span it sees for that PID, so these
+// must come before the rest.
+//
+// When the heap is full and the watermark lets none of it go, the whole heap
+// is spilled in order to a temporary file, and the held spans are from then
+// on the merge of the heap and those sorted runs. Nothing is written early.
 //
-// Usage: eventtospan3 <event file name> [-v] [-t]
+// A PID that only gets a second name after the header is written, a header
+// line that shows up after it, and a span older than the watermark scan looks
+// back (see SpanWatermark) can still sort before a line already written. These
+// are counted in late_lines and eventtospan3 exits with status 1, so the caller
+// can sort the output.
+//
+
+static const size_t kMaxHeldLines = 1 << 21;
+static const int64 kMinScanEvents = 1024;
+// Start times at or above this (1000 sec) are wider than 12 characters and
+// no longer sort the same as text
+static const uint64 kMaxSortedTenNsec = 100000000000llu;
+
+// Compare two times in multiples of 10 nsec the way their %<width>.8f text sorts
+inline int TenNsecTextCompare(uint64 a, uint64 b, int width) {
+  uint64 asec = a / 100000000;
+  uint64 bsec = b / 100000000;
+  int pad = width - 9;		// Integer digits that fit in width
+  int adigits = 1;
+  int bdigits = 1;
+  for (uint64 x = asec; x >= 10; x /= 10) {++adigits;}
+  for (uint64 x = bsec; x >= 10; x /= 10) {++bdigits;}
+  int alen = (adigits < pad) ? pad : adigits;
+  int blen = (bdigits < pad) ? pad : bdigits;
+  if (alen == blen) {return (a == b) ? 0 : (a < b) ? -1 : 1;}
+  // Different widths. A padded one starts with a space, below any digit
+  if (adigits < pad) {return -1;}
+  if (bdigits < pad) {return 1;}
+  return TextNumberCompare(asec, bsec);
+}
+
+// Compare two names the way they sort at the end of a json line, followed by "],
+inline int NameTextCompare(const string& a, const string& b) {
+  static const char kTail[] = "\"],";
+  size_t alen = a.size();
+  size_t blen = b.size();
+  for (size_t i = 0; ; ++i) {
+    int ac = (i < alen) ? (uint8)a[i] : (i - alen < 3) ? kTail[i - alen] : -1;
+    int bc = (i < blen) ? (uint8)b[i] : (i - blen < 3) ? kTail[i - blen] : -1;
+    if (ac != bc) {return (ac < bc) ? -1 : 1;}
+    if (ac < 0) {return 0;}
+  }
+}
+
+// True if the json line for span a sorts before the one for b
+inline bool SpanLineLess(const OneSpan& a, const OneSpan& b) {
+  int c = TenNsecTextCompare(a.start_ts, b.start_ts, 12);
+  if (c == 0) {c = TenNsecTextCompare(a.duration, b.duration, 10);}
+  if (c == 0) {c = TextNumberCompare(a.cpu, b.cpu);}
+  if (c == 0) {c = TextNumberCompare(a.pid, b.pid);}
+  if (c == 0) {c = TextNumberCompare(a.rpcid, b.rpcid);}
+  if (c == 0) {c = TextNumberCompare(a.eventnum, b.eventnum);}
+  if (c == 0) {c = TextNumberCompare(a.arg, b.arg);}
+  if (c == 0) {c = TextNumberCompare(a.retval, b.retval);}
+  if (c == 0) {c = TextNumberCompare(a.ipc, b.ipc);}
+  if ((c == 0) && (a.name != b.name)) {c = NameTextCompare(NameString(a.name), NameString(b.name));}
+  return c < 0;
+}
+
+struct SpanLineGreater {
+  bool operator()(const OneSpan& a, const OneSpan& b) const {return SpanLineLess(b, a);}
+};
+
+typedef std::priority_queue<OneSpan, std::vector<OneSpan>, SpanLineGreater> SpanHeap;
+
+// The earliest span not yet read back from one spilled run
+typedef struct {
+  OneSpan span;
+  FILE* f;
+} SpillHead;
+
+struct SpillHeadGreater {
+  bool operator()(const SpillHead& a, const SpillHead& b) const {return SpanLineLess(b.span, a.span);}
+};
+
+typedef std::priority_queue<SpillHead, std::vector<SpillHead>, SpillHeadGreater> SpillHeap;
+
+static char* held_buf = NULL;		// span_out contents since the last scan
+static size_t held_buf_len = 0;
+static SpanHeap held_spans;		// Spans not yet written, earliest line on top
+static SpillHeap spilled_runs;		// Sorted runs of spans spilled to temporary files
+static std::vector<string> header_lines;
+static IntName held_rownames;		// Multi-named PID row names already held
+static bool header_written = false;
+static bool span_written = false;
+static OneSpan last_written;		// Latest span written
+static int64 events_to_scan = 0;	// Input events until the next scan
+uint64 late_lines = 0;			// Span lines that sort before one already written
+
+void StartReorder() {
+  span_out = open_memstream(&held_buf, &held_buf_len);
+  events_to_scan = kMinScanEvents;
+}
+
+// Write one header line to json_out, or keep it as text in the span store
+void PutLine(const string& line) {
+  if (span_store == NULL) {
+    fputs(line.c_str(), json_out);
+    fputc('\n', json_out);
+  } else {
+    AddSpanStoreText(span_store, line.c_str());
+  }
+}
+
+// Write one span as its json line, or add it to the span store
+void PutSpan(const OneSpan& span) {
+  const string& name = NameString(span.name);
+  if (span_store == NULL) {
+    //                      ts dur cpu  pid rpc event  arg ret ipc  name
+    WriteSpanLine(json_out, span.start_ts, span.duration, span.cpu,
+                  span.pid, span.rpcid, span.eventnum,
+                  span.arg, span.retval, span.ipc, name.c_str(), true);
+  } else {
+    AddSpan(span_store, span.start_ts, span.duration, span.cpu,
+            span.pid, span.rpcid, span.eventnum,
+            span.arg, span.retval, span.ipc, name);
+  }
+}
+
+// Move spans into the heap
+void HoldSpans(std::vector<OneSpan>* spans) {
+  for (size_t i = 0; i < spans->size(); ++i) {
+    const OneSpan& span = (*spans)[i];
+    if (span_written && SpanLineLess(span, last_written)) {++late_lines;}
+    held_spans.push(span);
+  }
+  spans->clear();
+}
+
+// Move the header lines written to span_out and the spans finished since the
+// last call into the reorder buffer. Header lines after the header is written
+// go straight out, late
+void CollectLines() {
+  fflush(span_out);
+  const char* p = held_buf;
+  const char* limit = held_buf + held_buf_len;
+  while (p < limit) {
+    const char* nl = (const char*)memchr(p, '\n', limit - p);
+    if (nl == NULL) {nl = limit;}
+    if (p < nl) {
+      string line(p, nl - p);
+      if (header_written) {
+        ++late_lines;
+        PutLine(line);
+      } else {
+        header_lines.push_back(line);
+      }
+    }
+    p = nl + 1;
+  }
+  // Reuse the same buffer
+  fseeko(span_out, 0, SEEK_SET);
+  HoldSpans(&new_spans);
+}
+
+// Hold a left mark at the trace start for each multi-named PID, giving the
+// name of its row. The names are all those the PID had, joined with +
+void HoldRowNames() {
+  std::vector<OneSpan> marks;
+  for (IntName::const_iterator it = pidrownames.begin(); it != pidrownames.end(); ++it) {
+    int pid = it->first;
+    const string& rowname = it->second;
+    if (rowname.find("+") == string::npos) {continue;}
+    if (held_rownames[pid] == rowname) {continue;}	// Already held
+    held_rownames[pid] = rowname;
+    char pidtext[16];
+    snprintf(pidtext, sizeof(pidtext), ".%d", pid);
+    OneSpan mark = {lowest_ts, 1, 0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, Intern(rowname + pidtext)};
+    marks.push_back(mark);
+  }
+  HoldSpans(&marks);
+}
+
+// The header lines sort in front of all the spans. Leading space is required.
+// mbit_sec goes in with them, as known by now. Then the row names join the
+// held spans
+void WriteHeader() {
+  char temp[64];
+  snprintf(temp, sizeof(temp), " \"mbit_sec\" : %d,", mbit_sec);
+  header_lines.push_back(string(temp));
+  std::sort(header_lines.begin(), header_lines.end());
+  for (size_t i = 0; i < header_lines.size(); ++i) {
+    PutLine(header_lines[i]);
+  }
+  header_lines.clear();
+  header_written = true;
+  HoldRowNames();
+}
+
+// Read the next span of a spilled run, or close it at the end
+void NextSpilled(FILE* f) {
+  SpillHead head;
+  head.f = f;
+  if (fread(&head.span, sizeof(OneSpan), 1, f) == 1) {
+    spilled_runs.push(head);
+  } else {
+    fclose(f);
+  }
+}
+
+// Move the whole heap, in order, to a new temporary file
+void SpillHeldSpans() {
+  FILE* f = tmpfile();
+  if (f == NULL) {
+    fprintf(stderr, "eventtospan3: no temporary file to spill spans to\n");
+    exit(0);
+  }
+  while (!held_spans.empty()) {
+    fwrite(&held_spans.top(), sizeof(OneSpan), 1, f);
+    held_spans.pop();
+  }
+  rewind(f);
+  NextSpilled(f);
+}
+
+bool HoldingSpans() {
+  return !held_spans.empty() || !spilled_runs.empty();
+}
+
+// True if the earliest held span is in the heap, not a spilled run
+bool EarliestInHeap() {
+  if (spilled_runs.empty()) {return true;}
+  if (held_spans.empty()) {return false;}
+  return SpanLineLess(held_spans.top(), spilled_runs.top().span);
+}
+
+// Start time of the earliest held span
+uint64 EarliestHeldTs() {
+  return EarliestInHeap() ? held_spans.top().start_ts : spilled_runs.top().span.start_ts;
+}
+
+// Write the earliest held span
+void WriteTopSpan() {
+  if (EarliestInHeap()) {
+    last_written = held_spans.top();
+    held_spans.pop();
+  } else {
+    SpillHead head = spilled_runs.top();
+    spilled_runs.pop();
+    last_written = head.span;
+    NextSpilled(head.f);
+  }
+  span_written = true;
+  PutSpan(last_written);
+}
+
+// Earliest start time, in multiples of 10 nsec, that any span not yet written
+// can have. Later input events all start at or after now.
+uint64 SpanWatermark(uint64 now) {
+  uint64 mark = now;
+  for (size_t cpu = 0; cpu < cpustate.size(); ++cpu) {
+    const CPUState* thiscpu = &cpustate[cpu];
+    // The open span, and fixups that insert events back at its start
+    if (thiscpu->valid_span) {mark = uint64min(mark, thiscpu->cur_span.start_ts);}
+    if (thiscpu->ctx_switch_ts != 0) {mark = uint64min(mark, thiscpu->ctx_switch_ts);}
+    // PC sample and frequency spans go back to the prior sample
+    if (thiscpu->prior_pc_samp_ts != 0) {mark = uint64min(mark, thiscpu->prior_pc_samp_ts);}
+    if (thiscpu->prior_pstate_ts != 0) {mark = uint64min(mark, thiscpu->prior_pstate_ts);}
+  }
+
+  // Pending per-PID, per-lock, and per-packet state can lie around forever.
+  // Spans from it end about now and wait_*, lock, and queued spans longer
+  // than kMAX_PLAUSIBLE_DURATION are dropped, so ignore anything older.
+  // An arc or packet message span that old is written late.
+  uint64 oldest = (now > kMAX_PLAUSIBLE_DURATION) ? now - kMAX_PLAUSIBLE_DURATION : 0;
+  priorPidEnd.ForEach([&](int pid, uint64 ts) {
+    if (oldest <= ts) {mark = uint64min(mark, ts);}
+  });
+  lockpending.ForEach([&](uint64 subscr, const LockContend& lockcontend) {
+    if (oldest <= lockcontend.start_ts) {mark = uint64min(mark, lockcontend.start_ts);}
+  });
+  enqueuetime.ForEach([&](uint32 rpcid, uint64 ts) {
+    if (oldest <= ts) {mark = uint64min(mark, ts);}
+  });
+  pendingWakeup.ForEach([&](int pid, const OneSpan& wakeup) {
+    if (oldest <= wakeup.start_ts) {mark = uint64min(mark, wakeup.start_ts);}
+  });
+  pendingIPI.ForEach([&](int cpu, const OneSpan& ipi) {
+    if (oldest <= ipi.start_ts) {mark = uint64min(mark, ipi.start_ts);}
+  });
+  pidtocorr.ForEach([&](uint32 pid, const PidCorr& corr) {
+    if (oldest <= corr.k_timestamp) {mark = uint64min(mark, corr.k_timestamp);}
+  });
+  rx_hashtocorr.ForEach([&](uint32 hash32, const HashCorr& corr) {
+    if (oldest <= corr.k_timestamp) {mark = uint64min(mark, corr.k_timestamp);}
+  });
+  return mark;
+}
+
+// Write the held spans whose start time sorts before mark
+void WriteHeldSpans(uint64 mark) {
+  while (HoldingSpans() && (TenNsecTextCompare(EarliestHeldTs(), mark, 12) < 0)) {
+    WriteTopSpan();
+  }
+}
+
+// Write the held spans that no later span can sort in front of. Until the
+// heap first fills, hold them all. Spill the heap if it is still full
+void WriteDoneLines(uint64 now) {
+  if (!header_written) {
+    if (held_spans.size() < kMaxHeldLines) {return;}
+    WriteHeader();
+  }
+  uint64 mark = SpanWatermark(now);
+  if (mark < kMaxSortedTenNsec) {WriteHeldSpans(mark);}
+  if (kMaxHeldLines <= held_spans.size()) {SpillHeldSpans();}
+}
+
+// Called after each input event. Every so often, write the held span lines
+// that no later span can sort in front of
+void ReleaseSpans(uint64 now) {
+  if (0 < --events_to_scan) {return;}
+  CollectLines();
+  WriteDoneLines(now);
+
+  // The scan costs about the size of the tables, so do it no more often than that
+  events_to_scan = kMinScanEvents;
+  int64 table_size = priorPidEnd.size() + lockpending.size() + enqueuetime.size() +
+                     pendingWakeup.size() + pendingIPI.size() + pidtocorr.size() +
+                     rx_hashtocorr.size();
+  if (events_to_scan < table_size) {events_to_scan = table_size;}
+}
+
+void InitCPUState(CPUState* thiscpu, int cpu) {
+  InitPidState(&thiscpu->cpu_stack);
+  InitSpan(&thiscpu->cur_span, cpu);
+  //InitSpan(&thiscpu->prior_pc_sample, cpu);
+  thiscpu->prior_pstate_ts = 0;
+  thiscpu->prior_pstate_freq = 0;
+  thiscpu->prior_pc_samp_ts = 0;
+  thiscpu->ctx_switch_ts = 0;
+  thiscpu->mwait_pending = -1;		// None pending
+  thiscpu->oldpid = 0;
+  thiscpu->newpid = 0;
+  thiscpu->valid_span = false;		// Ignore initial span
+}
+
+// Make room for CPU number cpu. Only done between events, so no CPUState
+// pointer is held across the resize
+void GrowCpuState(int cpu) {
+  for (int i = cpustate.size(); i <= cpu; ++i) {
+    CPUState temp;
+    InitCPUState(&temp, i);
+    cpustate.push_back(temp);
+  }
+}
+
+//
+// Usage: eventtospan3 <event file name> [-v] [-t] [-bin] [-spans <file>]
+//   -bin reads sorted binary EventRecords from rawtoevent -bin instead of text
+//   -spans writes a columnar span store to file instead of json to stdout
+//
+// Exit status is 1 if some span lines were written out of order
 //
 int main (int argc, const char** argv) {
-  CPUState cpustate[kMAX_CPUS];	// Running state for each CPU
   PerPidState perpidstate;	// Saved PID call stacks, for context switching
 
   OneSpan event;
@@ -2898,22 +3368,27 @@ int main (int argc, const char** argv) {
     if (strcmp(argv[i], "-v") == 0) {verbose = true;}
     if (strcmp(argv[i], "-t") == 0) {trace = true;}
     if (strcmp(argv[i], "-rel0") == 0) {rel0 = true;}
+    if (strcmp(argv[i], "-bin") == 0) {binary_in = true;}
+    if ((strcmp(argv[i], "-spans") == 0) && (i < (argc - 1))) {
+      ++i;
+      FILE* f = fopen(argv[i], "wb");
+      if (f == NULL) {
+        fprintf(stderr, "%s did not open\n", argv[i]);
+        exit(0);
+      }
+      span_store = new SpanStoreWriter;
+      StartSpanStore(f, span_store);
+    }
   }
 
-  // Initialize CPU state
-  for (int i = 0; i < kMAX_CPUS; ++i) {
-    InitPidState(&cpustate[i].cpu_stack);
-    InitSpan(&cpustate[i].cur_span, i);
-    //InitSpan(&cpustate[i].prior_pc_sample, i);
-    cpustate[i].prior_pstate_ts = 0;
-    cpustate[i].prior_pstate_freq = 0;
-    cpustate[i].prior_pc_samp_ts = 0;
-    cpustate[i].ctx_switch_ts = 0;
-    cpustate[i].mwait_pending = -1;		// None pending
-    cpustate[i].oldpid = 0;
-    cpustate[i].newpid = 0;
-    cpustate[i].valid_span = false;		// Ignore initial span
-  }
+  // Large output buffer for the span lines, unless debug output is interleaved
+  if (!verbose && !trace) {setvbuf(stdout, NULL, _IOFBF, kOutputBufferSize);}
+
+  StartReorder();
+  InitNames();
+
+  // Initialize CPU state. More CPUs are added as they show up in events
+  GrowCpuState(0);
 
   // Set idle name
   pidnames[pid_idle] = string(kIdleName);
@@ -2923,20 +3398,33 @@ int main (int argc, const char** argv) {
   // It can be in the midst of an interrupt when a context switch goes to another thread,
   // but the interrupt code is silently done.
   // Here we set the stacked idle task as inside sched, and we never change that elsewhere.
-  BrandNewPid(pid_idle, string(kIdleName), &perpidstate);
+  BrandNewPid(pid_idle, kIdleId, &perpidstate);
 
 
   //
   // Main loop
   //
-  uint64 lowest_ts = 0;
   uint64 prior_ts = 0;
   int linenum = 0;
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  EventRecord rec;
+  for (;;) {
+    // Binary records carry the same fields as text lines. Comments are passed
+    // as text; names and events skip the sscanf parsing.
+    if (binary_in) {
+      if (!ReadEventRecord(stdin, &rec)) {break;}
+      if (rec.kind == kRecordComment) {
+        strcpy(buffer, rec.name);
+      } else {
+        buffer[0] = '\0';
+        if (trace) {FormatEventRecord(&rec, buffer, kMaxBufferSize);}
+      }
+    } else {
+      if (!ReadLine(stdin, buffer, kMaxBufferSize)) {break;}
+    }
     ++linenum;
     int len = strlen(buffer);
-    if (buffer[0] == '\0') {continue;}
+    if (!binary_in && (buffer[0] == '\0')) {continue;}
 
     // Comments start with #, some are stylized and contain data
     if (buffer[0] == '#') {
@@ -2952,7 +3440,7 @@ int main (int argc, const char** argv) {
           // since the timestamps are all relative to a minute boundary
           trace_timeofday = string(buffer, 6, 17) + "00";
           //fprintf(stderr, "eventtospan3: trace_timeofday '%s'\n", trace_timeofday.c_str());
-          InitialJson(stdout, trace_label.c_str(), trace_timeofday.c_str());
+          InitialJson(span_out, trace_label.c_str(), trace_timeofday.c_str());
       }
       // Pull version and flags out if present
       if (memcmp(buffer, "# ## VERSION: ", 14) == 0) {
@@ -2987,7 +3475,15 @@ int main (int argc, const char** argv) {
     int temp_eventnum = 0;
     int temp_arg = 0;
     char temp_name[64];
-    sscanf(buffer, "%lld %llu %d %d %[ -~]", &temp_ts, &temp_dur, &temp_eventnum, &temp_arg, temp_name);
+    if (binary_in) {
+      temp_ts = rec.ts;
+      temp_eventnum = rec.event;
+      temp_arg = (rec.kind == kRecordName) ? rec.arg : rec.cpu;
+      memcpy(temp_name, rec.name, 63);
+      temp_name[63] = '\0';
+    } else {
+      sscanf(buffer, "%lld %llu %d %d %[ -~]", &temp_ts, &temp_dur, &temp_eventnum, &temp_arg, temp_name);
+    }
     if (IsNamedef(temp_eventnum)) {
 //fprintf(stdout, "====%%%s\n", buffer);
       if (IsLockNameInt(temp_eventnum)) {		// Lock names
@@ -3011,7 +3507,7 @@ int main (int argc, const char** argv) {
         ////if (temp_ts == -1) {fprintf(stderr, "host_name = %s\n", temp_name);}
       ////} else if (IsUserExecNonidlenum(temp_arg)) {	// Just pick off PID names, accumulating if multiple ones
       } else if (IsPidNameInt(temp_eventnum)) {	// Just pick off PID names, accumulating if multiple ones
-        RecordPidName(temp_ts, temp_arg, temp_name, cpustate);
+        RecordPidName(temp_ts, temp_arg, temp_name, &cpustate[0]);
         // Update any active stack if name just changed
         // Update any current span if name just changed
       } else if (IsMethodNameInt(temp_eventnum)) {
@@ -3026,7 +3522,19 @@ int main (int argc, const char** argv) {
     }
 
     // Read the full non-name event
-    if (incoming_version < 2) {
+    if (binary_in) {
+      if (rec.kind != kRecordEvent) {continue;}
+      event.start_ts = rec.ts;
+      event.duration = rec.duration;
+      event.eventnum = rec.event;
+      event.cpu = rec.cpu;
+      event.pid = rec.pid;
+      event.rpcid = rec.rpc;
+      event.arg = rec.arg;
+      event.retval = rec.retval;
+      event.ipc = rec.ipc;
+      strcpy(name_buffer, rec.name);
+    } else if (incoming_version < 2) {
       int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %s",
                      &event.start_ts, &event.duration, &event.eventnum, &event.cpu,
                      &event.pid, &event.rpcid, &event.arg, &event.retval, name_buffer);
@@ -3039,16 +3547,24 @@ int main (int argc, const char** argv) {
                      &event.ipc, name_buffer);
       if (n != 10) {continue;}
     }
-    event.name = string(name_buffer);
+    event.name = Intern(name_buffer);
+
+    if ((event.cpu < 0) || (kMAX_CPUS <= event.cpu)) {
+      if (binary_in) {FormatEventRecord(&rec, buffer, kMaxBufferSize);}
+      fprintf(stderr, "FATAL: Too-big CPU number at line[%d] '%s'\n", linenum, buffer);
+      exit(0);
+    }
+    GrowCpuState(event.cpu);
 
     // Fix event.rpcid. rawtoevent does not carry them across context switches
     event.rpcid = cpustate[event.cpu].cpu_stack.rpcid;	// 2021.02.05
 
     // Fixup name of idle thread once and for all
-    if (IsAnIdle(event)) {event.name = string(kIdleName);}
+    if (IsAnIdle(event)) {event.name = kIdleId;}
 
     // Input must be sorted by timestamp
     if (event.start_ts < prior_ts) {
+      if (binary_in) {FormatEventRecord(&rec, buffer, kMaxBufferSize);}
       fprintf(stderr, "rawtoevent: Timestamp out of order at line[%d] %s\n", linenum, buffer);
       exit(0);
     }
@@ -3056,7 +3572,7 @@ int main (int argc, const char** argv) {
 if (verbose) {
 fprintf(stdout, "\n%% [%d] %llu %llu %03x(%d)=%d %s ",
         event.cpu, event.start_ts, event.duration,
-        event.eventnum, event.arg, event.retval, event.name.c_str());
+        event.eventnum, event.arg, event.retval, NameString(event.name).c_str());
 DumpShort(stdout, &cpustate[event.cpu]);
 }
 
@@ -3064,11 +3580,6 @@ DumpShort(stdout, &cpustate[event.cpu]);
       lowest_ts = event.start_ts;
     }
 
-    if (kMAX_CPUS <= event.cpu){
-      fprintf(stderr, "FATAL: Too-big CPU number at line[%d] '%s'\n", linenum, buffer);
-      exit(0);
-    }
-
     // Keep track of largest CPU number seen
     if (max_cpu_seen < event.cpu) {
       max_cpu_seen = event.cpu;
@@ -3087,7 +3598,7 @@ DumpShort(stdout, &cpustate[event.cpu]);
       if (true || strlen(maybe_better_name) > strlen(name_buffer)) {
         // Do the replacement
 //fprintf(stderr, "LOCK %d %s => %s\n", event.arg, name_buffer, maybe_better_name);
-        event.name = string(maybe_better_name);
+        event.name = Intern(maybe_better_name);
       }
     }
 
@@ -3096,7 +3607,7 @@ DumpShort(stdout, &cpustate[event.cpu]);
       if (strchr(name_buffer, '(') == NULL) {
         char temp[64];
         sprintf(temp, "%s(%d)", name_buffer, event.arg);
-        event.name = string(temp);
+        event.name = Intern(temp);
       }
     }
 
@@ -3110,6 +3621,9 @@ DumpShort(stdout, &cpustate[event.cpu]);
       CPUState* thiscpu = &cpustate[event.cpu];
       DumpStackShort(stderr, &thiscpu->cpu_stack);
     }
+
+    // Write out whatever spans are done
+    ReleaseSpans(event.start_ts);
   }
   //
   // End main loop
@@ -3124,22 +3638,18 @@ DumpShort(stdout, &cpustate[event.cpu]);
     }
   }
 
-  // Keep any hardware description. Leading space is required.
-  fprintf(stdout, " \"mbit_sec\" : %d,\n", mbit_sec);
-
-  // Put out any multi-named PID row names
-  for (IntName::const_iterator it = pidrownames.begin(); it != pidrownames.end(); ++it) {
-    int pid = it->first;
-    string rowname = it->second;
-    double lowest_sec = lowest_ts / 100000000.0;
-    if (rowname.find("+") != string::npos) {
-      fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s.%d\"],\n",
-          lowest_sec, 0.00000001, 0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, rowname.c_str(), pid);
-    }
+  // Everything still held, then the end. mbit_sec is in the header, and the
+  // header puts the multi-named PID row names in with the spans. Any PID
+  // named again since a header written early is late
+  CollectLines();
+  if (header_written) {HoldRowNames();} else {WriteHeader();}
+  while (HoldingSpans()) {WriteTopSpan();}
+  if (span_store == NULL) {
+    FinalJson(json_out);
+  } else {
+    FinishSpanStore(span_store);
   }
 
-  FinalJson(stdout);
-
   // Statistics for main timeline; no decorations, PCsamp, etc.
   double total_dur = total_usermode + total_idle + total_kernelmode;
   total_dur *= 0.01;	// To give percents
@@ -3147,6 +3657,10 @@ DumpShort(stdout, &cpustate[event.cpu]);
           "eventtospan3: %lld spans, %2.0f%% usr, %2.0f%% sys, %2.0f%% idle\n",
           span_count,
           total_usermode / total_dur, total_kernelmode / total_dur, total_idle / total_dur);
+  if (0 < late_lines) {
+    fprintf(stderr, "eventtospan3: %llu span lines written out of order; sort the output\n",
+            late_lines);
+  }
 
-  return 0;
+  return (0 < late_lines) ? 1 : 0;
 }
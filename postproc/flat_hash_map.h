@@ -0,0 +1,143 @@
+// flat_hash_map.h
+//
+// Small open-addressing hash map for the per-PID/per-lock/per-hash tables in
+// eventtospan3. Keys are integers, values are plain structs. Linear probing in
+// one flat array of slots, so a lookup is usually a single cache line instead
+// of a walk down a red-black tree.
+//
+// Supports just the std::map operations eventtospan3 uses:
+//   find(key) != end(), it->first, it->second, [key], erase(key), clear(), size()
+// There is no ordered iteration; ForEach visits the entries in table order.
+// Unlike std::map, pointers and references into the table are only good until
+// the next insertion, which may grow and rehash it.
+//
+
+#ifndef __FLAT_HASH_MAP_H__
+#define __FLAT_HASH_MAP_H__
+
+#include <stddef.h>
+#include <vector>
+
+#include "basetypes.h"
+
+template<typename K, typename V>
+class FlatHashMap {
+ public:
+  typedef struct {
+    K first;
+    V second;
+    bool used;
+  } Slot;
+  typedef Slot* iterator;
+  typedef const Slot* const_iterator;
+
+  FlatHashMap() : count_(0), mask_(kInitialSize - 1), slots_(kInitialSize) {
+    ClearSlots();
+  }
+
+  size_t size() const {return count_;}
+  bool empty() const {return count_ == 0;}
+
+  iterator end() {return NULL;}
+  const_iterator end() const {return NULL;}
+
+  iterator find(K key) {
+    for (size_t i = Home(key); slots_[i].used; i = (i + 1) & mask_) {
+      if (slots_[i].first == key) {return &slots_[i];}
+    }
+    return NULL;
+  }
+  const_iterator find(K key) const {
+    return const_cast<FlatHashMap*>(this)->find(key);
+  }
+
+  // Like std::map, a missing key is inserted with a zeroed value
+  V& operator[](K key) {
+    size_t i = Home(key);
+    for (; slots_[i].used; i = (i + 1) & mask_) {
+      if (slots_[i].first == key) {return slots_[i].second;}
+    }
+    // Keep the table at most half full
+    if ((mask_ + 1) <= (count_ + 1) * 2) {
+      Grow();
+      for (i = Home(key); slots_[i].used; i = (i + 1) & mask_) {}
+    }
+    slots_[i].first = key;
+    slots_[i].second = V();
+    slots_[i].used = true;
+    ++count_;
+    return slots_[i].second;
+  }
+
+  // Returns the number of entries removed, 0 or 1
+  size_t erase(K key) {
+    iterator it = find(key);
+    if (it == NULL) {return 0;}
+    // Backward-shift deletion: pull later entries of the probe run into the
+    // hole if that does not move them ahead of their home slot. No tombstones.
+    size_t hole = it - &slots_[0];
+    for (size_t i = (hole + 1) & mask_; slots_[i].used; i = (i + 1) & mask_) {
+      size_t home = Home(slots_[i].first);
+      // Leave it if home is cyclically in (hole, i]
+      bool stays = (hole < i) ? ((hole < home) && (home <= i))
+                              : ((hole < home) || (home <= i));
+      if (!stays) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole].used = false;
+    --count_;
+    return 1;
+  }
+
+  // Calls f(key, value) for every entry, in no particular order.
+  // f must not insert or erase
+  template<typename F>
+  void ForEach(F f) const {
+    for (size_t i = 0; i <= mask_; ++i) {
+      if (slots_[i].used) {f(slots_[i].first, slots_[i].second);}
+    }
+  }
+
+  // Keeps the allocated size, since the same tables are refilled for each trace
+  void clear() {
+    if (count_ == 0) {return;}
+    ClearSlots();
+    count_ = 0;
+  }
+
+ private:
+  static const size_t kInitialSize = 64;	// Power of two
+
+  // Fibonacci hashing; the top bits of the product are well mixed even for
+  // small sequential keys like PIDs
+  size_t Home(K key) const {
+    uint64 h = static_cast<uint64>(key) * 0x9E3779B97F4A7C15llu;
+    return (h >> 32) & mask_;
+  }
+
+  void ClearSlots() {
+    for (size_t i = 0; i <= mask_; ++i) {slots_[i].used = false;}
+  }
+
+  void Grow() {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    mask_ = (mask_ << 1) | 1;
+    slots_.resize(mask_ + 1);
+    ClearSlots();
+    for (size_t k = 0; k < old.size(); ++k) {
+      if (!old[k].used) {continue;}
+      size_t i = Home(old[k].first);
+      while (slots_[i].used) {i = (i + 1) & mask_;}
+      slots_[i] = old[k];
+    }
+  }
+
+  size_t count_;		// Entries in use
+  size_t mask_;			// Table size - 1
+  std::vector<Slot> slots_;
+};
+
+#endif	// __FLAT_HASH_MAP_H__
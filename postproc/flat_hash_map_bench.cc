@@ -0,0 +1,220 @@
+// Little program to compare std::map and FlatHashMap for the eventtospan3 tables
+//
+// Runs the same synthetic trace of context switches, wakeups, lock contention,
+// and RPC packet correlation against both kinds of table, the way eventtospan3
+// uses them, and reports nanoseconds per event. The checksums must match.
+//
+// Compile with  g++ -O2 flat_hash_map_bench.cc -o flat_hash_map_bench
+//
+// Usage: flat_hash_map_bench [-cpus n] [-threads n] [-events n]
+//
+
+#include <map>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <sys/time.h>   // gettimeofday
+
+#include "basetypes.h"
+#include "flat_hash_map.h"
+
+using std::map;
+
+// Stand-ins for the eventtospan3 values, same sizes
+typedef struct {
+  int ambiguous;
+  int rpcid;
+  int enqueue_num_pending;
+  int dequeue_num_pending;
+  int top;
+  int eventnum[5];
+  uint32 name[5];
+} PidState;
+
+typedef struct {
+  uint64 start_ts;
+  uint64 duration;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  uint32 name;
+} OneSpan;
+
+typedef struct {
+  uint64 start_ts;
+  int pid;
+  int eventnum;
+} LockContend;
+
+typedef struct {
+  uint64 k_timestamp;
+  uint32 pid;
+} HashCorr;
+
+static const int kMaxCpus = 256;
+
+// Deterministic pseudo-random numbers, so both runs see the same trace
+static uint64 rand_state;
+inline uint32 NextRand() {
+  rand_state = rand_state * 6364136223846793005llu + 1442695040888963407llu;
+  return rand_state >> 33;
+}
+
+// One full set of tables, either kind
+template<template<typename, typename> class M>
+struct Tables {
+  M<int, PidState> perpidstate;
+  M<int, OneSpan> pendingWakeup;
+  M<int, OneSpan> priorPidEvent;
+  M<int, uint64> priorPidEnd;
+  M<int, bool> pidRunning;
+  M<uint64, LockContend> lockpending;
+  M<uint32, HashCorr> rx_hashtocorr;
+};
+
+// Just the two template parameters, to match FlatHashMap
+template<typename K, typename V>
+class StdMap : public map<K, V> {};
+
+template<template<typename, typename> class M>
+uint64 RunTrace(int cpus, int threads, int64 events, double* nsec_per_event) {
+  Tables<M>* t = new Tables<M>;
+  int running[kMaxCpus];
+  for (int c = 0; c < cpus; ++c) {running[c] = 0;}
+  uint64 sum = 0;
+  rand_state = 12345;
+
+  struct timeval tv_start, tv_end;
+  gettimeofday(&tv_start, NULL);
+  for (int64 n = 0; n < events; ++n) {
+    uint32 r = NextRand();
+    uint64 ts = n * 10;
+    int cpu = r % cpus;
+    int pid = 1 + ((r >> 8) % threads);
+    OneSpan event;
+    memset(&event, 0, sizeof(event));
+    event.start_ts = ts;
+    event.cpu = cpu;
+    event.pid = pid;
+    switch ((r >> 24) & 7) {
+    case 0:
+    case 1:
+    case 2: {
+      // Context switch on cpu from running[cpu] to pid; see SwapStacks
+      int oldpid = running[cpu];
+      if (oldpid == pid) {break;}
+      PidState stack;
+      memset(&stack, 0, sizeof(stack));
+      stack.top = oldpid & 3;
+      if (oldpid != 0) {t->perpidstate[oldpid] = stack;}
+      if (t->perpidstate.find(pid) == t->perpidstate.end()) {
+        t->perpidstate[pid] = stack;
+      }
+      sum += t->perpidstate[pid].top;
+      t->pidRunning.erase(oldpid);
+      t->pidRunning[pid] = true;
+      running[cpu] = pid;
+      // Arc from any pending wakeup
+      if (t->pendingWakeup.find(pid) != t->pendingWakeup.end()) {
+        sum += ts - t->pendingWakeup[pid].start_ts;
+        t->pendingWakeup.erase(pid);
+      }
+      if (t->priorPidEnd.find(pid) != t->priorPidEnd.end()) {
+        sum += t->priorPidEnd[pid];
+      }
+      t->priorPidEnd[pid] = ts;
+      break;
+    }
+    case 3:
+    case 4: {
+      // Wakeup of pid; see WaitBeforeWakeup and DoWakeup
+      if ((t->priorPidEvent.find(pid) != t->priorPidEvent.end()) &&
+          (t->pidRunning.find(pid) == t->pidRunning.end())) {
+        sum += t->priorPidEvent[pid].start_ts;
+      }
+      t->pendingWakeup[pid] = event;
+      t->priorPidEnd[pid] = ts;
+      break;
+    }
+    case 5: {
+      // User-mode event; remember it for the wait_xxx display
+      t->priorPidEvent[pid] = event;
+      break;
+    }
+    case 6: {
+      // Lock try/acquire/release, keyed by lock hash and pid
+      uint64 subscr = (static_cast<uint64>(r & 0xff) << 32) | pid;
+      if (t->lockpending.find(subscr) != t->lockpending.end()) {
+        sum += t->lockpending[subscr].start_ts;
+        t->lockpending.erase(subscr);
+      } else {
+        LockContend lockcontend = {ts, pid, 0};
+        t->lockpending[subscr] = lockcontend;
+      }
+      break;
+    }
+    case 7: {
+      // Kernel RX_PKT then user RX_USER with the same hash32
+      uint32 hash32 = NextRand() & 0x3ff;
+      if (t->rx_hashtocorr.find(hash32) != t->rx_hashtocorr.end()) {
+        sum += t->rx_hashtocorr[hash32].k_timestamp;
+        t->rx_hashtocorr.erase(hash32);
+      } else {
+        t->rx_hashtocorr[hash32].k_timestamp = ts;
+      }
+      break;
+    }
+    }
+  }
+  gettimeofday(&tv_end, NULL);
+  int64 usec = (tv_end.tv_sec - tv_start.tv_sec) * 1000000LL + (tv_end.tv_usec - tv_start.tv_usec);
+  *nsec_per_event = (usec * 1000.0) / events;
+
+  sum += t->perpidstate.size() + t->pendingWakeup.size() + t->priorPidEvent.size() +
+         t->priorPidEnd.size() + t->pidRunning.size() + t->lockpending.size() +
+         t->rx_hashtocorr.size();
+  delete t;
+  return sum;
+}
+
+void usage() {
+  fprintf(stderr, "Usage: flat_hash_map_bench [-cpus n] [-threads n] [-events n]\n");
+  exit(0);
+}
+
+int main (int argc, const char** argv) {
+  int cpus = 64;
+  int threads = 4000;
+  int64 events = 20000000;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-cpus") == 0) && (i + 1 < argc)) {
+      cpus = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-threads") == 0) && (i + 1 < argc)) {
+      threads = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-events") == 0) && (i + 1 < argc)) {
+      events = atoll(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if ((cpus < 1) || (kMaxCpus < cpus) || (threads < 1) || (events < 1)) {usage();}
+
+  double map_nsec, flat_nsec;
+  uint64 map_sum = RunTrace<StdMap>(cpus, threads, events, &map_nsec);
+  uint64 flat_sum = RunTrace<FlatHashMap>(cpus, threads, events, &flat_nsec);
+
+  fprintf(stdout, "%d CPUs, %d threads, %lld events\n", cpus, threads, events);
+  fprintf(stdout, "  std::map     %7.1f nsec/event  checksum %016llx\n", map_nsec, map_sum);
+  fprintf(stdout, "  FlatHashMap  %7.1f nsec/event  checksum %016llx\n", flat_nsec, flat_sum);
+  if (map_sum != flat_sum) {
+    fprintf(stderr, "flat_hash_map_bench FAIL: checksums differ\n");
+    return 1;
+  }
+  fprintf(stdout, "  speedup      %7.2fx\n", map_nsec / flat_nsec);
+  return 0;
+}
@@ -5,17 +5,17 @@
 //
 
 // dsites 2023.04.14 add showing local datetime for each raw block header
+// read compressed traces too, see trace_compress.h
 
-// compile with g++ -O2 kuod.cc -o kuod
+// compile with g++ -O2 kuod.cc -o kuod -lpthread
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "basetypes.h"
 #include "kutrace_lib.h"
-
-typedef unsigned char uint8;
-typedef unsigned long long int uint64;
+#include "trace_mmap.h"
 
 bool printall = false;
 
@@ -92,15 +92,21 @@ int main(int argc, const char** argv) {
   // If any extra parameter, treat as print all lines of zero
   if (3 <= argc) {printall = true;}
     
+  TraceInput in;
+  OpenTraceInput(f, &in);	// Plain bytes, even from a compressed trace
+
   int n;
-  uint64 buffer[1024];	// read 8KB at a time
+  uint64 buf[1024];	// read 8KB at a time
+  uint64* buffer;
+  uint8* p;
   
   size_t offset = 0;
   bool skipping = false;
   int inside_name = 0;
   int block_8k = 0;
   bool has_ipc = false;
-  while ((n = fread(buffer, 1, sizeof(buffer), f)) != 0) {
+  while ((n = ReadTraceBytes(&in, buf, sizeof(buf), &p)) != 0) {
+    buffer = reinterpret_cast<uint64*>(p);
     int lenu64 = n >> 3;
     if (block_8k == 0) {
       has_ipc = (((buffer[1] >> 56) & 0x80) != 0);  // High flag bit is IPC bit
@@ -168,6 +174,7 @@ int main(int argc, const char** argv) {
     ++block_8k;
   }
   
+  CloseTraceInput(&in);
   fclose(f);
   return 0;
 }
@@ -42,6 +42,42 @@ typedef struct {
 #define KUTRACE_CMD_SET4KB 12
 #define KUTRACE_CMD_GET4KB 13
 #define KUTRACE_CMD_GETIPC4KB 14
+// Added 2024.10.21
+#define KUTRACE_CMD_GETMAPSIZE 15
+// Added 2024.10.22
+#define KUTRACE_CMD_GETFULL 16
+#define KUTRACE_CMD_FREEBLOCK 17
+// Added 2024.10.23
+#define KUTRACE_CMD_INSERTBATCH 18
+// Added 2024.10.24
+#define KUTRACE_CMD_REGRING 19
+#define KUTRACE_CMD_DRAINRING 20
+// Added 2024.10.25
+#define KUTRACE_CMD_GETSTATS 21
+#define KUTRACE_STAT_WORDS 10
+// Added 2024.10.27
+#define KUTRACE_CMD_SETCLASSES 22
+#define KUTRACE_CMD_SETPIDS 23
+#define KUTRACE_MAX_PIDS 1024
+// Added 2024.11.03
+#define KUTRACE_CMD_HANDOFF 24
+
+// Event classes for KUTRACE_CMD_SETCLASSES. Names, context switches, and
+// the scheduler pseudo-syscall around each switch are always recorded
+#define KUTRACE_CLASS_SYSCALL 0x01
+#define KUTRACE_CLASS_TRAP    0x02
+#define KUTRACE_CLASS_IRQ     0x04
+#define KUTRACE_CLASS_SCHED   0x08
+#define KUTRACE_CLASS_PCSAMP  0x10
+#define KUTRACE_CLASS_USER    0x20
+#define KUTRACE_CLASS_OTHER   0x40
+#define KUTRACE_CLASS_ALL     0x7F
+
+// User event rings, mapped from /dev/kutrace past the trace buffer
+#define KUTRACE_MAX_RINGS 64
+#define KUTRACE_RING_HEADER_BYTES 4096
+#define KUTRACE_RING_DATA_WORDS 2048
+#define KUTRACE_RING_BYTES (KUTRACE_RING_HEADER_BYTES + KUTRACE_RING_DATA_WORDS * 8)
 
 
 
@@ -277,6 +313,18 @@ namespace kutrace {
   u64 addevent(u64 eventnum, u64 arg);
   void addname(u64 eventnum, u64 number, const char* name);
 
+  // Per-thread batching of marks, addevent, and addname. Entries keep the
+  // time they were made and go to the module up to 64 words per call.
+  // batch(false) and flush_batch() send whatever is pending
+  void batch(bool on);
+  void flush_batch();
+
+  // Per-thread event ring shared with the module: marks, addevent, and
+  // addname become plain stores, no syscall. The module picks them up
+  // when this thread is switched out. Falls back to batch() if the module
+  // has no ring for us. ring(false) sends whatever is pending
+  void ring(bool on);
+
   void msleep(int msec);
   int64 readtime();
 
@@ -284,17 +332,24 @@ namespace kutrace {
   u64 CharToBase40(const char* str);
 
   u64 DoControl(u64 command, u64 arg);
+  // Have DoDump and DoStreamStop write compressed trace files, which
+  // rawtoevent, checktrace, and kuod read as is. See postproc/trace_compress.h
+  void DoCompress(bool on);
   void DoDump(const char* fname);
   u64 DoEvent(u64 eventnum, u64 arg);
+  bool DoFilter(u64 class_mask);
   void DoFlush();
   void DoInit(const char* process_name);
   void DoMark(u64 n, u64 arg);
   bool DoTest();
   bool DoOff();
   bool DoOn();
+  bool DoPids(const u64* pids, int n);
   void DoQuit();
   void DoReset(u64 doing_ipc);
   void DoStat(u64 control_flags);
+  bool DoStreamStart(const char* fname);
+  void DoStreamStop();
   void EmitNames(const NumNamePair* ipair, u64 n);
   u64 GetUsec();
   const char* MakeTraceFileName(const char* name, char* str);
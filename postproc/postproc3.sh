@@ -7,7 +7,13 @@ export LC_ALL=C
 # Strip trailing .trace if it is there
 var1=${1%.trace}
 
-cat $var1.trace  |./rawtoevent |sort -n |./eventtospan3 "$2" |sort >$var1.json 
+# eventtospan3 writes its spans already sorted. It exits with status 1 if
+# some came out late, and then they are sorted here
+cat $var1.trace  |./rawtoevent |sort -n |./eventtospan3 "$2" >$var1.json 
+if [ ${PIPESTATUS[3]} -ne 0 ]
+then
+sort $var1.json -o $var1.json
+fi
 echo "  $var1.json written"
 
 trim_arg='0'
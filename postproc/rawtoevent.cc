@@ -5,7 +5,7 @@
 // Input has filename like 
 //   kutrace_control_20170821_095154_dclab-1_2056.trace
 //
-// compile with g++ -O2 rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent
+// compile with g++ -O2 rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent -lpthread
 //
 // To see raw trace in hex, use
 //   od -Ax -tx8z -w32 foo.trace
@@ -16,11 +16,21 @@
 // dsites 2023.04.30 Update TSDELTA processing to go backward
 // dsites 2023.05.03 Update timestamp processing to go backward in top 7/8 of wrap period
 // dsites 2024.05.29 Accept both IPC and LLC bytes
-
+// Add -bin fixed-width binary event records, see event_record.h
+// Add -merge to produce sorted output directly, with no sort -n
+// Add -j to decode blocks on multiple threads
+// Walk memory-mapped trace blocks in place, see trace_mmap.h
+// Add -index .trace.idx block index and -start/-stop time windows
+// Grow per-CPU decode state for the CPU numbers seen, up to 256
+
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
@@ -30,13 +40,15 @@
 #include <sys/types.h>
 
 #include "basetypes.h"
+#include "event_record.h"
 #include "from_base40.h"
 ////#include "kutrace_control_names.h"
 #include "kutrace_lib.h"
+#include "trace_mmap.h"
 
-// To come from names in trace
-static int gTIMER_IRQ_EVENT = 0x05ec;	// local_timer
-static int gSCHED_EVENT = 0x0dff;	// -sched-
+// Defaults until they come from names in trace
+static const int kDefaultTimerIrqEvent = 0x05ec;	// local_timer
+static const int kDefaultSchedEvent = 0x0dff;		// -sched-
 
 // Remap high syscall numbers into lo sys32 numbers
 #define	kutrace_map_nr(nr) (nr + (nr & 0x200)) 
@@ -52,6 +64,80 @@ static int gSCHED_EVENT = 0x0dff;	// -sched-
 bool verbose = false;
 bool hexevent = false;
 
+// Binary output: fixed-width EventRecords instead of text lines.
+// Binary cannot go through sort -n, so it is always merged here into sorted order.
+bool binary_out = false;
+
+// The % debug lines from -v and -h. In -bin mode they go to stderr so they
+// do not land in the middle of the binary records.
+FILE* debug_out = stdout;
+
+// Merged output: produce exactly the order LC_ALL=C sort -n would give, in two passes.
+// The names pass finds all the names and block headers, which sort to the very front.
+// The events pass buckets events per CPU and merges the buckets as soon as no
+// later block can produce anything earlier.
+static const int kSinglePass = 0;
+static const int kNamesPass = 1;
+static const int kEventsPass = 2;
+bool merge_out = false;
+int merge_pass = kSinglePass;
+uint64 merge_cpu = 0;				// CPU of the block being decoded
+std::vector<EventRecord> early_records;		// Names at time -1 and comments
+std::vector<std::deque<EventRecord> > cpu_records;	// Per-CPU, each kept sorted
+std::vector<uint64> block_lowest;		// Lowest time each block produces
+
+// Parallel decode, -j N. See ParallelDecodeBlocks
+int num_threads = 1;
+static const int kBlocksPerThread = 8;	// Blocks per thread in each batch
+bool block_records = false;		// Merged records from -j threads go to their block's buffer
+
+// Block index, kept in a foo.trace.idx sidecar file next to foo.trace.
+// A 32-byte header, then one 32-byte entry per 64KB trace block:
+//   +-------------------------------+-------------------------------+
+//   |              file offset of the trace block                   | 0
+//   +-------------------------------+-------------------------------+
+//   |       lowest event time in block, multiples of 10ns           | 1
+//   +-------------------------------+-------------------------------+
+//   |       highest event time in block, multiples of 10ns          | 2
+//   +-------------------------------+---------------+-------+-------+
+//   |                   u n u s e d                 | flags | cpu#  | 3
+//   +-------------------------------+---------------+-------+-------+
+// Times are the same ones rawtoevent writes. A block with no events has lo > hi.
+// With -start/-stop, only the blocks that overlap the window are decoded,
+// plus any other blocks that define names.
+static const char* kIndexMagic = "KUTRIDX1";
+static const uint8 kIndexIpc = 0x01;		// 8KB of IPC/LLC bytes follow the block
+static const uint8 kIndexNames = 0x02;		// Block has name definitions
+
+typedef struct {
+  char magic[8];
+  uint64 trace_size;			// To notice a stale index
+  uint64 block_count;
+  uint64 unused;
+} BlockIndexHeader;
+
+typedef struct {
+  uint64 offset;
+  uint64 lo_nsec10;
+  uint64 hi_nsec10;
+  uint8 cpu;
+  uint8 flags;
+  uint8 unused[6];
+} BlockIndexEntry;
+
+std::vector<BlockIndexEntry> block_index;	// Empty unless -start/-stop
+bool use_window = false;
+double start_seconds = 0.0;			// As in the TIMES comment
+double stop_seconds = 999.0;
+const char* trace_name = NULL;			// For finding the sidecar; NULL for stdin
+uint64 window_lo_nsec10 = 0;
+uint64 window_hi_nsec10 = ~0LLU;
+
+// What to do with each block when there is a time window
+static const int kSkipBlock = 0;
+static const int kNamesBlock = 1;	// Decode just its names
+static const int kFullBlock = 2;
+
 //VERYTEMP
 bool keep_idle = false;
 
@@ -60,7 +146,7 @@ bool keep_idle = false;
 static const uint64 FINDME = 0;
 
 static const bool TRACEWRAP = false;
-static const int kMAX_CPUS = 80;
+static const uint64 kMAX_CPUS = 256;	// Block header CPU number is 8 bits
 static const int mhz_32bit_counts = 54;
 static const int kNetworkMbPerSec = 1000;	// Default: 1 Gb/s
 static const int kDefaultLowResNsec10 = 35;	// Low-res riscv: 0 dur => 350 nsec instead 
@@ -71,9 +157,6 @@ static const uint64 usec_per_100_years = 1000000LL * 86400 * 365 * 100;  // Thru
 // Large ts difference means slightly backward time
 static const uint64 kLargeTsdelta = 2000000000;	
 
-// For dealing with riscv poor-resolution sifive u74-mc clock (1MHz)
-bool is_low_res_ts = false;		// True for Riscv u74 1 MHz timestamp
-
 
 // For deciding that large timestamp advance is really a late store with backward time.
 static const uint64 kLateStoreThresh = 0x0000000000020000LLU;
@@ -204,6 +287,17 @@ const char* missingeventname[16] = {
 typedef map<uint64, string> U64toString;
 typedef set<uint64> U64set;
 
+// Every value a name has had, with the block that set it. For the -j threads
+typedef std::pair<int, string> BlockName;
+typedef map<uint64, std::vector<BlockName> > NameHistory;
+
+// Heap order for the k-way merge: smallest head record on top
+struct CpuHeadGreater {
+  bool operator()(int a, int b) const {
+    return RecordLess(cpu_records[b].front(), cpu_records[a].front());
+  }
+};
+
 // These all use a single static buffer. In real production code, these would 
 // all be std::string values, or something else at least as safe.
 static const int kMaxDateTimeBuffer = 32;
@@ -222,6 +316,158 @@ typedef struct {
   double m_slope_nsec10;
 } CyclesToUsecParams;
 
+// Decoding state carried from one trace block to the next
+typedef struct {
+  // Start timepair is set by DoInit
+  // Stop timepair is set by DoOff
+  // If start_counts is zero, we got here directly without calling DoInit,
+  // which was done in some earlier run of this program. In that case, go
+  // find the start pair as the first real trace entry in the first trace block.
+  CyclesToUsecParams params;
+  uint64 base_usec_timestamp;
+  uint8 first_flags;			// Just first block has tracefile version number
+
+  // Per-CPU state, subscripted by CPU number. Sized by GrowCpuState for the
+  // highest CPU number seen so far, so small machines carry just a few entries
+  std::vector<uint64> current_pid;		// Keep track of current PID on each of 16+ cores
+  std::vector<uint64> current_rpc; 		// Keep track of current rpcid on each of 1+6 cores
+  std::vector<uint64> prior_timer_irq_nsec10;	// For moving PC sample start_ts back
+  std::vector<bool> at_first_cpu_block;	// To special-case the initial PID of each CPU in trace
+  U64toString names;			// Name keyed by PID#, RPC# etc. with high type nibble
+					// In a -j thread, just the names its own block defines
+  const NameHistory* earlier_names;	// In a -j thread, the names from earlier blocks
+  NameHistory* name_history;		// In the -j carry pass, record every name change here
+  U64set idle_pids;
+
+  // These come from names in trace (they vary in different historical traces)
+  int timer_irq_event;			// local_timer
+  int sched_event;			// -sched-
+  bool is_low_res_ts;			// True for Riscv u74 1 MHz timestamp
+} DecodeState;
+
+// Some statistics
+typedef struct {
+  uint64 event_count;
+  uint64 lo_timestamp;
+  uint64 hi_timestamp;
+  U64set unique_cpus;
+  U64set unique_pids;
+  uint64 ctx_switches;
+  uint64 total_marks;
+  uint64 name_count;
+  uint64 events_by_type[16];		// From high nibble of eventnum
+} DecodeStats;
+
+void InitDecodeState(DecodeState* ds) {
+  memset(&ds->params, 0, sizeof(CyclesToUsecParams));
+  ds->base_usec_timestamp = 0;
+  ds->first_flags = 0;
+  ds->current_pid.clear();
+  ds->current_rpc.clear();
+  ds->prior_timer_irq_nsec10.clear();
+  ds->at_first_cpu_block.clear();
+  // Events are 0..64K-1 for everything except context switch.
+  // Context switch events are 0x10000 + pid
+  // Initialize idle process name, pid 0
+  ds->names.clear();
+  ds->names[0x10000] = string(kIdleName);
+  ds->earlier_names = NULL;
+  ds->name_history = NULL;
+  ds->idle_pids.clear();
+  ds->timer_irq_event = kDefaultTimerIrqEvent;
+  ds->sched_event = kDefaultSchedEvent;
+  ds->is_low_res_ts = false;
+}
+
+// Start a -j thread's block from the carried state. Everything but the names is
+// copied; the names come from the shared history that the carry pass records
+void CopyBlockState(DecodeState* to, const DecodeState* from) {
+  to->params = from->params;
+  to->base_usec_timestamp = from->base_usec_timestamp;
+  to->first_flags = from->first_flags;
+  to->current_pid = from->current_pid;
+  to->current_rpc = from->current_rpc;
+  to->prior_timer_irq_nsec10 = from->prior_timer_irq_nsec10;
+  to->at_first_cpu_block = from->at_first_cpu_block;
+  to->names.clear();
+  to->earlier_names = from->name_history;
+  to->name_history = NULL;
+  to->idle_pids = from->idle_pids;
+  to->timer_irq_event = from->timer_irq_event;
+  to->sched_event = from->sched_event;
+  to->is_low_res_ts = from->is_low_res_ts;
+}
+
+// Remember a name defined in this block
+void SetName(DecodeState* ds, uint64 key, const string& name, int blocknumber) {
+  ds->names[key] = name;
+  if (ds->name_history != NULL) {
+    std::vector<BlockName>& history = (*ds->name_history)[key];
+    if (history.empty() || (history.back().second != name)) {
+      history.push_back(BlockName(blocknumber, name));
+    }
+  }
+}
+
+// The name for key as of this point in this block, or NULL if none
+const string* FindName(const DecodeState* ds, uint64 key, int blocknumber) {
+  U64toString::const_iterator it = ds->names.find(key);
+  if (it != ds->names.end()) {return &it->second;}
+  if (ds->earlier_names == NULL) {return NULL;}
+  NameHistory::const_iterator hit = ds->earlier_names->find(key);
+  if (hit == ds->earlier_names->end()) {return NULL;}
+  const std::vector<BlockName>& history = hit->second;
+  for (int i = (int)history.size() - 1; i >= 0; --i) {
+    if (history[i].first < blocknumber) {return &history[i].second;}
+  }
+  return NULL;
+}
+
+// Same, but the empty string if none
+const string& NameOrEmpty(const DecodeState* ds, uint64 key, int blocknumber) {
+  static const string empty;
+  const string* name = FindName(ds, key, blocknumber);
+  return (name == NULL) ? empty : *name;
+}
+
+// Make room in the per-CPU state for CPU number cpu
+inline void GrowCpuState(DecodeState* ds, uint64 cpu) {
+  if (cpu < ds->current_pid.size()) {return;}
+  if (kMAX_CPUS <= cpu) {
+    fprintf(stderr, "rawtoevent FATAL: CPU number %lld > max %lld\n", cpu, kMAX_CPUS);
+    exit(0);
+  }
+  ds->current_pid.resize(cpu + 1, 0);
+  ds->current_rpc.resize(cpu + 1, 0);
+  ds->prior_timer_irq_nsec10.resize(cpu + 1, 0);
+  ds->at_first_cpu_block.resize(cpu + 1, true);
+}
+
+void InitDecodeStats(DecodeStats* stats) {
+  stats->event_count = 0;
+  stats->lo_timestamp = 0x7FFFFFFFFFFFFFFFl;
+  stats->hi_timestamp = 0;
+  stats->unique_cpus.clear();
+  stats->unique_pids.clear();
+  stats->ctx_switches = 0;
+  stats->total_marks = 0;
+  stats->name_count = 0;
+  memset(stats->events_by_type, 0, 16 * sizeof(uint64));
+}
+
+// Fold in the statistics of one -j block
+void AddDecodeStats(DecodeStats* stats, const DecodeStats* more) {
+  stats->event_count += more->event_count;
+  if (stats->lo_timestamp > more->lo_timestamp) {stats->lo_timestamp = more->lo_timestamp;}
+  if (stats->hi_timestamp < more->hi_timestamp) {stats->hi_timestamp = more->hi_timestamp;}
+  stats->unique_cpus.insert(more->unique_cpus.begin(), more->unique_cpus.end());
+  stats->unique_pids.insert(more->unique_pids.begin(), more->unique_pids.end());
+  stats->ctx_switches += more->ctx_switches;
+  stats->total_marks += more->total_marks;
+  stats->name_count += more->name_count;
+  for (int i = 0; i < 16; ++i) {stats->events_by_type[i] += more->events_by_type[i];}
+}
+
 void SetParams(int64 start_cycles, int64 start_usec, 
                int64 stop_cycles, int64 stop_usec, CyclesToUsecParams* params) {
   params->base_cycles = start_cycles;
@@ -230,11 +476,11 @@ void SetParams(int64 start_cycles, int64 start_usec,
   params->m_slope = (stop_usec - start_usec) * 1.0 / (stop_cycles - start_cycles);
   params->m_slope_nsec10 = params->m_slope * 100.0;
   if (verbose) {
-    fprintf(stdout, "SetParams maps %18lldcy ==> %18lldus\n", start_cycles, start_usec);
-    fprintf(stdout, "SetParams maps %18lldcy ==> %18lldus\n", stop_cycles, stop_usec);
-    fprintf(stdout, "          diff %18lldcy ==> %18lldus\n", stop_cycles - start_cycles, stop_usec - start_usec);
+    fprintf(debug_out, "SetParams maps %18lldcy ==> %18lldus\n", start_cycles, start_usec);
+    fprintf(debug_out, "SetParams maps %18lldcy ==> %18lldus\n", stop_cycles, stop_usec);
+    fprintf(debug_out, "          diff %18lldcy ==> %18lldus\n", stop_cycles - start_cycles, stop_usec - start_usec);
     // Assume that cy increments every 64 CPU cycles
-    fprintf(stdout, "SetParams slope %f us/cy (%f MHz)\n", params->m_slope, 64.0/params->m_slope);
+    fprintf(debug_out, "SetParams slope %f us/cy (%f MHz)\n", params->m_slope, 64.0/params->m_slope);
   }
 }
 
@@ -242,7 +488,7 @@ void SetParams10(int64 start_cycles10, int64 start_nsec10, CyclesToUsecParams* p
   params->base_cycles10 = start_cycles10;
   params->base_nsec10 = start_nsec10;
   if (verbose) {
-    fprintf(stdout, "SetParams10 maps %16lldcy ==> %lldns10\n", start_cycles10, start_nsec10);
+    fprintf(debug_out, "SetParams10 maps %16lldcy ==> %lldns10\n", start_cycles10, start_nsec10);
   }
 }
 
@@ -378,8 +624,8 @@ inline bool is_pc_sample(uint64 event) {
 }
 
 // Return true if the event is a local timer, for PC start_ts fixup
-inline bool is_timer_irq(uint64 event) {
-  return (event == gTIMER_IRQ_EVENT);
+inline bool is_timer_irq(uint64 event, int timer_irq_event) {
+  return (event == timer_irq_event);
 }
 
 // Return true if the event is rpcreq, rpcresp, rpcmid, rpcrxpkt, rpxtxpkt,
@@ -431,12 +677,110 @@ int HasWraparound(uint8 flags) {
 }
 
 
+// Write one merged record, as binary or as the exact text line
+void WriteRecord(FILE* f, const EventRecord* rec) {
+  if (binary_out) {
+    WriteEventRecord(f, rec);
+  } else {
+    char buffer[kMaxPrintBuffer];
+    FormatEventRecord(rec, buffer, kMaxPrintBuffer);
+    fputs(buffer, f);
+    fputc('\n', f);
+  }
+}
+
+// Names at time -1 and the stylized comments all sort in front of any real event
+inline bool IsEarlyRecord(const EventRecord* rec) {
+  return (rec->kind == kRecordComment) || (rec->ts < 0);
+}
+
+// Put a record into its CPU bucket. Each CPU's events arrive almost in order;
+// late stores and PC samples moved back to their timer interrupt are out of
+// order by just a few entries, so insert from the back.
+void InsertPerCpu(const EventRecord* rec) {
+  if (cpu_records.size() <= merge_cpu) {cpu_records.resize(merge_cpu + 1);}
+  std::deque<EventRecord>& q = cpu_records[merge_cpu];
+  std::deque<EventRecord>::iterator it = q.end();
+  while ((it != q.begin()) && RecordLess(*rec, *(it - 1))) {--it;}
+  q.insert(it, *rec);
+}
+
+// Route a record according to which pass we are in
+void MergeRecord(FILE* f, const EventRecord* rec) {
+  if (block_records) {
+    WriteEventRecord(f, rec);	// A -j thread; merged later in block order
+    return;
+  }
+  if (merge_pass == kNamesPass) {
+    if (IsEarlyRecord(rec)) {early_records.push_back(*rec);}
+    return;
+  }
+  if (merge_pass == kEventsPass) {
+    if (!IsEarlyRecord(rec)) {InsertPerCpu(rec);}
+    return;
+  }
+  WriteRecord(f, rec);	// After the merge is done
+}
+
+// Write the names and comments found in the names pass
+void FlushEarlyRecords(FILE* f) {
+  std::sort(early_records.begin(), early_records.end(), RecordLess);
+  for (size_t i = 0; i < early_records.size(); ++i) {
+    WriteRecord(f, &early_records[i]);
+  }
+  early_records.clear();
+}
+
+// K-way merge of the per-CPU buckets, writing everything earlier than limit
+void FlushMergedRecords(FILE* f, uint64 limit) {
+  // Min-heap of CPU numbers, ordered by the head record of each bucket
+  std::vector<int> heap;
+  for (int cpu = 0; cpu < (int)cpu_records.size(); ++cpu) {
+    if (!cpu_records[cpu].empty()) {heap.push_back(cpu);}
+  }
+  CpuHeadGreater greater;
+  std::make_heap(heap.begin(), heap.end(), greater);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    int cpu = heap.back();
+    const EventRecord& rec = cpu_records[cpu].front();
+    if ((uint64)rec.ts >= limit) {break;}	// Everything left is later
+    WriteRecord(f, &rec);
+    cpu_records[cpu].pop_front();
+    if (cpu_records[cpu].empty()) {
+      heap.pop_back();
+    } else {
+      std::push_heap(heap.begin(), heap.end(), greater);
+    }
+  }
+}
+
+// Remember the lowest time that a block produces
+void NoteBlockLowest(int blocknumber, uint64 nsec10) {
+  if (block_lowest.size() <= (size_t)blocknumber) {block_lowest.resize(blocknumber + 1, ~0LLU);}
+  if (block_lowest[blocknumber] > nsec10) {block_lowest[blocknumber] = nsec10;}
+}
+
+// Turn block_lowest into the lowest time produced by this block or any later one
+void SuffixBlockLowest() {
+  for (int i = (int)block_lowest.size() - 2; i >= 0; --i) {
+    if (block_lowest[i] > block_lowest[i + 1]) {block_lowest[i] = block_lowest[i + 1];}
+  }
+}
+
+// Lowest time that this block or any later one can still produce
+uint64 LowestFrom(int blocknumber) {
+  if (block_lowest.size() <= (size_t)blocknumber) {return ~0LLU;}
+  return block_lowest[blocknumber];
+}
+
 // Change any spaces and non-Ascii to underscore
 // time dur event pid name(event)
 void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char* name) {
+  if (f == NULL) {return;}	// The -j carry pass
   // Avoid crazy big times
   if (nsec10 >= 99900000000LL) {
-    if (verbose) {fprintf(stdout, "BUG ts=%lld\n", nsec10);}
+    if (verbose) {fprintf(debug_out, "BUG ts=%lld\n", nsec10);}
     return;
   }
 
@@ -445,6 +789,22 @@ void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char*
   uint64 len = ((strlen(name) + 7) >> 3) + 1;
   event = (event & 0xF0F) | (len << 4);		// Set name length
 
+  if (merge_out) {
+    EventRecord rec;
+    memset(&rec, 0, sizeof(EventRecord));
+    rec.kind = kRecordName;
+    rec.ts = nsec10;
+    rec.duration = dur;
+    rec.event = event;
+    rec.arg = argall;
+    SetRecordName(&rec, name);
+    MergeRecord(f, &rec);
+    // Also put the name at the very front of the sorted event list
+    rec.ts = -1;
+    MergeRecord(f, &rec);
+    return;
+  }
+
   fprintf(f, "%lld %lld %lld %d %s\n", nsec10, dur, event, argall, name);
   // Also put the name at the very front of the sorted event list
   fprintf(f, "%lld %lld %lld %d %s\n", -1ll, dur, event, argall, name);
@@ -455,13 +815,32 @@ void OutputEvent(FILE* f,
                  uint64 nsec10, uint64 duration, uint64 event, uint64 current_cpu,
                  uint64 pid, uint64 rpc, 
                  uint64 arg, uint64 retval, int ipc, const char* name) {
+  if (f == NULL) {return;}	// The -j carry pass
   // Avoid crazy big times
   bool fail = false;
   if (nsec10 >= 99900000000LL) {fail = true;}
   if (duration >= 99900000000LL) {fail = true;}
   if (nsec10 + duration >= 99900000000LL) {fail = true;}
   if (fail) {
-    if (verbose) {fprintf(stdout, "BUG %lld %lld\n", nsec10, duration);}
+    if (verbose) {fprintf(debug_out, "BUG %lld %lld\n", nsec10, duration);}
+    return;
+  }
+
+  if (merge_out) {
+    EventRecord rec;
+    memset(&rec, 0, sizeof(EventRecord));	// No stray bytes in the binary output
+    rec.kind = kRecordEvent;
+    rec.ts = nsec10;
+    rec.duration = duration;
+    rec.event = event;
+    rec.cpu = current_cpu;
+    rec.pid = pid;
+    rec.rpc = rpc;
+    rec.arg = arg;
+    rec.retval = retval;
+    rec.ipc = ipc;
+    SetRecordName(&rec, name);
+    MergeRecord(f, &rec);
     return;
   }
 
@@ -471,6 +850,20 @@ void OutputEvent(FILE* f,
           arg, retval, ipc, name, event);
 }
 
+// Stylized comment line that eventtospan depends on
+void OutputComment(FILE* f, const char* text) {
+  if (f == NULL) {return;}	// Building the block index
+  if (merge_out) {
+    EventRecord rec;
+    memset(&rec, 0, sizeof(EventRecord));
+    rec.kind = kRecordComment;
+    SetRecordName(&rec, text);
+    MergeRecord(f, &rec);
+    return;
+  }
+  fprintf(f, "%s\n", text);
+}
+
 // Add the pid#/rpc#/etc. to the end of name, if not already there
 string AppendNum(const string& name, uint64 num) {
   char num_temp[24];
@@ -651,15 +1044,15 @@ bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, C
       }
       
       if (verbose || hexevent) {
-        fprintf(stdout, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
+        fprintf(debug_out, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
           traceblock[2], start_counts, start_usec, start_usec % 60000000l);
-        fprintf(stdout, "%% %016llx\n", traceblock[3]);
-        fprintf(stdout, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
+        fprintf(debug_out, "%% %016llx\n", traceblock[3]);
+        fprintf(debug_out, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
           traceblock[4], stop_counts, stop_usec, stop_usec % 60000000l);
-        fprintf(stdout, "%% %016llx\n", traceblock[5]);
-        fprintf(stdout, "%% %016llx unused\n", traceblock[6]);
-        fprintf(stdout, "%% %016llx unused\n", traceblock[7]);
-        fprintf(stdout, "\n");
+        fprintf(debug_out, "%% %016llx\n", traceblock[5]);
+        fprintf(debug_out, "%% %016llx unused\n", traceblock[6]);
+        fprintf(debug_out, "%% %016llx unused\n", traceblock[7]);
+        fprintf(debug_out, "\n");
       }
 
       // Now do some error checking 
@@ -712,108 +1105,75 @@ bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, C
 }
 
 //
-// Usage: rawtoevent <trace file name> [-v] [-h] [-maxblock n]
-//
-int main (int argc, const char** argv) {
-  // Some statistics
-  uint64 base_usec_timestamp;
-  uint64 event_count = 0;
-  uint64 lo_timestamp = 0x7FFFFFFFFFFFFFFFl;
-  uint64 hi_timestamp = 0;
-  U64set unique_cpus;
-  U64set unique_pids;
-  U64set idle_pids;
-  uint64 ctx_switches = 0;
-  uint64 total_marks = 0;
-  uint64 events_by_type[16];		// From high nibble of eventnum
-  memset(events_by_type, 0, 16 * sizeof(uint64));
-
-  int maxblock = 999999999;
-  uint64 current_cpu = 0;
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint8 ipcblock[kTraceBufSize];	// One byte per trace entry
-
-  uint64 current_pid[kMAX_CPUS];	// Keep track of current PID on each of 16+ cores
-  uint64 current_rpc[kMAX_CPUS]; 	// Keep track of current rpcid on each of 1+6 cores
-  uint64 prior_timer_irq_nsec10[kMAX_CPUS];	// For moving PC sample start_ts back
-  bool at_first_cpu_block[kMAX_CPUS];	// To special-case the initial PID of each CPU in trace
-  U64toString names;			// Name keyed by PID#, RPC# etc. with high type nibble
-
-  // Start timepair is set by DoInit
-  // Stop timepair is set by DoOff
-  // If start_counts is zero, we got here directly without calling DoInit, 
-  // which was done in some earlier run of this program. In that case, go 
-  // find the start pair as the first real trace entry in the first trace block.
-  CyclesToUsecParams params;
-
-  // Events are 0..64K-1 for everything except context switch.
-  // Context switch events are 0x10000 + pid
-  // Initialize idle process name, pid 0
-  names[0x10000] = string(kIdleName);
-
-  // Pick up flags
-  for (int i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-v") == 0) {verbose = true;}
-    if (strcmp(argv[i], "-h") == 0) {hexevent = true;}
-    if ((strcmp(argv[i], "-maxblock") == 0) && (i < (argc - 1))) {
-      ++i;
-      maxblock = atoi(argv[i]);
-    }
+// Merged output and -start/-stop read the input twice. Copy a pipe to a temp file first.
+FILE* SeekableInput(FILE* f) {
+  if (fseek(f, 0, SEEK_SET) == 0) {return f;}
+  FILE* tf = tmpfile();
+  if (tf == NULL) {
+    fprintf(stderr, "rawtoevent: could not create temp file for stdin\n");
+    exit(0);
   }
-  
-  for (int i = 0; i < kMAX_CPUS; ++i) {
-    current_pid[i] = 0; 
-    current_rpc[i] = 0;
-    prior_timer_irq_nsec10[i] = 0;
-    at_first_cpu_block[i] = true;
+  uint64 copybuffer[kTraceBufSize];
+  size_t n;
+  while ((n = fread(copybuffer, 1, sizeof(copybuffer), f)) != 0) {
+    fwrite(copybuffer, 1, n, tf);
   }
+  rewind(tf);
+  return tf;
+}
 
-  // For converting cycle counts to multiples of 100ns
-  double m = kDefaultSlope;
-
-  FILE* f = stdin;
-  if (argc >= 2) {
-    f = fopen(argv[1], "rb");
-    if (f == NULL) {
-      fprintf(stderr, "rawtoevent: %s did not open\n", argv[1]);
-      exit(0);
-    }
+// Next trace block and its IPC bytes, in place in the mapped file or read into
+// the buffers. Returns false at end of file
+bool ReadTraceBlock(TraceInput* in, uint64* tracebuf, uint8* ipcbuf,
+                    uint64** traceblock, uint8** ipcblock) {
+  uint8* p;
+  if (ReadTraceBytes(in, tracebuf, kTraceBufSize * sizeof(uint64), &p) == 0) {return false;}
+  *traceblock = reinterpret_cast<uint64*>(p);
+
+  // traceblock[1] has flags in top byte.
+  uint8 flags = (*traceblock)[1] >> 56;
+  bool this_block_has_ipc = (HasIPC(flags) | HasLLC(flags));
+
+  // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
+  if (this_block_has_ipc) {
+    // Extract 8KB IPC block
+    ReadTraceBytes(in, ipcbuf, kTraceBufSize, ipcblock);
+  } else {
+    memset(ipcbuf, 0, kTraceBufSize);	// Default if no IPC data
+    *ipcblock = ipcbuf;
   }
+  return true;
+}
 
-  int blocknumber = 0;
-  uint64 base_minute_usec, base_minute_cycle, base_minute_shift;
-
-  // Need this to sort in front of allthe timestamps
-  fprintf(stdout, "# ## VERSION: %d\n", kRawVersionNumber);
-  uint8 all_flags = 0;	// They should all be the same
-  uint8 first_flags;	// Just first block has tracefile version number
-
-
-  //--------------------------------------------------------------------------//
-  // Outer loop over blocks                                                   //
-  //--------------------------------------------------------------------------//
-  while (fread(traceblock, 1, sizeof(traceblock), f) != 0) {
-    if (blocknumber >= maxblock) {break;}
-
+// Emit the stylized comments for one block and check its header.
+// Sets up the time conversion from the very first block.
+// Returns false if the block is bad and is to be skipped
+bool StartBlock(uint64* traceblock, int blocknumber,
+                DecodeState* ds, uint8* all_flags, FILE* out) {
+    char comment[kMaxPrintBuffer];
     // Need first [1] line to get basetime in later steps
     // TODO: Move this to a stylized BASETIME comment
     ////fprintf(stdout, "# blocknumber %d\n", blocknumber);
     // These are stylized comments that eventtospan depends on for initial time
-    fprintf(stdout, "# [0] %016llx cpu %02llx block %d\n", 
+    snprintf(comment, kMaxPrintBuffer, "# [0] %016llx cpu %02llx block %d",
             traceblock[0],
             traceblock[0] >> 56,
             blocknumber);
-    fprintf(stdout, "# [1] %s cpu %02llx flags %02llx block %d\n",
+    OutputComment(out, comment);
+    snprintf(comment, kMaxPrintBuffer, "# [1] %s cpu %02llx flags %02llx block %d",
             FormatUsecDateTime(traceblock[1] & 0x00fffffffffffffful),
-            traceblock[0] >> 56, 
+            traceblock[0] >> 56,
             traceblock[1] >> 56,
             blocknumber);
-    fprintf(stdout, 
-            "# TS      DUR EVENT CPU PID RPC ARG0 RETVAL IPC NAME (t and dur multiples of 10ns)\n");
+    OutputComment(out, comment);
+    if (!merge_out && (out != NULL)) {
+      fprintf(out,
+              "# TS      DUR EVENT CPU PID RPC ARG0 RETVAL IPC NAME (t and dur multiples of 10ns)\n");
+    }
 
-    if (verbose || hexevent) {
-       fprintf(stdout, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
-       fprintf(stdout, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
+    if ((verbose || hexevent) && (out != NULL)) {
+       fprintf(debug_out, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
+       fprintf(debug_out, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
     }
 //   +-------+-----------------------+-------------------------------+
 //   | cpu#  |                  cycle counter                        | 0 module
@@ -822,16 +1182,16 @@ int main (int argc, const char** argv) {
 //   +-------+-----------------------+-------------------------------+
 
     // Pick out CPU number for this traceblock
-    current_cpu = traceblock[0] >> 56;
-    uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+    uint64 current_cpu = traceblock[0] >> 56;
+    merge_cpu = current_cpu;
 
-    // traceblock[1] has flags in top byte. 
+    // traceblock[1] has flags in top byte.
     uint8 flags = traceblock[1] >> 56;
     uint64 gtod = traceblock[1] & 0x00fffffffffffffful;
 
     bool fail = false;
     if (kMAX_CPUS <= current_cpu) {
-      fprintf(stderr, "rawtoevent FAIL: block[%d] CPU number %lld > max %d\n", blocknumber, current_cpu, kMAX_CPUS);
+      fprintf(stderr, "rawtoevent FAIL: block[%d] CPU number %lld > max %lld\n", blocknumber, current_cpu, kMAX_CPUS);
       fail = true;
     }
     // No constraints on base_cycle
@@ -840,18 +1200,9 @@ int main (int argc, const char** argv) {
       fprintf(stderr, "rawtoevent FAIL: block[%d] gettimeofday crazy large %016llx\n", blocknumber, gtod);
       fail = true;
     }
-  
 
-    all_flags |= flags;
-    bool this_block_has_ipc = (HasIPC(flags) | HasLLC(flags));
 
-    // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
-    if (this_block_has_ipc) {
-      // Extract 8KB IPC block
-      int n = fread(ipcblock, 1, sizeof(ipcblock), f);
-    } else {
-      memset(ipcblock, 0, sizeof(ipcblock));	// Default if no IPC data
-    }
+    *all_flags |= flags;
 
 // WRAPAROUND PROBLEM:
 // We pick base_minute_usec here in block 0, but it can be
@@ -859,30 +1210,38 @@ int main (int argc, const char** argv) {
 // Our downstream display does badly with seconds much over 120...
 //
 // We would like the base_minute_usec to be set by the first real entry in block 1 instead...
-// Can still use paramaters here for basic time conversion. 
+// Can still use paramaters here for basic time conversion.
 // Not much issue with overflow, I think.
 //
 
     // If very first block, pick out time conversion parameters
-    int first_real_entry = 2;
-    bool very_first_block = (blocknumber == 0);
-    if (very_first_block) {
-      first_real_entry = 8;
-      first_flags = flags;
-      fail |= handle_very_first_block(traceblock, &base_usec_timestamp, &params);
+    if (blocknumber == 0) {
+      ds->first_flags = flags;
+      fail |= handle_very_first_block(traceblock, &ds->base_usec_timestamp, &ds->params);
     }
 
     if (fail) {
       fprintf(stderr, "rawtoevent **** FAIL -- skipping block[%d] ****\n", blocknumber);
       fprintf(stderr, "     %016llx %016llx\n",traceblock[0], traceblock[1]);
       for (int i = 0; i < 16; ++i) {fprintf(stderr, "  [%d] %016llx\n", i, traceblock[i]);}
-      ++blocknumber;
-      continue;
+      return false;
     }
+    return true;
+}
+
+// Decode the entries of one trace block, after StartBlock, updating the carried state.
+// If f is NULL, just carry the state forward with no output (the -j carry pass).
+// If just_names, output only the names, as for the first block of a wraparound trace
+void DecodeBlock(uint64* traceblock, uint8* ipcblock, int blocknumber,
+                 DecodeState* ds, DecodeStats* stats, FILE* f, bool just_names) {
+    uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+    bool very_first_block = (blocknumber == 0);
+    int first_real_entry = very_first_block ? 8 : 2;
 
     // Pick out CPU number for this traceblock
-    current_cpu = traceblock[0] >> 56;
-    unique_cpus.insert(current_cpu);	// stats
+    uint64 current_cpu = traceblock[0] >> 56;
+    stats->unique_cpus.insert(current_cpu);	// stats
+    GrowCpuState(ds, current_cpu);
 
     // Pick out times for converting to 100Mhz
     uint64 prepend = base_cycle & ~0xfffff;
@@ -895,7 +1254,7 @@ int main (int argc, const char** argv) {
 
     // If wraparound trace and in very_first_block, suppress everything except name entries
     // and hardware description
-    bool keep_just_names = HasWraparound(first_flags) && very_first_block;
+    bool keep_just_names = (HasWraparound(ds->first_flags) && very_first_block) || just_names;
 
 // Every block has PID and pidname at the front                          created by
 //   +-------+-----------------------+-------------------------------+
@@ -913,7 +1272,7 @@ int main (int argc, const char** argv) {
 //   |                                                               | 5 or 11 module
 //   +-------------------------------+-------------------------------+
 
-    if (TracefileVersion(first_flags) >= 3) {
+    if (TracefileVersion(ds->first_flags) >= 3) {
       /* Every block has PID and pidname at the front */
       /* CPU frequency may be in the first block per CPU, in the high half of pid */
       uint64 pid = traceblock[first_real_entry + 0] & 0x00000000ffffffffLLU;
@@ -926,33 +1285,34 @@ int main (int argc, const char** argv) {
       
       // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
       // Map all of these to pid 0 name -idle-, remembering them
-      FixupIdlePid(&pid, pidname, &idle_pids);
+      FixupIdlePid(&pid, pidname, &ds->idle_pids);
 
       if (verbose || hexevent) {
-        if (at_first_cpu_block[current_cpu]) {
+        if (ds->at_first_cpu_block[current_cpu]) {
           fprintf(stderr, "rawtoevent block[%d] cpu %lld pid %lld freq %lld %s\n", 
                   blocknumber, current_cpu, pid, freq_mhz, pidname);
         }
-        fprintf(stdout, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
-        fprintf(stdout, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
-        fprintf(stdout, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
-        fprintf(stdout, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
-        fprintf(stdout, "\n");
+        fprintf(debug_out, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
+        fprintf(debug_out, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
+        fprintf(debug_out, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
+        fprintf(debug_out, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
+        fprintf(debug_out, "\n");
       }
 
       // Remember the name for this pid
       uint64 nameinsert = PidToEvent(pid);
       string name = MakeSafeAscii(ReduceSpaces(string(pidname)));
-      names[nameinsert] = name;
+      SetName(ds, nameinsert, name, blocknumber);
       
       // To allow updates of the reconstruction stack in eventtospan
-      uint64 nsec10 = CyclesToNsec10(base_cycle, params);
-      OutputName(stdout, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
+      uint64 nsec10 = CyclesToNsec10(base_cycle, ds->params);
+      if (merge_pass == kNamesPass) {NoteBlockLowest(blocknumber, nsec10);}
+      OutputName(f, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
 
       // New user-mode process id, pid
-      unique_pids.insert(pid);	// stats
-      if (current_pid[current_cpu] != pid) {++ctx_switches;}	// stats
-      current_pid[current_cpu] = pid;
+      stats->unique_pids.insert(pid);	// stats
+      if (ds->current_pid[current_cpu] != pid) {++stats->ctx_switches;}	// stats
+      ds->current_pid[current_cpu] = pid;
 
       uint64 event = KUTRACE_USERPID;	// Context switch
       uint64 duration = 1;
@@ -970,7 +1330,7 @@ int main (int argc, const char** argv) {
         // A possible alternate design is to back up the timestamp here to just before the 
         // first real entry.
         //
-        /////OutputEvent(stdout, nsec10, duration, event, current_cpu, 
+        /////OutputEvent(f, nsec10, duration, event, current_cpu, 
         ////            pid, 0,  0, 0, 0, name.c_str());
 
         // Statistics: don't count as a context switch -- almost surely same
@@ -978,12 +1338,12 @@ int main (int argc, const char** argv) {
         // dsites 2021.07.26
         // Output the very first block's context switch to the running process at trace startup
         // dsites 2021.10.20 Output initial CPU frequency if nonzero
-        if (at_first_cpu_block[current_cpu]) {
-          at_first_cpu_block[current_cpu] = false;
-          OutputEvent(stdout, nsec10, duration, KUTRACE_USERPID, current_cpu, 
+        if (ds->at_first_cpu_block[current_cpu]) {
+          ds->at_first_cpu_block[current_cpu] = false;
+          OutputEvent(f, nsec10, duration, KUTRACE_USERPID, current_cpu, 
                       pid, 0,  0, 0, 0, name.c_str());
           if (0 < freq_mhz) {
-            OutputEvent(stdout, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
+            OutputEvent(f, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
                         pid, 0,  freq_mhz, 0, 0, "-freq-");
            }
         }
@@ -996,7 +1356,7 @@ int main (int argc, const char** argv) {
     // We wrapped if high bit of first_timestamp is 1 and high bit of base is 0
     if (Wrapped(first_timestamp, base_cycle)) {
       prepend -= 0x100000; 
-      if (TRACEWRAP) {fprintf(stdout, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
+      if (TRACEWRAP) {fprintf(debug_out, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
     }
 
     //------------------------------------------------------------------------//
@@ -1034,7 +1394,7 @@ int main (int argc, const char** argv) {
       // Sign extend optimized retval [-128..127] from 8 bits to 16
       retval = (uint64)(((int64)(retval << 56)) >> 56) & 0xffff;
       if (verbose) {
-        fprintf(stdout, 
+        fprintf(debug_out, 
                 "%% [%d,%d] %05llx %03llx %04llx %04llx = %lld %lld %lld, %lld %lld %02x\n", 
                 blocknumber, i,
                 (traceblock[i] >> 44) & 0xFFFFF, 
@@ -1045,9 +1405,9 @@ int main (int argc, const char** argv) {
       }
 
       if (is_mark(n)) {
-        ++total_marks;	// stats
+        ++stats->total_marks;	// stats
       } else {
-        ++events_by_type[n >> 8];	// stats
+        ++stats->events_by_type[n >> 8];	// stats
       }
 
       uint64 event;
@@ -1136,14 +1496,15 @@ int main (int argc, const char** argv) {
       // For a trace starting at 50 seconds into a minute and spanning 99 seconds, 
       // this reaches 14,900,000,000 which means the 
       // base minute + 149.000 000 00 seconds. More than 32 bits.
-      uint64 nsec10 = CyclesToNsec10(tfull, params);
+      uint64 nsec10 = CyclesToNsec10(tfull, ds->params);
       uint64 duration = 0;
+      if (merge_pass == kNamesPass) {NoteBlockLowest(blocknumber, nsec10);}
 
       if (has_rpcid(n)) {
         // Working on this RPC until one with arg=0
         has_arg = true;
         // Defer switching to zero until after the OutputEvent
-        if (arg != 0) {current_rpc[current_cpu] = arg;}
+        if (arg != 0) {ds->current_rpc[current_cpu] = arg;}
         else {deferred_rpcid0 = true;}
       }
 
@@ -1151,7 +1512,7 @@ int main (int argc, const char** argv) {
       if (is_namedef(n)) {
         has_arg = true;
         // We have a name or other variable-length entry
-        // Remap the raw numbering to unique ranges in names[]
+        // Remap the raw numbering to unique ranges in ds->names[]
         uint64 nameinsert;
         uint64 rpcid;
         uint8 lglen8;
@@ -1188,31 +1549,32 @@ int main (int argc, const char** argv) {
           if (is_pidnamedef(n)) {
             // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
             // Map all of these to pid 0 name -idle-, remembering them
-            FixupIdlePid(&arg, tempstring, &idle_pids);
+            FixupIdlePid(&arg, tempstring, &ds->idle_pids);
             nameinsert = PidToEvent(arg); 	  // Processes 0..64K
           }
           
           // Remember the name, except throw away the empty name
           string name = string(tempstring);
           if (is_modelnamedef(n)) {
-            is_low_res_ts = (name.find("u74-mc") != 0);
+            ds->is_low_res_ts = (name.find("u74-mc") != 0);
           }
           name = ReduceSpaces(name);
           name = MakeSafeAscii(name);
           if (!name.empty()) {
-            names[nameinsert] = name;
-            ////OutputName(stdout, nsec10, nameinsert, argall, name.c_str());
-            OutputName(stdout, nsec10, n, argall, name.c_str());
+            SetName(ds, nameinsert, name, blocknumber);
+            ++stats->name_count;	// stats
+            ////OutputName(f, nsec10, nameinsert, argall, name.c_str());
+            OutputName(f, nsec10, n, argall, name.c_str());
           }
           // Remember which event number is local_timer (or local_timer_vector) and which is -sched-
           // (these vary in different historical traces)
           if (memcmp(tempstring, "local_timer", 11) == 0) {
-            gTIMER_IRQ_EVENT = KUTRACE_IRQ | (arg & 0xffff);
-//fprintf(stderr, "local_timer irq = %03x %d\n", gTIMER_IRQ_EVENT, gTIMER_IRQ_EVENT);
+            ds->timer_irq_event = KUTRACE_IRQ | (arg & 0xffff);
+//fprintf(stderr, "local_timer irq = %03x %d\n", ds->timer_irq_event, ds->timer_irq_event);
           }
           if (memcmp(tempstring, "-sched-", 7) == 0) {
-            gSCHED_EVENT = KUTRACE_SYSCALL64 | (kutrace_map_nr(arg & 0xffff));
-//fprintf(stderr, "-sched- syscall = %03x %d\n", gSCHED_EVENT, gSCHED_EVENT);
+            ds->sched_event = KUTRACE_SYSCALL64 | (kutrace_map_nr(arg & 0xffff));
+//fprintf(stderr, "-sched- syscall = %03x %d\n", ds->sched_event, ds->sched_event);
           }
         }
         i += (len - 1);	// Skip over the rest of the name event
@@ -1221,24 +1583,47 @@ int main (int argc, const char** argv) {
       }
       
       if (is_cpu_description(n)) {	// Just pass it on to eventtospan
-        OutputEvent(stdout, nsec10, 1, event, current_cpu, 
+        OutputEvent(f, nsec10, 1, event, current_cpu, 
                     0, 0, argall, 0, 0, "");
       }
 
       if (keep_just_names) {continue;}
 
+      // The names pass needs nothing more except the lowest time,
+      // allowing for PC samples that get moved back to their timer interrupt
+      if (merge_pass == kNamesPass) {
+        if (is_timer_irq(n, ds->timer_irq_event)) {ds->prior_timer_irq_nsec10[current_cpu] = nsec10;}
+        if (is_pc_sample(n)) {
+          if (ds->prior_timer_irq_nsec10[current_cpu] != 0) {
+            NoteBlockLowest(blocknumber, ds->prior_timer_irq_nsec10[current_cpu] - 1);
+          }
+          ++i;		// Skip the PC word
+        }
+        continue;
+      }
+
       //========================================================================
       // Name definitions above skip this code, so do not affect lo/hi 
-      if (lo_timestamp > nsec10) {lo_timestamp = nsec10;}	// stats
-      if (hi_timestamp < nsec10) {hi_timestamp = nsec10;}	// stats
+      if (stats->lo_timestamp > nsec10) {stats->lo_timestamp = nsec10;}	// stats
+      if (stats->hi_timestamp < nsec10) {stats->hi_timestamp = nsec10;}	// stats
+
+      // The -j carry pass needs nothing more except the state later blocks start from.
+      // Building the block index needs just lo/hi
+      if (f == NULL) {
+        if (is_contextswitch(n)) {ds->current_pid[current_cpu] = RemapIdlePid(arg, &ds->idle_pids);}
+        if (is_timer_irq(n, ds->timer_irq_event)) {ds->prior_timer_irq_nsec10[current_cpu] = nsec10;}
+        if (is_pc_sample(n)) {++i;}		// Skip the PC word
+        if (deferred_rpcid0) {ds->current_rpc[current_cpu] = 0;}
+        continue;
+      }
 
       // Look for new user-mode process id, pid
       if (is_contextswitch(n)) {
         has_arg = true;
-        arg = RemapIdlePid(arg, &idle_pids);
-        unique_pids.insert(arg);	// stats
-        if (current_pid[current_cpu] != arg) {++ctx_switches;}	// stats
-        current_pid[current_cpu] = arg;
+        arg = RemapIdlePid(arg, &ds->idle_pids);
+        stats->unique_pids.insert(arg);	// stats
+        if (ds->current_pid[current_cpu] != arg) {++stats->ctx_switches;}	// stats
+        ds->current_pid[current_cpu] = arg;
       }
 
       // Nothing else, so dump in decimal
@@ -1248,20 +1633,21 @@ int main (int argc, const char** argv) {
       // Put in name of event
       if (is_return(n)) {
         uint64 call_event = event & ~0x0200;
-        if (names.find(call_event) != names.end()) {name.append("/" + names[call_event]);}
+        const string* call_name = FindName(ds, call_event, blocknumber);
+        if (call_name != NULL) {name.append("/" + *call_name);}
       } else {
-        if (names.find(event) != names.end()) {name.append(names[event]);}
+        name.append(NameOrEmpty(ds, event, blocknumber));
       }
 
       if (is_contextswitch(n)) {
         has_arg = true;
         uint64 target = PidToEvent(arg);
-        if (names.find(target) != names.end()) {name.append(names[target]);}
+        name.append(NameOrEmpty(ds, target, blocknumber));
         name = AppendNum(name, arg);
      }
 
       if (is_usermode(event)) {
-        if (names.find(event) != names.end()) {name.append(names[event]);}
+        name.append(NameOrEmpty(ds, event, blocknumber));
         name = AppendNum(name, EventToPid(event));
       }
 
@@ -1271,8 +1657,8 @@ int main (int argc, const char** argv) {
       if (is_opt_call(n, delta_t)) {
         has_arg = true;
         // Optimized call with delta_t and retval
-        duration = CyclesToNsec10(tfull + delta_t, params) - nsec10;
-        if (is_low_res_ts && (delta_t == 1)) {
+        duration = CyclesToNsec10(tfull + delta_t, ds->params) - nsec10;
+        if (ds->is_low_res_ts && (delta_t == 1)) {
           duration = kDefaultLowResNsec10;
         }
         if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
@@ -1281,8 +1667,8 @@ int main (int argc, const char** argv) {
       }
 
       // Remember timer interrupt start time, for PC sample fixup below
-      if (is_timer_irq(n)) {
-          prior_timer_irq_nsec10[current_cpu] = nsec10;
+      if (is_timer_irq(n, ds->timer_irq_event)) {
+          ds->prior_timer_irq_nsec10[current_cpu] = nsec10;
       }
 
       // Pick off non-standard PC values here
@@ -1317,8 +1703,8 @@ int main (int argc, const char** argv) {
 
         // The PC sample is generated after the local_timer interrupt, but we really 
         // want its sample time to be just before that interrupt. We move it back here.
-        if (prior_timer_irq_nsec10[current_cpu] != 0) {
-          nsec10 = prior_timer_irq_nsec10[current_cpu] - 1;	// 10 nsec before timer IRQ
+        if (ds->prior_timer_irq_nsec10[current_cpu] != 0) {
+          nsec10 = ds->prior_timer_irq_nsec10[current_cpu] - 1;	// 10 nsec before timer IRQ
         }
         // Put a hash of the PC name into arg, so HTML display can choose colors quickly
         arg = (pc_sample >> 6) & 0xFFFF;	// Initial hash just uses PC bits <21:6>
@@ -1332,10 +1718,10 @@ int main (int argc, const char** argv) {
 
         // Output the frequency event first if nonzero
         if (0 < freq_mhz) { 
-          OutputEvent(stdout, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
-                      current_pid[current_cpu], current_rpc[current_cpu], 
+          OutputEvent(f, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
+                      ds->current_pid[current_cpu], ds->current_rpc[current_cpu], 
                       freq_mhz, 0, 0, "-freq-");
-          ++event_count;	// stats
+          ++stats->event_count;	// stats
         }
       }
 
@@ -1344,9 +1730,9 @@ int main (int argc, const char** argv) {
         has_arg = true;
         name.append(string(kSpecialName[n & 0x001f]));
         if (has_rpcid(n)) {
-          name = AppendNum(names[arg | 0x30000], arg);	// method.rpcid
+          name = AppendNum(NameOrEmpty(ds, arg | 0x30000, blocknumber), arg);	// method.rpcid
         } else if (is_lock(n)) {
-          name = string(kSpecialName[n & 0x001f]) + names[arg | 0x20000];  // try_lockname etc.
+          name = string(kSpecialName[n & 0x001f]) + NameOrEmpty(ds, arg | 0x20000, blocknumber);  // try_lockname etc.
         } else if (is_raw_pkt_hash(n)  || is_user_msg_hash(n)) {
           uint64 hash16 = ((argall >> 16) ^ argall) & 0xffffLLU;	// HTML shows this 16-bit hash
           name = AppendHexNum(name, hash16);
@@ -1403,15 +1789,15 @@ int main (int argc, const char** argv) {
 
       // Debug output. Raw 64-bit event in hex
       if (hexevent) {
-        fprintf(stdout, "%05llx.%03llx ", 
+        fprintf(debug_out, "%05llx.%03llx ", 
           (traceblock[entry_i] >> 44) & 0xFFFFF, 
           (traceblock[entry_i] >> 32) & 0xFFF);
         if (has_arg) {
-          fprintf(stdout, " %04llx%04llx ", 
+          fprintf(debug_out, " %04llx%04llx ", 
             (traceblock[entry_i] >> 16) & 0xFFFF, 
             (traceblock[entry_i] >> 0) & 0xFFFF);
         } else {
-          fprintf(stdout, "          "); 
+          fprintf(debug_out, "          "); 
         }
       }
 
@@ -1433,48 +1819,424 @@ int main (int argc, const char** argv) {
       // Output the trace event
       // Output format:
       // time dur event cpu  pid rpc  arg retval IPC name(event)
-      OutputEvent(stdout, nsec10, duration, event, current_cpu, 
-                  current_pid[current_cpu], current_rpc[current_cpu], 
+      OutputEvent(f, nsec10, duration, event, current_cpu, 
+                  ds->current_pid[current_cpu], ds->current_rpc[current_cpu], 
                   arg, retval, ipc, name.c_str());
       // Update some statistics
-      ++event_count;	// stats
+      ++stats->event_count;	// stats
 
       if (hexevent && extra_word) {
-        fprintf(stdout, "   %16llx\n", traceblock[entry_i + 1]); 
+        fprintf(debug_out, "   %16llx\n", traceblock[entry_i + 1]); 
       }
 
       // Do deferred switch to rpcid = 0
-      if (deferred_rpcid0) {current_rpc[current_cpu] = 0;}
+      if (deferred_rpcid0) {ds->current_rpc[current_cpu] = 0;}
 
     }
     //------------------------------------------------------------------------//
     // End inner loop over eight-byte entries                                 //
     //------------------------------------------------------------------------//
+}
 
+// Build the block index with a quick carry pass over the whole trace, no output.
+// Leaves the input positioned back at the start
+void BuildBlockIndex(TraceInput* in) {
+  DecodeState ds;
+  InitDecodeState(&ds);
+  uint8 all_flags = 0;
+  uint64 tracebuf[kTraceBufSize];
+  uint8 ipcbuf[kTraceBufSize];
+  uint64* traceblock;
+  uint8* ipcblock;
+  uint64 offset = 0;
+  int blocknumber = 0;
+  block_index.clear();
+  while (ReadTraceBlock(in, tracebuf, ipcbuf, &traceblock, &ipcblock)) {
+    uint8 flags = traceblock[1] >> 56;
+    BlockIndexEntry entry;
+    memset(&entry, 0, sizeof(BlockIndexEntry));
+    entry.offset = offset;
+    entry.cpu = traceblock[0] >> 56;
+    entry.flags = (HasIPC(flags) | HasLLC(flags)) ? kIndexIpc : 0;
+    offset += kTraceBufSize * sizeof(uint64);
+    if (entry.flags & kIndexIpc) {offset += kTraceBufSize;}
+
+    DecodeStats stats;
+    InitDecodeStats(&stats);
+    if (StartBlock(traceblock, blocknumber, &ds, &all_flags, NULL)) {
+      DecodeBlock(traceblock, ipcblock, blocknumber, &ds, &stats, NULL, false);
+    }
+    entry.lo_nsec10 = stats.lo_timestamp;
+    entry.hi_nsec10 = stats.hi_timestamp;
+    if (stats.name_count > 0) {entry.flags |= kIndexNames;}
+    block_index.push_back(entry);
     ++blocknumber;
+  }
+  rewind(in->f);
+  SeekTraceInput(in, 0);
+}
+
+// Write the block index to the sidecar file
+void WriteBlockIndex(const char* fname, uint64 trace_size) {
+  FILE* f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "rawtoevent: %s did not open\n", fname);
+    exit(0);
+  }
+  BlockIndexHeader header;
+  memset(&header, 0, sizeof(BlockIndexHeader));
+  memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+  header.trace_size = trace_size;
+  header.block_count = block_index.size();
+  fwrite(&header, 1, sizeof(BlockIndexHeader), f);
+  fwrite(block_index.data(), sizeof(BlockIndexEntry), block_index.size(), f);
+  fclose(f);
+}
+
+// Read the block index from the sidecar file.
+// Returns false if it is missing or does not match the trace
+bool ReadBlockIndex(const char* fname, uint64 trace_size) {
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {return false;}
+  BlockIndexHeader header;
+  bool ok = (fread(&header, 1, sizeof(BlockIndexHeader), f) == sizeof(BlockIndexHeader)) &&
+            (memcmp(header.magic, kIndexMagic, sizeof(header.magic)) == 0) &&
+            (header.trace_size == trace_size) &&
+            (header.block_count <= trace_size / (kTraceBufSize * sizeof(uint64)));
+  if (ok) {
+    block_index.resize(header.block_count);
+    ok = (fread(block_index.data(), sizeof(BlockIndexEntry), block_index.size(), f) ==
+          block_index.size());
+  }
+  fclose(f);
+  if (!ok) {block_index.clear();}
+  return ok;
+}
+
+// Turn -start/-stop seconds into trace times. Like the TIMES comment, the seconds
+// leave out any whole minutes before the earliest event of a wraparound trace
+void SetWindow() {
+  uint64 lo_timestamp = ~0LLU;
+  for (size_t i = 0; i < block_index.size(); ++i) {
+    const BlockIndexEntry& entry = block_index[i];
+    if ((entry.lo_nsec10 <= entry.hi_nsec10) && (lo_timestamp > entry.lo_nsec10)) {
+      lo_timestamp = entry.lo_nsec10;
+    }
+  }
+  uint64 offset_timestamp = 0;
+  if (lo_timestamp != ~0LLU) {offset_timestamp = (lo_timestamp / 6000000000l) * 6000000000l;}
+  window_lo_nsec10 = offset_timestamp + (uint64)(start_seconds * 100000000.0);
+  window_hi_nsec10 = offset_timestamp + (uint64)(stop_seconds * 100000000.0);
+}
+
+// Use the sidecar index if it is there and current, else build it here
+void SetupBlockIndex(TraceInput* in, const char* tracename) {
+  struct stat st;
+  fstat(fileno(in->f), &st);
+  if (tracename != NULL) {
+    string fname = string(tracename) + ".idx";
+    if (ReadBlockIndex(fname.c_str(), st.st_size)) {SetWindow(); return;}
+  }
+  BuildBlockIndex(in);
+  SetWindow();
+}
+
+// What to do with this block, given the -start/-stop window
+int BlockMode(int blocknumber) {
+  if (block_index.empty()) {return kFullBlock;}	// No window
+  if (block_index.size() <= (size_t)blocknumber) {return kFullBlock;}	// Past a short index
+  const BlockIndexEntry& entry = block_index[blocknumber];
+  // A block with no events, such as an unused one flushed empty at the end of
+  // the trace, still has its comment lines and PID name. Decode it in full, so
+  // that a window over the whole trace gives the same output as no window
+  bool no_events = (entry.hi_nsec10 < entry.lo_nsec10);
+  bool overlaps = no_events ||
+                  ((entry.lo_nsec10 <= window_hi_nsec10) && (window_lo_nsec10 <= entry.hi_nsec10));
+  if (overlaps) {return kFullBlock;}
+  // Block 0 always goes through StartBlock for the time conversion
+  if ((blocknumber == 0) || (entry.flags & kIndexNames)) {return kNamesBlock;}
+  return kSkipBlock;
+}
+
+// Next trace block to decode, skipping ahead past blocks outside any time window.
+// *blocknumber is the block to start looking at and is updated to the one found.
+// Returns false at end of file
+bool NextTraceBlock(TraceInput* in, int* blocknumber, uint64* tracebuf, uint8* ipcbuf,
+                    uint64** traceblock, uint8** ipcblock) {
+  if (block_index.empty()) {
+    return ReadTraceBlock(in, tracebuf, ipcbuf, traceblock, ipcblock);
+  }
+  while (((size_t)*blocknumber < block_index.size()) && (BlockMode(*blocknumber) == kSkipBlock)) {
+    ++(*blocknumber);
+  }
+  if (block_index.size() <= (size_t)*blocknumber) {return false;}
+  if (!SeekTraceInput(in, block_index[*blocknumber].offset)) {return false;}
+  return ReadTraceBlock(in, tracebuf, ipcbuf, traceblock, ipcblock);
+}
+
+// Parallel decode for -j N.
+// Blocks are read in batches. A quick sequential carry pass over each batch
+// saves the per-CPU decoding state just before every block (current pid and rpc,
+// latest timer interrupt) and records each name with the block that defined it.
+// Then a pool of N threads decodes the blocks in full, each from its saved state
+// into its own memory buffer, looking up names as of the start of its block.
+// The buffers go out in block order.
+
+// One trace block in a -j batch
+typedef struct {
+  uint64* traceblock;		// In the mapped file, or tracebuf
+  uint8* ipcblock;		// In the mapped file, or ipcbuf
+  uint64 tracebuf[kTraceBufSize];
+  uint8 ipcbuf[kTraceBufSize];
+  int blocknumber;
+  uint64 cpu;
+  bool good;			// False if StartBlock rejected the block
+  bool just_names;		// Outside the -start/-stop window
+  DecodeState start;		// Decoding state just before this block, but no names
+  DecodeStats stats;
+  FILE* out;			// In-memory output for this block
+  char* outbuf;
+  size_t outbuf_len;
+} BatchBlock;
+
+typedef struct {
+  BatchBlock* blocks;
+  int count;
+  int next;			// Next block to decode, shared by all the threads
+} Batch;
+
+// The -j threads, started once and handed one batch at a time
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;	// A new batch is ready, or quit
+  pthread_cond_t done_cond;	// The last thread finished the batch
+  pthread_t* threads;
+  Batch* batch;
+  int generation;		// Bumped for each new batch
+  int busy;			// Threads still working on this batch
+  bool quit;
+} DecodePool;
+
+// Take the next undecoded block until there are none
+void DecodeBatchBlocks(Batch* batch) {
+  for (;;) {
+    int k = __sync_fetch_and_add(&batch->next, 1);
+    if (batch->count <= k) {break;}
+    BatchBlock* bb = &batch->blocks[k];
+    if (bb->good) {
+      DecodeBlock(bb->traceblock, bb->ipcblock, bb->blocknumber, &bb->start, &bb->stats, bb->out,
+                  bb->just_names);
+    }
+    fclose(bb->out);
+  }
+}
+
+void* DecodeWorker(void* arg) {
+  DecodePool* pool = reinterpret_cast<DecodePool*>(arg);
+  int generation = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->quit && (pool->generation == generation)) {
+      pthread_cond_wait(&pool->start_cond, &pool->mutex);
+    }
+    if (pool->quit) {
+      pthread_mutex_unlock(&pool->mutex);
+      break;
+    }
+    generation = pool->generation;
+    Batch* batch = pool->batch;
+    pthread_mutex_unlock(&pool->mutex);
+
+    DecodeBatchBlocks(batch);
+
+    pthread_mutex_lock(&pool->mutex);
+    --pool->busy;
+    if (pool->busy == 0) {pthread_cond_signal(&pool->done_cond);}
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return NULL;
+}
+
+void StartDecodePool(DecodePool* pool) {
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  pool->threads = new pthread_t[num_threads];
+  pool->batch = NULL;
+  pool->generation = 0;
+  pool->busy = 0;
+  pool->quit = false;
+  for (int t = 0; t < num_threads; ++t) {
+    pthread_create(&pool->threads[t], NULL, DecodeWorker, pool);
+  }
+}
+
+// Hand a batch to the threads and wait until it is all decoded
+void RunDecodePool(DecodePool* pool, Batch* batch) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->batch = batch;
+  pool->busy = num_threads;
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->start_cond);
+  while (pool->busy != 0) {pthread_cond_wait(&pool->done_cond, &pool->mutex);}
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void StopDecodePool(DecodePool* pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start_cond);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int t = 0; t < num_threads; ++t) {
+    pthread_join(pool->threads[t], NULL);
+  }
+  delete[] pool->threads;
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->start_cond);
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+// Decode all the blocks using num_threads threads. Same output as the loop in DecodeTrace
+void ParallelDecodeBlocks(TraceInput* in, int maxblock,
+                          DecodeState* ds, DecodeStats* stats, uint8* all_flags) {
+  int batch_size = num_threads * kBlocksPerThread;
+  BatchBlock* blocks = new BatchBlock[batch_size];
+  DecodeStats carry_stats;	// Ignored; the full decode counts everything
+  InitDecodeStats(&carry_stats);
+
+  // The threads read names from here, never from the carry pass's own table
+  NameHistory name_history;
+  for (U64toString::const_iterator it = ds->names.begin(); it != ds->names.end(); ++it) {
+    name_history[it->first].push_back(BlockName(-1, it->second));
+  }
+  ds->name_history = &name_history;
+
+  DecodePool pool;
+  StartDecodePool(&pool);
+  int blocknumber = 0;
+  bool more = true;
+  while (more) {
+    // Read a batch and carry the state forward across it
+    int count = 0;
+    while (count < batch_size) {
+      BatchBlock* bb = &blocks[count];
+      if (!NextTraceBlock(in, &blocknumber, bb->tracebuf, bb->ipcbuf,
+                          &bb->traceblock, &bb->ipcblock)) {
+        more = false;
+        break;
+      }
+      if (blocknumber >= maxblock) {more = false; break;}
+      bb->blocknumber = blocknumber;
+      bb->cpu = bb->traceblock[0] >> 56;
+      bb->just_names = (BlockMode(blocknumber) == kNamesBlock);
+      bb->out = open_memstream(&bb->outbuf, &bb->outbuf_len);
+      InitDecodeStats(&bb->stats);
+      bb->good = StartBlock(bb->traceblock, blocknumber, ds, all_flags, bb->out);
+      if (bb->good) {
+        CopyBlockState(&bb->start, ds);
+        DecodeBlock(bb->traceblock, bb->ipcblock, blocknumber, ds, &carry_stats, NULL,
+                    bb->just_names);
+      }
+      ++blocknumber;
+      ++count;
+    }
+    if (count == 0) {break;}
+
+    // Decode the batch
+    Batch batch;
+    batch.blocks = blocks;
+    batch.count = count;
+    batch.next = 0;
+    block_records = merge_out;
+    RunDecodePool(&pool, &batch);
+    block_records = false;
+
+    // Write it out in block order
+    for (int k = 0; k < count; ++k) {
+      BatchBlock* bb = &blocks[k];
+      if (merge_out) {
+        // Write out everything that no block from here on can precede
+        FlushMergedRecords(stdout, LowestFrom(bb->blocknumber));
+        merge_cpu = bb->cpu;
+        const EventRecord* rec = reinterpret_cast<const EventRecord*>(bb->outbuf);
+        int nrec = bb->outbuf_len / sizeof(EventRecord);
+        for (int r = 0; r < nrec; ++r) {MergeRecord(stdout, &rec[r]);}
+      } else {
+        fwrite(bb->outbuf, 1, bb->outbuf_len, stdout);
+      }
+      free(bb->outbuf);
+      AddDecodeStats(stats, &bb->stats);
+    }
+  }
+  StopDecodePool(&pool);
+  ds->name_history = NULL;
+  delete[] blocks;
+}
+
+// Decode all the trace blocks in the input, writing events, names, and comments.
+// Called once, or twice for merged output (see merge_pass).
+void DecodeTrace(TraceInput* in, int maxblock) {
+  DecodeState ds;
+  InitDecodeState(&ds);
+  DecodeStats stats;
+  InitDecodeStats(&stats);
+
+  // Need this to sort in front of allthe timestamps
+  char comment[kMaxPrintBuffer];
+  snprintf(comment, kMaxPrintBuffer, "# ## VERSION: %d", kRawVersionNumber);
+  OutputComment(stdout, comment);
+  uint8 all_flags = 0;	// They should all be the same
+
+  uint64 tracebuf[kTraceBufSize];	// 8 bytes per trace entry, if not mapped
+  uint8 ipcbuf[kTraceBufSize];	// One byte per trace entry, if not mapped
+  uint64* traceblock;
+  uint8* ipcblock;
+  int blocknumber = 0;
+
+  // The names pass is quick; debug output has to stay in order
+  bool parallel = (1 < num_threads) && (merge_pass != kNamesPass) && !verbose && !hexevent;
+  if (parallel) {
+    ParallelDecodeBlocks(in, maxblock, &ds, &stats, &all_flags);
+  }
 
-  }	// while (fread...
   //--------------------------------------------------------------------------//
-  // End outer loop over blocks                                               //
+  // Outer loop over blocks                                                   //
   //--------------------------------------------------------------------------//
+  while (!parallel && NextTraceBlock(in, &blocknumber, tracebuf, ipcbuf, &traceblock, &ipcblock)) {
+    if (blocknumber >= maxblock) {break;}
 
+    // Write out everything that no block from here on can precede
+    if (merge_pass == kEventsPass) {
+      FlushMergedRecords(stdout, LowestFrom(blocknumber));
+    }
+
+    if (StartBlock(traceblock, blocknumber, &ds, &all_flags, stdout)) {
+      DecodeBlock(traceblock, ipcblock, blocknumber, &ds, &stats, stdout,
+                  BlockMode(blocknumber) == kNamesBlock);
+    }
+    ++blocknumber;
+  }
+  //--------------------------------------------------------------------------//
+  // End outer loop over blocks                                               //
+  //--------------------------------------------------------------------------//
 
-  fclose(f);
 
   // Pass along the OR of all incoming raw traceblock flags, in particular IPC_Flag 
-  fprintf(stdout, "# ## FLAGS: %d\n", all_flags);
+  snprintf(comment, kMaxPrintBuffer, "# ## FLAGS: %d", all_flags);
+  OutputComment(stdout, comment);
+  if (merge_pass == kNamesPass) {return;}
 
 
   // Reduce timestamps to start at no more than 60 seconds after the base minute.
   // With wraparound tracing, we don't know the true value of lo_timestamp until
   // possibly the very last input block. So we offset here. The output file already 
   // has the larger times so eventtospan will reduce those. 
-  uint64 extra_minutes = lo_timestamp / 6000000000l;
+  uint64 extra_minutes = stats.lo_timestamp / 6000000000l;
   uint64 offset_timestamp = extra_minutes * 6000000000l;
-  lo_timestamp -= offset_timestamp;
-  hi_timestamp -= offset_timestamp;
-  double lo_seconds = lo_timestamp / 100000000.0;
-  double hi_seconds = hi_timestamp / 100000000.0;
+  stats.lo_timestamp -= offset_timestamp;
+  stats.hi_timestamp -= offset_timestamp;
+  double lo_seconds = stats.lo_timestamp / 100000000.0;
+  double hi_seconds = stats.hi_timestamp / 100000000.0;
 if (lo_seconds < 0.0) {fprintf(stderr,"BUG: lo_seconds < 0.0 %12.8f\n", lo_seconds);}
 if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_seconds);}
   double total_seconds = hi_seconds - lo_seconds;
@@ -1484,33 +2246,142 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
     total_seconds = 1.0;	// avoid zdiv
   }
   // Pass along the time bounds 
-  fprintf(stdout, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
+  snprintf(comment, kMaxPrintBuffer, "# ## TIMES: %10.8f %10.8f", lo_seconds, hi_seconds);
+  if (merge_pass == kEventsPass) {
+    // Everything else is out. TIMES goes last instead of in front
+    FlushMergedRecords(stdout, ~0LLU);
+    merge_pass = kSinglePass;
+  }
+  OutputComment(stdout, comment);
 
 
-  uint64 total_cpus = unique_cpus.size();
+  uint64 total_cpus = stats.unique_cpus.size();
   if (total_cpus == 0) {total_cpus = 1;}	// avoid zdiv
    
   //fprintf(stderr, "rawtoevent(%3.1fMB):\n", blocknumber / kTraceBlocksPerMB); 
   //fprintf(stderr, 
   //        "  %s,  %lld events, %lld CPUs  (%1.0f/sec/cpu)\n",
-  //        FormatSecondsDateTime(base_usec_timestamp / 1000000),
-  //        event_count, total_cpus, (event_count / total_seconds) /total_cpus); 
-  uint64 total_irqs  = events_by_type[5] + events_by_type[7];
-  uint64 total_traps = events_by_type[4] + events_by_type[6];
-  uint64 total_sys64 = events_by_type[8] + events_by_type[9] +
-                       events_by_type[10] + events_by_type[11];
-  uint64 total_sys32 = events_by_type[12] + events_by_type[13] +
-                       events_by_type[14] + events_by_type[15];
+  //        FormatSecondsDateTime(ds.base_usec_timestamp / 1000000),
+  //        stats.event_count, total_cpus, (stats.event_count / total_seconds) /total_cpus); 
+  uint64 total_irqs  = stats.events_by_type[5] + stats.events_by_type[7];
+  uint64 total_traps = stats.events_by_type[4] + stats.events_by_type[6];
+  uint64 total_sys64 = stats.events_by_type[8] + stats.events_by_type[9] +
+                       stats.events_by_type[10] + stats.events_by_type[11];
+  uint64 total_sys32 = stats.events_by_type[12] + stats.events_by_type[13] +
+                       stats.events_by_type[14] + stats.events_by_type[15];
 
   //fprintf(stderr, "  %lld IRQ, %lld Trap, %lld Sys64, %lld Sys32, %lld Mark\n",
-  //        total_irqs, total_traps, total_sys64, total_sys32, total_marks); 
+  //        total_irqs, total_traps, total_sys64, total_sys32, stats.total_marks); 
   //fprintf(stderr, "  %lld PIDs, %lld context-switches (%1.0f/sec/cpu)\n", 
-  //        (u64)unique_pids.size(), ctx_switches, (ctx_switches / total_seconds) / total_cpus);
+  //        (u64)stats.unique_pids.size(), stats.ctx_switches, (stats.ctx_switches / total_seconds) / total_cpus);
 
-  fprintf(stderr, "rawtoevent: %llu events\n", event_count); 
+  fprintf(stderr, "rawtoevent: %llu events\n", stats.event_count); 
   fprintf(stderr, 
           "  %5.3f elapsed seconds: %5.3f to %5.3f\n", 
           total_seconds, lo_seconds, hi_seconds); 
+}
+
+//
+// Usage: rawtoevent <trace file name> [-v] [-h] [-maxblock n] [-merge] [-bin] [-j n]
+//   -merge writes events already sorted; no sort -n needed before eventtospan3
+//   -bin   writes fixed-width binary EventRecords, always merged; feed straight
+//          to eventtospan3 -bin
+//   -j n   decodes blocks on n threads; same output
+//   -index writes the block index foo.trace.idx for foo.trace, and nothing else
+//   -start s -stop s decode only the blocks with events in that range of seconds,
+//          plus the names from all blocks. Uses foo.trace.idx if there, else
+//          indexes first. Spans just outside the range still come out; spantotrim
+//          cuts exactly
+//
+int main (int argc, const char** argv) {
+  int maxblock = 999999999;
+  bool write_index = false;
 
+  // Pick up flags
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {verbose = true;}
+    if (strcmp(argv[i], "-h") == 0) {hexevent = true;}
+    if (strcmp(argv[i], "-merge") == 0) {merge_out = true;}
+    if (strcmp(argv[i], "-bin") == 0) {binary_out = true; merge_out = true; debug_out = stderr;}
+    if ((strcmp(argv[i], "-j") == 0) && (i < (argc - 1))) {
+      ++i;
+      num_threads = atoi(argv[i]);
+      if (num_threads < 1) {num_threads = 1;}
+    }
+    if ((strcmp(argv[i], "-maxblock") == 0) && (i < (argc - 1))) {
+      ++i;
+      maxblock = atoi(argv[i]);
+    }
+    if (strcmp(argv[i], "-index") == 0) {write_index = true;}
+    if ((strcmp(argv[i], "-start") == 0) && (i < (argc - 1))) {
+      ++i;
+      start_seconds = atof(argv[i]);
+      use_window = true;
+    }
+    if ((strcmp(argv[i], "-stop") == 0) && (i < (argc - 1))) {
+      ++i;
+      stop_seconds = atof(argv[i]);
+      use_window = true;
+    }
+  }
+
+  FILE* f = stdin;
+  if ((argc >= 2) && (argv[1][0] != '-')) {
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+      fprintf(stderr, "rawtoevent: %s did not open\n", argv[1]);
+      exit(0);
+    }
+    trace_name = argv[1];
+  }
+
+  if (write_index) {
+    if (trace_name == NULL) {
+      fprintf(stderr, "rawtoevent: -index needs a trace file name\n");
+      exit(0);
+    }
+    TraceInput in;
+    OpenTraceInput(f, &in);
+    BuildBlockIndex(&in);
+    CloseTraceInput(&in);
+    struct stat st;
+    fstat(fileno(f), &st);
+    string fname = string(trace_name) + ".idx";
+    WriteBlockIndex(fname.c_str(), st.st_size);
+    fprintf(stderr, "rawtoevent: %d blocks indexed in %s\n", (int)block_index.size(), fname.c_str());
+    fclose(f);
+    return 0;
+  }
+
+  if (!merge_out) {
+    // Walk the blocks in place if f is a file; a pipe is read with fread
+    if (use_window) {f = SeekableInput(f);}
+    TraceInput in;
+    OpenTraceInput(f, &in);
+    if (use_window) {SetupBlockIndex(&in, trace_name);}
+    DecodeTrace(&in, maxblock);
+    CloseTraceInput(&in);
+    fclose(f);
+    return 0;
+  }
+
+  // Names pass
+  f = SeekableInput(f);
+  TraceInput in;
+  OpenTraceInput(f, &in);
+  if (use_window) {SetupBlockIndex(&in, trace_name);}
+  merge_pass = kNamesPass;
+  DecodeTrace(&in, maxblock);
+  FlushEarlyRecords(stdout);
+  SuffixBlockLowest();
+
+  // Events pass
+  rewind(f);
+  SeekTraceInput(&in, 0);
+  merge_pass = kEventsPass;
+  DecodeTrace(&in, maxblock);
+  CloseTraceInput(&in);
+  fclose(f);
+  return 0;
 }
 
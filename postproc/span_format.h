@@ -0,0 +1,136 @@
+// span_format.h
+//
+// Fast writing of the span lines in the json files. Produces the same bytes as
+//   fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", ...)
+// with no printf format parsing. Times that are integer multiples of 10 nsec
+// are written as fixed-point seconds with eight fraction digits directly from
+// the integer, never going through double.
+//
+
+#ifndef __SPAN_FORMAT_H__
+#define __SPAN_FORMAT_H__
+
+#include <math.h>	// signbit
+#include <stdio.h>
+#include <string.h>
+
+#include "basetypes.h"
+
+// Longest line built in place; lines with longer names are written in pieces
+static const int kMaxSpanLine = 256;
+
+// For setvbuf on the json output, so the lines go out in few large writes
+static const int kOutputBufferSize = 1 << 20;
+
+// Times below 10**7 seconds go the fast way. Up to there a double is within
+// 0.5e-8 of the decimal value, so %.8f has exactly the same eight digits
+static const uint64 kMaxFastTenNsec = 1000000000000000llu;
+
+// Append the decimal digits of x, like %llu
+inline char* AppendUint(char* p, uint64 x) {
+  char temp[24];
+  int n = 0;
+  do {temp[n++] = '0' + (x % 10); x /= 10;} while (x != 0);
+  while (0 < n) {*p++ = temp[--n];}
+  return p;
+}
+
+// Like %d
+inline char* AppendInt(char* p, int x) {
+  if (x < 0) {
+    *p++ = '-';
+    return AppendUint(p, -static_cast<int64>(x));
+  }
+  return AppendUint(p, x);
+}
+
+// Like %<width>.8f of nsec10 / 100000000.0. nsec10 is below kMaxFastTenNsec
+inline char* AppendTenNsec(char* p, uint64 nsec10, int width) {
+  char temp[24];
+  int n = 0;
+  for (int i = 0; i < 8; ++i) {temp[n++] = '0' + (nsec10 % 10); nsec10 /= 10;}
+  temp[n++] = '.';
+  do {temp[n++] = '0' + (nsec10 % 10); nsec10 /= 10;} while (nsec10 != 0);
+  for (int i = n; i < width; ++i) {*p++ = ' ';}
+  while (0 < n) {*p++ = temp[--n];}
+  return p;
+}
+
+// If sec is exactly some multiple of 10 nsec that can go the fast way, set
+// *nsec10 and return true
+inline bool SecondsToTenNsec(double sec, uint64* nsec10) {
+  if (signbit(sec) || !(sec < kMaxFastTenNsec / 100000000.0)) {return false;}
+  *nsec10 = static_cast<uint64>(sec * 100000000.0 + 0.5);
+  return (*nsec10 / 100000000.0) == sec;
+}
+
+// Write one span line, with ts and dur in multiples of 10 nsec.
+// If quoted, the same as
+//   fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", ...)
+// else the same as
+//   fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n", ...)
+// where name already carries its closing punctuation
+inline void WriteSpanLine(FILE* f, uint64 ts, uint64 dur,
+                          int cpu, int pid, int rpcid, int eventnum,
+                          int arg, int retval, int ipc, const char* name, bool quoted) {
+  if ((kMaxFastTenNsec <= ts) || (kMaxFastTenNsec <= dur)) {
+    fprintf(f, quoted ? "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n"
+                      : "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
+            ts / 100000000.0, dur / 100000000.0, cpu, pid, rpcid, eventnum,
+            arg, retval, ipc, name);
+    return;
+  }
+  char line[kMaxSpanLine];
+  char* p = line;
+  *p++ = '[';
+  p = AppendTenNsec(p, ts, 12);
+  *p++ = ','; *p++ = ' ';
+  p = AppendTenNsec(p, dur, 10);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, cpu);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, pid);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, rpcid);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, eventnum);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, arg);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, retval);
+  *p++ = ','; *p++ = ' ';
+  p = AppendInt(p, ipc);
+  *p++ = ','; *p++ = ' ';
+  if (quoted) {*p++ = '"';}
+  const char* tail = quoted ? "\"],\n" : "\n";
+  int namelen = strlen(name);
+  int taillen = strlen(tail);
+  if ((p - line) + namelen + taillen <= kMaxSpanLine) {
+    memcpy(p, name, namelen);
+    p += namelen;
+    memcpy(p, tail, taillen);
+    p += taillen;
+    fwrite(line, 1, p - line, f);
+  } else {
+    fwrite(line, 1, p - line, f);
+    fwrite(name, 1, namelen, f);
+    fwrite(tail, 1, taillen, f);
+  }
+}
+
+// Same, with ts and dur in seconds. Times that are not exact multiples of
+// 10 nsec go through fprintf
+inline void WriteSpanLineSec(FILE* f, double ts_sec, double dur_sec,
+                             int cpu, int pid, int rpcid, int eventnum,
+                             int arg, int retval, int ipc, const char* name, bool quoted) {
+  uint64 ts, dur;
+  if (SecondsToTenNsec(ts_sec, &ts) && SecondsToTenNsec(dur_sec, &dur)) {
+    WriteSpanLine(f, ts, dur, cpu, pid, rpcid, eventnum, arg, retval, ipc, name, quoted);
+    return;
+  }
+  fprintf(f, quoted ? "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n"
+                    : "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
+          ts_sec, dur_sec, cpu, pid, rpcid, eventnum, arg, retval, ipc, name);
+}
+
+#endif	// __SPAN_FORMAT_H__
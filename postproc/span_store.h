@@ -0,0 +1,355 @@
+// span_store.h
+//
+// Columnar binary span file, an alternative to the json span lines that every
+// later stage otherwise re-parses with sscanf. eventtospan3 -spans writes one;
+// readers mmap it and touch only the columns they need.
+// spantotrim is the only reader so far; spantoprof, spantospan, samptoname_k/u
+// and makeself still take the json.
+//
+// Spans are kept in time order in blocks of kSpanBlockSpans. Each block holds
+// one array per field, and a small index gives each block's time range, so a
+// reader can binary-search to a start time instead of scanning from the front.
+// Names are interned once in a dictionary; spans carry a name number.
+// The json header lines are kept as text so the json can be made again exactly.
+//
+
+#ifndef __SPAN_STORE_H__
+#define __SPAN_STORE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "basetypes.h"
+
+static const char kSpanStoreMagic[8] = {'K', 'U', 'S', 'P', 'A', 'N', 'S', '1'};
+static const uint32 kSpanStoreVersion = 1;
+
+// Spans per block. Also the granularity of the time index
+static const int kSpanBlockSpans = 65536;
+
+// File layout. All offsets are from the front of the file, multiples of 8
+//   SpanStoreHeader
+//   block 0 columns, block 1 columns, ...
+//   SpanBlockIndex[block_count]
+//   uint32 name_offsets[name_count], then the NUL-terminated names
+//   json header text, each line ending in \n
+//
+// Columns of one block of n spans, in this order
+//   uint64 start_ts[n]		multiples of 10 nsec
+//   uint64 duration[n]		multiples of 10 nsec
+//   int32  cpu[n], pid[n], rpcid[n], eventnum[n], arg[n], retval[n], name[n]
+//   uint8  ipc[n]
+//   padding to a multiple of 8
+//
+typedef struct {
+  char magic[8];		// kSpanStoreMagic
+  uint32 version;
+  uint32 block_spans;		// kSpanBlockSpans
+  uint64 span_count;
+  uint64 block_count;
+  uint64 index_offset;
+  uint64 name_count;
+  uint64 names_offset;
+  uint64 text_offset;
+  uint64 text_len;
+} SpanStoreHeader;
+
+typedef struct {
+  uint64 first_ts;		// Earliest and latest start_ts in the block
+  uint64 last_ts;
+  uint64 offset;		// Of the block's columns
+  uint64 count;
+} SpanBlockIndex;
+
+// One block's columns, as pointers into the mapped file
+typedef struct {
+  uint64 count;
+  const uint64* start_ts;
+  const uint64* duration;
+  const int32* cpu;
+  const int32* pid;
+  const int32* rpcid;
+  const int32* eventnum;
+  const int32* arg;
+  const int32* retval;
+  const int32* name;
+  const uint8* ipc;
+} SpanBlock;
+
+inline uint64 SpanBlockBytes(uint64 n) {
+  return ((n * (8 + 8 + 7 * 4 + 1)) + 7) & ~7llu;
+}
+
+inline void SpanBlockColumns(const uint8* p, uint64 n, SpanBlock* block) {
+  block->count = n;
+  block->start_ts = (const uint64*)p;
+  block->duration = block->start_ts + n;
+  block->cpu = (const int32*)(block->duration + n);
+  block->pid = block->cpu + n;
+  block->rpcid = block->pid + n;
+  block->eventnum = block->rpcid + n;
+  block->arg = block->eventnum + n;
+  block->retval = block->arg + n;
+  block->name = block->retval + n;
+  block->ipc = (const uint8*)(block->name + n);
+}
+
+
+//
+// Reading
+//
+
+typedef struct {
+  const uint8* base;		// Whole file mapped read-only
+  uint64 size;
+  const SpanStoreHeader* hdr;
+  const SpanBlockIndex* index;
+  const uint32* name_offsets;
+  const char* names;
+  const char* text;
+} SpanStore;
+
+inline void SpanStoreDamaged() {
+  fprintf(stderr, "Span store is damaged or from another version\n");
+  exit(0);
+}
+
+// True if len bytes at offset lie within limit, written so nothing overflows
+inline bool SpanStoreFits(uint64 offset, uint64 len, uint64 limit) {
+  return (offset <= limit) && (len <= limit - offset);
+}
+
+// Map f if it is a span store. Return false, with nothing read, if it is not.
+// Every offset and count in the header, the index, and the name table is
+// checked against the file size here, so readers need not check them again
+inline bool OpenSpanStore(FILE* f, SpanStore* store) {
+  struct stat st;
+  if ((fstat(fileno(f), &st) != 0) || !S_ISREG(st.st_mode)) {return false;}
+  if (st.st_size < (off_t)sizeof(SpanStoreHeader)) {return false;}
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (p == MAP_FAILED) {return false;}
+  const SpanStoreHeader* hdr = (const SpanStoreHeader*)p;
+  if (memcmp(hdr->magic, kSpanStoreMagic, 8) != 0) {
+    munmap(p, st.st_size);
+    return false;
+  }
+  uint64 size = st.st_size;
+  if ((hdr->version != kSpanStoreVersion) || (hdr->block_spans != kSpanBlockSpans)) {
+    SpanStoreDamaged();
+  }
+  // Blocks, then index, then names, then text, each starting on 8 bytes
+  if (((hdr->index_offset | hdr->names_offset | hdr->text_offset) & 7) != 0) {
+    SpanStoreDamaged();
+  }
+  if (!SpanStoreFits(hdr->text_offset, hdr->text_len, size) ||
+      (hdr->names_offset > hdr->text_offset) ||
+      (hdr->index_offset > hdr->names_offset) ||
+      (hdr->index_offset < sizeof(SpanStoreHeader))) {
+    SpanStoreDamaged();
+  }
+  if ((hdr->block_count > (hdr->names_offset - hdr->index_offset) / sizeof(SpanBlockIndex)) ||
+      (hdr->name_count > (hdr->text_offset - hdr->names_offset) / sizeof(uint32))) {
+    SpanStoreDamaged();
+  }
+  store->base = (const uint8*)p;
+  store->size = st.st_size;
+  store->hdr = hdr;
+  store->index = (const SpanBlockIndex*)(store->base + hdr->index_offset);
+  store->name_offsets = (const uint32*)(store->base + hdr->names_offset);
+  store->names = (const char*)(store->name_offsets + hdr->name_count);
+  store->text = (const char*)(store->base + hdr->text_offset);
+
+  // Each block lies before the index, and the blocks hold all the spans
+  uint64 spans = 0;
+  for (uint64 b = 0; b < hdr->block_count; ++b) {
+    const SpanBlockIndex* entry = &store->index[b];
+    if (((entry->offset & 7) != 0) || (entry->offset < sizeof(SpanStoreHeader)) ||
+        (entry->count == 0) || (entry->count > kSpanBlockSpans) ||
+        !SpanStoreFits(entry->offset, SpanBlockBytes(entry->count), hdr->index_offset)) {
+      SpanStoreDamaged();
+    }
+    spans += entry->count;
+  }
+  if (spans != hdr->span_count) {SpanStoreDamaged();}
+
+  // Each name starts inside the name bytes and ends in a NUL before the text
+  uint64 names_len = hdr->text_offset - (hdr->names_offset + hdr->name_count * sizeof(uint32));
+  for (uint64 i = 0; i < hdr->name_count; ++i) {
+    uint32 offset = store->name_offsets[i];
+    if ((offset >= names_len) ||
+        (memchr(store->names + offset, '\0', names_len - offset) == NULL)) {
+      SpanStoreDamaged();
+    }
+  }
+  return true;
+}
+
+// b must be less than block_count; OpenSpanStore checked the index entry
+inline void GetSpanBlock(const SpanStore* store, uint64 b, SpanBlock* block) {
+  SpanBlockColumns(store->base + store->index[b].offset, store->index[b].count, block);
+}
+
+// Name numbers come from the span columns, which are not checked when opened
+inline const char* SpanName(const SpanStore* store, int32 name) {
+  if ((name < 0) || ((uint64)name >= store->hdr->name_count)) {SpanStoreDamaged();}
+  return store->names + store->name_offsets[name];
+}
+
+// First block that can hold a span starting at or after ts, or block_count
+inline uint64 FindSpanBlock(const SpanStore* store, uint64 ts) {
+  uint64 lo = 0;
+  uint64 hi = store->hdr->block_count;
+  while (lo < hi) {
+    uint64 mid = (lo + hi) / 2;
+    if (store->index[mid].last_ts < ts) {lo = mid + 1;} else {hi = mid;}
+  }
+  return lo;
+}
+
+
+//
+// Writing
+//
+
+typedef struct {
+  FILE* f;			// Must be seekable; the header is rewritten at the end
+  uint64 offset;		// Bytes written so far
+  SpanStoreHeader hdr;
+  std::vector<SpanBlockIndex> index;
+  std::map<std::string, int32> name_ids;
+  std::vector<std::string> names;
+  std::string text;
+  // Current block, one vector per column
+  std::vector<uint64> start_ts;
+  std::vector<uint64> duration;
+  std::vector<int32> cpu;
+  std::vector<int32> pid;
+  std::vector<int32> rpcid;
+  std::vector<int32> eventnum;
+  std::vector<int32> arg;
+  std::vector<int32> retval;
+  std::vector<int32> name;
+  std::vector<uint8> ipc;
+} SpanStoreWriter;
+
+template<typename T> void WriteSpanColumn(const std::vector<T>& v, SpanStoreWriter* w) {
+  fwrite(v.data(), sizeof(T), v.size(), w->f);
+}
+
+inline void PadSpanStore(SpanStoreWriter* w) {
+  static const uint8 zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  int pad = (8 - (w->offset & 7)) & 7;
+  fwrite(zeros, 1, pad, w->f);
+  w->offset += pad;
+}
+
+inline void StartSpanStore(FILE* f, SpanStoreWriter* w) {
+  w->f = f;
+  memset(&w->hdr, 0, sizeof(w->hdr));
+  memcpy(w->hdr.magic, kSpanStoreMagic, 8);
+  w->hdr.version = kSpanStoreVersion;
+  w->hdr.block_spans = kSpanBlockSpans;
+  // Placeholder until FinishSpanStore
+  fwrite(&w->hdr, 1, sizeof(w->hdr), f);
+  w->offset = sizeof(w->hdr);
+}
+
+// Write out the spans gathered so far as one block
+inline void FlushSpanBlock(SpanStoreWriter* w) {
+  uint64 n = w->start_ts.size();
+  if (n == 0) {return;}
+  SpanBlockIndex entry;
+  entry.first_ts = w->start_ts[0];
+  entry.last_ts = w->start_ts[n - 1];
+  entry.offset = w->offset;
+  entry.count = n;
+  w->index.push_back(entry);
+  WriteSpanColumn(w->start_ts, w);
+  WriteSpanColumn(w->duration, w);
+  WriteSpanColumn(w->cpu, w);
+  WriteSpanColumn(w->pid, w);
+  WriteSpanColumn(w->rpcid, w);
+  WriteSpanColumn(w->eventnum, w);
+  WriteSpanColumn(w->arg, w);
+  WriteSpanColumn(w->retval, w);
+  WriteSpanColumn(w->name, w);
+  WriteSpanColumn(w->ipc, w);
+  w->offset += n * (8 + 8 + 7 * 4 + 1);
+  PadSpanStore(w);
+  w->start_ts.clear(); w->duration.clear(); w->cpu.clear(); w->pid.clear();
+  w->rpcid.clear(); w->eventnum.clear(); w->arg.clear(); w->retval.clear();
+  w->name.clear(); w->ipc.clear();
+}
+
+// Add one span. Spans must come in start_ts order
+inline void AddSpan(SpanStoreWriter* w, uint64 ts, uint64 dur, int cpu, int pid,
+                    int rpcid, int eventnum, int arg, int retval, int ipc,
+                    const std::string& name) {
+  std::map<std::string, int32>::const_iterator it = w->name_ids.find(name);
+  int32 id;
+  if (it == w->name_ids.end()) {
+    id = w->names.size();
+    w->name_ids[name] = id;
+    w->names.push_back(name);
+  } else {
+    id = it->second;
+  }
+  w->start_ts.push_back(ts);
+  w->duration.push_back(dur);
+  w->cpu.push_back(cpu);
+  w->pid.push_back(pid);
+  w->rpcid.push_back(rpcid);
+  w->eventnum.push_back(eventnum);
+  w->arg.push_back(arg);
+  w->retval.push_back(retval);
+  w->name.push_back(id);
+  w->ipc.push_back(ipc);
+  ++w->hdr.span_count;
+  if (w->start_ts.size() == kSpanBlockSpans) {FlushSpanBlock(w);}
+}
+
+// Add one json line that is not a span
+inline void AddSpanStoreText(SpanStoreWriter* w, const char* line) {
+  w->text += line;
+  w->text += '\n';
+}
+
+// Write the last block, the index, names, and text, then the real header
+inline void FinishSpanStore(SpanStoreWriter* w) {
+  FlushSpanBlock(w);
+  w->hdr.block_count = w->index.size();
+  w->hdr.index_offset = w->offset;
+  fwrite(w->index.data(), sizeof(SpanBlockIndex), w->index.size(), w->f);
+  w->offset += w->index.size() * sizeof(SpanBlockIndex);
+
+  w->hdr.name_count = w->names.size();
+  w->hdr.names_offset = w->offset;
+  uint32 name_offset = 0;
+  for (size_t i = 0; i < w->names.size(); ++i) {
+    fwrite(&name_offset, sizeof(uint32), 1, w->f);
+    name_offset += w->names[i].size() + 1;
+  }
+  for (size_t i = 0; i < w->names.size(); ++i) {
+    fwrite(w->names[i].c_str(), 1, w->names[i].size() + 1, w->f);
+  }
+  w->offset += w->names.size() * sizeof(uint32) + name_offset;
+  PadSpanStore(w);
+
+  w->hdr.text_offset = w->offset;
+  w->hdr.text_len = w->text.size();
+  fwrite(w->text.data(), 1, w->text.size(), w->f);
+  w->offset += w->text.size();
+
+  fseeko(w->f, 0, SEEK_SET);
+  fwrite(&w->hdr, 1, sizeof(w->hdr), w->f);
+  fflush(w->f);
+}
+
+#endif	// __SPAN_STORE_H__
@@ -4,6 +4,8 @@
 //
 // Copyright 2021 Richard L. Sites
 //
+// Summary rows with exact 10ns times skip fprintf
+//
 // Compile with g++ -O2 spantoprof.cc -o spantoprof
 //
 
@@ -18,6 +20,7 @@
 
 #include "basetypes.h"
 #include "kutrace_lib.h"
+#include "span_format.h"
 
 
 using std::map;
@@ -842,19 +845,16 @@ void WriteOneRowJson(FILE* f, int type, const RowTotal& rowtotal, int new_rownum
     switch (type) {
     case SUMM_CPU:
       //                   ts dur cpu  pid rpc event  arg ret ipc  name
-      fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec,   new_rownum, -1, -1,   eventtotal->eventnum,
-          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str());
+      WriteSpanLineSec(f, ts_sec, dur_sec,   new_rownum, -1, -1,   eventtotal->eventnum,
+          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str(), true);
       break;
     case SUMM_PID:
-      fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec,   -1, new_rownum, -1,   eventtotal->eventnum,
-          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str());
+      WriteSpanLineSec(f, ts_sec, dur_sec,   -1, new_rownum, -1,   eventtotal->eventnum,
+          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str(), true);
       break;
     case SUMM_RPC:
-      fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec,   -1, -1, new_rownum,   eventtotal->eventnum,
-          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str());
+      WriteSpanLineSec(f, ts_sec, dur_sec,   -1, -1, new_rownum,   eventtotal->eventnum,
+          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str(), true);
       break;
     }
     ++output_events;
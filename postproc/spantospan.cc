@@ -13,6 +13,7 @@
 // dick sites 2017.11.18
 //  add instructions per cycle IPC support
 // dsites 2022.07.07 Total rewrite
+// Allow CPU numbers up to 255
 //
 
 /***
@@ -67,7 +68,7 @@ typedef struct {
   SpanMap spanmap;
 } CPUstate;
 
-static const int kMaxCpus = 80;
+static const int kMaxCpus = 256;	// Raw trace block header CPU number is 8 bits
 
 
 // Globals
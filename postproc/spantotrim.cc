@@ -1,8 +1,12 @@
 // Little program to filter time range in per-CPU timespans
 // 
 // Filter from stdin to stdout
+// stdin is a json file of spans or a span store from eventtospan3 -spans
 // One or two command-line parameters -- 
 //   stat_second [stop_second]
+// or any number of windows, each to its own file --
+//   -w <out file> label | start_sec [stop_sec]
+//   -windows <file of lines: out file, label | start_sec [stop_sec]>
 //
 // dick sites 2016.11.07
 // dick sites 2017.08.16
@@ -11,19 +15,31 @@
 //  Add trim by mark_abc label
 // dick sites 2017.11.18
 //  add optional instructions per cycle IPC support
+//  Kept spans go out through WriteSpanLineSec, in big writes
+//  Read a columnar span store from eventtospan3 -spans, see span_store.h
+//  Map a json file on stdin and binary-search to start_sec; keep long spans
+//  that start earlier but run into the window
+//  Trim many windows to their own files in one pass, with -w and -windows
+//  Write lines that are not spans straight from the input; lines of any length
 //
 //
 // Compile with g++ -O2 spantotrim.cc from_base40.cc -o spantotrim
 //
 
+#include <algorithm>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "basetypes.h"
 #include "from_base40.h"
+#include "span_format.h"
+#include "span_store.h"
 
 using std::string;
 using std::map;
@@ -40,7 +56,7 @@ typedef struct {
   int arg;
   int retval;
   int ipc;
-  char name[64];
+  const char* name;	// Rest of the line, with its trailing punctuation
 } OneSpan;
 
 static int incoming_version = 0;  // Incoming version number, if any, from ## VERSION: 2
@@ -57,6 +73,9 @@ inline bool is_mark_abc(uint64 event) {return (event == 0x020A) || (event == 0x0
 
 static const int kMaxBufferSize = 256;
 
+// eventtospan3 drops spans longer than this, so no earlier span reaches the window
+static const double kMaxSpanSec = 8.0;
+
 // Read next line, stripping any crlf. Return false if no more.
 bool ReadLine(FILE* f, char* buffer, int maxsize) {
   char* s = fgets(buffer, maxsize, f);
@@ -73,97 +92,460 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
   fprintf(stderr, "Usage: spantotrim label | start_sec [stop_sec]\n");
+  fprintf(stderr, "       spantotrim {-w <out file> label | start_sec [stop_sec]} [-windows <file>]\n");
   exit(0);
 }
 
-//
-// Filter from stdin to stdout
-//
-int main (int argc, const char** argv) {
-  double start_sec = 0.0;
-  double stop_sec = 999.0;
+// One trim window. The command-line form has one, written to the file passed
+// in. -w and -windows give any number, each written to its own file, all in
+// one pass over the input. Windows may nest or overlap
+typedef struct {
+  string fname;		// Empty for the command-line window
+  FILE* f;		// Open output file, or NULL
+  bool opened;		// Header written; later opens append
+  double start_sec;
+  double stop_sec;
   char label[8];
   char notlabel[8];
+  bool is_label;
   // Default: label filter is a nop
-  bool inside_label_span = true;
-  bool next_inside_label_span = true;
+  bool inside_label_span;
+  bool next_inside_label_span;
+  bool active;		// On the active list
+  int output_events;
+} TrimWindow;
 
-  if (argc < 2) {Usage();}
-  
-  if ('9' < argv[1][0]) {
+// Trim state
+static std::vector<TrimWindow> windows;
+static std::vector<TrimWindow*> by_open;	// Time windows, by start_sec
+static size_t next_open = 0;		// Next of by_open to make active
+static std::vector<TrimWindow*> active;	// Windows that may keep the next span
+static map<string, std::vector<TrimWindow*> > by_label;
+static map<string, std::vector<TrimWindow*> > by_notlabel;
+static std::vector<TrimWindow*> kept;		// Windows keeping the current span
+static string header_text;			// Lines that are not spans, for each file
+static double first_sec = 0.0;		// No window keeps a span ending before this
+static double last_sec = 999.0;		// or one starting at or after this
+static int output_events = 0;
+static bool past_stop = false;	// Seen a span at or after last_sec
+
+// Pick up label | start_sec [stop_sec]. arg2 may be NULL
+void ParseWindow(const char* arg1, const char* arg2, TrimWindow* w) {
+  w->f = NULL;
+  w->opened = false;
+  w->start_sec = 0.0;
+  w->stop_sec = 999.0;
+  w->label[0] = '\0';
+  w->notlabel[0] = '\0';
+  w->is_label = false;
+  w->inside_label_span = true;
+  w->next_inside_label_span = true;
+  w->active = false;
+  w->output_events = 0;
+
+  if ('9' < arg1[0]) {
     // Does not start with a digit. Assume it is a label and
     // that we should filter  
     //   Mark_abc label .. Mark_abc /label 
     // inclusive
-    int len = strlen(argv[1]);
+    int len = strlen(arg1);
     if (len > 6 ) {len = 6;}
-    memcpy(label, argv[1], len + 1);
-    memcpy(notlabel + 1, label, len);
-    notlabel[0] = '/';
-    notlabel[7] = '\0';
-    inside_label_span = false;
-    next_inside_label_span = false;
+    memcpy(w->label, arg1, len);
+    w->label[len] = '\0';
+    memcpy(w->notlabel + 1, w->label, len + 1);
+    w->notlabel[0] = '/';
+    w->is_label = true;
+    w->inside_label_span = false;
+    w->next_inside_label_span = false;
+    return;
   }
 
-  if (inside_label_span && (argc >= 2)) {
-    int n = sscanf(argv[1], "%lf", &start_sec);
+  int n = sscanf(arg1, "%lf", &w->start_sec);
+  if (n != 1) {Usage();}
+  if (arg2 != NULL) {
+    n = sscanf(arg2, "%lf", &w->stop_sec);
     if (n != 1) {Usage();}
   }
-  if (inside_label_span && (argc >= 3)) {
-    int n = sscanf(argv[2], "%lf", &stop_sec);
-    if (n != 1) {Usage();}
+}
+
+// Add the windows in fname, one per line:  <out file> label | start_sec [stop_sec]
+void ReadWindows(const char* fname) {
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+  char buffer[kMaxBufferSize];
+  while (ReadLine(f, buffer, kMaxBufferSize)) {
+    char outname[kMaxBufferSize];
+    char arg1[kMaxBufferSize];
+    char arg2[kMaxBufferSize];
+    if ((buffer[0] == '#') || (buffer[0] == '\0')) {continue;}
+    int n = sscanf(buffer, "%s %s %s", outname, arg1, arg2);
+    if (n < 2) {Usage();}
+    TrimWindow w;
+    ParseWindow(arg1, (n == 3) ? arg2 : NULL, &w);
+    w.fname = string(outname);
+    windows.push_back(w);
+  }
+  fclose(f);
+}
+
+inline bool SortByStart(const TrimWindow* a, const TrimWindow* b) {
+  return a->start_sec < b->start_sec;
+}
+
+// The file for window w. The command-line window writes to f. The others are
+// opened when they first keep something, and closed when done
+FILE* WindowFile(TrimWindow* w, FILE* f) {
+  if (w->fname.empty()) {return f;}
+  if (w->f == NULL) {
+    w->f = fopen(w->fname.c_str(), w->opened ? "ab" : "wb");
+    if (w->f == NULL) {
+      fprintf(stderr, "%s did not open\n", w->fname.c_str());
+      exit(0);
+    }
+    if (!w->opened) {fwrite(header_text.data(), 1, header_text.size(), w->f);}
+    w->opened = true;
+  }
+  return w->f;
+}
+
+void CloseWindow(TrimWindow* w) {
+  if (w->f != NULL) {fclose(w->f);}
+  w->f = NULL;
+}
+
+void Activate(TrimWindow* w) {
+  if (!w->active) {active.push_back(w);}
+  w->active = true;
+}
+
+void Deactivate(TrimWindow* w) {
+  for (size_t i = 0; i < active.size(); ++i) {
+    if (active[i] == w) {
+      active[i] = active.back();
+      active.pop_back();
+      break;
+    }
   }
+  w->active = false;
+  CloseWindow(w);
+}
+
+// Copy a line of len bytes that is not a span to every output
+void PutText(const char* line, int len, FILE* f) {
+  header_text.append(line, len);
+  header_text += '\n';
+  for (size_t i = 0; i < windows.size(); ++i) {
+    TrimWindow* w = &windows[i];
+    FILE* out = w->fname.empty() ? f : w->f;
+    if (out != NULL) {
+      fwrite(line, 1, len, out);
+      fputc('\n', out);
+    }
+  }
+}
+
+// Find the windows that keep the span at start_ts for duration (seconds),
+// into kept. Return false if there are none.
+// Also keeps track of mark_abc labels
+bool RouteSpan(double start_ts, double duration, int event, int arg) {
+  kept.clear();
+  if (start_ts >= last_sec) {past_stop = true; return false;}
 
+  // A time window also keeps spans that start earlier but run into it
+  while ((next_open < by_open.size()) &&
+         (by_open[next_open]->start_sec - kMaxSpanSec <= start_ts)) {
+    Activate(by_open[next_open++]);
+  }
+
+  // Keep an eye out for mark_abc
+  if (is_mark_abc(event) && !by_label.empty()) {
+    char temp[8];
+    Base40ToChar(arg, temp);
+    // Turn on keeping events if we find a matching label
+    map<string, std::vector<TrimWindow*> >::iterator it = by_label.find(string(temp));
+    if (it != by_label.end()) {
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        TrimWindow* w = it->second[i];
+        w->inside_label_span = true;
+        w->next_inside_label_span = true;
+        Activate(w);
+      }
+    }
+    // Defer turning off keeping events so we keep this one
+    it = by_notlabel.find(string(temp));
+    if (it != by_notlabel.end()) {
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        it->second[i]->next_inside_label_span = false;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < active.size(); ) {
+    TrimWindow* w = active[i];
+    if (!w->is_label) {
+      if (start_ts >= w->stop_sec) {
+        // Done with this window
+        Deactivate(w);
+        continue;
+      }
+      // Started earlier: keep only if still running at start_sec
+      if ((start_ts < w->start_sec) && (start_ts + duration <= w->start_sec)) {
+        ++i;
+        continue;
+      }
+    }
+    if (w->inside_label_span) {kept.push_back(w);}
+    ++i;
+  }
+  return !kept.empty();
+}
+
+// After the span is written to the kept windows
+void SpanKept() {
+  output_events += kept.size();
+  for (size_t i = 0; i < kept.size(); ++i) {
+    TrimWindow* w = kept[i];
+    ++w->output_events;
+    w->inside_label_span = w->next_inside_label_span;
+    if (!w->inside_label_span) {Deactivate(w);}
+  }
+}
+
+// The span line being parsed. Only span lines are copied here
+static string span_line;
+
+// Filter one input line of len bytes, without its line ending, to f.
+// Return false at the 999.0 end marker
+bool TrimLine(const char* line, int len, FILE* f) {
   // expecting:
   //    ts           dur       cpu  pid  rpc event arg ret  name--------------------> 
   //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, "gnome-terminal-.1910"],
 
-  int output_events = 0;
-  char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
-    char buffer2[256];
-    buffer2[0] = '\0';
-    OneSpan onespan;
-    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %s",
-                   &onespan.start_ts, &onespan.duration, 
-                   &onespan.cpu, &onespan.pid, &onespan.rpcid, 
-                   &onespan.event, &onespan.arg, &onespan.retval, &onespan.ipc, onespan.name);
-    // fprintf(stderr, "%d: %s\n", n, buffer);
-    
-    if (n < 9) {
-      // Copy unchanged anything not a span
-      fprintf(stdout, "%s\n", buffer);
-      continue;
+  if ((len == 0) || (line[0] != '[')) {
+    PutText(line, len, f);
+    return true;
+  }
+  span_line.assign(line, len);
+  OneSpan onespan;
+  int name_start = len;
+  int n = sscanf(span_line.c_str(), "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                 &onespan.start_ts, &onespan.duration, 
+                 &onespan.cpu, &onespan.pid, &onespan.rpcid, 
+                 &onespan.event, &onespan.arg, &onespan.retval, &onespan.ipc, &name_start);
+  onespan.name = span_line.c_str() + name_start;
+  // fprintf(stderr, "%d: %s\n", n, span_line.c_str());
+  
+  if (n < 9) {
+    // Copy unchanged anything not a span
+    PutText(line, len, f);
+    return true;
+  }
+  if (onespan.start_ts >= 999.0) {return false;}	// Always strip 999.0 end marker and stop
+  if (!RouteSpan(onespan.start_ts, onespan.duration, onespan.event, onespan.arg)) {return true;}
+
+  // Name has trailing punctuation, including ],
+  for (size_t i = 0; i < kept.size(); ++i) {
+    WriteSpanLineSec(WindowFile(kept[i], f), onespan.start_ts, onespan.duration,
+                     onespan.cpu, onespan.pid, onespan.rpcid, onespan.event, 
+                     onespan.arg, onespan.retval, onespan.ipc, onespan.name, false);
+  }
+  SpanKept();
+  return true;
+}
+
+// Set *len to the length of the line at p, up to limit, less any crlf.
+// Return the start of the next line
+const char* LineAt(const char* p, const char* limit, int* len) {
+  const char* nl = (const char*)memchr(p, '\n', limit - p);
+  const char* next = (nl == NULL) ? limit : nl + 1;
+  if (nl == NULL) {nl = limit;}
+  if ((p < nl) && (nl[-1] == '\r')) {--nl;}
+  *len = nl - p;
+  return next;
+}
+
+// Start time in seconds of the line at p. Anything not a span sorts last
+double LineStartSec(const char* p, const char* limit) {
+  if ((limit <= p) || (*p != '[')) {return 1.0e99;}
+  return strtod(p + 1, NULL);
+}
+
+// The first line in [lo..hi) starting at or after sec. The span lines are
+// sorted, so binary search on byte offsets, moving each probe to a line start.
+// lo and hi are line starts
+const char* FindLine(const char* lo, const char* hi, double sec) {
+  while (lo < hi) {
+    const char* mid = lo + (hi - lo) / 2;
+    // Probe the first line starting at or after mid, or lo if there is none
+    const char* m = lo;
+    if (mid != lo) {
+      const char* nl = (const char*)memchr(mid - 1, '\n', hi - (mid - 1));
+      if ((nl != NULL) && (nl + 1 < hi)) {m = nl + 1;}
     }
-    if (onespan.start_ts >= 999.0) {break;}	// Always strip 999.0 end marker and stop
-    if (onespan.start_ts < start_sec) {continue;}
-    if (onespan.start_ts >= stop_sec) {continue;}
-
-    // Keep an eye out for mark_abc
-    if (is_mark_abc(onespan.event)) {
-      char temp[8];
-      Base40ToChar(onespan.arg, temp);
-      // Turn on keeping events if we find a mathcing label
-      if (strcmp(label, temp) == 0) {inside_label_span = true;}
-      // Defer turning off keeping events so we keep this one
-      next_inside_label_span = inside_label_span;
-      if (strcmp(notlabel, temp) == 0) {next_inside_label_span = false;}
+    const char* next = (const char*)memchr(m, '\n', hi - m);
+    next = (next == NULL) ? hi : next + 1;
+    if (LineStartSec(m, hi) < sec) {lo = next;} else {hi = m;}
+  }
+  return lo;
+}
+
+// Filter a mapped json file to f. Header lines are copied, then only the
+// span lines from just before first_sec up to last_sec are read
+void TrimJsonText(const char* base, uint64 size, FILE* f) {
+  const char* p = base;
+  const char* limit = base + size;
+  int len;
+  while ((p < limit) && (*p != '[')) {
+    const char* line = p;
+    p = LineAt(p, limit, &len);
+    TrimLine(line, len, f);
+  }
+  if (0.0 < first_sec) {p = FindLine(p, limit, first_sec - kMaxSpanSec);}
+  // Most spans before first_sec end before it too; skip them without sscanf
+  while ((p < limit) && (LineStartSec(p, limit) < first_sec)) {
+    char* end;
+    double ts = strtod(p + 1, &end);
+    if ((*end != ',') || (first_sec < ts + strtod(end + 1, NULL))) {break;}
+    const char* nl = (const char*)memchr(p, '\n', limit - p);
+    p = (nl == NULL) ? limit : nl + 1;
+  }
+  while (p < limit) {
+    const char* line = p;
+    p = LineAt(p, limit, &len);
+    if (!TrimLine(line, len, f) || past_stop) {break;}
+  }
+}
+
+// Filter a span store to f. Spans are in time order, so start at the first
+// block that can hold first_sec and stop at last_sec. Until a span is kept,
+// only the start_ts, duration, eventnum, and arg columns are read
+void TrimSpanStore(const SpanStore* store, FILE* f) {
+  // Header text lines are copied unchanged
+  const char* p = store->text;
+  const char* limit = store->text + store->hdr->text_len;
+  while (p < limit) {
+    const char* nl = (const char*)memchr(p, '\n', limit - p);
+    if (nl == NULL) {nl = limit;}
+    PutText(p, nl - p, f);
+    p = nl + 1;
+  }
+
+  uint64 start_ts = 0;
+  // One less, in case the multiply rounded up
+  if (kMaxSpanSec < first_sec) {
+    start_ts = static_cast<uint64>((first_sec - kMaxSpanSec) * 100000000.0);
+  }
+  if (0 < start_ts) {--start_ts;}
+  for (uint64 b = FindSpanBlock(store, start_ts); b < store->hdr->block_count; ++b) {
+    SpanBlock block;
+    GetSpanBlock(store, b, &block);
+    for (uint64 i = 0; i < block.count; ++i) {
+      double ts_sec = block.start_ts[i] / 100000000.0;
+      if (ts_sec >= 999.0) {return;}	// Like the 999.0 end marker
+      if (!RouteSpan(ts_sec, block.duration[i] / 100000000.0, block.eventnum[i], block.arg[i])) {
+        if (past_stop) {return;}
+        continue;
+      }
+
+      for (size_t k = 0; k < kept.size(); ++k) {
+        WriteSpanLine(WindowFile(kept[k], f), block.start_ts[i], block.duration[i],
+                      block.cpu[i], block.pid[i], block.rpcid[i], block.eventnum[i],
+                      block.arg[i], block.retval[i], block.ipc[i],
+                      SpanName(store, block.name[i]), true);
+      }
+      SpanKept();
+    }
+  }
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  // Pick up the windows from the command line
+  if (argc < 2) {Usage();}
+  bool multi = (strcmp(argv[1], "-w") == 0) || (strcmp(argv[1], "-windows") == 0);
+  if (!multi) {
+    TrimWindow w;
+    ParseWindow(argv[1], (argc >= 3) ? argv[2] : NULL, &w);
+    windows.push_back(w);
+  }
+  for (int i = 1; multi && (i < argc); ++i) {
+    if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 2))) {
+      TrimWindow w;
+      // A stop_sec is optional, so take the next argument only if it is a number
+      const char* arg2 = NULL;
+      if ((i < (argc - 3)) && (argv[i + 3][0] <= '9') && (argv[i + 3][0] != '-')) {
+        arg2 = argv[i + 3];
+      }
+      ParseWindow(argv[i + 2], arg2, &w);
+      w.fname = string(argv[i + 1]);
+      windows.push_back(w);
+      i += (arg2 == NULL) ? 2 : 3;
+    } else if ((strcmp(argv[i], "-windows") == 0) && (i < (argc - 1))) {
+      ReadWindows(argv[++i]);
+    } else {
+      Usage();
     }
-    if (!inside_label_span) {continue;}	
+  }
 
-    // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
-            onespan.start_ts, onespan.duration,
-            onespan.cpu, onespan.pid, onespan.rpcid, onespan.event, 
-            onespan.arg, onespan.retval, onespan.ipc, onespan.name);
-    ++output_events;
+  // No pointers into windows are taken until it is complete
+  first_sec = 999.0;
+  last_sec = 0.0;
+  for (size_t i = 0; i < windows.size(); ++i) {
+    TrimWindow* w = &windows[i];
+    if (w->is_label) {
+      by_label[string(w->label)].push_back(w);
+      by_notlabel[string(w->notlabel)].push_back(w);
+      first_sec = 0.0;
+      last_sec = 999.0;
+    } else {
+      by_open.push_back(w);
+      if (w->start_sec < first_sec) {first_sec = w->start_sec;}
+      if (last_sec < w->stop_sec) {last_sec = w->stop_sec;}
+    }
+  }
+  std::sort(by_open.begin(), by_open.end(), SortByStart);
+  if (999.0 < last_sec) {last_sec = 999.0;}
+
+  setvbuf(stdout, NULL, _IOFBF, kOutputBufferSize);
 
-    inside_label_span = next_inside_label_span;
+  // A span store or a json file is mapped and searched. A pipe is read line by line
+  SpanStore store;
+  struct stat st;
+  void* base = MAP_FAILED;
+  if (OpenSpanStore(stdin, &store)) {
+    TrimSpanStore(&store, stdout);
+  } else if ((fstat(fileno(stdin), &st) == 0) && S_ISREG(st.st_mode) && (st.st_size != 0) &&
+             ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(stdin), 0)) != MAP_FAILED)) {
+    TrimJsonText((const char*)base, st.st_size, stdout);
+  } else {
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, stdin)) >= 0) {
+      // Strip any crlf or cr or lf
+      if ((0 < len) && (line[len - 1] == '\n')) {--len;}
+      if ((0 < len) && (line[len - 1] == '\r')) {--len;}
+      if (!TrimLine(line, len, stdout)) {break;}
+    }
+    free(line);
   }
 
-  // Add marker and closing at the end
-  FinalJson(stdout);
-  fprintf(stderr, "spantotrim: %d events\n", output_events);
+  // Add marker and closing at the end of each output
+  for (size_t i = 0; i < windows.size(); ++i) {
+    TrimWindow* w = &windows[i];
+    FinalJson(WindowFile(w, stdout));
+    CloseWindow(w);
+  }
+  if ((windows.size() == 1) && windows[0].fname.empty()) {
+    fprintf(stderr, "spantotrim: %d events\n", output_events);
+  } else {
+    fprintf(stderr, "spantotrim: %d windows, %d events\n", (int)windows.size(), output_events);
+  }
 
   return 0;
 }
@@ -0,0 +1,448 @@
+// trace_compress.h
+//
+// Compressed raw trace files. A compressed .trace file is a small header and
+// then one chunk per trace block: the 64KB block plus its 8KB IPC block, if
+// any, exactly the bytes a plain DoDump file has for that block. Readers that
+// go through OpenTraceInput see the plain bytes and never know the difference.
+//
+// Each chunk is compressed by itself in three steps:
+//   1. The 20-bit timestamp field of every trace word becomes the difference
+//      from the word before, mod 2**20. Non-entry words (names, header) just
+//      come along; the step is undone exactly either way
+//   2. The 8192 words are split into eight 8KB byte planes, byte 0 of every
+//      word, then byte 1, etc. Timestamp deltas, event numbers, and the many
+//      zero NOP words turn into long runs of the same few byte values
+//   3. The planes and any IPC bytes go through a small LZ77 coder with
+//      16-bit offsets, byte-aligned tokens, and no entropy stage, so decoding
+//      is little more than memcpy
+// A chunk that does not get smaller is stored as is.
+//
+//   File:   magic "KUTRACEZ", u64 plain file size, then chunks
+//   Chunk:  u32 plain size, u32 compressed size (high bit set if stored),
+//           then the compressed bytes
+//
+
+#ifndef __TRACE_COMPRESS_H__
+#define __TRACE_COMPRESS_H__
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "basetypes.h"
+
+static const char kTraceZMagic[8] = {'K', 'U', 'T', 'R', 'A', 'C', 'E', 'Z'};
+static const int kTraceZHeaderSize = 16;
+static const int kTraceZChunkHeaderSize = 8;
+static const uint32 kTraceZStored = 0x80000000;
+
+// Biggest chunk is a 64KB trace block plus its 8KB IPC block
+static const int kTraceZBlockWords = 8192;
+static const int kTraceZMaxChunk = kTraceZBlockWords * 8 + kTraceZBlockWords;
+// Worst-case compressed size is bounded by storing the chunk as is
+static const int kTraceZMaxPacked = kTraceZMaxChunk;
+
+// LZ77 parameters. Matches are at least 4 bytes, at most 64KB-1 back
+static const int kTraceZMinMatch = 4;
+static const int kTraceZHashBits = 14;
+static const int kTraceZMaxOffset = 65535;
+// The last few bytes are always literals, so the decoder's 8-byte copies
+// stay inside the chunk
+static const int kTraceZTailLiterals = 12;
+
+// True if the first bytes of a file are a compressed trace header
+inline bool IsCompressedTrace(const uint8* p, uint64 len) {
+  return (len >= kTraceZHeaderSize) && (memcmp(p, kTraceZMagic, 8) == 0);
+}
+
+inline uint32 TraceZLoad32(const uint8* p) {uint32 x; memcpy(&x, p, 4); return x;}
+inline uint64 TraceZLoad64(const uint8* p) {uint64 x; memcpy(&x, p, 8); return x;}
+inline void TraceZStore32(uint8* p, uint32 x) {memcpy(p, &x, 4);}
+inline void TraceZStore64(uint8* p, uint64 x) {memcpy(p, &x, 8);}
+
+// Transpose an 8x8 matrix of bytes, r[i] byte j <==> r[j] byte i, by
+// swapping off-diagonal 4x4, then 2x2, then 1x1 blocks
+inline void TraceZTranspose8(uint64* r) {
+  for (int i = 0; i < 4; ++i) {
+    uint64 t = ((r[i] >> 32) ^ r[i + 4]) & CLU(0x00000000FFFFFFFF);
+    r[i] ^= t << 32;
+    r[i + 4] ^= t;
+  }
+  for (int i = 0; i < 8; i += ((i & 1) ? 3 : 1)) {	// 0 1 4 5
+    uint64 t = ((r[i] >> 16) ^ r[i + 2]) & CLU(0x0000FFFF0000FFFF);
+    r[i] ^= t << 16;
+    r[i + 2] ^= t;
+  }
+  for (int i = 0; i < 8; i += 2) {
+    uint64 t = ((r[i] >> 8) ^ r[i + 1]) & CLU(0x00FF00FF00FF00FF);
+    r[i] ^= t << 8;
+    r[i + 1] ^= t;
+  }
+}
+
+// Steps 1 and 2: timestamp deltas, then byte planes. len is a multiple of 64
+inline void TraceZSplit(const uint8* raw, int len, uint8* planes) {
+  int nwords = len >> 3;
+  uint64 prior_ts = 0;
+  for (int i = 0; i < nwords; i += 8) {
+    uint64 r[8];
+    for (int j = 0; j < 8; ++j) {
+      uint64 word = TraceZLoad64(raw + (i + j) * 8);
+      uint64 ts = word >> 44;
+      r[j] = (word & CLU(0x00000FFFFFFFFFFF)) | (((ts - prior_ts) & 0xFFFFF) << 44);
+      prior_ts = ts;
+    }
+    TraceZTranspose8(r);
+    for (int b = 0; b < 8; ++b) {TraceZStore64(planes + b * nwords + i, r[b]);}
+  }
+}
+
+// Undo TraceZSplit
+inline void TraceZJoin(const uint8* planes, int len, uint8* raw) {
+  int nwords = len >> 3;
+  uint64 ts = 0;
+#if defined(__SSE2__)
+  // Sixteen words at a time: three rounds of interleaving take the eight
+  // planes' bytes to 2-, 4-, then 8-byte groups
+  for (int i = 0; i < (nwords & ~15); i += 16) {
+    __m128i p[8], a[8], b[8];
+    for (int k = 0; k < 8; ++k) {
+      p[k] = _mm_loadu_si128((const __m128i*)(planes + k * nwords + i));
+    }
+    for (int k = 0; k < 8; k += 2) {
+      a[k] = _mm_unpacklo_epi8(p[k], p[k + 1]);
+      a[k + 1] = _mm_unpackhi_epi8(p[k], p[k + 1]);
+    }
+    for (int k = 0; k < 8; k += 4) {
+      b[k] = _mm_unpacklo_epi16(a[k], a[k + 2]);
+      b[k + 1] = _mm_unpackhi_epi16(a[k], a[k + 2]);
+      b[k + 2] = _mm_unpacklo_epi16(a[k + 1], a[k + 3]);
+      b[k + 3] = _mm_unpackhi_epi16(a[k + 1], a[k + 3]);
+    }
+    uint8* w = raw + i * 8;
+    for (int k = 0; k < 4; ++k) {
+      _mm_storeu_si128((__m128i*)(w + k * 32), _mm_unpacklo_epi32(b[k], b[k + 4]));
+      _mm_storeu_si128((__m128i*)(w + k * 32 + 16), _mm_unpackhi_epi32(b[k], b[k + 4]));
+    }
+    for (int j = 0; j < 16; ++j) {
+      uint64 word = TraceZLoad64(w + j * 8);
+      ts = (ts + (word >> 44)) & 0xFFFFF;
+      TraceZStore64(w + j * 8, (word & CLU(0x00000FFFFFFFFFFF)) | (ts << 44));
+    }
+  }
+  int start = nwords & ~15;
+#else
+  int start = 0;
+#endif
+  for (int i = start; i < nwords; i += 8) {
+    uint64 r[8];
+    for (int b = 0; b < 8; ++b) {r[b] = TraceZLoad64(planes + b * nwords + i);}
+    TraceZTranspose8(r);
+    for (int j = 0; j < 8; ++j) {
+      ts = (ts + (r[j] >> 44)) & 0xFFFFF;
+      TraceZStore64(raw + (i + j) * 8, (r[j] & CLU(0x00000FFFFFFFFFFF)) | (ts << 44));
+    }
+  }
+}
+
+// Variable-length token field: 15 in the nibble means more bytes follow,
+// each adding up to 255
+inline uint8* TraceZPutLength(uint8* out, int len) {
+  while (len >= 255) {*out++ = 255; len -= 255;}
+  *out++ = (uint8)len;
+  return out;
+}
+
+// Emit one sequence: literals, then a match of matchlen at offset back.
+// matchlen 0 ends the chunk. Returns NULL if it would not fit before limit
+inline uint8* TraceZPutSequence(uint8* out, const uint8* limit,
+                                const uint8* lit, int litlen, int offset, int matchlen) {
+  if (out + 1 + (litlen / 255) + 1 + litlen + 2 + (matchlen / 255) + 1 > limit) {return NULL;}
+  int mcode = (matchlen == 0) ? 0 : matchlen - kTraceZMinMatch;
+  uint8* token = out++;
+  *token = (uint8)(((litlen < 15) ? litlen : 15) << 4);
+  if (litlen >= 15) {out = TraceZPutLength(out, litlen - 15);}
+  memcpy(out, lit, litlen);
+  out += litlen;
+  if (matchlen == 0) {return out;}
+  *token |= (uint8)((mcode < 15) ? mcode : 15);
+  *out++ = (uint8)offset;
+  *out++ = (uint8)(offset >> 8);
+  if (mcode >= 15) {out = TraceZPutLength(out, mcode - 15);}
+  return out;
+}
+
+// LZ77-compress in[0..len) into out, at most maxout bytes.
+// Returns the compressed size, or 0 if it does not fit
+inline int TraceZPack(const uint8* in, int len, uint8* out, int maxout) {
+  uint32 table[1 << kTraceZHashBits];
+  memset(table, 0, sizeof(table));
+  const uint8* limit = out + maxout;
+  uint8* op = out;
+  int anchor = 0;	// First literal not yet emitted
+  int i = 1;
+  int last_match = len - kTraceZTailLiterals;	// No match goes past here
+  while (i + kTraceZMinMatch <= last_match) {
+    uint32 seq = TraceZLoad32(in + i);
+    uint32 h = (seq * 2654435761u) >> (32 - kTraceZHashBits);
+    int cand = table[h];
+    table[h] = i;
+    if ((cand == 0) || (i - cand > kTraceZMaxOffset) || (TraceZLoad32(in + cand) != seq)) {
+      ++i;
+      continue;
+    }
+    // Extend backward over pending literals, then forward
+    while ((i > anchor) && (cand > 0) && (in[i - 1] == in[cand - 1])) {--i; --cand;}
+    int matchlen = kTraceZMinMatch;
+    while ((i + matchlen < last_match) && (in[i + matchlen] == in[cand + matchlen])) {
+      ++matchlen;
+    }
+    op = TraceZPutSequence(op, limit, in + anchor, i - anchor, i - cand, matchlen);
+    if (op == NULL) {return 0;}
+    i += matchlen;
+    anchor = i;
+    // Seed the table inside long runs, so the next match is found right away
+    if (i + kTraceZMinMatch <= last_match) {
+      table[(TraceZLoad32(in + i - 2) * 2654435761u) >> (32 - kTraceZHashBits)] = i - 2;
+    }
+  }
+  op = TraceZPutSequence(op, limit, in + anchor, len - anchor, 0, 0);
+  if (op == NULL) {return 0;}
+  return op - out;
+}
+
+// Read a variable-length token field. Returns NULL past inlimit
+inline const uint8* TraceZGetLength(const uint8* ip, const uint8* inlimit, int* len) {
+  uint8 b;
+  do {
+    if (ip >= inlimit) {return NULL;}
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return ip;
+}
+
+// Undo TraceZPack into out[0..len). Returns false if the input is damaged
+inline bool TraceZUnpack(const uint8* in, int inlen, uint8* out, int len) {
+  const uint8* ip = in;
+  const uint8* inlimit = in + inlen;
+  uint8* op = out;
+  uint8* oplimit = out + len;
+  while (ip < inlimit) {
+    uint8 token = *ip++;
+    int litlen = token >> 4;
+    if (litlen == 15) {
+      ip = TraceZGetLength(ip, inlimit, &litlen);
+      if (ip == NULL) {return false;}
+    }
+    if ((litlen > inlimit - ip) || (litlen > oplimit - op)) {return false;}
+    if ((litlen <= 16) && (inlimit - ip >= 16) && (oplimit - op >= 16)) {
+      memcpy(op, ip, 16);	// Common short run, one fixed-size copy
+    } else {
+      memcpy(op, ip, litlen);
+    }
+    op += litlen;
+    ip += litlen;
+    if (ip == inlimit) {break;}		// Last sequence, literals only
+
+    if (inlimit - ip < 2) {return false;}
+    int offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    int matchlen = token & 15;
+    if (matchlen == 15) {
+      ip = TraceZGetLength(ip, inlimit, &matchlen);
+      if (ip == NULL) {return false;}
+    }
+    matchlen += kTraceZMinMatch;
+    if ((offset == 0) || (offset > op - out)) {return false;}
+    // The encoder leaves kTraceZTailLiterals after every match
+    if (matchlen > (oplimit - op) - kTraceZTailLiterals) {return false;}
+    const uint8* match = op - offset;
+    uint8* matchend = op + matchlen;
+    if (offset == 1) {
+      memset(op, *match, matchlen);
+    } else {
+      if (offset < 8) {
+        // Lay down the first 8 bytes one at a time, then copy the repeating
+        // pattern from a whole number of periods back, at least 8 bytes
+        for (int k = 0; k < 8; ++k) {op[k] = match[k];}
+        op += 8;
+        match = op - ((8 + offset - 1) / offset) * offset;
+      }
+      // 8 bytes at a time, possibly a little past matchend
+      while (op < matchend) {memcpy(op, match, 8); op += 8; match += 8;}
+    }
+    op = matchend;
+  }
+  return op == oplimit;
+}
+
+// Compress one plain chunk, a 64KB trace block with or without its 8KB IPC
+// block, into out, chunk header included. out has room for
+// kTraceZChunkHeaderSize + kTraceZMaxPacked bytes. Returns bytes used
+inline int CompressTraceChunk(const uint8* raw, int len, uint8* out) {
+  uint8 planes[kTraceZMaxChunk];
+  int tracelen = (len < kTraceZBlockWords * 8) ? (len & ~63) : kTraceZBlockWords * 8;
+  TraceZSplit(raw, tracelen, planes);
+  memcpy(planes + tracelen, raw + tracelen, len - tracelen);
+  int packed = 0;
+  if (len > kTraceZTailLiterals) {
+    packed = TraceZPack(planes, len, out + kTraceZChunkHeaderSize, len - 1);
+  }
+  TraceZStore32(out, len);
+  if (packed == 0) {
+    TraceZStore32(out + 4, len | kTraceZStored);
+    memcpy(out + kTraceZChunkHeaderSize, raw, len);
+    return kTraceZChunkHeaderSize + len;
+  }
+  TraceZStore32(out + 4, packed);
+  return kTraceZChunkHeaderSize + packed;
+}
+
+// Decompress one chunk whose header is at in, with inlen bytes available,
+// into out, which has room for outlen bytes. *rawlen gets the plain size,
+// *used the bytes consumed. Returns false if the chunk is damaged or runs
+// off the end of either
+inline bool DecompressTraceChunk(const uint8* in, uint64 inlen, uint8* out, uint64 outlen,
+                                 int* rawlen, uint64* used) {
+  if (inlen < kTraceZChunkHeaderSize) {return false;}
+  uint32 len = TraceZLoad32(in);
+  uint32 packed = TraceZLoad32(in + 4);
+  bool stored = ((packed & kTraceZStored) != 0);
+  packed &= ~kTraceZStored;
+  if ((len > kTraceZMaxChunk) || (len > outlen)) {return false;}
+  if (packed > inlen - kTraceZChunkHeaderSize) {return false;}
+  *rawlen = len;
+  *used = kTraceZChunkHeaderSize + packed;
+  if (stored) {
+    if (packed != len) {return false;}
+    memcpy(out, in + kTraceZChunkHeaderSize, len);
+    return true;
+  }
+  uint8 planes[kTraceZMaxChunk];
+  if (!TraceZUnpack(in + kTraceZChunkHeaderSize, packed, planes, len)) {return false;}
+  int tracelen = (len < kTraceZBlockWords * 8) ? (len & ~63) : kTraceZBlockWords * 8;
+  TraceZJoin(planes, tracelen, out);
+  memcpy(out + tracelen, planes + tracelen, len - tracelen);
+  return true;
+}
+
+// Write the file header. plain_size may be 0 and patched by FinishCompressedTrace
+inline bool StartCompressedTrace(FILE* f, uint64 plain_size) {
+  uint8 header[kTraceZHeaderSize];
+  memcpy(header, kTraceZMagic, 8);
+  TraceZStore64(header + 8, plain_size);
+  return fwrite(header, 1, kTraceZHeaderSize, f) == kTraceZHeaderSize;
+}
+
+// Compress and write one chunk
+inline bool WriteCompressedChunk(FILE* f, const uint8* raw, int len) {
+  static uint8 out[kTraceZChunkHeaderSize + kTraceZMaxPacked];
+  int n = CompressTraceChunk(raw, len, out);
+  return fwrite(out, 1, n, f) == (size_t)n;
+}
+
+// Fill in the plain file size. f must be seekable
+inline bool FinishCompressedTrace(FILE* f, uint64 plain_size) {
+  uint8 size[8];
+  TraceZStore64(size, plain_size);
+  if (fseek(f, 8, SEEK_SET) != 0) {return false;}
+  bool ok = (fwrite(size, 1, 8, f) == 8);
+  fseek(f, 0, SEEK_END);
+  return ok;
+}
+
+// One decompression thread's share of the chunks
+typedef struct {
+  const uint8* in;
+  uint8* out;
+  const uint64* in_off;		// Per chunk
+  const uint64* out_off;	// Per chunk, plus one past the end
+  int lo, hi;			// Chunks [lo..hi)
+  bool ok;
+} TraceZWork;
+
+inline void* TraceZThread(void* arg) {
+  TraceZWork* w = (TraceZWork*)arg;
+  for (int k = w->lo; k < w->hi; ++k) {
+    int rawlen;
+    uint64 used;
+    uint64 room = w->out_off[k + 1] - w->out_off[k];
+    if (!DecompressTraceChunk(w->in + w->in_off[k], w->in_off[k + 1] - w->in_off[k],
+                              w->out + w->out_off[k], room, &rawlen, &used) ||
+        ((uint64)rawlen != room)) {
+      w->ok = false;
+      return NULL;
+    }
+  }
+  w->ok = true;
+  return NULL;
+}
+
+// Decompress a whole file image into a new buffer from malloc, on up to
+// kTraceZMaxThreads threads; the chunks are independent.
+// *plain_size gets its size. Returns NULL if the image is damaged
+static const int kTraceZMaxThreads = 8;
+static const int kTraceZChunksPerThread = 16;
+
+inline uint8* DecompressTrace(const uint8* in, uint64 inlen, uint64* plain_size) {
+  if (!IsCompressedTrace(in, inlen)) {return NULL;}
+  // Find every chunk from the chunk headers
+  int nchunks = 0;
+  for (uint64 off = kTraceZHeaderSize; off + kTraceZChunkHeaderSize <= inlen; ++nchunks) {
+    off += kTraceZChunkHeaderSize + (TraceZLoad32(in + off + 4) & ~kTraceZStored);
+  }
+  uint64* in_off = (uint64*)malloc((nchunks + 1) * sizeof(uint64));
+  uint64* out_off = (uint64*)malloc((nchunks + 1) * sizeof(uint64));
+  in_off[0] = kTraceZHeaderSize;
+  out_off[0] = 0;
+  for (int k = 0; k < nchunks; ++k) {
+    const uint8* chunk = in + in_off[k];
+    in_off[k + 1] = in_off[k] + kTraceZChunkHeaderSize + (TraceZLoad32(chunk + 4) & ~kTraceZStored);
+    out_off[k + 1] = out_off[k] + TraceZLoad32(chunk);
+  }
+  uint64 size = out_off[nchunks];
+  uint64 header_size = TraceZLoad64(in + 8);	// 0 if never filled in
+  uint8* out = NULL;
+  if ((in_off[nchunks] == inlen) && ((header_size == 0) || (header_size == size))) {
+    out = (uint8*)malloc(size + 1);
+  }
+
+  if (out != NULL) {
+    int nthreads = nchunks / kTraceZChunksPerThread;
+    if (nthreads > kTraceZMaxThreads) {nthreads = kTraceZMaxThreads;}
+    if (nthreads < 1) {nthreads = 1;}
+    TraceZWork work[kTraceZMaxThreads];
+    pthread_t thread[kTraceZMaxThreads];
+    for (int t = 0; t < nthreads; ++t) {
+      work[t].in = in;
+      work[t].out = out;
+      work[t].in_off = in_off;
+      work[t].out_off = out_off;
+      work[t].lo = (int)(((int64)nchunks * t) / nthreads);
+      work[t].hi = (int)(((int64)nchunks * (t + 1)) / nthreads);
+      work[t].ok = false;
+      if ((t == 0) || (pthread_create(&thread[t], NULL, TraceZThread, &work[t]) != 0)) {
+        thread[t] = 0;
+        if (t != 0) {TraceZThread(&work[t]);}
+      }
+    }
+    TraceZThread(&work[0]);
+    bool ok = work[0].ok;
+    for (int t = 1; t < nthreads; ++t) {
+      if (thread[t] != 0) {pthread_join(thread[t], NULL);}
+      ok &= work[t].ok;
+    }
+    if (!ok) {free(out); out = NULL;}
+  }
+  free(in_off);
+  free(out_off);
+  *plain_size = size;
+  return out;
+}
+
+#endif	// __TRACE_COMPRESS_H__
@@ -0,0 +1,149 @@
+// trace_mmap.h
+//
+// Raw trace file input, memory-mapped when possible so that trace blocks are
+// walked in place instead of being copied by fread. Pipes fall back to fread.
+// A compressed trace (see trace_compress.h) is decompressed into memory up
+// front and then walked the same way, so callers see only plain trace bytes.
+//
+
+#ifndef __TRACE_MMAP_H__
+#define __TRACE_MMAP_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "basetypes.h"
+#include "trace_compress.h"
+
+typedef struct {
+  FILE* f;
+  uint8* base;		// Whole file mapped read-only, or NULL to use fread on f
+  uint64 size;		// Bytes mapped
+  uint64 offset;	// Next byte to read, if mapped
+  bool decompressed;	// base is from malloc, the decompressed trace
+  int pending_len;	// Bytes read from f while checking for compression
+  uint8 pending[kTraceZHeaderSize];
+} TraceInput;
+
+// Replace compressed image [p..p+len) with the plain trace. Exits if damaged
+inline void UseDecompressed(const uint8* p, uint64 len, TraceInput* in) {
+  uint64 plain_size = 0;
+  uint8* plain = DecompressTrace(p, len, &plain_size);
+  if (plain == NULL) {
+    fprintf(stderr, "Compressed trace is damaged\n");
+    exit(0);
+  }
+  in->base = plain;
+  in->size = plain_size;
+  in->offset = 0;
+  in->decompressed = true;
+}
+
+// Read all of a compressed trace from a pipe, after its first bytes in pending
+inline void ReadCompressedPipe(TraceInput* in) {
+  uint64 len = in->pending_len;
+  uint64 room = 1 << 20;
+  uint8* buf = (uint8*)malloc(room);
+  memcpy(buf, in->pending, len);
+  size_t n;
+  while ((n = fread(buf + len, 1, room - len, in->f)) != 0) {
+    len += n;
+    if (len == room) {room *= 2; buf = (uint8*)realloc(buf, room);}
+  }
+  in->pending_len = 0;
+  UseDecompressed(buf, len, in);
+  free(buf);
+}
+
+// Map all of f if it is a regular file. Otherwise leave base NULL, to use fread
+inline void OpenTraceInput(FILE* f, TraceInput* in) {
+  in->f = f;
+  in->base = NULL;
+  in->size = 0;
+  in->offset = 0;
+  in->decompressed = false;
+  in->pending_len = 0;
+  struct stat st;
+  bool mappable = (fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (st.st_size != 0);
+  void* p = MAP_FAILED;
+  if (mappable) {p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);}
+  if (p == MAP_FAILED) {
+    // Peek at the front for a compressed trace; fread hands these bytes out first
+    in->pending_len = fread(in->pending, 1, kTraceZHeaderSize, f);
+    if (IsCompressedTrace(in->pending, in->pending_len)) {ReadCompressedPipe(in);}
+    return;
+  }
+  if (IsCompressedTrace(reinterpret_cast<uint8*>(p), st.st_size)) {
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    UseDecompressed(reinterpret_cast<uint8*>(p), st.st_size, in);
+    munmap(p, st.st_size);
+    return;
+  }
+  // Hints only; ignore failures
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(p, st.st_size, MADV_HUGEPAGE);
+#endif
+  in->base = reinterpret_cast<uint8*>(p);
+  in->size = st.st_size;
+  in->offset = ftell(f);	// Normally zero
+}
+
+// Get the next len bytes of the trace. *ptr points to them, in place in the
+// mapped file if possible, else copied into buf. A short final piece is
+// copied into buf and zero-filled. Returns the number of bytes actually there,
+// zero at end of file
+inline size_t ReadTraceBytes(TraceInput* in, void* buf, size_t len, uint8** ptr) {
+  size_t n;
+  if (in->base != NULL) {
+    n = (in->offset < in->size) ? in->size - in->offset : 0;
+    if (n > len) {n = len;}
+    if (n == len) {
+      *ptr = in->base + in->offset;
+    } else {
+      memcpy(buf, in->base + in->offset, n);
+      *ptr = reinterpret_cast<uint8*>(buf);
+    }
+    in->offset += n;
+  } else {
+    n = 0;
+    if (in->pending_len > 0) {
+      n = ((size_t)in->pending_len < len) ? in->pending_len : len;
+      memcpy(buf, in->pending, n);
+      in->pending_len -= n;
+      memmove(in->pending, in->pending + n, in->pending_len);
+    }
+    n += fread(reinterpret_cast<uint8*>(buf) + n, 1, len - n, in->f);
+    *ptr = reinterpret_cast<uint8*>(buf);
+  }
+  if (n < len) {memset(reinterpret_cast<uint8*>(buf) + n, 0, len - n);}
+  return n;
+}
+
+// Position to byte offset off. Returns false if that cannot be done
+inline bool SeekTraceInput(TraceInput* in, uint64 off) {
+  if (in->base != NULL) {
+    if (in->size < off) {return false;}
+    in->offset = off;
+    return true;
+  }
+  in->pending_len = 0;
+  return fseek(in->f, off, SEEK_SET) == 0;
+}
+
+// Unmap. The caller still closes the file
+inline void CloseTraceInput(TraceInput* in) {
+  if (in->decompressed) {
+    free(in->base);
+  } else if (in->base != NULL) {
+    munmap(in->base, in->size);
+  }
+  in->decompressed = false;
+  in->base = NULL;
+  in->size = 0;
+}
+
+#endif	// __TRACE_MMAP_H__
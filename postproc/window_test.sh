@@ -0,0 +1,41 @@
+#!/bin/bash
+# Check that a rawtoevent -start/-stop window covering the whole trace gives
+# exactly the output of no window, text and -merge, with the block index built
+# on the fly and read from the .trace.idx sidecar
+# arg 1 trace file name
+# uses rawtoevent in current directory
+
+fname=$1
+plain=/tmp/window_test_plain.txt
+windowed=/tmp/window_test_windowed.txt
+made_idx=0
+fail=0
+
+check() {
+  ./rawtoevent $fname $1 >$plain 2>/dev/null
+  ./rawtoevent $fname $1 -start 0 -stop 999 >$windowed 2>/dev/null
+  if cmp -s $plain $windowed
+  then
+    echo "  PASS ${1:-text}, $2"
+  else
+    echo "  FAIL ${1:-text}, $2"
+    fail=1
+  fi
+}
+
+if [ ! -f $fname.idx ]
+then
+  check "" "index built"
+  check "-merge" "index built"
+  ./rawtoevent $fname -index 2>/dev/null
+  made_idx=1
+fi
+check "" "index read"
+check "-merge" "index read"
+
+if [ $made_idx -eq 1 ]
+then
+  rm -f $fname.idx
+fi
+rm -f $plain $windowed
+exit $fail